@@ -0,0 +1,952 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "structures/index_tree.h"
+#include "structures/heap_table.h"
+
+// Benchmark driver for the index tree.
+// Each run creates a tree with one combination of page size and key size, runs one workload against it from
+// a number of threads, and prints a line with the throughput, the latency percentiles and the peak memory of
+// the process. Workloads that read need records to read, so their tree is bulk loaded first, outside of the
+// measured time.
+//
+// The records have keys 0 to records - 1. A key of 4 bytes is an INT32 column and a key of 8 bytes an INT64
+// column. Wider keys are a BINARY column, with the number big-endian in the first 8 bytes so keys sort like
+// the numbers, followed by bytes derived from it, like the rest of a wide composite key would be.
+//
+// The row-lookup workload also keeps a row for each record in a heap table, in memory, and indexes the rows by
+// their real RecordIDs, so each lookup goes through the tree to the row, as a query on an index would.
+
+// Histogram buckets. Values below LAT_SUB_BUCKETS nanoseconds get a bucket each, and every power of two above
+// that is split into LAT_SUB_BUCKETS buckets, so a percentile is off by at most 1 / LAT_SUB_BUCKETS (3%).
+#define LAT_SUB_BITS 5
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (64 * LAT_SUB_BUCKETS)
+
+// Most records a scan reads with one call.
+#define SCAN_BATCH 256
+
+typedef struct BenchOptions BenchOptions_t;
+typedef struct BenchRun BenchRun_t;
+typedef struct BenchThread BenchThread_t;
+typedef struct LatencyHistogram LatencyHistogram_t;
+typedef struct ZipfGenerator ZipfGenerator_t;
+typedef bool (*BenchWorkload_t)(BenchThread_t *thread, uint64_t op);
+
+typedef enum BenchWorkloadType
+{
+    BENCH_SEQ_INSERT,
+    BENCH_RAND_INSERT,
+    BENCH_LOOKUP,
+    BENCH_ZIPF_LOOKUP,
+    BENCH_SCAN,
+    BENCH_MIXED,
+    BENCH_ROW_LOOKUP,
+    BENCH_NUM_WORKLOADS,
+} BenchWorkloadType_t;
+
+static const char *workload_names[BENCH_NUM_WORKLOADS] = {
+    "seq-insert", "rand-insert", "lookup", "zipf-lookup", "scan", "mixed", "row-lookup",
+};
+
+// Whether a workload needs the records in the tree before it starts.
+static const bool workload_preloads[BENCH_NUM_WORKLOADS] = {
+    false, false, true, true, true, true, true,
+};
+
+struct BenchOptions
+{
+    bool workloads[BENCH_NUM_WORKLOADS];
+    uint32_t page_sizes[16];
+    uint32_t num_page_sizes;
+    uint32_t key_sizes[16];
+    uint32_t num_key_sizes;
+    uint64_t records;
+    // Operations per run, spread over the threads. Inserts always add every record once instead.
+    uint64_t ops;
+    uint32_t threads;
+    // Records read by a scan.
+    uint32_t scan_length;
+    // Skew of the Zipfian lookups. 0.99 is the YCSB default, where a few percent of the keys take most lookups.
+    double zipf_theta;
+    // Share of lookups in the mixed workload, in percent. The rest are inserts and deletes of new keys.
+    uint32_t read_percent;
+    // Fill factor of the preloaded trees.
+    double fill_factor;
+    // Preload the trees with a parallel build of this many threads, 0 for one per core.
+    bool parallel_build;
+    uint32_t build_threads;
+    // Size of the rows of the row-lookup workload, at least 8 bytes for the record number they start with.
+    uint32_t row_size;
+    uint64_t seed;
+    bool non_unique;
+    bool compress_keys;
+    // Print the shape and the counters of the tree after each run.
+    bool stats;
+    // Index file, and how it's accessed. NULL keeps the tree in memory.
+    const char *path;
+    uint32_t buffer_frames;
+    bool wal;
+    uint32_t wal_group_delay;
+    // Create trees that allow snapshots, and have every scan read a snapshot of its own.
+    bool snapshots;
+    IndexSplitPolicy_t split_policy;
+    // Keys the adaptive hash of each tree takes, 0 for none.
+    uint64_t adaptive_hash_entries;
+};
+
+// Latencies in nanoseconds.
+struct LatencyHistogram
+{
+    uint64_t counts[LAT_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+// Draws ranks from 0 to n - 1, rank 0 the most likely, with the method of Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases", which YCSB uses as well. Setting it up takes O(n) once, each draw O(1).
+struct ZipfGenerator
+{
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zeta_n;
+    double eta;
+    double half_pow_theta;
+};
+
+struct BenchRun
+{
+    const BenchOptions_t *options;
+    BenchWorkloadType_t type;
+    IndexTree_t *tree;
+    // Rows of the records, for the row-lookup workload only.
+    HeapTable_t *table;
+    uint8_t *row;
+    uint32_t key_size;
+    // Bits of the permutation domain, the smallest power of two holding every record.
+    uint32_t domain_bits;
+    ZipfGenerator_t zipf;
+    // Next record to insert, shared by the insert workloads so the records go in once in total.
+    uint64_t next_record;
+    pthread_barrier_t start;
+};
+
+struct BenchThread
+{
+    BenchRun_t *run;
+    pthread_t handle;
+    uint32_t id;
+    uint64_t rng;
+    uint64_t ops;
+    // Keys this thread inserted and deleted in the mixed workload, counted from its own base key.
+    uint64_t inserted;
+    uint64_t deleted;
+    // Lookups that didn't find their record, and calls that failed. Both should stay 0.
+    uint64_t misses;
+    uint64_t errors;
+    LatencyHistogram_t histogram;
+    uint8_t *key;
+    RecordID_t *rids;
+};
+
+static void Usage(const char *program);
+static bool ParseOptions(int argc, char **argv, BenchOptions_t *options);
+static uint32_t ParseList(const char *arg, uint32_t *values, uint32_t max);
+static bool RunBenchmark(const BenchOptions_t *options, BenchWorkloadType_t type, uint32_t page_size, uint32_t key_size);
+static void *RunThread(void *arg);
+static bool SeqInsert(BenchThread_t *thread, uint64_t op);
+static bool RandInsert(BenchThread_t *thread, uint64_t op);
+static bool Lookup(BenchThread_t *thread, uint64_t op);
+static bool ZipfLookup(BenchThread_t *thread, uint64_t op);
+static bool Scan(BenchThread_t *thread, uint64_t op);
+static bool Mixed(BenchThread_t *thread, uint64_t op);
+static bool RowLookup(BenchThread_t *thread, uint64_t op);
+static bool Preload(BenchRun_t *run);
+static bool PreloadSource(void *context, void *key, RecordID_t *rid);
+static void MakeKey(BenchRun_t *run, uint64_t value, uint8_t *key);
+static uint64_t Permute(BenchRun_t *run, uint64_t value);
+static void InitZipf(ZipfGenerator_t *zipf, uint64_t n, double theta);
+static uint64_t NextZipf(ZipfGenerator_t *zipf, uint64_t *rng);
+static void RecordLatency(LatencyHistogram_t *histogram, uint64_t nanoseconds);
+static void MergeHistogram(LatencyHistogram_t *into, const LatencyHistogram_t *from);
+static double Percentile(const LatencyHistogram_t *histogram, double fraction);
+static void PrintStats(IndexTree_t *tree);
+static inline double AverageCycles(const IndexTreeTimer_t *timer);
+static void ResetPeakRSS(void);
+static uint64_t PeakRSS(void);
+static void RemoveFiles(const char *path);
+static inline uint64_t NowNanoseconds(void);
+static inline uint64_t NextRandom(uint64_t *state);
+
+static const BenchWorkload_t workload_ops[BENCH_NUM_WORKLOADS] = {
+    SeqInsert, RandInsert, Lookup, ZipfLookup, Scan, Mixed, RowLookup,
+};
+
+int main(int argc, char **argv)
+{
+    BenchOptions_t options;
+    if (!ParseOptions(argc, argv, &options))
+    {
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-12s %6s %4s %7s %10s %8s %12s %9s %9s %9s %9s %10s\n", "workload", "page", "key", "threads", "ops",
+           "seconds", "ops/s", "p50 us", "p99 us", "p999 us", "max us", "peak RSS");
+    for (uint32_t w = 0; w < BENCH_NUM_WORKLOADS; w++)
+        for (uint32_t p = 0; p < options.num_page_sizes; p++)
+            for (uint32_t k = 0; k < options.num_key_sizes; k++)
+                if (options.workloads[w] && !RunBenchmark(&options, w, options.page_sizes[p], options.key_sizes[k]))
+                    return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+void Usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -w, --workloads LIST     comma-separated, from seq-insert, rand-insert, lookup, zipf-lookup, scan,\n"
+            "                           mixed, row-lookup, or all (default all)\n"
+            "  -p, --page-size LIST     page sizes to run each workload with (default 4096)\n"
+            "  -k, --key-size LIST      key sizes, 4, 8 or more (default 8)\n"
+            "  -n, --records N          records in the tree (default 1000000)\n"
+            "  -o, --ops N              lookups, scans or mixed operations per run (default 1000000)\n"
+            "  -t, --threads N          threads running each workload (default 1)\n"
+            "  -l, --scan-length N      records read by a scan (default 100)\n"
+            "  -z, --zipf THETA         skew of the Zipfian lookups, 0 < THETA < 1 (default 0.99)\n"
+            "  -r, --read-percent N     share of lookups in the mixed workload (default 90)\n"
+            "  -f, --fill FACTOR        fill factor of the preloaded trees (default 0.7)\n"
+            "      --build-threads N    preload the trees with a parallel build of N threads, 0 for one per core\n"
+            "      --row-size N         bytes in each row of the row-lookup workload (default 100)\n"
+            "  -s, --seed N             random seed (default 1)\n"
+            "      --non-unique         create non-unique trees\n"
+            "      --compress           create trees with key compression\n"
+            "      --path FILE          keep the trees in an index file, removed after each run\n"
+            "      --buffer-frames N    page the index file through a buffer pool of N frames\n"
+            "      --wal                log every change, needs --buffer-frames\n"
+            "      --group-delay US     group commit delay of the log in microseconds\n"
+            "      --snapshots          allow snapshots, and scan through a snapshot of the tree\n"
+            "      --split POLICY       how full pages split, balanced, append or adaptive (default adaptive)\n"
+            "      --adaptive-hash N    hash up to N keys of the hottest leaf pages, for unique trees\n"
+            "      --stats              print the shape and the counters of the tree after each run\n",
+            program);
+}
+
+bool ParseOptions(int argc, char **argv, BenchOptions_t *options)
+{
+    static const struct option long_options[] = {
+        {"workloads", required_argument, NULL, 'w'},
+        {"page-size", required_argument, NULL, 'p'},
+        {"key-size", required_argument, NULL, 'k'},
+        {"records", required_argument, NULL, 'n'},
+        {"ops", required_argument, NULL, 'o'},
+        {"threads", required_argument, NULL, 't'},
+        {"scan-length", required_argument, NULL, 'l'},
+        {"zipf", required_argument, NULL, 'z'},
+        {"read-percent", required_argument, NULL, 'r'},
+        {"fill", required_argument, NULL, 'f'},
+        {"seed", required_argument, NULL, 's'},
+        {"non-unique", no_argument, NULL, 'U'},
+        {"compress", no_argument, NULL, 'C'},
+        {"path", required_argument, NULL, 'P'},
+        {"buffer-frames", required_argument, NULL, 'B'},
+        {"wal", no_argument, NULL, 'W'},
+        {"group-delay", required_argument, NULL, 'G'},
+        {"stats", no_argument, NULL, 'S'},
+        {"row-size", required_argument, NULL, 'R'},
+        {"build-threads", required_argument, NULL, 'T'},
+        {"snapshots", no_argument, NULL, 'V'},
+        {"split", required_argument, NULL, 'Y'},
+        {"adaptive-hash", required_argument, NULL, 'H'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    memset(options, 0, sizeof(BenchOptions_t));
+    for (uint32_t w = 0; w < BENCH_NUM_WORKLOADS; w++)
+        options->workloads[w] = true;
+    options->page_sizes[0] = 4096;
+    options->num_page_sizes = 1;
+    options->key_sizes[0] = 8;
+    options->num_key_sizes = 1;
+    options->records = 1000000;
+    options->ops = 1000000;
+    options->threads = 1;
+    options->scan_length = 100;
+    options->zipf_theta = 0.99;
+    options->read_percent = 90;
+    options->fill_factor = 0.7;
+    options->row_size = 100;
+    options->seed = 1;
+    options->split_policy = IDXT_SPLIT_ADAPTIVE;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "w:p:k:n:o:t:l:z:r:f:s:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'w':
+        {
+            // Picking workloads replaces the default of all of them.
+            memset(options->workloads, 0, sizeof(options->workloads));
+            char *list = strdup(optarg), *save = NULL;
+            for (char *name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+            {
+                uint32_t w = 0;
+                while (w < BENCH_NUM_WORKLOADS && strcasecmp(name, workload_names[w]) != 0)
+                    w++;
+                if (w < BENCH_NUM_WORKLOADS)
+                    options->workloads[w] = true;
+                else if (strcasecmp(name, "all") == 0)
+                    for (w = 0; w < BENCH_NUM_WORKLOADS; w++)
+                        options->workloads[w] = true;
+                else
+                {
+                    fprintf(stderr, "Error in benchmark: unknown workload %s.\n", name);
+                    free(list);
+                    return false;
+                }
+            }
+            free(list);
+            break;
+        }
+        case 'p':
+            options->num_page_sizes = ParseList(optarg, options->page_sizes, 16);
+            if (options->num_page_sizes == 0)
+                return false;
+            break;
+        case 'k':
+            options->num_key_sizes = ParseList(optarg, options->key_sizes, 16);
+            if (options->num_key_sizes == 0)
+                return false;
+            break;
+        case 'n':
+            options->records = strtoull(optarg, NULL, 0);
+            break;
+        case 'o':
+            options->ops = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            options->threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            options->scan_length = strtoul(optarg, NULL, 0);
+            break;
+        case 'z':
+            options->zipf_theta = strtod(optarg, NULL);
+            break;
+        case 'r':
+            options->read_percent = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            options->fill_factor = strtod(optarg, NULL);
+            break;
+        case 's':
+            options->seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'U':
+            options->non_unique = true;
+            break;
+        case 'C':
+            options->compress_keys = true;
+            break;
+        case 'P':
+            options->path = optarg;
+            break;
+        case 'B':
+            options->buffer_frames = strtoul(optarg, NULL, 0);
+            break;
+        case 'W':
+            options->wal = true;
+            break;
+        case 'G':
+            options->wal_group_delay = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            options->stats = true;
+            break;
+        case 'R':
+            options->row_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'T':
+            options->parallel_build = true;
+            options->build_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'V':
+            options->snapshots = true;
+            break;
+        case 'Y':
+            if (strcasecmp(optarg, "balanced") == 0)
+                options->split_policy = IDXT_SPLIT_BALANCED;
+            else if (strcasecmp(optarg, "append") == 0)
+                options->split_policy = IDXT_SPLIT_APPEND;
+            else if (strcasecmp(optarg, "adaptive") == 0)
+                options->split_policy = IDXT_SPLIT_ADAPTIVE;
+            else
+            {
+                fprintf(stderr, "Error in benchmark: unknown split policy %s.\n", optarg);
+                return false;
+            }
+            break;
+        case 'H':
+            options->adaptive_hash_entries = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            return false;
+        }
+    }
+    if (optind < argc)
+        return false;
+
+    for (uint32_t k = 0; k < options->num_key_sizes; k++)
+        if (options->key_sizes[k] < 4 || (options->key_sizes[k] > 4 && options->key_sizes[k] < 8))
+        {
+            fprintf(stderr, "Error in benchmark: key size %u is neither 4 nor at least 8.\n", options->key_sizes[k]);
+            return false;
+        }
+    // Keys of 4 bytes have to hold every record, and the keys the mixed workload adds after them.
+    if (options->records == 0 || options->records + options->ops > INT32_MAX)
+    {
+        fprintf(stderr, "Error in benchmark: records and ops together have to be between 1 and %d.\n", INT32_MAX);
+        return false;
+    }
+    if (options->threads == 0 || options->scan_length == 0 || options->read_percent > 100)
+        return false;
+    if (options->row_size < sizeof(uint64_t))
+    {
+        fprintf(stderr, "Error in benchmark: rows have to be at least %zu bytes.\n", sizeof(uint64_t));
+        return false;
+    }
+    if (options->zipf_theta <= 0 || options->zipf_theta >= 1)
+    {
+        fprintf(stderr, "Error in benchmark: the Zipfian skew has to be between 0 and 1.\n");
+        return false;
+    }
+    return true;
+}
+
+uint32_t ParseList(const char *arg, uint32_t *values, uint32_t max)
+{
+    uint32_t count = 0;
+    const char *pos = arg;
+    while (*pos != '\0')
+    {
+        char *end;
+        unsigned long value = strtoul(pos, &end, 0);
+        if (end == pos || count == max || (*end != ',' && *end != '\0'))
+        {
+            fprintf(stderr, "Error in benchmark: can't read the list %s.\n", arg);
+            return 0;
+        }
+        values[count++] = value;
+        pos = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+bool RunBenchmark(const BenchOptions_t *options, BenchWorkloadType_t type, uint32_t page_size, uint32_t key_size)
+{
+    BenchRun_t run;
+    memset(&run, 0, sizeof(BenchRun_t));
+    run.options = options;
+    run.type = type;
+    run.key_size = key_size;
+    while ((1ULL << run.domain_bits) < options->records)
+        run.domain_bits++;
+    if (type == BENCH_ZIPF_LOOKUP || type == BENCH_MIXED)
+        InitZipf(&run.zipf, options->records, options->zipf_theta);
+
+    IndexTreeOptions_t tree_options;
+    idxt_InitOptions(&tree_options);
+    tree_options.page_size = page_size;
+    if (key_size == 4)
+        idxk_AddColumn(&tree_options.key, IDXK_TYPE_INT32, 4, false);
+    else if (key_size == 8)
+        idxk_AddColumn(&tree_options.key, IDXK_TYPE_INT64, 8, false);
+    else
+        idxk_AddColumn(&tree_options.key, IDXK_TYPE_BINARY, key_size, false);
+    tree_options.non_unique = options->non_unique;
+    tree_options.compress_keys = options->compress_keys;
+    tree_options.path = options->path;
+    tree_options.buffer_frames = options->buffer_frames;
+    tree_options.wal = options->wal;
+    tree_options.wal_group_delay = options->wal_group_delay;
+    tree_options.snapshots = options->snapshots;
+    tree_options.split_policy = options->split_policy;
+    tree_options.adaptive_hash_entries = options->adaptive_hash_entries;
+
+    // The peak is taken from here, so each run reports its own, and not the largest of the runs before it.
+    ResetPeakRSS();
+    run.tree = idxt_Create(&tree_options);
+    if (run.tree == NULL)
+        return false;
+    if (type == BENCH_ROW_LOOKUP)
+    {
+        // The table is kept in memory, with pages of the same size as the tree.
+        HeapTableOptions_t table_options;
+        heap_InitOptions(&table_options);
+        table_options.page_size = page_size;
+        run.table = heap_Create(&table_options);
+        run.row = calloc(1, options->row_size);
+        if (run.table == NULL || options->row_size > run.table->max_row_size)
+        {
+            fprintf(stderr, "Error in benchmark: rows of %u bytes don't fit in pages of %u.\n", options->row_size, page_size);
+            heap_Destroy(run.table);
+            free(run.row);
+            idxt_Destroy(run.tree);
+            RemoveFiles(options->path);
+            return false;
+        }
+    }
+    if (workload_preloads[type] && !Preload(&run))
+    {
+        heap_Destroy(run.table);
+        free(run.row);
+        idxt_Destroy(run.tree);
+        RemoveFiles(options->path);
+        return false;
+    }
+
+    BenchThread_t *threads = calloc(options->threads, sizeof(BenchThread_t));
+    pthread_barrier_init(&run.start, NULL, options->threads + 1);
+    for (uint32_t t = 0; t < options->threads; t++)
+    {
+        BenchThread_t *thread = &threads[t];
+        thread->run = &run;
+        thread->id = t;
+        thread->rng = options->seed * 0x9E3779B97F4A7C15ULL + t + 1;
+        // Inserts add every record once between them, the other workloads share out the operations.
+        uint64_t total = type == BENCH_SEQ_INSERT || type == BENCH_RAND_INSERT ? options->records : options->ops;
+        thread->ops = total / options->threads + (t < total % options->threads ? 1 : 0);
+        thread->key = calloc(1, key_size);
+        thread->rids = malloc(sizeof(RecordID_t) * SCAN_BATCH);
+        pthread_create(&thread->handle, NULL, RunThread, thread);
+    }
+
+    // Every thread is set up by the time they pass the barrier, so the clock only runs over the operations.
+    pthread_barrier_wait(&run.start);
+    uint64_t start = NowNanoseconds();
+    LatencyHistogram_t *histogram = calloc(1, sizeof(LatencyHistogram_t));
+    uint64_t ops = 0, misses = 0, errors = 0;
+    for (uint32_t t = 0; t < options->threads; t++)
+    {
+        pthread_join(threads[t].handle, NULL);
+        MergeHistogram(histogram, &threads[t].histogram);
+        ops += threads[t].ops;
+        misses += threads[t].misses;
+        errors += threads[t].errors;
+    }
+    double seconds = (NowNanoseconds() - start) / 1e9;
+    uint64_t peak_rss = PeakRSS();
+
+    printf("%-12s %6u %4u %7u %10lu %8.3f %12.0f %9.2f %9.2f %9.2f %9.2f %7lu MB\n", workload_names[type], page_size,
+           key_size, options->threads, ops, seconds, ops / seconds, Percentile(histogram, 0.5) / 1e3,
+           Percentile(histogram, 0.99) / 1e3, Percentile(histogram, 0.999) / 1e3, histogram->max / 1e3,
+           peak_rss >> 20);
+    if (misses > 0 || errors > 0)
+        fprintf(stderr, "Error in benchmark: %s had %lu lookups that missed and %lu calls that failed.\n",
+                workload_names[type], misses, errors);
+    if (options->stats)
+        PrintStats(run.tree);
+    fflush(stdout);
+
+    for (uint32_t t = 0; t < options->threads; t++)
+    {
+        free(threads[t].key);
+        free(threads[t].rids);
+    }
+    free(threads);
+    free(histogram);
+    pthread_barrier_destroy(&run.start);
+    bool destroyed = idxt_Destroy(run.tree);
+    if (run.table != NULL)
+        destroyed = heap_Destroy(run.table) && destroyed;
+    free(run.row);
+    RemoveFiles(options->path);
+    return destroyed && errors == 0;
+}
+
+void *RunThread(void *arg)
+{
+    BenchThread_t *thread = arg;
+    BenchWorkload_t workload = workload_ops[thread->run->type];
+    pthread_barrier_wait(&thread->run->start);
+    // The clock is read around each call. That adds some 20 ns to every latency, which is small next to even
+    // a lookup in a tree that fits in the cache.
+    for (uint64_t op = 0; op < thread->ops; op++)
+    {
+        uint64_t start = NowNanoseconds();
+        if (!workload(thread, op))
+            thread->errors++;
+        RecordLatency(&thread->histogram, NowNanoseconds() - start);
+    }
+    return NULL;
+}
+
+bool SeqInsert(BenchThread_t *thread, uint64_t op)
+{
+    (void)op;
+    // The threads take the records from a shared counter, so the keys reach the tree in ascending order even
+    // with many threads, and all of them meet at the rightmost leaf.
+    BenchRun_t *run = thread->run;
+    uint64_t record = __atomic_fetch_add(&run->next_record, 1, __ATOMIC_RELAXED);
+    MakeKey(run, record, thread->key);
+    return idxt_AddRecord(run->tree, thread->key, (uint32_t)record, 0);
+}
+
+bool RandInsert(BenchThread_t *thread, uint64_t op)
+{
+    (void)op;
+    BenchRun_t *run = thread->run;
+    uint64_t record = Permute(run, __atomic_fetch_add(&run->next_record, 1, __ATOMIC_RELAXED));
+    MakeKey(run, record, thread->key);
+    return idxt_AddRecord(run->tree, thread->key, (uint32_t)record, 0);
+}
+
+bool Lookup(BenchThread_t *thread, uint64_t op)
+{
+    (void)op;
+    BenchRun_t *run = thread->run;
+    uint64_t record = NextRandom(&thread->rng) % run->options->records;
+    MakeKey(run, record, thread->key);
+    RecordID_t rid;
+    if (!idxt_FindRecord(run->tree, thread->key, &rid) || rid.page_num != (uint32_t)record)
+        thread->misses++;
+    return true;
+}
+
+bool ZipfLookup(BenchThread_t *thread, uint64_t op)
+{
+    (void)op;
+    // The ranks are scrambled into records, as YCSB does, so the popular keys are spread over the tree
+    // instead of all sitting in its first leaves.
+    BenchRun_t *run = thread->run;
+    uint64_t record = Permute(run, NextZipf(&run->zipf, &thread->rng));
+    MakeKey(run, record, thread->key);
+    RecordID_t rid;
+    if (!idxt_FindRecord(run->tree, thread->key, &rid) || rid.page_num != (uint32_t)record)
+        thread->misses++;
+    return true;
+}
+
+bool Scan(BenchThread_t *thread, uint64_t op)
+{
+    (void)op;
+    BenchRun_t *run = thread->run;
+    uint64_t record = NextRandom(&thread->rng) % run->options->records;
+    MakeKey(run, record, thread->key);
+    IndexSnapshot_t *snapshot = NULL;
+    if (run->options->snapshots)
+    {
+        snapshot = idxt_OpenSnapshot(run->tree);
+        if (snapshot == NULL)
+            return false;
+    }
+    IndexCursor_t *cursor = snapshot != NULL ? idxt_OpenSnapshotCursor(snapshot, thread->key, NULL) : idxt_OpenCursor(run->tree, thread->key, NULL);
+    if (cursor == NULL)
+    {
+        if (snapshot != NULL)
+            idxt_CloseSnapshot(snapshot);
+        return false;
+    }
+    uint32_t left = run->options->scan_length;
+    while (left > 0)
+    {
+        uint32_t wanted = left < SCAN_BATCH ? left : SCAN_BATCH;
+        uint32_t count = idxt_Next(cursor, thread->rids, NULL, wanted);
+        left -= count;
+        if (count < wanted)
+            break;
+    }
+    idxt_Close(cursor);
+    if (snapshot != NULL)
+        idxt_CloseSnapshot(snapshot);
+    return true;
+}
+
+bool Mixed(BenchThread_t *thread, uint64_t op)
+{
+    (void)op;
+    BenchRun_t *run = thread->run;
+    const BenchOptions_t *options = run->options;
+    if (NextRandom(&thread->rng) % 100 < options->read_percent)
+        return ZipfLookup(thread, op);
+
+    // Each thread writes keys of its own above the preloaded records, adding new ones and deleting the oldest
+    // of those it added, so the tree stays about the same size and the lookups always find their records.
+    uint64_t base = options->records + thread->id * (options->ops / options->threads + 1);
+    if (thread->inserted > thread->deleted && (NextRandom(&thread->rng) & 1))
+    {
+        uint64_t record = base + thread->deleted++;
+        MakeKey(run, record, thread->key);
+        return idxt_DeleteRecord(run->tree, thread->key, (uint32_t)record, 0);
+    }
+    uint64_t record = base + thread->inserted++;
+    MakeKey(run, record, thread->key);
+    return idxt_AddRecord(run->tree, thread->key, (uint32_t)record, 0);
+}
+
+bool RowLookup(BenchThread_t *thread, uint64_t op)
+{
+    (void)op;
+    // The row is read in place, and checked by the record number it starts with.
+    BenchRun_t *run = thread->run;
+    uint64_t record = NextRandom(&thread->rng) % run->options->records;
+    MakeKey(run, record, thread->key);
+    RecordID_t rid;
+    HeapRow_t row;
+    if (!idxt_FindRecord(run->tree, thread->key, &rid) || !heap_Fetch(run->table, &rid, &row))
+    {
+        thread->misses++;
+        return true;
+    }
+    uint64_t number;
+    memcpy(&number, row.data, sizeof(uint64_t));
+    if (number != record)
+        thread->misses++;
+    heap_Release(&row);
+    return true;
+}
+
+bool Preload(BenchRun_t *run)
+{
+    run->next_record = 0;
+    bool loaded;
+    if (run->options->parallel_build)
+        loaded = idxt_BulkLoadParallel(run->tree, PreloadSource, run, run->options->fill_factor, run->options->build_threads);
+    else
+        loaded = idxt_BulkLoad(run->tree, PreloadSource, run, run->options->fill_factor);
+    run->next_record = 0;
+    if (!loaded)
+        fprintf(stderr, "Error in benchmark: can't preload the tree.\n");
+    return loaded;
+}
+
+bool PreloadSource(void *context, void *key, RecordID_t *rid)
+{
+    BenchRun_t *run = context;
+    if (run->next_record == run->options->records)
+        return false;
+    MakeKey(run, run->next_record, key);
+    // With a table, the row of the record is added as it's loaded, and the tree gets its address.
+    if (run->table != NULL)
+    {
+        memcpy(run->row, &run->next_record, sizeof(uint64_t));
+        memset(run->row + sizeof(uint64_t), (int)run->next_record, run->options->row_size - sizeof(uint64_t));
+        if (!heap_Insert(run->table, run->row, run->options->row_size, rid))
+            return false;
+    }
+    else
+    {
+        rid->page_num = (uint32_t)run->next_record;
+        rid->slot_num = 0;
+    }
+    run->next_record++;
+    return true;
+}
+
+void MakeKey(BenchRun_t *run, uint64_t value, uint8_t *key)
+{
+    if (run->key_size == 4)
+    {
+        int32_t number = (int32_t)value;
+        memcpy(key, &number, 4);
+        return;
+    }
+    if (run->key_size == 8)
+    {
+        int64_t number = (int64_t)value;
+        memcpy(key, &number, 8);
+        return;
+    }
+    for (uint32_t i = 0; i < 8; i++)
+        key[i] = (uint8_t)(value >> (56 - 8 * i));
+    uint64_t filler = value * 0x9E3779B97F4A7C15ULL;
+    for (uint32_t i = 8; i < run->key_size; i++)
+    {
+        key[i] = (uint8_t)filler;
+        filler = filler >> 8 | filler << 56;
+    }
+}
+
+uint64_t Permute(BenchRun_t *run, uint64_t value)
+{
+    // A bijection on the smallest power of two holding every record, made of steps that are each one: an odd
+    // multiply, an add and an xor with the value shifted down, all cut to the domain. A value that lands
+    // past the last record is sent through again until it doesn't, which keeps it a bijection on the records.
+    // It replaces a shuffled array of every record, which would show up in the peak memory.
+    uint32_t bits = run->domain_bits;
+    uint64_t mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+    uint64_t seed = run->options->seed;
+    do
+    {
+        for (uint32_t round = 0; round < 3; round++)
+        {
+            value = (value * (0xD6E8FEB86659FD93ULL ^ (seed << 1)) + seed + round) & mask;
+            value ^= value >> (bits / 2 + 1);
+        }
+    } while (value >= run->options->records);
+    return value;
+}
+
+void InitZipf(ZipfGenerator_t *zipf, uint64_t n, double theta)
+{
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->zeta_n = 0;
+    for (uint64_t i = 1; i <= n; i++)
+        zipf->zeta_n += 1 / pow((double)i, theta);
+    double zeta_2 = 1 + 1 / pow(2, theta);
+    zipf->alpha = 1 / (1 - theta);
+    zipf->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta_2 / zipf->zeta_n);
+    zipf->half_pow_theta = 1 + pow(0.5, theta);
+}
+
+uint64_t NextZipf(ZipfGenerator_t *zipf, uint64_t *rng)
+{
+    double u = (NextRandom(rng) >> 11) * (1.0 / (1ULL << 53));
+    double uz = u * zipf->zeta_n;
+    if (uz < 1)
+        return 0;
+    if (uz < zipf->half_pow_theta)
+        return 1;
+    uint64_t rank = (uint64_t)(zipf->n * pow(zipf->eta * u - zipf->eta + 1, zipf->alpha));
+    return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+void RecordLatency(LatencyHistogram_t *histogram, uint64_t nanoseconds)
+{
+    uint32_t bucket;
+    if (nanoseconds < LAT_SUB_BUCKETS)
+        bucket = nanoseconds;
+    else
+    {
+        uint32_t top = 63 - __builtin_clzll(nanoseconds);
+        bucket = (top - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS + ((nanoseconds >> (top - LAT_SUB_BITS)) & (LAT_SUB_BUCKETS - 1));
+    }
+    histogram->counts[bucket]++;
+    histogram->total++;
+    if (nanoseconds > histogram->max)
+        histogram->max = nanoseconds;
+}
+
+void MergeHistogram(LatencyHistogram_t *into, const LatencyHistogram_t *from)
+{
+    for (uint32_t i = 0; i < LAT_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+double Percentile(const LatencyHistogram_t *histogram, double fraction)
+{
+    // Returns the middle of the bucket the percentile falls in.
+    uint64_t rank = (uint64_t)ceil(fraction * histogram->total), seen = 0;
+    for (uint32_t bucket = 0; bucket < LAT_BUCKETS; bucket++)
+    {
+        seen += histogram->counts[bucket];
+        if (seen == 0 || seen < rank)
+            continue;
+        if (bucket < LAT_SUB_BUCKETS)
+            return bucket;
+        uint32_t shift = bucket / LAT_SUB_BUCKETS - 1;
+        double low = (double)((LAT_SUB_BUCKETS + bucket % LAT_SUB_BUCKETS) << shift);
+        return low + (double)(1ULL << shift) / 2;
+    }
+    return histogram->max;
+}
+
+void PrintStats(IndexTree_t *tree)
+{
+    IndexTreeStats_t stats;
+    idxt_GetStats(tree, &stats);
+    const IndexTreeCounters_t *counters = &stats.counters;
+    printf("    height %u, pages %lu leaf + %lu non-leaf + %lu posting, fill %.1f%% (leaf %.1f%%), records %lu\n",
+           stats.height, stats.leaf_pages, stats.nonleaf_pages, stats.posting_pages, stats.fill_factor * 100,
+           stats.level_fill[stats.height - 1] * 100, stats.records);
+    printf("    splits %lu leaf + %lu non-leaf, %lu of the root, merges %lu, redistributions %lu, restarts %lu\n",
+           counters->leaf_splits, counters->nonleaf_splits, counters->root_splits, counters->merges,
+           counters->redistributions, counters->restarts);
+    if (counters->append_splits > 0 || counters->rightmost_inserts > 0)
+        printf("    append splits %lu, inserts straight to the right-most leaf %lu\n", counters->append_splits,
+               counters->rightmost_inserts);
+    printf("    cycles per descent %.0f, per leaf search %.0f, per split %.0f\n", AverageCycles(&counters->descent),
+           AverageCycles(&counters->leaf_search), AverageCycles(&counters->split));
+    if (stats.page_versions > 0 || stats.reclaimed_versions > 0)
+        printf("    page versions %lu kept, %lu reclaimed\n", stats.page_versions, stats.reclaimed_versions);
+    if (counters->hash_hits > 0 || stats.hash_entries > 0)
+        printf("    adaptive hash %lu keys, %lu lookups answered, %lu pages hashed\n", stats.hash_entries,
+               counters->hash_hits, counters->hashed_pages);
+}
+
+static inline double AverageCycles(const IndexTreeTimer_t *timer)
+{
+    return timer->count > 0 ? (double)timer->cycles / timer->count : 0;
+}
+
+void ResetPeakRSS(void)
+{
+    // Writing 5 to clear_refs resets the peak of the resident set size the kernel keeps for the process.
+    // Without it, the peak only ever grows over the runs.
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if (file == NULL)
+        return;
+    fputs("5", file);
+    fclose(file);
+}
+
+uint64_t PeakRSS(void)
+{
+    // Peak resident set size in bytes, from VmHWM, which the reset above applies to, or else from getrusage.
+    FILE *file = fopen("/proc/self/status", "r");
+    if (file != NULL)
+    {
+        char line[256];
+        unsigned long long kilobytes;
+        while (fgets(line, sizeof(line), file) != NULL)
+            if (sscanf(line, "VmHWM: %llu kB", &kilobytes) == 1)
+            {
+                fclose(file);
+                return kilobytes << 10;
+            }
+        fclose(file);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)usage.ru_maxrss << 10;
+}
+
+void RemoveFiles(const char *path)
+{
+    if (path == NULL)
+        return;
+    unlink(path);
+    char wal_path[4096];
+    snprintf(wal_path, sizeof(wal_path), "%s.wal", path);
+    unlink(wal_path);
+}
+
+static inline uint64_t NowNanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline uint64_t NextRandom(uint64_t *state)
+{
+    // splitmix64.
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
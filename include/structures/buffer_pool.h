@@ -0,0 +1,175 @@
+#ifndef _DB2EMU_STRUCTURES_BUFFER_POOL_H_
+#define _DB2EMU_STRUCTURES_BUFFER_POOL_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "page_pool.h"
+#include "latch.h"
+
+// Marks an empty frame, or the end of a list of frames.
+#define BP_NO_FRAME UINT32_MAX
+
+typedef struct BufferFrame BufferFrame_t;
+typedef struct BufferList BufferList_t;
+typedef struct BufferPoolStats BufferPoolStats_t;
+typedef struct BufferPool BufferPool_t;
+
+// Called with a dirty page before it's written to the file, with the pool lock held. The page is only
+// written if it returns true.
+typedef bool (*BufferWriteHook_t)(void *context, uint64_t page_id, const void *page);
+
+// How the frame to reuse is picked when a page has to be read and every frame holds a page.
+typedef enum BufferPolicy
+{
+    // The least recently used page goes first.
+    BP_POLICY_LRU,
+    // Frames are swept in a circle, and a page is spared once if it was used since the last sweep.
+    // Approximates LRU without touching a list on every hit.
+    BP_POLICY_CLOCK,
+    // Pages read for the first time go on a short FIFO queue, and only move to the LRU list if they are
+    // asked for again after they left it. A scan of many pages, each used once, then can't push out the
+    // pages that are used over and over, like the upper levels of a tree.
+    BP_POLICY_2Q,
+} BufferPolicy_t;
+
+// Book-keeping for one frame. The page itself is in the frame memory of the pool.
+struct BufferFrame
+{
+    // Page held by the frame, or POOL_NO_FRAME if it's empty.
+    uint64_t page_id;
+    // A pinned page stays in its frame.
+    uint32_t pin_count;
+    // The page has changed since it was read, and has to be written before the frame is reused.
+    bool dirty;
+    // Used since the clock hand last passed it. CLOCK only.
+    bool referenced;
+    // List the frame is on, and its neighbours there.
+    uint8_t list;
+    uint32_t prev;
+    uint32_t next;
+    // Next frame in the same bucket of the page table.
+    uint32_t hash_next;
+    // For the caller, to guard the page while it's pinned. It must be released before the page is unpinned.
+    Latch_t latch;
+};
+
+// A list of frames, from the most recently added at the head to the oldest at the tail.
+struct BufferList
+{
+    uint32_t head;
+    uint32_t tail;
+    uint32_t count;
+};
+
+struct BufferPoolStats
+{
+    // Pins of a page that was already in a frame, and of one that had to be read.
+    uint64_t hits;
+    uint64_t misses;
+    // Pages read from, and written to, the file.
+    uint64_t reads;
+    uint64_t writes;
+    // Pages pushed out of their frame to make room for another.
+    uint64_t evictions;
+};
+
+// A fixed number of page frames in front of a page file.
+// Page n is stored at n * page_size in the file, the same layout a file-backed page pool has, so a file
+// can be used through either. Pages are read on demand and stay in their frame while they are pinned.
+// Once unpinned, a page may be pushed out by the replacement policy, and is written back first if it's dirty.
+// Like the page pool, the pool also hands out and takes back pages of the file, reusing released pages
+// through a free list linked through their first 8 bytes.
+// Every call may be made from any thread. The book-keeping is serialized by one lock, which is also held
+// while a page is read or written.
+struct BufferPool
+{
+    pthread_mutex_t lock;
+    int fd;
+    uint32_t page_size;
+    uint32_t num_frames;
+    BufferPolicy_t policy;
+    // num_frames pages, back to back.
+    uint8_t *memory;
+    BufferFrame_t *frames;
+    // Page table, mapping a page id to its frame through chains of frames.
+    uint32_t *buckets;
+    uint32_t bucket_bits;
+    // Frames without a page.
+    BufferList_t free;
+    // Frames in use, by recency. For 2Q this is the main LRU list.
+    BufferList_t lru;
+    // 2Q: pages read once, in the order they were read, and the longest that queue may get before it gives
+    // up pages ahead of the LRU list.
+    BufferList_t a1in;
+    uint32_t a1in_max;
+    // 2Q: ids of the pages that recently left the FIFO queue. A ring of ghost_capacity ids, oldest first,
+    // with a hash table of its own so a miss can tell whether the page is one of them.
+    uint64_t *ghosts;
+    uint32_t *ghost_next;
+    uint32_t *ghost_buckets;
+    uint32_t ghost_capacity;
+    uint32_t ghost_head;
+    uint32_t ghost_count;
+    // CLOCK: next frame to look at.
+    uint32_t clock_hand;
+    // Pages of the file handed out so far, free or not, and the released ones.
+    uint64_t num_pages;
+    uint64_t free_head;
+    uint64_t num_free;
+    // Called before each page is written. NULL by default.
+    BufferWriteHook_t write_hook;
+    void *write_context;
+    BufferPoolStats_t stats;
+};
+
+// Create a pool of num_frames frames in front of a new page file at path. An existing file is replaced.
+// Returns NULL if the file can't be created or the frames can't be allocated.
+BufferPool_t *bp_Create(const char *path, uint32_t page_size, uint32_t num_frames, BufferPolicy_t policy);
+
+// Same as bp_Create, but for an existing page file. The file carries the pages, but not the counters below,
+// so the caller passes back the values it saved from a pool on the same file.
+BufferPool_t *bp_Open(const char *path, uint32_t page_size, uint32_t num_frames, BufferPolicy_t policy, uint64_t num_pages, uint64_t free_head, uint64_t num_free);
+
+// Pins a page in a frame, reading it if it isn't in one already, and returns its address.
+// Returns NULL if every frame is pinned, or the page can't be read.
+void *bp_Pin(BufferPool_t *pool, uint64_t page_id);
+
+// Unpins a page, given the address bp_Pin returned. If dirty, the page has been changed.
+void bp_Unpin(BufferPool_t *pool, void *page, bool dirty);
+
+// Latch of the frame holding a pinned page.
+static inline Latch_t *bp_Latch(BufferPool_t *pool, void *page)
+{
+    return &pool->frames[((uint8_t *)page - pool->memory) / pool->page_size].latch;
+}
+
+// Hands out a zeroed page of the file, pinned and dirty, and its id through page_id.
+// Returns NULL if there is no frame for it.
+void *bp_New(BufferPool_t *pool, uint64_t *page_id);
+
+// Puts a page of the file back on the free list. Its contents are lost. The page must not be pinned.
+void bp_Free(BufferPool_t *pool, uint64_t page_id);
+
+// Has hook called with context before every page that is written, from now on. A write-ahead log uses it
+// to get its records for the page on the disk first.
+void bp_SetWriteHook(BufferPool_t *pool, BufferWriteHook_t hook, void *context);
+
+// Writes every dirty page to the file, and waits for the file to reach the disk.
+// Returns false if a write fails.
+bool bp_Flush(BufferPool_t *pool);
+
+void bp_GetStats(BufferPool_t *pool, BufferPoolStats_t *stats);
+
+// Share of the pins that found their page already in a frame.
+static inline double bp_HitRatio(const BufferPoolStats_t *stats)
+{
+    uint64_t pins = stats->hits + stats->misses;
+    return pins > 0 ? (double)stats->hits / pins : 0;
+}
+
+// Frees the frames and closes the file. Dirty pages are not written, the caller flushes first.
+void bp_Destroy(BufferPool_t *pool);
+
+#endif
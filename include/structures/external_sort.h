@@ -0,0 +1,69 @@
+#ifndef _DB2EMU_STRUCTURES_EXTERNAL_SORT_H_
+#define _DB2EMU_STRUCTURES_EXTERNAL_SORT_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct ExternalSort ExternalSort_t;
+typedef struct ExternalSortRun ExternalSortRun_t;
+
+// Orders two records. Returns <0, 0 or >0 like memcmp.
+typedef int (*ExternalSortCompare_t)(const void *a, const void *b, void *context);
+
+// A sorted run spilled to a temporary file, read back one record at a time during the merge.
+struct ExternalSortRun
+{
+    FILE *file;
+    // The record at the head of the run, valid while has_record is set.
+    uint8_t *record;
+    bool has_record;
+};
+
+// Sorts fixed-size records that may not fit in memory.
+// Records are collected in a buffer bounded by the memory budget. Each time the buffer fills up,
+// it is sorted and spilled to a temporary file as a run. Finishing merges all the runs in one pass,
+// so the sorted records can be streamed out in order with a single sequential read of each run.
+struct ExternalSort
+{
+    // Defined at creation.
+    uint32_t record_size;
+    ExternalSortCompare_t compare;
+    void *context;
+    // In-memory buffer of unsorted records.
+    uint8_t *buffer;
+    size_t buffer_capacity;
+    size_t buffer_count;
+    // Position in the buffer when the whole input fit in memory and no runs were spilled.
+    size_t buffer_pos;
+    // Spilled runs.
+    ExternalSortRun_t *runs;
+    uint32_t num_runs;
+    // Min-heap of run indices, ordered by the record at the head of each run.
+    uint32_t *heap;
+    uint32_t heap_size;
+    // The record handed out by the last call to xsort_Next.
+    uint8_t *current;
+    bool finished;
+};
+
+// Create a sorter for records of record_size bytes, using at most memory_budget bytes for buffering.
+// Returns NULL if the budget can't hold at least two records or memory can't be allocated.
+ExternalSort_t *xsort_Create(uint32_t record_size, size_t memory_budget, ExternalSortCompare_t compare, void *context);
+
+// Add a record to the sorter. Spills a run to disk if the buffer is full.
+// Returns false if the sorter is already finished or a run couldn't be written.
+bool xsort_Add(ExternalSort_t *sort, const void *record);
+
+// Ends the input and prepares the merge. No records can be added afterwards.
+bool xsort_Finish(ExternalSort_t *sort);
+
+// Returns the next record in ascending order, or NULL when all records have been returned.
+// The record is only valid until the next call.
+const void *xsort_Next(ExternalSort_t *sort);
+
+// Frees the sorter and closes, which also removes, its temporary files.
+void xsort_Destroy(ExternalSort_t *sort);
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef _DB2EMU_STRUCTURES_HASH_INDEX_H_
+#define _DB2EMU_STRUCTURES_HASH_INDEX_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "index_key.h"
+#include "record_id.h"
+
+// Segments of an index. A power of two, picked by the top bits of the hash of a key.
+#define HIDX_SEGMENTS 64
+// Slots of a bucket. Their tags fill 16 bytes, which one vector compare checks at once.
+#define HIDX_BUCKET_SLOTS 8
+// Fewest buckets a segment has.
+#define HIDX_MIN_BUCKETS 4
+// Percentage of the slots of a segment that may be in use before it's given twice as many buckets.
+#define HIDX_MAX_LOAD 80
+// Buckets of the old table a change to a segment moves over while the segment is resized.
+#define HIDX_MOVE_BUCKETS 8
+// Entries a segment allocates at a time.
+#define HIDX_CHUNK_ENTRIES 1024
+// An entry number that isn't there.
+#define HIDX_NO_ENTRY UINT32_MAX
+
+typedef struct HashEntry HashEntry_t;
+typedef struct HashBucket HashBucket_t;
+typedef struct HashTable HashTable_t;
+typedef struct HashSegment HashSegment_t;
+typedef struct HashIndex HashIndex_t;
+typedef struct HashIndexStats HashIndexStats_t;
+
+// A key and its record. Entries stay where they are for as long as they are in the index, and only their
+// numbers move between buckets, so growing the index never copies a key.
+struct HashEntry
+{
+    // The hash of the key, so it never has to be hashed again. While the entry is free, the number of the
+    // next free entry.
+    uint64_t hash;
+    RecordID_t rid;
+    uint8_t key[];
+};
+
+// One cache line of slots. A slot in use has the number of its entry, and a tag of 16 bits of the hash of its
+// key, which is never 0. A lookup compares all the tags of a bucket at once, and only reads the entries of
+// the tags that match, which is almost always just the one it's looking for.
+struct HashBucket
+{
+    uint16_t tags[HIDX_BUCKET_SLOTS];
+    uint32_t entries[HIDX_BUCKET_SLOTS];
+    // An entry was put further on because the bucket was full, so a lookup has to go on as well. It stays
+    // set until the table is replaced, since further entries may be behind any of the full ones.
+    bool overflow;
+} __attribute__((aligned(64)));
+
+// Open addressing: a key goes in the first bucket with a free slot, starting from the one its hash picks.
+struct HashTable
+{
+    HashBucket_t *buckets;
+    // A power of two.
+    uint64_t num_buckets;
+    uint64_t used;
+};
+
+// A share of the keys of an index, with a lock of its own, so changes to different segments never wait for
+// each other.
+// A segment that runs full isn't rehashed all at once. It gets a table of twice the buckets, and keeps the
+// old one until every change to the segment has moved a few of its buckets over. Lookups meanwhile look in
+// both. So no call ever waits for more than a few buckets to be moved.
+struct HashSegment
+{
+    // Taken shared by lookups, and exclusively by changes.
+    pthread_rwlock_t lock;
+    HashTable_t table;
+    // The table being moved into the new one, or no buckets, and the buckets of it moved so far.
+    HashTable_t old;
+    uint64_t moved;
+    // The entries, in chunks of HIDX_CHUNK_ENTRIES. Entry n is in chunk n / HIDX_CHUNK_ENTRIES.
+    uint8_t **chunks;
+    uint32_t num_chunks;
+    // Entries handed out so far, and the first free one, or HIDX_NO_ENTRY.
+    uint32_t next_entry;
+    uint32_t free_entry;
+    uint64_t num_entries;
+} __attribute__((aligned(64)));
+
+// A hash index of unique keys, for equality lookups. A lookup takes one bucket and one entry, where a tree
+// goes through a page of every level.
+// Keys are laid out and compared like the keys of an index tree, and two keys are the same if they compare
+// equal. Every call may be made from any thread.
+struct HashIndex
+{
+    IndexKeyOps_t key_ops;
+    uint32_t key_size;
+    // Bytes of an entry, with the key, rounded up to 8.
+    uint32_t entry_size;
+    // Segments that were given a larger table so far.
+    uint64_t resizes;
+    HashSegment_t segments[HIDX_SEGMENTS];
+};
+
+struct HashIndexStats
+{
+    uint64_t entries;
+    // Buckets of every table, and of the old ones among them, in segments that are being resized.
+    uint64_t buckets;
+    uint64_t old_buckets;
+    uint64_t resizes;
+    // Bytes of buckets and entries.
+    uint64_t memory;
+};
+
+// Create an empty index for keys with this layout, sized for expected keys, which may be 0. It grows as
+// needed either way.
+// Returns NULL if the layout is invalid, or memory can't be allocated.
+HashIndex_t *hidx_Create(const IndexKeyDesc_t *key, uint64_t expected);
+
+// Adds key with its record. Returns false if the key is there already, or memory can't be allocated.
+bool hidx_Insert(HashIndex_t *index, const void *key, const RecordID_t *rid);
+
+// Adds key with its record, or gives it this record if it's there already.
+// Returns false if memory can't be allocated.
+bool hidx_Put(HashIndex_t *index, const void *key, const RecordID_t *rid);
+
+// Looks up key, and copies its record into rid. Returns false if it isn't there.
+bool hidx_Find(HashIndex_t *index, const void *key, RecordID_t *rid);
+
+// Takes key out. Returns false if it isn't there.
+bool hidx_Delete(HashIndex_t *index, const void *key);
+
+// Keys in the index. With changes under way, about that many.
+uint64_t hidx_Count(HashIndex_t *index);
+
+// Takes out every key, and gives back the memory of the segments down to their fewest buckets.
+void hidx_Clear(HashIndex_t *index);
+
+void hidx_GetStats(HashIndex_t *index, HashIndexStats_t *stats);
+
+// Frees the index, which no other thread may be using.
+void hidx_Destroy(HashIndex_t *index);
+
+#endif
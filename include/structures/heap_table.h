@@ -0,0 +1,220 @@
+#ifndef _DB2EMU_STRUCTURES_HEAP_TABLE_H_
+#define _DB2EMU_STRUCTURES_HEAP_TABLE_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "record_id.h"
+#include "page_pool.h"
+#include "buffer_pool.h"
+
+typedef struct HeapPage HeapPage_t;
+typedef struct HeapSlot HeapSlot_t;
+typedef struct HeapFreeSpacePage HeapFreeSpacePage_t;
+typedef struct HeapFreeSpaceMap HeapFreeSpaceMap_t;
+typedef struct HeapSuperblock HeapSuperblock_t;
+typedef struct HeapTable HeapTable_t;
+typedef struct HeapTableOptions HeapTableOptions_t;
+typedef struct HeapRow HeapRow_t;
+typedef struct HeapScan HeapScan_t;
+
+// Identifies a table file, and the version of its layout.
+#define HEAP_FILE_MAGIC 0x454C424154324244ULL
+#define HEAP_FILE_VERSION 1
+// Fewest frames a table takes in a buffer pool. An insert keeps at most two pages pinned.
+#define HEAP_MIN_BUFFER_FRAMES 8
+// Free space is tracked in this many steps per page.
+#define HEAP_FSM_CATEGORIES 256
+// Marks the end of the chain of free-space map pages, or a page that isn't there.
+#define HEAP_NO_PAGE UINT64_MAX
+
+// What a page of a table file holds.
+typedef enum HeapPageKind
+{
+    // A page that was handed out, but not set up yet, or the superblock.
+    HEAP_PAGE_NONE,
+    HEAP_PAGE_DATA,
+    HEAP_PAGE_FREE_SPACE,
+} HeapPageKind_t;
+
+// A slotted data page.
+// The header is followed by the slot directory, which grows up, and the rows are stored from the end of the
+// page down, so the free space is in the middle. A row is found through its slot, which holds where the row
+// is in the page, so rows can move within the page without changing their RecordID. Rows are 8-byte aligned.
+// A deleted row leaves its slot empty, to be reused by a later insert, and its bytes as a hole, which is
+// only closed up once an insert needs the space.
+struct HeapPage
+{
+    // Same place as in an IndexPage, where a freed page keeps its link in the free list.
+    uint64_t page_id;
+    uint32_t kind;
+    // Slots in the directory, empty ones included.
+    uint32_t num_slots;
+    // Offset of the lowest row, where the free space in the middle ends.
+    uint32_t free_end;
+    // Every free byte of the page, the holes left by deleted and shrunk rows included.
+    uint32_t free_bytes;
+};
+
+struct HeapSlot
+{
+    // Offset of the row from the start of the page, or 0 for an empty slot.
+    uint32_t offset;
+    uint32_t size;
+};
+
+// A page of the free-space map, as kept in a table file: the category of count pages, from first on.
+// The pages are chained, and rewritten on every sync.
+struct HeapFreeSpacePage
+{
+    uint64_t page_id;
+    uint32_t kind;
+    uint32_t count;
+    uint64_t first;
+    uint64_t next;
+};
+
+// Free space of every page of the table, in HEAP_FSM_CATEGORIES steps: a page of category c has at least
+// c * step bytes free. The categories are the leaves of a tree where each node holds the highest category
+// below it, so the first page with enough room is found by going down from the top in O(log n), instead
+// of looking at every page.
+// Non-data pages are in category 0, and so never picked.
+struct HeapFreeSpaceMap
+{
+    pthread_mutex_t lock;
+    uint32_t step;
+    // Leaves of the tree, a power of two. Node 1 is the top, and the children of node n are 2n and 2n + 1,
+    // so leaf i is node capacity + i.
+    uint64_t capacity;
+    uint8_t *nodes;
+};
+
+// The first pages of a table file hold the superblock, which describes the table.
+struct HeapSuperblock
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t num_rows;
+    // First page of the free-space map.
+    uint64_t fsm_head;
+    // State of the page arena.
+    uint64_t num_frames;
+    uint64_t free_head;
+    uint64_t num_free;
+};
+
+// A table of variable-length rows in slotted pages, without any order. Rows are addressed by RecordID,
+// which stays the same for as long as the row is in the table, unless heap_Update has to move it.
+// Like an index tree, the table is kept in memory, in a mapped file or in a file paged through a buffer
+// pool, and every call may be made from any thread. Each page is guarded by the latch of its frame.
+struct HeapTable
+{
+    uint32_t page_size;
+    // Largest row a page takes.
+    uint32_t max_row_size;
+    // Rows in the table.
+    uint64_t num_rows;
+    // Exactly one of the two is set, like in an index tree.
+    PagePool_t *pool;
+    BufferPool_t *buffer;
+    // Pages at the start of the arena taken by the superblock.
+    uint32_t superblock_pages;
+    // First page of the free-space map in the file.
+    uint64_t fsm_head;
+    HeapFreeSpaceMap_t fsm;
+};
+
+// Settings for a new table.
+struct HeapTableOptions
+{
+    // Size of a page in bytes.
+    uint32_t page_size;
+    // Back the page arena with huge pages. Doesn't apply to table files.
+    bool huge_pages;
+    // Keep the table in a file at this path instead of in memory. NULL by default.
+    const char *path;
+    // Page the file through a buffer pool of this many frames, at least HEAP_MIN_BUFFER_FRAMES, instead of
+    // mapping it. 0 by default.
+    uint32_t buffer_frames;
+    // Replacement policy of the buffer pool. LRU by default.
+    BufferPolicy_t buffer_policy;
+};
+
+// A row, read in place from its page. The page stays pinned and latched shared until the row is released,
+// so the row can't change or move while it's read, but writers to the page wait until then.
+struct HeapRow
+{
+    const void *data;
+    uint32_t size;
+    RecordID_t rid;
+    // The table and page the row is in.
+    HeapTable_t *table;
+    HeapPage_t *page;
+};
+
+// A scan over every row of the table, page by page. It holds a shared latch on the page it's on, from one
+// call to the next, like an index cursor.
+struct HeapScan
+{
+    HeapTable_t *table;
+    // Current page, or NULL between pages, and the next slot to look at in it.
+    HeapPage_t *page;
+    uint64_t page_id;
+    uint32_t slot;
+};
+
+// Fills in the default options: 4 KB pages, in memory.
+void heap_InitOptions(HeapTableOptions_t *options);
+
+// Creates an empty table. With a path in the options, the table is kept in a new file, replacing any file
+// at that path. Returns NULL if the table can't be created.
+HeapTable_t *heap_Create(const HeapTableOptions_t *options);
+
+// Opens the table file at options->path. The page size is read from the file.
+// Returns NULL if the file can't be opened or isn't a table file.
+HeapTable_t *heap_Open(const HeapTableOptions_t *options);
+
+// Writes the superblock, the free-space map and every changed page of a table file to disk. Changes made
+// since the last sync may be lost if the process crashes. Does nothing for a table in memory.
+bool heap_Sync(HeapTable_t *table);
+
+// Frees the table and its handle. A table file is synced first, and stays behind.
+bool heap_Destroy(HeapTable_t *table);
+
+// Adds a row of size bytes, at most table->max_row_size, and returns its address through rid.
+// The row goes into the first page the free-space map finds with room for it, or a new page if none has.
+// Returns false if the row is too large, or the table can't grow.
+bool heap_Insert(HeapTable_t *table, const void *data, uint32_t size, RecordID_t *rid);
+
+// Finds the row at rid, without copying it. The row is released with heap_Release, and until then the
+// thread must not change the page it's in.
+// Returns false if there is no row at rid.
+bool heap_Fetch(HeapTable_t *table, const RecordID_t *rid, HeapRow_t *row);
+
+// Lets go of a row from heap_Fetch.
+void heap_Release(HeapRow_t *row);
+
+// Replaces the row at rid with a row of size bytes. A row that no longer fits in its page is moved to
+// another one, and rid is changed to its new address, which the indexes on the table then have to follow,
+// with idxt_UpdateRecord.
+// Returns false if there is no row at rid, or the new row is too large.
+bool heap_Update(HeapTable_t *table, RecordID_t *rid, const void *data, uint32_t size);
+
+// Removes the row at rid. Its slot may be given to a row inserted later.
+// Returns false if there is no row at rid.
+bool heap_Delete(HeapTable_t *table, const RecordID_t *rid);
+
+// Opens a scan over every row of the table, in the order of their RecordIDs.
+HeapScan_t *heap_OpenScan(HeapTable_t *table);
+
+// Moves to the next row, and points row at it, in place. The row stays valid until the next call or
+// until the scan is closed, and isn't released on its own.
+// Returns false once the scan is done.
+bool heap_Next(HeapScan_t *scan, HeapRow_t *row);
+
+// Closes the scan.
+void heap_CloseScan(HeapScan_t *scan);
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef _DB2EMU_STRUCTURES_INDEX_KEY_H_
+#define _DB2EMU_STRUCTURES_INDEX_KEY_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+// The most columns a composite key may have.
+#define IDXK_MAX_COLUMNS 16
+
+typedef struct IndexKeyColumn IndexKeyColumn_t;
+typedef struct IndexKeyDesc IndexKeyDesc_t;
+typedef struct IndexKeyOps IndexKeyOps_t;
+
+// How the bytes of a key column are ordered.
+typedef enum IndexKeyType
+{
+    // Compared byte by byte, like memcmp.
+    IDXK_TYPE_BINARY,
+    // Native(host byte order) signed integers, compared numerically.
+    IDXK_TYPE_INT32,
+    IDXK_TYPE_INT64,
+    // Native IEEE 754 doubles, compared numerically. NaN orders after every number.
+    IDXK_TYPE_DOUBLE,
+    // Fixed-length character data, padded with blanks to the column size. Compared byte by byte, which is
+    // how DB2 orders CHAR columns under the default IDENTITY collation once both sides are blank padded.
+    IDXK_TYPE_CHAR,
+} IndexKeyType_t;
+
+// One column of a key.
+struct IndexKeyColumn
+{
+    IndexKeyType_t type;
+    // Size in bytes. Implied by the type, except for BINARY and CHAR columns.
+    uint32_t size;
+    // Orders the column from high to low, like a DESC column in an index definition.
+    bool descending;
+};
+
+// Describes the layout of a key: one or more columns stored back to back without padding.
+// Keys are ordered by the first column, then by the second column, and so on.
+struct IndexKeyDesc
+{
+    uint32_t num_columns;
+    IndexKeyColumn_t columns[IDXK_MAX_COLUMNS];
+};
+
+// Orders two keys. Returns <0, 0 or >0 like memcmp.
+typedef int (*IndexKeyCompare_t)(const IndexKeyOps_t *ops, const void *a, const void *b);
+
+// Searches count keys stored back to back in ascending order, and returns a position between 0 and count.
+typedef uint32_t (*IndexKeySearch_t)(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key);
+
+// The key routines used by a tree. They are picked once, when the tree is created, based on the key layout
+// and what the CPU supports, so the hot path never has to look at the key type again.
+// Single-column keys get routines specialized for their type, with the compare inlined into the search.
+struct IndexKeyOps
+{
+    IndexKeyDesc_t desc;
+    uint32_t key_size;
+    IndexKeyCompare_t compare;
+    // Position of the first key equal to or higher than key.
+    IndexKeySearch_t lower_bound;
+    // Position of the first key higher than key.
+    IndexKeySearch_t upper_bound;
+};
+
+// Resets a key layout to no columns.
+void idxk_InitDesc(IndexKeyDesc_t *desc);
+
+// Appends a column to a key layout. size is only used for BINARY and CHAR columns.
+// Returns false if the layout is full or the column is invalid.
+bool idxk_AddColumn(IndexKeyDesc_t *desc, IndexKeyType_t type, uint32_t size, bool descending);
+
+// Size in bytes of a key with this layout.
+uint32_t idxk_KeySize(const IndexKeyDesc_t *desc);
+
+// Fills in the key routines for a key layout.
+// Returns false if the layout has no columns.
+bool idxk_InitOps(IndexKeyOps_t *ops, const IndexKeyDesc_t *desc);
+
+// Writes a readable form of a key into buffer, at most size bytes including the terminator.
+void idxk_FormatKey(const IndexKeyOps_t *ops, const void *key, char *buffer, size_t size);
+
+// Keys may be kept in pieces, cut at byte offsets that keep the order of the pieces that of the keys:
+// the start or end of a column, or anywhere inside a BINARY or CHAR column, whose bytes compare one
+// at a time. These give the last cut point at or before offset, and the first one at or after it.
+uint32_t idxk_CutBefore(const IndexKeyOps_t *ops, uint32_t offset);
+uint32_t idxk_CutAfter(const IndexKeyOps_t *ops, uint32_t offset);
+
+// Orders the bytes from start to end of two keys, both cut points. a and b point at byte start of each key.
+// Returns <0, 0 or >0 like memcmp.
+int idxk_CompareRange(const IndexKeyOps_t *ops, const void *a, const void *b, uint32_t start, uint32_t end);
+
+// Searches count pieces of end - start bytes, stored back to back in ascending order, for a piece of key
+// between the same cut points. Returns the position of the first piece equal to or higher than key, or with
+// upper, of the first higher one.
+uint32_t idxk_SearchRange(const IndexKeyOps_t *ops, const void *pieces, uint32_t count, const void *key, uint32_t start, uint32_t end, bool upper);
+
+// Sets the bytes of key from start, a cut point, to the highest value of each column, so the key orders
+// after every other key that shares its first start bytes.
+void idxk_FillHighest(const IndexKeyOps_t *ops, void *key, uint32_t start);
+
+// Hashes a key, for hash lookups of keys with this layout. Keys that compare equal hash the same, even
+// DOUBLE columns whose bytes differ, like 0 and -0.
+uint64_t idxk_Hash(const IndexKeyOps_t *ops, const void *key);
+
+#endif
@@ -4,34 +4,98 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
+#include "index_key.h"
+#include "record_id.h"
+#include "page_pool.h"
+#include "buffer_pool.h"
+#include "write_ahead_log.h"
+#include "page_versions.h"
+#include "hash_index.h"
 
 typedef struct IndexPage IndexPage_t;
-typedef struct IndexPageEntry IndexPageEntry_t;
-typedef struct RecordID RecordID_t;
+typedef struct IndexPosting IndexPosting_t;
+typedef struct IndexPostingPage IndexPostingPage_t;
 typedef struct IndexTree IndexTree_t;
+typedef struct IndexCursor IndexCursor_t;
+typedef struct IndexSnapshot IndexSnapshot_t;
+typedef struct IndexTreeOptions IndexTreeOptions_t;
+typedef struct IndexSuperblock IndexSuperblock_t;
+typedef struct IndexTreeTimer IndexTreeTimer_t;
+typedef struct IndexTreeCounters IndexTreeCounters_t;
+typedef struct IndexTreeStats IndexTreeStats_t;
+typedef struct IndexThreadStats IndexThreadStats_t;
 
-struct RecordID
-{
-    uint32_t page_num;
-    uint32_t slot_num;
-};
+// Page id 0 is taken by the superblock, so no page of the tree ever has it. It marks a missing page link.
+#define IDXT_NO_PAGE 0
+// Identifies an index file, and the version of its layout.
+#define IDXT_FILE_MAGIC 0x5845444E49324244ULL
+#define IDXT_FILE_VERSION 5
+// The deepest tree we can build. Even with two entries per page this is far beyond anything that fits in memory.
+#define IDXT_MAX_HEIGHT 64
+// Fewest frames a tree takes in a buffer pool. A split keeps about two pages per level pinned.
+#define IDXT_MIN_BUFFER_FRAMES 32
+// Inserts in a row past the end of the right-most leaf page after which a tree takes its inserts for appends.
+#define IDXT_APPEND_STREAK 16
+// Lookups of a leaf page, that didn't find their key in the adaptive hash, after which its keys are hashed.
+#define IDXT_HASH_HEAT 32
+// Lookup counts kept for leaf pages, shared by the pages whose ids are the same in the low bits. A power of two.
+#define IDXT_HEAT_SLOTS 4096
+// Once the adaptive hash is full, lookups that miss it, as a multiple of the keys it takes, after which it's
+// emptied for the pages that are hot by then.
+#define IDXT_HASH_RENEW 4
 
-struct IndexPageEntry
+// Supplies records, one per call, for loading a tree in bulk.
+// The callback copies the next key(key_size bytes) into key and its RecordID into rid.
+// It returns false once there are no more records.
+typedef bool (*IndexRecordSource_t)(void *context, void *key, RecordID_t *rid);
+
+// How a full page is divided when an insert splits it. Only splits of the right-most page of a level, with the
+// new entry going to its end, are divided differently from IDXT_SPLIT_BALANCED. Keys that only ever grow,
+// like identity columns and timestamps, all go there, and leave every page they split behind for good.
+typedef enum IndexSplitPolicy
 {
-    bool in_use;
-    void *key;
-    // Entry may either contain a reference to an underlying index page,
-    // or a RecordID. This will be decoded based on page-type, i.e. leaf or non-leaf page.
-    void *data;
-};
+    // Half of the entries stay, half go to the new page, and the pages that are left behind stay half full.
+    IDXT_SPLIT_BALANCED,
+    // Every entry stays, and the new page starts out with just the new one. The pages left behind are full.
+    IDXT_SPLIT_APPEND,
+    // Balanced, until the last inserts of the tree have all gone past the end of the right-most leaf page.
+    // Then 90% of the entries stay, which leaves some room for keys that come in slightly out of order, as
+    // they do from concurrent writers.
+    IDXT_SPLIT_ADAPTIVE,
+} IndexSplitPolicy_t;
 
 // One page may contain m keys and m entries, with each pair pointing either to another page or to a
 // data record(RID).
 // Note: Pure B+ has m-1 keys and m children.
+//
+// A page is a single page_size block. The header below sits at the start of the block, and is followed
+// by two parallel arrays:
+//   - The key array, max_entries keys of key_size bytes each, stored back to back in ascending order.
+//   - The data array, max_entries entries of data_size bytes each. Entry i in the data array belongs to
+//     key i. It is either a RecordID(leaf page), a posting(leaf page of a non-unique tree) or the page id
+//     of a child page(non-leaf page).
+// Only the first num_entries slots of each array are in use.
+//
+// In a non-leaf page, key i is the upper bound of the keys found below child i. The last child also
+// receives every key higher than any key in the page, so its key is only used for display.
+//
+// With key compression, the bytes every key of the page has in common are only kept once, in a whole key
+// right after the header: the first prefix_size bytes, and in a non-leaf page the bytes from key_end on.
+// The key array then only holds bytes prefix_size to key_end of each key, so the fewer bytes the keys of a
+// page differ in, the more of them it takes. max_entries and keys_offset follow from the two. Without key
+// compression, there is no whole key, and the key array holds the keys in full.
+//
+// Pages refer to each other by page id rather than by address, so a page means the same thing in memory
+// and in an index file. Links only go down and sideways. A page doesn't know its parent, changes that
+// have to work their way up use the path taken down instead.
 struct IndexPage
 {
     // Meta-data used to manage entries.
     uint64_t page_id;
+    // In a logged tree, LSN of the last action that changed the page. The page is only written to the
+    // index file once the log is on the disk up to here, and recovery skips the actions the page already has.
+    uint64_t lsn;
     bool is_leaf;
     // Depends on is_leaf.
     uint32_t data_size;
@@ -39,42 +103,436 @@ struct IndexPage
     uint32_t max_entries;
     // Utilized entries.
     uint32_t num_entries;
-    // The optimum way to store the entries is as a contigous array as it will increase performance.
-    // Depending on the size of the page, there might be difficulties in allocating and reserving enough memory.
-    // This puts a restraint on the user as it will be implemented as an array, and depending on their system,
-    // they have to adjust the size of their pages.
-    IndexPageEntry_t *entries;
-    // In addition to multiple downward pointers, we need one upward-pointer since there are only
-    // one parent.
-    IndexPage_t *parent;
+    // Offsets, in bytes from the start of the page, of the key array and the data array.
+    uint32_t keys_offset;
+    uint32_t data_offset;
+    // Bytes of every key that are kept in the key array, from prefix_size up to key_end.
+    uint32_t prefix_size;
+    uint32_t key_end;
+    // The pages of each level are chained together in key order, so the leaf pages can be walked
+    // from left to right without going through the parents.
+    uint64_t prev;
+    uint64_t next;
+};
+
+// In a non-unique tree every key has a single leaf entry, whose data lists the records with the key.
+// A key with a single record keeps it right in the entry. More records go into a chain of posting pages.
+struct IndexPosting
+{
+    // Number of records with the key.
+    uint64_t count;
+    union
+    {
+        // The record, if it's the only one.
+        RecordID_t rid;
+        // Otherwise the first posting page.
+        uint64_t head;
+    };
+};
+
+// A page of a posting list. The records of a list are sorted by page_num, then slot_num, and divided over
+// its pages in that order. Each record is taken as the number page_num << 32 | slot_num. The first one of
+// a page is in the header, and every following one is stored as its distance to the one before it, as a
+// varint of 7 bits per byte, right after the header. Records of the same table pages are close together,
+// so most take a byte or two instead of eight, and a million records with the same key fit in a few MB.
+struct IndexPostingPage
+{
+    // Same place as in an IndexPage.
+    uint64_t page_id;
+    uint64_t lsn;
+    uint64_t next;
+    // Last page of the list, so records added in order go straight to it. Only kept in the first page.
+    uint64_t tail;
+    // First and last record of the page.
+    uint64_t first;
+    uint64_t last;
+    // Records in the page, and bytes taken by their distances after the header.
+    uint32_t count;
+    uint32_t used;
+};
+
+// The first pages of the arena hold the superblock, which describes the tree. In an index file it's what
+// a tree is opened from: the file is mapped, and the pages are read straight out of the mapping.
+// The superblock is brought up to date on every sync.
+struct IndexSuperblock
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t key_size;
+    IndexKeyDesc_t key;
+    bool non_unique;
+    bool compress_keys;
+    bool wal;
+    uint64_t root;
+    uint64_t page_counter;
+    // State of the page arena, so released pages are still reused after the file is reopened.
+    uint64_t num_frames;
+    uint64_t free_head;
+    uint64_t num_free;
+    // The tree was closed, rather than left behind by a crash. Only kept for a logged tree, whose free
+    // pages are counted again after a crash, since the pages they are linked through aren't logged.
+    bool clean;
 };
 
 struct IndexTree
 {
-    // Meta-data.
+    // Meta-data. Number of pages in use.
     uint64_t page_counter;
-    // Defined at creation.
+    // Derived from the key layout at creation.
     uint32_t key_size;
     // Defined at creation.
     uint32_t page_size;
-    // Tree.
-    IndexPage_t *root;
+    // Compare and search routines for the key layout, defined at creation.
+    IndexKeyOps_t key_ops;
+    // A key may have any number of records, kept in a posting list. Defined at creation.
+    bool non_unique;
+    // Pages keep the bytes their keys share only once. Defined at creation.
+    bool compress_keys;
+    // The most bytes of a key that may be shared as a prefix: up to the first DOUBLE column, since doubles
+    // that compare equal may still differ in their bytes.
+    uint32_t prefix_limit;
+    // Page id of the root. It changes under concurrent readers, so it's read and written atomically.
+    uint64_t root;
+    // Arena the pages are allocated from. The page id of a page is its frame number, which is also its
+    // address in an index file.
+    PagePool_t *pool;
+    // Or, if the index file is paged through a buffer pool instead of being mapped, the pool.
+    // Exactly one of the two is set. The pool's counters tell how well it works for the tree.
+    BufferPool_t *buffer;
+    // The log every change goes to before its pages do, or NULL if the tree isn't logged. Defined at creation.
+    WriteAheadLog_t *log;
+    // Of a logged tree. Taken shared by every change, and exclusively by a checkpoint, which needs the
+    // pages to hold still while they are written.
+    pthread_rwlock_t checkpoint_lock;
+    // Old versions of the pages, for snapshots, or NULL if the tree doesn't take any. Defined at creation.
+    PageVersions_t *versions;
+    // Of a tree with snapshots. Taken shared by every change, and exclusively while a snapshot is taken, so a
+    // snapshot never has half of a change.
+    pthread_rwlock_t snapshot_lock;
+    // How full pages are split. Defined at creation.
+    IndexSplitPolicy_t split_policy;
+    // Inserts in a row that went past the end of the right-most leaf page, up to IDXT_APPEND_STREAK. Once
+    // there, inserts go to the right-most leaf page straight away, and adaptive splits leave pages 90% full.
+    uint32_t append_streak;
+    // Page id of the right-most leaf page, or IDXT_NO_PAGE if it isn't known. It's only changed while that
+    // page is latched, so once the page is latched and it's still here, it's still the right-most leaf page.
+    uint64_t rightmost_leaf;
+    // The adaptive hash, of the keys of the leaf pages lookups go to most, with their records, or NULL if the
+    // tree has none. Defined at creation. A lookup that finds its key there doesn't go down the tree at all.
+    // Keys are only added while their leaf page is latched, and taken out by every change to them before the
+    // change returns, so the hash never has a record the tree doesn't.
+    HashIndex_t *adaptive_hash;
+    // Keys the adaptive hash takes, give or take the pages being hashed at the time. Once it's full, it's
+    // emptied now and then, and the pages that are hot then fill it again.
+    uint64_t adaptive_hash_limit;
+    // Lookups of leaf pages that went down the tree, by page id modulo IDXT_HEAT_SLOTS. Updated without
+    // latches, so some are lost, which only means a page is hashed a little later.
+    uint32_t *leaf_heat;
+    // Pages that got hot while the adaptive hash was full, since it was last emptied.
+    uint64_t hash_skipped;
+    // The operation counters, a block for each thread that has used the tree, so the threads never write to
+    // the same cache line. Blocks are only ever added, at the head, and freed with the tree.
+    // stats_id tells the trees a thread has counters for apart, and is never reused, unlike the handle.
+    uint64_t stats_id;
+    IndexThreadStats_t *thread_stats;
+};
+
+// Time taken by one step of the operations on a tree.
+// Only one operation in every few of each thread is timed, so cycles / count is the average of a step, and
+// count is much lower than the number of times it was taken.
+struct IndexTreeTimer
+{
+    uint64_t count;
+    // Cycles of the CPU's time stamp counter, or nanoseconds where there is none.
+    uint64_t cycles;
+};
+
+// What the operations on a tree have done since it was created or opened.
+// Building with -DIDXT_NO_STATS leaves them out of the operations, and at zero.
+struct IndexTreeCounters
+{
+    // Calls, by kind. An update to a new key is counted as an update, and again as a delete and an insert.
+    uint64_t inserts;
+    uint64_t deletes;
+    uint64_t updates;
+    uint64_t lookups;
+    uint64_t batch_lookups;
+    uint64_t scans;
+    uint64_t bulk_loads;
+    // Inserts and deletes that found the leaf page had to be split or merged, and went down a second time
+    // latching every page that may change.
+    uint64_t restarts;
+    // Pages split, by kind, and splits of the root, each of which made the tree one level higher.
+    uint64_t leaf_splits;
+    uint64_t nonleaf_splits;
+    uint64_t root_splits;
+    // Splits of a right-most page that left more than half of the entries in it, for inserts at the end.
+    uint64_t append_splits;
+    // Inserts that went straight to the right-most leaf page, without going down from the root.
+    uint64_t rightmost_inserts;
+    // Lookups answered by the adaptive hash, and leaf pages whose keys were added to it.
+    uint64_t hash_hits;
+    uint64_t hashed_pages;
+    // Underfull pages merged with a sibling, or evened out with one, and roots handed down to their only
+    // child, each of which made the tree one level lower.
+    uint64_t merges;
+    uint64_t redistributions;
+    uint64_t root_collapses;
+    // Going down from the root to a leaf page, searching a leaf page for a key, and splitting a leaf page
+    // with all the splits it leads to above it.
+    IndexTreeTimer_t descent;
+    IndexTreeTimer_t leaf_search;
+    IndexTreeTimer_t split;
+};
+
+// The shape of a tree, and its counters.
+struct IndexTreeStats
+{
+    // Levels of the tree, 1 while the root is a leaf page.
+    uint32_t height;
+    // Pages and entries of each level, from the root down, and how full their pages are on average: the
+    // entries over the entries the pages could take.
+    uint64_t level_pages[IDXT_MAX_HEIGHT];
+    uint64_t level_entries[IDXT_MAX_HEIGHT];
+    double level_fill[IDXT_MAX_HEIGHT];
+    uint64_t leaf_pages;
+    uint64_t nonleaf_pages;
+    // Pages of posting lists, in a non-unique tree.
+    uint64_t posting_pages;
+    // Records in the tree. More than the leaf entries in a non-unique tree.
+    uint64_t records;
+    // How full the pages of the tree are on average, leaf and non-leaf pages together.
+    double fill_factor;
+    // Old versions of pages kept for the open snapshots, and the ones reclaimed since the tree was created
+    // or opened.
+    uint64_t page_versions;
+    uint64_t reclaimed_versions;
+    // Keys in the adaptive hash.
+    uint64_t hash_entries;
+    IndexTreeCounters_t counters;
+};
+
+// Settings for a new tree.
+struct IndexTreeOptions
+{
+    // Size of a page in bytes.
+    uint32_t page_size;
+    // Layout and ordering of the keys. The key size follows from it.
+    IndexKeyDesc_t key;
+    // Keep a single entry for each key, with a compressed list of all of its records, instead of an entry
+    // for every record. Meant for keys shared by many records. False by default.
+    bool non_unique;
+    // Keep the bytes the keys of a page share only once per page, and cut the keys that go up into non-leaf
+    // pages down to the fewest bytes that still tell the pages apart. More keys fit in a page, which makes
+    // for fewer levels and fewer pages to go through, at the cost of some work on every page searched.
+    // Meant for wide CHAR and BINARY keys, and composite keys led by them. False by default.
+    bool compress_keys;
+    // Back the page arena with huge pages, which saves TLB misses on large trees.
+    // Doesn't apply to index files.
+    bool huge_pages;
+    // Keep the tree in an index file at this path instead of in memory. NULL by default.
+    const char *path;
+    // Page the index file through a buffer pool of this many frames, at least IDXT_MIN_BUFFER_FRAMES,
+    // instead of mapping the whole file. Memory use then stays fixed however large the tree grows.
+    // 0 by default, which maps the file. Only applies to index files.
+    uint32_t buffer_frames;
+    // Replacement policy of the buffer pool. LRU by default.
+    BufferPolicy_t buffer_policy;
+    // Log every change in a write-ahead log next to the index file, at the path with ".wal" added, and have
+    // it on the disk before the call that made it returns. After a crash, opening the tree brings it back
+    // to the last change that returned. Requires a buffer pool. False by default.
+    bool wal;
+    // How long, in microseconds, a sync of the log waits for more changes to join it. With many writers
+    // on a slow disk, a few hundred make for fewer, larger syncs. 0 by default. Not stored in the file.
+    uint32_t wal_group_delay;
+    // Allow snapshots of the tree. Every change then holds off new snapshots while it's under way, and copies
+    // the pages it changes first while there are snapshots open. False by default. Not stored in the file.
+    bool snapshots;
+    // How full pages are split. IDXT_SPLIT_ADAPTIVE by default. Not stored in the file.
+    IndexSplitPolicy_t split_policy;
+    // Keep an adaptive hash of up to this many keys of the leaf pages that are looked up the most, which
+    // answers lookups of them without going down the tree. Lookups of other keys, and every change, then do a
+    // little more work. Only applies to unique trees. 0 by default, which keeps none. Not stored in the file.
+    uint64_t adaptive_hash_entries;
+};
+
+// A consistent view of a tree as it was at one point in time, for long reads that shouldn't see, or wait
+// for, the changes made after it.
+struct IndexSnapshot
+{
+    IndexTree_t *tree;
+    // Changes of a later epoch came after the snapshot.
+    uint64_t epoch;
+    // The root when the snapshot was taken.
+    uint64_t root;
 };
 
-// Create index-tree with page-size and key-size, both in bytes.
-void idxt_Create(uint32_t page_size, uint32_t key_size);
+// An open range scan over the leaf pages.
+struct IndexCursor
+{
+    IndexTree_t *tree;
+    // Current leaf page, NULL once the scan is done. It stays pinned while the cursor is on it.
+    IndexPage_t *page;
+    // Next entry to return, and the end(exclusive) of the range within the current page.
+    uint32_t pos;
+    uint32_t end;
+    // In a non-unique tree, while the cursor is partway through the posting list of the entry at pos:
+    // the posting page it's in, pinned, the position and offset of the next record there, and the record
+    // before it.
+    IndexPostingPage_t *posting_page;
+    uint32_t posting_pos;
+    uint32_t posting_offset;
+    uint64_t posting_value;
+    // The snapshot a cursor from idxt_OpenSnapshotCursor reads, or NULL. Such a cursor holds no latches or
+    // pins between calls: page and posting_page are its own copies of the pages, in page_copy and posting_copy.
+    IndexSnapshot_t *snapshot;
+    uint8_t *page_copy;
+    uint8_t *posting_copy;
+    // Inclusive upper bound of the range, if any.
+    bool has_hi;
+    uint8_t hi[];
+};
+
+// Fills in the default options: 4 KB pages, and a key without any columns.
+// The caller adds the key columns with idxk_AddColumn.
+void idxt_InitOptions(IndexTreeOptions_t *options);
+
+// Create index-tree with the given options.
+// Returns a handle that every other call takes, or NULL if the tree can't be created.
+// Each tree owns its own pages, so a process may hold any number of trees.
+// With a path in the options, the tree is kept in a new index file, replacing any file at that path.
+IndexTree_t *idxt_Create(const IndexTreeOptions_t *options);
 
-// Tear down and free all the memory used by the index-tree.
-bool idxt_Destroy();
+// Opens the index file at options->path, written by a tree created with a path. The page size and key
+// layout are read from the superblock, the rest of the options only choose how the file is accessed.
+// The file is mapped or paged rather than read, so the tree serves lookups right away, and pages
+// are brought in as they are touched.
+// Returns NULL if the file can't be opened or isn't an index file.
+IndexTree_t *idxt_Open(const IndexTreeOptions_t *options);
+
+// Writes the superblock and every changed page of an index file to disk.
+// Changes made since the last sync may be lost if the process crashes, and may leave the file
+// inconsistent. Does nothing for a tree in memory.
+// In a logged tree, no change is lost either way, and a sync is a checkpoint: once the pages are on the
+// disk, the log is emptied, so there is less to replay after a crash. It waits for the changes under way,
+// and holds off new ones until it's done.
+bool idxt_Sync(IndexTree_t *tree);
+
+// Tear down and free all the memory used by the index-tree, including the handle.
+// The pages are released with their arena, without walking the tree.
+// An index file is synced first, and stays behind.
+bool idxt_Destroy(IndexTree_t *tree);
 
 // When adding a record to a table we have to add an entry into the index table aswell.
 // (Re)organizing the index-tree is handled internally, not visible to the user.
-bool idxt_AddRecord(void *key, uint32_t page_num, uint32_t slot_num);
+// In a non-unique tree the record is added to the list of its key, and false is returned if it's already there.
+//
+// idxt_AddRecord, idxt_DeleteRecord, idxt_UpdateRecord, idxt_FindRecord, idxt_FindRecords, cursors and
+// snapshots may be used from any number of threads at once.
+// The pages are guarded by reader-writer latches, taken top-down with latch crabbing. A writer first
+// latches only the leaf page exclusively, and only if that page has to be split does it go down again
+// latching every page the split may reach. Every other call needs the tree to itself.
+//
+// In a logged tree, each call is an action. The pages it changes stay latched until it's done, and then go
+// to the log together in one record, which is on the disk before the call returns. Calls that finish at
+// the same time share a sync of the log, so with many writers there are far fewer syncs than calls.
+bool idxt_AddRecord(IndexTree_t *tree, void *key, uint32_t page_num, uint32_t slot_num);
+
+// Used to look up the record in question based on key. The RecordID is copied into rid.
+// If not found, false is returned. If the key has several records, this is the first of them.
+// With an adaptive hash, a key of a hot leaf page is found there, in one probe.
+bool idxt_FindRecord(IndexTree_t *tree, void *key, RecordID_t *rid);
+
+// Looks up num_keys keys at once, for joins and IN-lists. keys holds them back to back, key_size bytes each.
+// The RecordID for keys[i] is copied into rids[i], and found[i] tells whether there was one.
+// The keys are sorted first, so neighbouring keys share the pages on their way down, and every level is
+// done for a group of keys before the next. The pages of a level are all prefetched before any of them
+// is searched, so their cache misses overlap instead of being paid one after the other.
+// Returns the number of keys found.
+uint32_t idxt_FindRecords(IndexTree_t *tree, void *keys, uint32_t num_keys, RecordID_t *rids, bool *found);
+
+// When a record is removed from a table, its entry has to go as well. The entry is the one with both
+// this key and this RecordID, since a key may be shared by several records.
+// A page left less than half full takes entries from a sibling under the same parent, or is merged into
+// it if the two fit in one page, and the pages freed that way are given back to the arena for reuse.
+// Like idxt_AddRecord, a writer first latches only the leaf page, and only goes down again latching
+// every page a merge may reach if the leaf page would end up less than half full.
+// Returns false if there is no such entry.
+bool idxt_DeleteRecord(IndexTree_t *tree, void *key, uint32_t page_num, uint32_t slot_num);
+
+// Moves the entry for a record to a new key and/or RecordID, for when an indexed column changes or the
+// record moves. With the same key the RecordID is changed in place, otherwise the entry is deleted and
+// added again, and concurrent readers may briefly find neither, as may a snapshot taken in between. In a
+// logged tree, the delete and the add are then two actions, and a crash between them leaves the record out
+// of the tree.
+// Returns false if there is no entry with key and the old RecordID.
+bool idxt_UpdateRecord(IndexTree_t *tree, void *key, uint32_t page_num, uint32_t slot_num, void *new_key, uint32_t new_page_num, uint32_t new_slot_num);
+
+// Opens a range scan over the keys from lo to hi, both inclusive.
+// A NULL lo starts at the lowest key, and a NULL hi runs to the highest key.
+// The cursor holds a shared latch on the leaf page it's on, from one call to the next, so writers to that
+// page wait until the cursor moves on or is closed. The thread holding a cursor must therefore not modify
+// the tree itself until it has closed the cursor.
+IndexCursor_t *idxt_OpenCursor(IndexTree_t *tree, void *lo, void *hi);
+
+// Opens a scan over all the records with key. In a non-unique tree they come out of the posting list of
+// the key, in RecordID order.
+IndexCursor_t *idxt_OpenKeyCursor(IndexTree_t *tree, void *key);
+
+// Copies the next RecordIDs of the range, in key order, into rids.
+// If keys isn't NULL, the matching keys are copied into it as well, key_size bytes each.
+// Returns the number of entries copied, at most max_rids. Less than max_rids means the scan is done.
+uint32_t idxt_Next(IndexCursor_t *cursor, RecordID_t *rids, void *keys, uint32_t max_rids);
+
+// Closes the range scan.
+void idxt_Close(IndexCursor_t *cursor);
+
+// Takes a snapshot of a tree created or opened with snapshots. It waits for the changes under way, and
+// holds off new ones meanwhile, which takes about as long as a change.
+// Returns NULL if the tree doesn't allow snapshots.
+IndexSnapshot_t *idxt_OpenSnapshot(IndexTree_t *tree);
+
+// Opens a range scan like idxt_OpenCursor, over the tree as it was when the snapshot was taken.
+// The cursor doesn't latch the pages it reads, but copies them: the old version of a page if it has changed
+// since the snapshot, or the page as it is, if no change got to it while it was copied. So the scan neither
+// waits for writers nor holds them up, and sees the splits and merges that came after the snapshot as if
+// they hadn't happened. The thread holding it may modify the tree meanwhile.
+// The cursor is closed with idxt_Close, before its snapshot.
+IndexCursor_t *idxt_OpenSnapshotCursor(IndexSnapshot_t *snapshot, void *lo, void *hi);
+
+// Ends a snapshot. The old versions of pages no open snapshot reads anymore are freed.
+void idxt_CloseSnapshot(IndexSnapshot_t *snapshot);
+
+// Builds an empty tree bottom-up from records streamed in ascending key order.
+// Leaves are packed to fill_factor(0 < fill_factor <= 1) of their capacity and written left to right,
+// and each non-leaf level is filled as the level below it completes pages, so the whole build is one
+// sequential O(n) pass without any descents or splits.
+// Returns false if the tree isn't empty, the fill factor is out of range or the input isn't sorted.
+// If the input turns out not to be sorted, the tree is left empty.
+// In a logged tree, the pages aren't logged, but written in a checkpoint once the tree is complete. A crash
+// before then leaves the tree empty. Other changes wait until the load is done.
+// There may be no snapshots open, which would see the pages of the empty tree go.
+bool idxt_BulkLoad(IndexTree_t *tree, IndexRecordSource_t source, void *context, double fill_factor);
+
+// Same as idxt_BulkLoad, but the records may arrive in any order.
+// They are first run through an external sort which buffers at most memory_budget bytes
+// and spills sorted runs to temporary files.
+bool idxt_BulkLoadUnsorted(IndexTree_t *tree, IndexRecordSource_t source, void *context, double fill_factor, size_t memory_budget);
+
+// Same as idxt_BulkLoadUnsorted, but the build is spread over num_threads threads, or one per core if 0.
+// The threads take the records from the source between them, sort their share in memory, and each builds
+// the leaf pages of one range of keys. The ranges are then joined into one leaf level, and the levels above
+// it are built over them. The source is called by one thread at a time, but not always the same one.
+// Every record is held in memory until the tree is built. In a buffer pool, fewer threads are used if the
+// frames can't keep the pages of all of them pinned.
+bool idxt_BulkLoadParallel(IndexTree_t *tree, IndexRecordSource_t source, void *context, double fill_factor, uint32_t num_threads);
 
-// Used to get a reference to the record in question based on key. 
-// If not found, NULL is returned.
-RecordID_t *idxt_FindRecord(void *key);
+// Fills in stats. The counters are only added up, but the shape of the tree is taken by walking every page of
+// it, level by level, under a shared latch at a time, so it costs about as much as a scan of the whole tree.
+// It may be called while other threads use the tree, and then tells how the tree was at about that time.
+void idxt_GetStats(IndexTree_t *tree, IndexTreeStats_t *stats);
 
-void idxt_DisplayTree();
+void idxt_DisplayTree(IndexTree_t *tree);
 
 #endif
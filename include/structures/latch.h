@@ -0,0 +1,108 @@
+#ifndef _DB2EMU_STRUCTURES_LATCH_H_
+#define _DB2EMU_STRUCTURES_LATCH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sched.h>
+
+// Held by a writer.
+#define LATCH_EXCLUSIVE 0x80000000u
+// A writer is waiting, so new readers hold back until it has had its turn.
+#define LATCH_WAITING 0x40000000u
+// The rest of the word counts the readers.
+#define LATCH_READERS 0x3fffffffu
+
+typedef struct Latch Latch_t;
+
+// A reader-writer latch in a single word, for guarding a page while a thread works on it.
+// Latches are held for short stretches, so a thread that has to wait spins for a while before it
+// yields the CPU. Waiting writers keep new readers out, so a steady stream of readers can't starve them.
+// A latch is not recursive, and a zeroed latch is free.
+struct Latch
+{
+    uint32_t state;
+};
+
+static inline void latch_Init(Latch_t *latch)
+{
+    __atomic_store_n(&latch->state, 0, __ATOMIC_RELAXED);
+}
+
+static inline void latch_Backoff(uint32_t attempt)
+{
+    if (attempt < 64)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    else
+    {
+        sched_yield();
+    }
+}
+
+static inline void latch_AcquireShared(Latch_t *latch)
+{
+    for (uint32_t attempt = 0;; attempt++)
+    {
+        uint32_t state = __atomic_load_n(&latch->state, __ATOMIC_RELAXED);
+        if ((state & (LATCH_EXCLUSIVE | LATCH_WAITING)) == 0 &&
+            __atomic_compare_exchange_n(&latch->state, &state, state + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+        latch_Backoff(attempt);
+    }
+}
+
+static inline void latch_ReleaseShared(Latch_t *latch)
+{
+    __atomic_fetch_sub(&latch->state, 1, __ATOMIC_RELEASE);
+}
+
+static inline void latch_AcquireExclusive(Latch_t *latch)
+{
+    for (uint32_t attempt = 0;; attempt++)
+    {
+        // Once the readers have drained, we swap our waiting flag for the latch.
+        uint32_t state = __atomic_load_n(&latch->state, __ATOMIC_RELAXED);
+        if ((state & (LATCH_EXCLUSIVE | LATCH_READERS)) == 0 &&
+            __atomic_compare_exchange_n(&latch->state, &state, LATCH_EXCLUSIVE, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+        if ((state & LATCH_WAITING) == 0)
+            __atomic_fetch_or(&latch->state, LATCH_WAITING, __ATOMIC_RELAXED);
+        latch_Backoff(attempt);
+    }
+}
+
+// Takes the latch exclusively if it's free right now, without waiting. Returns false if it isn't.
+// For when waiting could close a cycle with a thread that takes latches in the usual order.
+static inline bool latch_TryAcquireExclusive(Latch_t *latch)
+{
+    uint32_t state = __atomic_load_n(&latch->state, __ATOMIC_RELAXED);
+    return (state & (LATCH_EXCLUSIVE | LATCH_READERS)) == 0 &&
+           __atomic_compare_exchange_n(&latch->state, &state, LATCH_EXCLUSIVE, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void latch_ReleaseExclusive(Latch_t *latch)
+{
+    // The waiting flag of another writer, if any, is left in place.
+    __atomic_fetch_and(&latch->state, ~LATCH_EXCLUSIVE, __ATOMIC_RELEASE);
+}
+
+static inline void latch_Acquire(Latch_t *latch, bool exclusive)
+{
+    if (exclusive)
+        latch_AcquireExclusive(latch);
+    else
+        latch_AcquireShared(latch);
+}
+
+static inline void latch_Release(Latch_t *latch, bool exclusive)
+{
+    if (exclusive)
+        latch_ReleaseExclusive(latch);
+    else
+        latch_ReleaseShared(latch);
+}
+
+#endif
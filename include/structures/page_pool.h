@@ -0,0 +1,112 @@
+#ifndef _DB2EMU_STRUCTURES_PAGE_POOL_H_
+#define _DB2EMU_STRUCTURES_PAGE_POOL_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "latch.h"
+
+// Frames are aligned to, and sized in multiples of, a cache line.
+#define POOL_CACHE_LINE 64
+// Memory is reserved from the system in chunks of this size, or one frame rounded up to whole system pages
+// if a frame is larger. That's the size of a huge page on x86-64, so a chunk can be backed by a single huge page.
+#define POOL_CHUNK_BYTES (2 * 1024 * 1024)
+// Most chunks an arena can have. The chunk directory is reserved at this size up front, so it never
+// moves and frames can be looked up without a lock while the arena grows.
+#define POOL_MAX_CHUNKS (1u << 20)
+// Marks the end of the free list.
+#define POOL_NO_FRAME UINT64_MAX
+
+typedef struct PagePool PagePool_t;
+
+// An arena of fixed-size page frames.
+// Frames are carved out of large chunks in order, and are numbered from 0 in the order they were first
+// handed out. A frame number maps straight to its address through the chunk directory, so pages can be
+// referred to by number. Released frames go on a free list and are handed out again before the arena grows.
+// The arena is only ever given back to the system as a whole.
+//
+// Frames can be looked up from any thread. Handing out and releasing frames is serialized by a lock.
+// Every frame also comes with a latch, kept outside the frame, which the owner of the arena may use to
+// guard the page in it.
+//
+// The arena may also be backed by a file, in which case chunk n is a shared mapping of the bytes at
+// n * chunk_bytes in the file. The chunks then hold a whole number of frames, so frame n is found at
+// n * frame_size in the file, and growing the arena grows the file. The free list lives in the frames,
+// so it is kept in the file too.
+struct PagePool
+{
+    // Size of a frame, the page size rounded up to a whole number of cache lines.
+    uint32_t frame_size;
+    uint32_t frames_per_chunk;
+    size_t chunk_bytes;
+    // Back the chunks with huge pages, if the system has them.
+    bool huge_pages;
+    // File the chunks are mapped from, or -1 if the arena only lives in memory.
+    int fd;
+    // Chunk directory. Frame n lives in chunks[n / frames_per_chunk], and its latch in latches[n / frames_per_chunk].
+    uint8_t **chunks;
+    Latch_t **latches;
+    uint32_t num_chunks;
+    pthread_mutex_t lock;
+    // Number of frames handed out from the chunks so far, free or not.
+    uint64_t num_frames;
+    // Released frames, linked through their first 8 bytes by frame number.
+    uint64_t free_head;
+    uint64_t num_free;
+};
+
+// Size of the frames for pages of page_size bytes.
+static inline uint32_t pool_FrameSize(uint32_t page_size)
+{
+    return (page_size + POOL_CACHE_LINE - 1) & ~(POOL_CACHE_LINE - 1);
+}
+
+// Create an arena of frames large enough for page_size bytes.
+// Returns NULL if memory can't be allocated.
+PagePool_t *pool_Create(uint32_t page_size, bool huge_pages);
+
+// Create an arena backed by a new file at path. An existing file is replaced.
+// Returns NULL if the file can't be created.
+PagePool_t *pool_CreateFile(const char *path, uint32_t page_size);
+
+// Maps an existing file of pages of page_size, created by pool_CreateFile or written through a buffer pool. The file carries the frames, but
+// not the counters below, so the caller passes back the values it saved from a pool on the same file.
+// Nothing is read from the file up front, the frames are paged in by the system as they are touched.
+// Returns NULL if the file can't be opened or is too short for num_frames.
+PagePool_t *pool_OpenFile(const char *path, uint32_t page_size, uint64_t num_frames, uint64_t free_head, uint64_t num_free);
+
+// Hands out a zeroed frame, and its number through frame.
+// Returns NULL if the arena can't grow.
+void *pool_Alloc(PagePool_t *pool, uint64_t *frame);
+
+// Address of a frame that has been handed out.
+static inline void *pool_Frame(PagePool_t *pool, uint64_t frame)
+{
+    return pool->chunks[frame / pool->frames_per_chunk] + (size_t)(frame % pool->frames_per_chunk) * pool->frame_size;
+}
+
+// Offset of a frame within the file backing the arena.
+static inline uint64_t pool_FrameOffset(PagePool_t *pool, uint64_t frame)
+{
+    return (frame / pool->frames_per_chunk) * pool->chunk_bytes + (frame % pool->frames_per_chunk) * pool->frame_size;
+}
+
+// Latch of a frame that has been handed out.
+static inline Latch_t *pool_Latch(PagePool_t *pool, uint64_t frame)
+{
+    return &pool->latches[frame / pool->frames_per_chunk][frame % pool->frames_per_chunk];
+}
+
+// Puts a frame back on the free list. Its contents are lost.
+void pool_Free(PagePool_t *pool, uint64_t frame);
+
+// Writes every changed frame of a file-backed arena to disk, and waits for it.
+// Does nothing for an arena in memory. Returns false if the write fails.
+bool pool_Sync(PagePool_t *pool);
+
+// Gives the whole arena back to the system. Every frame is released at once, without visiting them.
+// A file-backed arena is unmapped and closed, but not synced, the file stays behind.
+void pool_Destroy(PagePool_t *pool);
+
+#endif
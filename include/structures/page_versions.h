@@ -0,0 +1,93 @@
+#ifndef _DB2EMU_STRUCTURES_PAGE_VERSIONS_H_
+#define _DB2EMU_STRUCTURES_PAGE_VERSIONS_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Buckets a store starts out with. It doubles whenever it has twice as many pages with versions as buckets.
+#define PV_MIN_BUCKETS 64
+
+typedef struct PageVersion PageVersion_t;
+typedef struct PageVersionChain PageVersionChain_t;
+typedef struct PageVersions PageVersions_t;
+
+// A copy of a page as it was before a change, kept for the snapshots taken before the change.
+struct PageVersion
+{
+    // Epoch of the change that replaced this version. A snapshot of an earlier epoch sees it, unless an
+    // older version was replaced after the snapshot as well.
+    uint64_t replaced;
+    PageVersion_t *older;
+    uint8_t page[];
+};
+
+// The versions of one page, the newest first, so their epochs go down along the chain.
+struct PageVersionChain
+{
+    uint64_t page_id;
+    PageVersionChain_t *next;
+    PageVersion_t *newest;
+};
+
+// Old versions of the pages of a store, such as the pages of an index tree, for snapshots of it.
+// Time is counted in epochs. Taking a snapshot ends the epoch under way, so every change made after it is of a
+// later epoch than the snapshot. Before a page is changed for the first time in an epoch while there are
+// snapshots, it is copied into a new version, and a snapshot reads the oldest version of a page replaced after
+// it, or the page itself if there is none. The page is only changed once the copy is in the store, so a reader
+// that copies a page, finds no version for it, and then still finds none, has a copy no change reached.
+//
+// Versions are reclaimed as snapshots end. A version is only ever read by snapshots of the epochs from the one
+// the version before it was replaced in, up to the one it was replaced in, so once none of those are open,
+// it goes. With no snapshots open, nothing is kept.
+//
+// The caller makes sure no change is under way while a snapshot is taken, and keeps the snapshot open while
+// it reads versions from it. Every call may be made from any thread.
+struct PageVersions
+{
+    uint32_t page_size;
+    pthread_rwlock_t lock;
+    // Hash table of the pages with versions, by page id.
+    PageVersionChain_t **buckets;
+    uint64_t num_buckets;
+    uint64_t num_chains;
+    // Versions kept, and the ones reclaimed so far.
+    uint64_t num_versions;
+    uint64_t reclaimed;
+    // The epoch under way, which changes are made in.
+    uint64_t epoch;
+    // Epochs of the open snapshots, in ascending order.
+    uint64_t *snapshots;
+    uint32_t num_snapshots;
+    uint32_t snapshot_capacity;
+};
+
+// Create an empty store for pages of page_size bytes.
+// Returns NULL if memory can't be allocated.
+PageVersions_t *pv_Create(uint32_t page_size);
+
+// Takes a snapshot, and returns its epoch. There may be no changes under way.
+uint64_t pv_OpenSnapshot(PageVersions_t *versions);
+
+// Ends the snapshot of epoch, and reclaims the versions no open snapshot reads anymore.
+void pv_CloseSnapshot(PageVersions_t *versions, uint64_t epoch);
+
+// Whether there are any snapshots open. While there are no changes under way, the answer holds.
+static inline bool pv_HasSnapshots(PageVersions_t *versions)
+{
+    return __atomic_load_n(&versions->num_snapshots, __ATOMIC_ACQUIRE) > 0;
+}
+
+// Keeps a copy of page, about to be changed, for the open snapshots. Does nothing if it's been copied
+// already in this epoch, or no snapshot is open. The caller keeps others from changing the page meanwhile.
+void pv_Save(PageVersions_t *versions, uint64_t page_id, const void *page);
+
+// The version of a page the snapshot of epoch reads, or NULL if that's the page as it is now.
+// The version stays where it is until the snapshot is closed.
+const void *pv_Find(PageVersions_t *versions, uint64_t page_id, uint64_t epoch);
+
+// Frees every version, and the store.
+void pv_Destroy(PageVersions_t *versions);
+
+#endif
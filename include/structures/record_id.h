@@ -0,0 +1,16 @@
+#ifndef _DB2EMU_STRUCTURES_RECORD_ID_H_
+#define _DB2EMU_STRUCTURES_RECORD_ID_H_
+
+#include <stdint.h>
+
+typedef struct RecordID RecordID_t;
+
+// Address of a row in a table: the page it's in, and its slot in the slot directory of the page.
+// Index entries point at rows with it, so what idxt_FindRecord returns goes straight into heap_Fetch.
+struct RecordID
+{
+    uint32_t page_num;
+    uint32_t slot_num;
+};
+
+#endif
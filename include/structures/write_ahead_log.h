@@ -0,0 +1,109 @@
+#ifndef _DB2EMU_STRUCTURES_WRITE_AHEAD_LOG_H_
+#define _DB2EMU_STRUCTURES_WRITE_AHEAD_LOG_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Identifies a log file, and the version of its layout.
+#define WAL_FILE_MAGIC 0x474F4C4C41573244ULL
+#define WAL_FILE_VERSION 1
+
+typedef struct WriteAheadLog WriteAheadLog_t;
+typedef struct WriteAheadLogHeader WriteAheadLogHeader_t;
+typedef struct WriteAheadLogStats WriteAheadLogStats_t;
+
+// Called for each record of the log, in the order they were appended, with the LSN wal_Append returned for it.
+// Returns false to stop.
+typedef bool (*WriteAheadLogReplay_t)(void *context, uint64_t lsn, const void *record, uint32_t size);
+
+// Start of a log file. Records follow right after it.
+struct WriteAheadLogHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    // LSN of the first byte after the header. It moves on every reset, so LSNs keep growing across them.
+    uint64_t base_lsn;
+};
+
+struct WriteAheadLogStats
+{
+    // Records appended, and the bytes they took in the log.
+    uint64_t records;
+    uint64_t bytes;
+    // Calls to wal_Commit that had to wait for the log, and the syncs that served them. With many writers
+    // committing at once, one sync serves many commits.
+    uint64_t commits;
+    uint64_t syncs;
+};
+
+// An append-only log of records, made durable in groups.
+// Each record is stored with its size and a checksum, so a record that only partly reached the disk before
+// a crash is recognized, and the log ends before it. A record is identified by its LSN, the position in the
+// log just past its end, which only ever grows.
+// Records are appended to a buffer in memory. wal_Commit waits until the log is durable up to an LSN: the
+// first caller to find the log behind writes out everything in the buffer and syncs the file once, and
+// every caller that came in meanwhile is done along with it. Appends go to a second buffer while the
+// first one is being written, so they never wait for the disk.
+// Every call may be made from any thread.
+struct WriteAheadLog
+{
+    pthread_mutex_t lock;
+    // Signalled each time a sync ends.
+    pthread_cond_t synced;
+    int fd;
+    // How long, in microseconds, a sync waits for more commits to join it. 0 by default.
+    uint32_t group_delay;
+    // LSN of the start of the records in the file.
+    uint64_t base_lsn;
+    // Records not written yet, from buffer_lsn up to next_lsn, and the buffer that is being written meanwhile.
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t buffer_capacity;
+    uint8_t *spare;
+    size_t spare_capacity;
+    uint64_t buffer_lsn;
+    uint64_t next_lsn;
+    // The log is on the disk up to here.
+    uint64_t durable_lsn;
+    // A sync is under way.
+    bool syncing;
+    // A write or sync failed, and the log can't be trusted to be on the disk from here on.
+    bool failed;
+    WriteAheadLogStats_t stats;
+};
+
+// Create an empty log file at path. An existing file is replaced.
+// Returns NULL if the file can't be created.
+WriteAheadLog_t *wal_Create(const char *path, uint32_t group_delay);
+
+// Open an existing log file. The records are checked, and the log is cut off after the last one that
+// reached the disk whole. Returns NULL if the file can't be opened or isn't a log file.
+WriteAheadLog_t *wal_Open(const char *path, uint32_t group_delay);
+
+// Calls replay for each record in the log.
+// Returns false if a record can't be read, or replay stops early.
+bool wal_Replay(WriteAheadLog_t *log, WriteAheadLogReplay_t replay, void *context);
+
+// Appends a record of size bytes, and returns its LSN. The record is only on the disk after a commit.
+uint64_t wal_Append(WriteAheadLog_t *log, const void *record, uint32_t size);
+
+// Waits until the log is on the disk up to lsn, syncing it if no one else is.
+// Returns false if the log can't be written.
+bool wal_Commit(WriteAheadLog_t *log, uint64_t lsn);
+
+// LSN of the last record appended.
+uint64_t wal_LastLSN(WriteAheadLog_t *log);
+
+// Drops every record, once the caller has made them redundant, and cuts the file back to its header.
+// LSNs carry on where they were. There may be no appends at the same time.
+// Returns false if the file can't be written.
+bool wal_Reset(WriteAheadLog_t *log);
+
+void wal_GetStats(WriteAheadLog_t *log, WriteAheadLogStats_t *stats);
+
+// Closes the file. Records that weren't committed are lost.
+void wal_Destroy(WriteAheadLog_t *log);
+
+#endif
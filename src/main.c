@@ -1,18 +1,39 @@
 #include <stdio.h>
+#include <string.h>
 #include "structures/index_tree.h"
+#include "structures/heap_table.h"
 
 int main()
 {
-    uint32_t id = 1;
-    idxt_Create(4096 /* 4 KB */, 4);
-    idxt_AddRecord(&id, 2,3);
-    uint32_t id2 = 2;
-    idxt_AddRecord(&id2, 2,4);
-    uint32_t id4 = 4;
-    uint32_t id3 = 3;
-    idxt_AddRecord(&id4, 2,5);
-    idxt_AddRecord(&id3, 2,6);
-    uint32_t id5 = 5;
-    idxt_AddRecord(&id5, 2,7);
-    idxt_DisplayTree();
+    IndexTreeOptions_t options;
+    idxt_InitOptions(&options);
+    options.page_size = 4096 /* 4 KB */;
+    idxk_AddColumn(&options.key, IDXK_TYPE_INT32, 0, false);
+
+    HeapTableOptions_t table_options;
+    heap_InitOptions(&table_options);
+    HeapTable_t *table = heap_Create(&table_options);
+    IndexTree_t *tree = idxt_Create(&options);
+
+    // The rows go into the table, and the index on their id gets the RecordIDs the table gave them.
+    const char *names[] = {"one", "two", "three", "four", "five"};
+    for (int32_t id = 1; id <= 5; id++)
+    {
+        RecordID_t rid;
+        heap_Insert(table, names[id - 1], strlen(names[id - 1]) + 1, &rid);
+        idxt_AddRecord(tree, &id, rid.page_num, rid.slot_num);
+    }
+    idxt_DisplayTree(tree);
+
+    // A lookup on the index leads straight to the row, which is read where it is in its page.
+    int32_t id = 3;
+    RecordID_t rid;
+    HeapRow_t row;
+    if (idxt_FindRecord(tree, &id, &rid) && heap_Fetch(table, &rid, &row))
+    {
+        printf("Row %d at (%u, %u): %s\n", id, rid.page_num, rid.slot_num, (const char *)row.data);
+        heap_Release(&row);
+    }
+    idxt_Destroy(tree);
+    heap_Destroy(table);
 }
@@ -0,0 +1,553 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "buffer_pool.h"
+
+// Lists a frame can be on.
+#define BP_LIST_NONE 0
+#define BP_LIST_FREE 1
+#define BP_LIST_LRU 2
+#define BP_LIST_A1IN 3
+
+// Marks an unused slot in the ring of 2Q ghosts.
+#define BP_NO_GHOST UINT32_MAX
+
+static BufferPool_t *InitBufferPool(int fd, uint32_t page_size, uint32_t num_frames, BufferPolicy_t policy);
+static inline uint8_t *FrameData(BufferPool_t *pool, uint32_t frame);
+static inline uint32_t FrameOf(BufferPool_t *pool, void *page);
+static inline uint32_t HashPage(uint64_t page_id, uint32_t bits);
+static uint32_t LookupFrame(BufferPool_t *pool, uint64_t page_id);
+static void InsertFrame(BufferPool_t *pool, uint32_t frame);
+static void RemoveFrame(BufferPool_t *pool, uint32_t frame);
+static BufferList_t *FrameList(BufferPool_t *pool, uint8_t list);
+static void PushHead(BufferPool_t *pool, uint8_t list, uint32_t frame);
+static void Unlink(BufferPool_t *pool, uint32_t frame);
+static void TouchFrame(BufferPool_t *pool, uint32_t frame);
+static void AdmitFrame(BufferPool_t *pool, uint32_t frame);
+static uint32_t OldestUnpinned(BufferPool_t *pool, BufferList_t *list);
+static uint32_t FindVictim(BufferPool_t *pool);
+static uint32_t GetFrame(BufferPool_t *pool);
+static bool WriteFrame(BufferPool_t *pool, uint32_t frame);
+static bool ReadFrame(BufferPool_t *pool, uint32_t frame);
+static bool TakeGhost(BufferPool_t *pool, uint64_t page_id);
+static void *PinPage(BufferPool_t *pool, uint64_t page_id);
+static void AddGhost(BufferPool_t *pool, uint64_t page_id);
+
+BufferPool_t *bp_Create(const char *path, uint32_t page_size, uint32_t num_frames, BufferPolicy_t policy)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error in buffer pool: unable to create %s.\n", path);
+        return NULL;
+    }
+    BufferPool_t *pool = InitBufferPool(fd, page_size, num_frames, policy);
+    if (pool == NULL)
+        close(fd);
+    return pool;
+}
+
+BufferPool_t *bp_Open(const char *path, uint32_t page_size, uint32_t num_frames, BufferPolicy_t policy, uint64_t num_pages, uint64_t free_head, uint64_t num_free)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error in buffer pool: unable to open %s.\n", path);
+        return NULL;
+    }
+    BufferPool_t *pool = InitBufferPool(fd, page_size, num_frames, policy);
+    if (pool == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    pool->num_pages = num_pages;
+    pool->free_head = free_head;
+    pool->num_free = num_free;
+    return pool;
+}
+
+void *bp_Pin(BufferPool_t *pool, uint64_t page_id)
+{
+    pthread_mutex_lock(&pool->lock);
+    void *page = PinPage(pool, page_id);
+    pthread_mutex_unlock(&pool->lock);
+    return page;
+}
+
+void bp_Unpin(BufferPool_t *pool, void *page, bool dirty)
+{
+    pthread_mutex_lock(&pool->lock);
+    uint32_t frame = FrameOf(pool, page);
+    pool->frames[frame].pin_count--;
+    pool->frames[frame].dirty |= dirty;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void *bp_New(BufferPool_t *pool, uint64_t *page_id)
+{
+    pthread_mutex_lock(&pool->lock);
+    // Released pages are reused first. The next free page is linked from the first 8 bytes of the page.
+    if (pool->free_head != POOL_NO_FRAME)
+    {
+        uint8_t *page = PinPage(pool, pool->free_head);
+        if (page != NULL)
+        {
+            *page_id = pool->free_head;
+            memcpy(&pool->free_head, page, sizeof(uint64_t));
+            pool->num_free--;
+            memset(page, 0, pool->page_size);
+            pool->frames[FrameOf(pool, page)].dirty = true;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return page;
+    }
+
+    // Otherwise the file grows by a page. There is nothing to read, the page starts out zeroed.
+    uint32_t frame = GetFrame(pool);
+    if (frame == BP_NO_FRAME)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    *page_id = pool->num_pages++;
+    pool->frames[frame].page_id = *page_id;
+    pool->frames[frame].pin_count = 1;
+    pool->frames[frame].dirty = true;
+    memset(FrameData(pool, frame), 0, pool->page_size);
+    InsertFrame(pool, frame);
+    AdmitFrame(pool, frame);
+    pthread_mutex_unlock(&pool->lock);
+    return FrameData(pool, frame);
+}
+
+void bp_Free(BufferPool_t *pool, uint64_t page_id)
+{
+    pthread_mutex_lock(&pool->lock);
+    uint8_t *page = PinPage(pool, page_id);
+    if (page == NULL)
+    {
+        fprintf(stderr, "Error in buffer pool: unable to free page %ld.\n", page_id);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    memcpy(page, &pool->free_head, sizeof(uint64_t));
+    pool->free_head = page_id;
+    pool->num_free++;
+    pool->frames[FrameOf(pool, page)].pin_count--;
+    pool->frames[FrameOf(pool, page)].dirty = true;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+bool bp_Flush(BufferPool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    bool flushed = true;
+    for (uint32_t i = 0; i < pool->num_frames && flushed; i++)
+    {
+        if (pool->frames[i].page_id != POOL_NO_FRAME && pool->frames[i].dirty && !WriteFrame(pool, i))
+            flushed = false;
+    }
+    if (flushed && fsync(pool->fd) != 0)
+    {
+        fprintf(stderr, "Error in buffer pool: unable to sync page file.\n");
+        flushed = false;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return flushed;
+}
+
+void bp_SetWriteHook(BufferPool_t *pool, BufferWriteHook_t hook, void *context)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->write_hook = hook;
+    pool->write_context = context;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void bp_GetStats(BufferPool_t *pool, BufferPoolStats_t *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void *PinPage(BufferPool_t *pool, uint64_t page_id)
+{
+    uint32_t frame = LookupFrame(pool, page_id);
+    if (frame != BP_NO_FRAME)
+    {
+        pool->stats.hits++;
+        pool->frames[frame].pin_count++;
+        TouchFrame(pool, frame);
+        return FrameData(pool, frame);
+    }
+
+    pool->stats.misses++;
+    frame = GetFrame(pool);
+    if (frame == BP_NO_FRAME)
+        return NULL;
+    pool->frames[frame].page_id = page_id;
+    if (!ReadFrame(pool, frame))
+    {
+        pool->frames[frame].page_id = POOL_NO_FRAME;
+        PushHead(pool, BP_LIST_FREE, frame);
+        return NULL;
+    }
+    pool->frames[frame].pin_count = 1;
+    pool->frames[frame].dirty = false;
+    InsertFrame(pool, frame);
+    AdmitFrame(pool, frame);
+    return FrameData(pool, frame);
+}
+
+void bp_Destroy(BufferPool_t *pool)
+{
+    if (pool == NULL)
+        return;
+    if (pool->memory != NULL)
+        munmap(pool->memory, (size_t)pool->num_frames * pool->page_size);
+    free(pool->frames);
+    free(pool->buckets);
+    free(pool->ghosts);
+    free(pool->ghost_next);
+    free(pool->ghost_buckets);
+    close(pool->fd);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+BufferPool_t *InitBufferPool(int fd, uint32_t page_size, uint32_t num_frames, BufferPolicy_t policy)
+{
+    if (num_frames == 0)
+    {
+        fprintf(stderr, "Error in buffer pool: a pool needs at least one frame.\n");
+        return NULL;
+    }
+    BufferPool_t *pool = calloc(1, sizeof(BufferPool_t));
+    if (pool == NULL)
+        return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->fd = fd;
+    pool->page_size = page_size;
+    pool->num_frames = num_frames;
+    pool->policy = policy;
+    pool->free_head = POOL_NO_FRAME;
+    // The page table has a bucket or two for every frame.
+    while ((1u << pool->bucket_bits) < num_frames)
+        pool->bucket_bits++;
+    pool->bucket_bits++;
+    // 2Q keeps a quarter of the frames for pages read once, and remembers as many pages as fit in half the
+    // frames after they left, the settings its authors recommend.
+    pool->a1in_max = num_frames / 4 > 0 ? num_frames / 4 : 1;
+    pool->ghost_capacity = num_frames / 2 > 0 ? num_frames / 2 : 1;
+
+    // The frame memory is mapped straight from the system, like the chunks of a page pool.
+    pool->memory = mmap(NULL, (size_t)num_frames * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool->memory == MAP_FAILED)
+        pool->memory = NULL;
+    pool->frames = calloc(num_frames, sizeof(BufferFrame_t));
+    pool->buckets = malloc(sizeof(uint32_t) << pool->bucket_bits);
+    if (policy == BP_POLICY_2Q)
+    {
+        pool->ghosts = malloc(sizeof(uint64_t) * pool->ghost_capacity);
+        pool->ghost_next = malloc(sizeof(uint32_t) * pool->ghost_capacity);
+        pool->ghost_buckets = malloc(sizeof(uint32_t) << pool->bucket_bits);
+    }
+    if (pool->memory == NULL || pool->frames == NULL || pool->buckets == NULL ||
+        (policy == BP_POLICY_2Q && (pool->ghosts == NULL || pool->ghost_next == NULL || pool->ghost_buckets == NULL)))
+    {
+        fprintf(stderr, "Error in buffer pool: unable to allocate %d frames.\n", num_frames);
+        pool->fd = -1;
+        bp_Destroy(pool);
+        return NULL;
+    }
+    memset(pool->buckets, 0xff, sizeof(uint32_t) << pool->bucket_bits);
+    if (policy == BP_POLICY_2Q)
+        memset(pool->ghost_buckets, 0xff, sizeof(uint32_t) << pool->bucket_bits);
+
+    pool->free.head = pool->free.tail = BP_NO_FRAME;
+    pool->lru.head = pool->lru.tail = BP_NO_FRAME;
+    pool->a1in.head = pool->a1in.tail = BP_NO_FRAME;
+    for (uint32_t i = 0; i < num_frames; i++)
+    {
+        pool->frames[i].page_id = POOL_NO_FRAME;
+        PushHead(pool, BP_LIST_FREE, i);
+    }
+    return pool;
+}
+
+static inline uint8_t *FrameData(BufferPool_t *pool, uint32_t frame)
+{
+    return pool->memory + (size_t)frame * pool->page_size;
+}
+
+static inline uint32_t FrameOf(BufferPool_t *pool, void *page)
+{
+    // The frames are back to back, so the address tells us the frame.
+    return ((uint8_t *)page - pool->memory) / pool->page_size;
+}
+
+static inline uint32_t HashPage(uint64_t page_id, uint32_t bits)
+{
+    // Fibonacci hashing: page ids are mostly consecutive, and the multiply spreads them over the buckets.
+    return (uint32_t)((page_id * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+uint32_t LookupFrame(BufferPool_t *pool, uint64_t page_id)
+{
+    uint32_t frame = pool->buckets[HashPage(page_id, pool->bucket_bits)];
+    while (frame != BP_NO_FRAME && pool->frames[frame].page_id != page_id)
+        frame = pool->frames[frame].hash_next;
+    return frame;
+}
+
+void InsertFrame(BufferPool_t *pool, uint32_t frame)
+{
+    uint32_t *bucket = &pool->buckets[HashPage(pool->frames[frame].page_id, pool->bucket_bits)];
+    pool->frames[frame].hash_next = *bucket;
+    *bucket = frame;
+}
+
+void RemoveFrame(BufferPool_t *pool, uint32_t frame)
+{
+    uint32_t *link = &pool->buckets[HashPage(pool->frames[frame].page_id, pool->bucket_bits)];
+    while (*link != frame)
+        link = &pool->frames[*link].hash_next;
+    *link = pool->frames[frame].hash_next;
+}
+
+BufferList_t *FrameList(BufferPool_t *pool, uint8_t list)
+{
+    switch (list)
+    {
+    case BP_LIST_FREE:
+        return &pool->free;
+    case BP_LIST_LRU:
+        return &pool->lru;
+    case BP_LIST_A1IN:
+        return &pool->a1in;
+    default:
+        return NULL;
+    }
+}
+
+void PushHead(BufferPool_t *pool, uint8_t list, uint32_t frame)
+{
+    BufferList_t *target = FrameList(pool, list);
+    BufferFrame_t *current = &pool->frames[frame];
+    current->list = list;
+    current->prev = BP_NO_FRAME;
+    current->next = target->head;
+    if (target->head != BP_NO_FRAME)
+        pool->frames[target->head].prev = frame;
+    else
+        target->tail = frame;
+    target->head = frame;
+    target->count++;
+}
+
+void Unlink(BufferPool_t *pool, uint32_t frame)
+{
+    BufferFrame_t *current = &pool->frames[frame];
+    BufferList_t *source = FrameList(pool, current->list);
+    if (source == NULL)
+        return;
+    if (current->prev != BP_NO_FRAME)
+        pool->frames[current->prev].next = current->next;
+    else
+        source->head = current->next;
+    if (current->next != BP_NO_FRAME)
+        pool->frames[current->next].prev = current->prev;
+    else
+        source->tail = current->prev;
+    source->count--;
+    current->list = BP_LIST_NONE;
+}
+
+void TouchFrame(BufferPool_t *pool, uint32_t frame)
+{
+    // Records a hit on a page that is already in a frame.
+    switch (pool->policy)
+    {
+    case BP_POLICY_CLOCK:
+        pool->frames[frame].referenced = true;
+        break;
+    case BP_POLICY_2Q:
+        // Hits while a page is still in the FIFO queue are usually the same access pattern touching it
+        // again shortly after it was read, so they don't count as reuse.
+        if (pool->frames[frame].list == BP_LIST_A1IN)
+            break;
+        // Fall through.
+    case BP_POLICY_LRU:
+        Unlink(pool, frame);
+        PushHead(pool, BP_LIST_LRU, frame);
+        break;
+    }
+}
+
+void AdmitFrame(BufferPool_t *pool, uint32_t frame)
+{
+    // Puts a page that was just brought into a frame under the replacement policy.
+    switch (pool->policy)
+    {
+    case BP_POLICY_CLOCK:
+        pool->frames[frame].referenced = true;
+        break;
+    case BP_POLICY_2Q:
+        // A page we saw leave the FIFO queue not long ago has proven it's reused, so it goes to the LRU list.
+        PushHead(pool, TakeGhost(pool, pool->frames[frame].page_id) ? BP_LIST_LRU : BP_LIST_A1IN, frame);
+        break;
+    case BP_POLICY_LRU:
+        PushHead(pool, BP_LIST_LRU, frame);
+        break;
+    }
+}
+
+uint32_t OldestUnpinned(BufferPool_t *pool, BufferList_t *list)
+{
+    uint32_t frame = list->tail;
+    while (frame != BP_NO_FRAME && pool->frames[frame].pin_count > 0)
+        frame = pool->frames[frame].prev;
+    return frame;
+}
+
+uint32_t FindVictim(BufferPool_t *pool)
+{
+    // Picks an unpinned frame to reuse, or returns BP_NO_FRAME if every frame is pinned.
+    switch (pool->policy)
+    {
+    case BP_POLICY_CLOCK:
+        // Two sweeps are enough: the first one clears every reference bit it passes.
+        for (uint64_t i = 0; i < 2 * (uint64_t)pool->num_frames; i++)
+        {
+            uint32_t frame = pool->clock_hand;
+            pool->clock_hand = (pool->clock_hand + 1) % pool->num_frames;
+            if (pool->frames[frame].pin_count > 0)
+                continue;
+            if (!pool->frames[frame].referenced)
+                return frame;
+            pool->frames[frame].referenced = false;
+        }
+        return BP_NO_FRAME;
+    case BP_POLICY_2Q:
+    {
+        // The FIFO queue gives up its oldest page once it's over its share, and we remember the page
+        // left, so it can go to the LRU list if it's read again soon.
+        uint32_t frame = BP_NO_FRAME;
+        if (pool->a1in.count > pool->a1in_max)
+            frame = OldestUnpinned(pool, &pool->a1in);
+        if (frame == BP_NO_FRAME)
+            frame = OldestUnpinned(pool, &pool->lru);
+        if (frame == BP_NO_FRAME)
+            frame = OldestUnpinned(pool, &pool->a1in);
+        if (frame != BP_NO_FRAME && pool->frames[frame].list == BP_LIST_A1IN)
+            AddGhost(pool, pool->frames[frame].page_id);
+        return frame;
+    }
+    case BP_POLICY_LRU:
+    default:
+        return OldestUnpinned(pool, &pool->lru);
+    }
+}
+
+uint32_t GetFrame(BufferPool_t *pool)
+{
+    // An empty frame is used first. Otherwise a page is pushed out, and written back if it has changed.
+    uint32_t frame = pool->free.head;
+    if (frame != BP_NO_FRAME)
+    {
+        Unlink(pool, frame);
+        return frame;
+    }
+
+    frame = FindVictim(pool);
+    if (frame == BP_NO_FRAME)
+    {
+        fprintf(stderr, "Error in buffer pool: all %d frames are pinned.\n", pool->num_frames);
+        return BP_NO_FRAME;
+    }
+    if (pool->frames[frame].dirty && !WriteFrame(pool, frame))
+        return BP_NO_FRAME;
+    RemoveFrame(pool, frame);
+    Unlink(pool, frame);
+    pool->frames[frame].page_id = POOL_NO_FRAME;
+    pool->frames[frame].referenced = false;
+    pool->stats.evictions++;
+    return frame;
+}
+
+bool WriteFrame(BufferPool_t *pool, uint32_t frame)
+{
+    off_t offset = (off_t)pool->frames[frame].page_id * pool->page_size;
+    if (pool->write_hook != NULL && !pool->write_hook(pool->write_context, pool->frames[frame].page_id, FrameData(pool, frame)))
+    {
+        fprintf(stderr, "Error in buffer pool: page %ld can't be written yet.\n", pool->frames[frame].page_id);
+        return false;
+    }
+    if (pwrite(pool->fd, FrameData(pool, frame), pool->page_size, offset) != (ssize_t)pool->page_size)
+    {
+        fprintf(stderr, "Error in buffer pool: unable to write page %ld.\n", pool->frames[frame].page_id);
+        return false;
+    }
+    pool->frames[frame].dirty = false;
+    pool->stats.writes++;
+    return true;
+}
+
+bool ReadFrame(BufferPool_t *pool, uint32_t frame)
+{
+    // A page that was handed out but never written lies beyond the end of the file, and reads as zeros.
+    uint8_t *data = FrameData(pool, frame);
+    off_t offset = (off_t)pool->frames[frame].page_id * pool->page_size;
+    ssize_t read = pread(pool->fd, data, pool->page_size, offset);
+    if (read < 0)
+    {
+        fprintf(stderr, "Error in buffer pool: unable to read page %ld.\n", pool->frames[frame].page_id);
+        return false;
+    }
+    memset(data + read, 0, pool->page_size - read);
+    pool->stats.reads++;
+    return true;
+}
+
+bool TakeGhost(BufferPool_t *pool, uint64_t page_id)
+{
+    // Looks for the page among the ghosts, and takes it out if it's there.
+    // Its slot in the ring stays behind, empty, until it's the oldest.
+    uint32_t *link = &pool->ghost_buckets[HashPage(page_id, pool->bucket_bits)];
+    while (*link != BP_NO_GHOST)
+    {
+        uint32_t slot = *link;
+        if (pool->ghosts[slot] == page_id)
+        {
+            *link = pool->ghost_next[slot];
+            pool->ghosts[slot] = POOL_NO_FRAME;
+            return true;
+        }
+        link = &pool->ghost_next[slot];
+    }
+    return false;
+}
+
+void AddGhost(BufferPool_t *pool, uint64_t page_id)
+{
+    // A full ring forgets its oldest ghost.
+    if (pool->ghost_count == pool->ghost_capacity)
+    {
+        uint32_t oldest = pool->ghost_head;
+        if (pool->ghosts[oldest] != POOL_NO_FRAME)
+            TakeGhost(pool, pool->ghosts[oldest]);
+        pool->ghost_head = (pool->ghost_head + 1) % pool->ghost_capacity;
+        pool->ghost_count--;
+    }
+    uint32_t slot = (pool->ghost_head + pool->ghost_count) % pool->ghost_capacity;
+    uint32_t *bucket = &pool->ghost_buckets[HashPage(page_id, pool->bucket_bits)];
+    pool->ghosts[slot] = page_id;
+    pool->ghost_next[slot] = *bucket;
+    *bucket = slot;
+    pool->ghost_count++;
+}
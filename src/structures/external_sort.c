@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include "external_sort.h"
+
+static bool SpillRun(ExternalSort_t *sort);
+static bool ReadRunRecord(ExternalSort_t *sort, ExternalSortRun_t *run);
+static int CompareRuns(ExternalSort_t *sort, uint32_t a, uint32_t b);
+static void SiftDown(ExternalSort_t *sort, uint32_t pos);
+
+ExternalSort_t *xsort_Create(uint32_t record_size, size_t memory_budget, ExternalSortCompare_t compare, void *context)
+{
+    if (record_size == 0 || memory_budget / record_size < 2)
+    {
+        fprintf(stderr, "Error in external sort: memory budget %zu can't hold two records of size %d.\n", memory_budget, record_size);
+        return NULL;
+    }
+
+    ExternalSort_t *sort = calloc(1, sizeof(ExternalSort_t));
+    if (sort == NULL)
+        return NULL;
+    sort->record_size = record_size;
+    sort->compare = compare;
+    sort->context = context;
+    sort->buffer_capacity = memory_budget / record_size;
+    sort->buffer = malloc(sort->buffer_capacity * record_size);
+    sort->current = malloc(record_size);
+    if (sort->buffer == NULL || sort->current == NULL)
+    {
+        xsort_Destroy(sort);
+        return NULL;
+    }
+    return sort;
+}
+
+bool xsort_Add(ExternalSort_t *sort, const void *record)
+{
+    if (sort->finished)
+        return false;
+    // If the buffer is full, we sort it and write it out as a run before taking the new record.
+    if (sort->buffer_count == sort->buffer_capacity && !SpillRun(sort))
+        return false;
+    memcpy(sort->buffer + sort->buffer_count * sort->record_size, record, sort->record_size);
+    sort->buffer_count++;
+    return true;
+}
+
+bool xsort_Finish(ExternalSort_t *sort)
+{
+    if (sort->finished)
+        return false;
+    sort->finished = true;
+
+    // If everything fit in memory, there is nothing to merge. We sort the buffer and stream it directly.
+    if (sort->num_runs == 0)
+    {
+        qsort_r(sort->buffer, sort->buffer_count, sort->record_size, sort->compare, sort->context);
+        sort->buffer_pos = 0;
+        return true;
+    }
+
+    // Otherwise the rest of the buffer becomes the last run, and the buffer is no longer needed.
+    if (sort->buffer_count > 0 && !SpillRun(sort))
+        return false;
+    free(sort->buffer);
+    sort->buffer = NULL;
+
+    // Rewind every run, read its first record and build a min-heap over the run heads.
+    sort->heap = malloc(sizeof(uint32_t) * sort->num_runs);
+    if (sort->heap == NULL)
+        return false;
+    sort->heap_size = 0;
+    for (uint32_t i = 0; i < sort->num_runs; i++)
+    {
+        rewind(sort->runs[i].file);
+        if (ReadRunRecord(sort, &sort->runs[i]))
+            sort->heap[sort->heap_size++] = i;
+    }
+    for (uint32_t i = sort->heap_size / 2; i > 0; i--)
+    {
+        SiftDown(sort, i - 1);
+    }
+    return true;
+}
+
+const void *xsort_Next(ExternalSort_t *sort)
+{
+    if (!sort->finished)
+        return NULL;
+
+    if (sort->num_runs == 0)
+    {
+        if (sort->buffer_pos == sort->buffer_count)
+            return NULL;
+        return sort->buffer + sort->record_size * sort->buffer_pos++;
+    }
+
+    if (sort->heap_size == 0)
+        return NULL;
+
+    // The smallest record is at the head of the run on top of the heap. We hand out a copy of it,
+    // advance that run, and restore the heap.
+    ExternalSortRun_t *run = &sort->runs[sort->heap[0]];
+    memcpy(sort->current, run->record, sort->record_size);
+    if (!ReadRunRecord(sort, run))
+        sort->heap[0] = sort->heap[--sort->heap_size];
+    if (sort->heap_size > 0)
+        SiftDown(sort, 0);
+    return sort->current;
+}
+
+void xsort_Destroy(ExternalSort_t *sort)
+{
+    if (sort == NULL)
+        return;
+    for (uint32_t i = 0; i < sort->num_runs; i++)
+    {
+        // Temporary files are removed when closed.
+        if (sort->runs[i].file)
+            fclose(sort->runs[i].file);
+        free(sort->runs[i].record);
+    }
+    free(sort->runs);
+    free(sort->heap);
+    free(sort->buffer);
+    free(sort->current);
+    free(sort);
+}
+
+bool SpillRun(ExternalSort_t *sort)
+{
+    ExternalSortRun_t *runs = realloc(sort->runs, sizeof(ExternalSortRun_t) * (sort->num_runs + 1));
+    if (runs == NULL)
+        return false;
+    sort->runs = runs;
+
+    ExternalSortRun_t *run = &sort->runs[sort->num_runs];
+    memset(run, 0, sizeof(ExternalSortRun_t));
+    run->file = tmpfile();
+    run->record = malloc(sort->record_size);
+    if (run->file == NULL || run->record == NULL)
+    {
+        fprintf(stderr, "Error in external sort: unable to create run %d.\n", sort->num_runs);
+        if (run->file)
+            fclose(run->file);
+        free(run->record);
+        return false;
+    }
+    sort->num_runs++;
+
+    qsort_r(sort->buffer, sort->buffer_count, sort->record_size, sort->compare, sort->context);
+    if (fwrite(sort->buffer, sort->record_size, sort->buffer_count, run->file) != sort->buffer_count)
+    {
+        fprintf(stderr, "Error in external sort: unable to write run %d.\n", sort->num_runs - 1);
+        return false;
+    }
+    sort->buffer_count = 0;
+    return true;
+}
+
+bool ReadRunRecord(ExternalSort_t *sort, ExternalSortRun_t *run)
+{
+    run->has_record = fread(run->record, sort->record_size, 1, run->file) == 1;
+    return run->has_record;
+}
+
+int CompareRuns(ExternalSort_t *sort, uint32_t a, uint32_t b)
+{
+    return sort->compare(sort->runs[a].record, sort->runs[b].record, sort->context);
+}
+
+void SiftDown(ExternalSort_t *sort, uint32_t pos)
+{
+    while (true)
+    {
+        uint32_t smallest = pos;
+        uint32_t left = 2 * pos + 1;
+        uint32_t right = left + 1;
+        if (left < sort->heap_size && CompareRuns(sort, sort->heap[left], sort->heap[smallest]) < 0)
+            smallest = left;
+        if (right < sort->heap_size && CompareRuns(sort, sort->heap[right], sort->heap[smallest]) < 0)
+            smallest = right;
+        if (smallest == pos)
+            return;
+        uint32_t tmp = sort->heap[pos];
+        sort->heap[pos] = sort->heap[smallest];
+        sort->heap[smallest] = tmp;
+        pos = smallest;
+    }
+}
@@ -0,0 +1,421 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include "hash_index.h"
+
+// On x86-64 the tags of a bucket are compared with one SSE2 compare, which is always there.
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HIDX_HAVE_SSE2 1
+#endif
+
+static bool InitSegment(HashSegment_t *segment, uint64_t num_buckets);
+static void FreeSegment(HashSegment_t *segment);
+static bool InitTable(HashTable_t *table, uint64_t num_buckets);
+static inline uint64_t TableCapacity(const HashTable_t *table);
+static inline HashSegment_t *KeySegment(HashIndex_t *index, uint64_t hash);
+static inline uint16_t HashTag(uint64_t hash);
+static inline HashEntry_t *Entry(HashIndex_t *index, HashSegment_t *segment, uint32_t entry);
+static inline uint32_t MatchTags(const HashBucket_t *bucket, uint16_t tag);
+static bool FindInTable(HashIndex_t *index, HashSegment_t *segment, HashTable_t *table, uint64_t hash, const void *key, uint64_t *bucket, uint32_t *slot);
+static uint32_t FindEntry(HashIndex_t *index, HashSegment_t *segment, uint64_t hash, const void *key, HashTable_t **table, uint64_t *bucket, uint32_t *slot);
+static void PlaceEntry(HashTable_t *table, uint64_t hash, uint32_t entry);
+static uint32_t AllocEntry(HashIndex_t *index, HashSegment_t *segment);
+static void FreeEntry(HashIndex_t *index, HashSegment_t *segment, uint32_t entry);
+static void MoveBuckets(HashIndex_t *index, HashSegment_t *segment, uint64_t count);
+static bool Grow(HashIndex_t *index, HashSegment_t *segment);
+static bool Store(HashIndex_t *index, const void *key, const RecordID_t *rid, bool replace);
+
+HashIndex_t *hidx_Create(const IndexKeyDesc_t *key, uint64_t expected)
+{
+    // The segments are aligned to cache lines, so the index is as well.
+    size_t size = (sizeof(HashIndex_t) + 63) & ~(size_t)63;
+    HashIndex_t *index = aligned_alloc(64, size);
+    if (index == NULL)
+    {
+        fprintf(stderr, "Error in hash index: unable to allocate index.\n");
+        return NULL;
+    }
+    memset(index, 0, sizeof(HashIndex_t));
+    if (!idxk_InitOps(&index->key_ops, key))
+    {
+        free(index);
+        return NULL;
+    }
+    index->key_size = index->key_ops.key_size;
+    index->entry_size = (sizeof(HashEntry_t) + index->key_size + 7) & ~7U;
+
+    // Each segment starts out with room for its share of the expected keys without being resized.
+    uint64_t num_buckets = HIDX_MIN_BUCKETS;
+    uint64_t slots = expected / HIDX_SEGMENTS * 100 / HIDX_MAX_LOAD + 1;
+    while (num_buckets * HIDX_BUCKET_SLOTS < slots)
+        num_buckets *= 2;
+    for (uint32_t i = 0; i < HIDX_SEGMENTS; i++)
+    {
+        if (!InitSegment(&index->segments[i], num_buckets))
+        {
+            fprintf(stderr, "Error in hash index: unable to allocate index.\n");
+            for (uint32_t j = 0; j < i; j++)
+                FreeSegment(&index->segments[j]);
+            free(index);
+            return NULL;
+        }
+    }
+    return index;
+}
+
+bool hidx_Insert(HashIndex_t *index, const void *key, const RecordID_t *rid)
+{
+    return Store(index, key, rid, false);
+}
+
+bool hidx_Put(HashIndex_t *index, const void *key, const RecordID_t *rid)
+{
+    return Store(index, key, rid, true);
+}
+
+bool hidx_Find(HashIndex_t *index, const void *key, RecordID_t *rid)
+{
+    uint64_t hash = idxk_Hash(&index->key_ops, key);
+    HashSegment_t *segment = KeySegment(index, hash);
+    pthread_rwlock_rdlock(&segment->lock);
+    HashTable_t *table;
+    uint64_t bucket;
+    uint32_t slot;
+    uint32_t entry = FindEntry(index, segment, hash, key, &table, &bucket, &slot);
+    if (entry != HIDX_NO_ENTRY)
+        *rid = Entry(index, segment, entry)->rid;
+    pthread_rwlock_unlock(&segment->lock);
+    return entry != HIDX_NO_ENTRY;
+}
+
+bool hidx_Delete(HashIndex_t *index, const void *key)
+{
+    uint64_t hash = idxk_Hash(&index->key_ops, key);
+    HashSegment_t *segment = KeySegment(index, hash);
+    pthread_rwlock_wrlock(&segment->lock);
+    MoveBuckets(index, segment, HIDX_MOVE_BUCKETS);
+    HashTable_t *table;
+    uint64_t bucket;
+    uint32_t slot;
+    uint32_t entry = FindEntry(index, segment, hash, key, &table, &bucket, &slot);
+    if (entry != HIDX_NO_ENTRY)
+    {
+        // The overflow flags of the buckets stay as they are, since entries further on may still count on them.
+        table->buckets[bucket].tags[slot] = 0;
+        table->used--;
+        FreeEntry(index, segment, entry);
+        __atomic_store_n(&segment->num_entries, segment->num_entries - 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&segment->lock);
+    return entry != HIDX_NO_ENTRY;
+}
+
+uint64_t hidx_Count(HashIndex_t *index)
+{
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < HIDX_SEGMENTS; i++)
+        count += __atomic_load_n(&index->segments[i].num_entries, __ATOMIC_RELAXED);
+    return count;
+}
+
+void hidx_Clear(HashIndex_t *index)
+{
+    for (uint32_t i = 0; i < HIDX_SEGMENTS; i++)
+    {
+        HashSegment_t *segment = &index->segments[i];
+        pthread_rwlock_wrlock(&segment->lock);
+        for (uint32_t j = 0; j < segment->num_chunks; j++)
+            free(segment->chunks[j]);
+        free(segment->chunks);
+        segment->chunks = NULL;
+        segment->num_chunks = 0;
+        segment->next_entry = 0;
+        segment->free_entry = HIDX_NO_ENTRY;
+        free(segment->old.buckets);
+        memset(&segment->old, 0, sizeof(HashTable_t));
+        segment->moved = 0;
+        // If a small table can't be had, the one there is is emptied instead.
+        HashTable_t table;
+        if (InitTable(&table, HIDX_MIN_BUCKETS))
+        {
+            free(segment->table.buckets);
+            segment->table = table;
+        }
+        else
+        {
+            memset(segment->table.buckets, 0, segment->table.num_buckets * sizeof(HashBucket_t));
+            segment->table.used = 0;
+        }
+        __atomic_store_n(&segment->num_entries, 0, __ATOMIC_RELAXED);
+        pthread_rwlock_unlock(&segment->lock);
+    }
+}
+
+void hidx_GetStats(HashIndex_t *index, HashIndexStats_t *stats)
+{
+    memset(stats, 0, sizeof(HashIndexStats_t));
+    for (uint32_t i = 0; i < HIDX_SEGMENTS; i++)
+    {
+        HashSegment_t *segment = &index->segments[i];
+        pthread_rwlock_rdlock(&segment->lock);
+        stats->entries += segment->num_entries;
+        stats->buckets += segment->table.num_buckets + segment->old.num_buckets;
+        stats->old_buckets += segment->old.num_buckets;
+        stats->memory += (segment->table.num_buckets + segment->old.num_buckets) * sizeof(HashBucket_t);
+        stats->memory += (uint64_t)segment->num_chunks * HIDX_CHUNK_ENTRIES * index->entry_size;
+        pthread_rwlock_unlock(&segment->lock);
+    }
+    stats->resizes = __atomic_load_n(&index->resizes, __ATOMIC_RELAXED);
+}
+
+void hidx_Destroy(HashIndex_t *index)
+{
+    if (index == NULL)
+        return;
+    for (uint32_t i = 0; i < HIDX_SEGMENTS; i++)
+        FreeSegment(&index->segments[i]);
+    free(index);
+}
+
+bool InitSegment(HashSegment_t *segment, uint64_t num_buckets)
+{
+    memset(segment, 0, sizeof(HashSegment_t));
+    if (!InitTable(&segment->table, num_buckets))
+        return false;
+    segment->free_entry = HIDX_NO_ENTRY;
+    pthread_rwlock_init(&segment->lock, NULL);
+    return true;
+}
+
+void FreeSegment(HashSegment_t *segment)
+{
+    for (uint32_t i = 0; i < segment->num_chunks; i++)
+        free(segment->chunks[i]);
+    free(segment->chunks);
+    free(segment->table.buckets);
+    free(segment->old.buckets);
+    pthread_rwlock_destroy(&segment->lock);
+}
+
+bool InitTable(HashTable_t *table, uint64_t num_buckets)
+{
+    // Every bucket is a cache line of its own.
+    table->buckets = aligned_alloc(64, num_buckets * sizeof(HashBucket_t));
+    if (table->buckets == NULL)
+        return false;
+    memset(table->buckets, 0, num_buckets * sizeof(HashBucket_t));
+    table->num_buckets = num_buckets;
+    table->used = 0;
+    return true;
+}
+
+static inline uint64_t TableCapacity(const HashTable_t *table)
+{
+    return table->num_buckets * HIDX_BUCKET_SLOTS;
+}
+
+static inline HashSegment_t *KeySegment(HashIndex_t *index, uint64_t hash)
+{
+    // The top bits pick the segment, the low bits the bucket, and the bits in between make the tag, so the
+    // three don't depend on each other.
+    return &index->segments[hash >> (64 - __builtin_ctz(HIDX_SEGMENTS))];
+}
+
+static inline uint16_t HashTag(uint64_t hash)
+{
+    // A tag of 0 marks a free slot.
+    uint16_t tag = (uint16_t)(hash >> 32);
+    return tag != 0 ? tag : 1;
+}
+
+static inline HashEntry_t *Entry(HashIndex_t *index, HashSegment_t *segment, uint32_t entry)
+{
+    return (HashEntry_t *)(segment->chunks[entry / HIDX_CHUNK_ENTRIES] + (size_t)(entry % HIDX_CHUNK_ENTRIES) * index->entry_size);
+}
+
+static inline uint32_t MatchTags(const HashBucket_t *bucket, uint16_t tag)
+{
+    // The slots whose tag is tag, as bit 2 * slot of the result.
+#ifdef HIDX_HAVE_SSE2
+    __m128i tags = _mm_load_si128((const __m128i *)bucket->tags);
+    __m128i matches = _mm_cmpeq_epi16(tags, _mm_set1_epi16((short)tag));
+    return (uint32_t)_mm_movemask_epi8(matches) & 0x5555;
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < HIDX_BUCKET_SLOTS; i++)
+        mask |= (uint32_t)(bucket->tags[i] == tag) << (2 * i);
+    return mask;
+#endif
+}
+
+bool FindInTable(HashIndex_t *index, HashSegment_t *segment, HashTable_t *table, uint64_t hash, const void *key, uint64_t *bucket, uint32_t *slot)
+{
+    // Goes from the bucket the hash picks on to the next ones for as long as they have overflowed.
+    if (table->buckets == NULL)
+        return false;
+    uint16_t tag = HashTag(hash);
+    uint64_t pos = hash & (table->num_buckets - 1);
+    for (uint64_t probed = 0; probed < table->num_buckets; probed++)
+    {
+        HashBucket_t *current = &table->buckets[pos];
+        for (uint32_t mask = MatchTags(current, tag); mask != 0; mask &= mask - 1)
+        {
+            uint32_t i = __builtin_ctz(mask) / 2;
+            HashEntry_t *entry = Entry(index, segment, current->entries[i]);
+            if (entry->hash == hash && index->key_ops.compare(&index->key_ops, entry->key, key) == 0)
+            {
+                *bucket = pos;
+                *slot = i;
+                return true;
+            }
+        }
+        if (!current->overflow)
+            return false;
+        pos = (pos + 1) & (table->num_buckets - 1);
+    }
+    return false;
+}
+
+uint32_t FindEntry(HashIndex_t *index, HashSegment_t *segment, uint64_t hash, const void *key, HashTable_t **table, uint64_t *bucket, uint32_t *slot)
+{
+    // While the segment is resized, a key is in one of its tables, the new one more likely the further along
+    // the move is.
+    *table = &segment->table;
+    if (FindInTable(index, segment, *table, hash, key, bucket, slot))
+        return (*table)->buckets[*bucket].entries[*slot];
+    *table = &segment->old;
+    if (FindInTable(index, segment, *table, hash, key, bucket, slot))
+        return (*table)->buckets[*bucket].entries[*slot];
+    return HIDX_NO_ENTRY;
+}
+
+void PlaceEntry(HashTable_t *table, uint64_t hash, uint32_t entry)
+{
+    // Puts the entry in the first bucket with a free slot, from the one the hash picks. The table is never
+    // full, so there is one.
+    uint64_t pos = hash & (table->num_buckets - 1);
+    for (;;)
+    {
+        HashBucket_t *current = &table->buckets[pos];
+        uint32_t free_slots = MatchTags(current, 0);
+        if (free_slots != 0)
+        {
+            uint32_t i = __builtin_ctz(free_slots) / 2;
+            current->tags[i] = HashTag(hash);
+            current->entries[i] = entry;
+            table->used++;
+            return;
+        }
+        current->overflow = true;
+        pos = (pos + 1) & (table->num_buckets - 1);
+    }
+}
+
+uint32_t AllocEntry(HashIndex_t *index, HashSegment_t *segment)
+{
+    if (segment->free_entry != HIDX_NO_ENTRY)
+    {
+        uint32_t entry = segment->free_entry;
+        segment->free_entry = (uint32_t)Entry(index, segment, entry)->hash;
+        return entry;
+    }
+    if (segment->next_entry == segment->num_chunks * HIDX_CHUNK_ENTRIES)
+    {
+        // A new chunk. The ones there are stay where they are.
+        uint8_t **chunks = realloc(segment->chunks, sizeof(uint8_t *) * (segment->num_chunks + 1));
+        if (chunks == NULL)
+            return HIDX_NO_ENTRY;
+        segment->chunks = chunks;
+        segment->chunks[segment->num_chunks] = malloc((size_t)HIDX_CHUNK_ENTRIES * index->entry_size);
+        if (segment->chunks[segment->num_chunks] == NULL)
+            return HIDX_NO_ENTRY;
+        segment->num_chunks++;
+    }
+    return segment->next_entry++;
+}
+
+void FreeEntry(HashIndex_t *index, HashSegment_t *segment, uint32_t entry)
+{
+    Entry(index, segment, entry)->hash = segment->free_entry;
+    segment->free_entry = entry;
+}
+
+void MoveBuckets(HashIndex_t *index, HashSegment_t *segment, uint64_t count)
+{
+    // Moves up to count buckets of the old table of a segment being resized into the new one, and lets go of
+    // the old table once it's empty. Called with the lock held exclusively.
+    for (; count > 0 && segment->old.buckets != NULL; count--)
+    {
+        HashBucket_t *current = &segment->old.buckets[segment->moved];
+        for (uint32_t i = 0; i < HIDX_BUCKET_SLOTS; i++)
+        {
+            if (current->tags[i] == 0)
+                continue;
+            PlaceEntry(&segment->table, Entry(index, segment, current->entries[i])->hash, current->entries[i]);
+            current->tags[i] = 0;
+            segment->old.used--;
+        }
+        if (++segment->moved == segment->old.num_buckets)
+        {
+            free(segment->old.buckets);
+            memset(&segment->old, 0, sizeof(HashTable_t));
+            segment->moved = 0;
+        }
+    }
+}
+
+bool Grow(HashIndex_t *index, HashSegment_t *segment)
+{
+    // The old table is left over from the last resize only if the segment filled up again before every change
+    // since has moved it, which takes far more keys than were left to move. It's moved first, all of it.
+    MoveBuckets(index, segment, segment->old.num_buckets);
+    HashTable_t table;
+    if (!InitTable(&table, 2 * segment->table.num_buckets))
+        return false;
+    segment->old = segment->table;
+    segment->moved = 0;
+    segment->table = table;
+    __atomic_fetch_add(&index->resizes, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+bool Store(HashIndex_t *index, const void *key, const RecordID_t *rid, bool replace)
+{
+    uint64_t hash = idxk_Hash(&index->key_ops, key);
+    HashSegment_t *segment = KeySegment(index, hash);
+    pthread_rwlock_wrlock(&segment->lock);
+    MoveBuckets(index, segment, HIDX_MOVE_BUCKETS);
+    HashTable_t *table;
+    uint64_t bucket;
+    uint32_t slot;
+    uint32_t entry = FindEntry(index, segment, hash, key, &table, &bucket, &slot);
+    if (entry != HIDX_NO_ENTRY)
+    {
+        if (replace)
+            Entry(index, segment, entry)->rid = *rid;
+        pthread_rwlock_unlock(&segment->lock);
+        return replace;
+    }
+    if ((segment->table.used + 1) * 100 > TableCapacity(&segment->table) * HIDX_MAX_LOAD && !Grow(index, segment))
+    {
+        fprintf(stderr, "Error in hash index: unable to allocate buckets.\n");
+        pthread_rwlock_unlock(&segment->lock);
+        return false;
+    }
+    entry = AllocEntry(index, segment);
+    if (entry == HIDX_NO_ENTRY)
+    {
+        fprintf(stderr, "Error in hash index: unable to allocate entry.\n");
+        pthread_rwlock_unlock(&segment->lock);
+        return false;
+    }
+    HashEntry_t *added = Entry(index, segment, entry);
+    added->hash = hash;
+    added->rid = *rid;
+    memcpy(added->key, key, index->key_size);
+    PlaceEntry(&segment->table, hash, entry);
+    __atomic_store_n(&segment->num_entries, segment->num_entries + 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&segment->lock);
+    return true;
+}
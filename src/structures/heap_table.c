@@ -0,0 +1,844 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include "heap_table.h"
+
+// Rows start on this boundary within a page.
+#define HEAP_ROW_ALIGN 8
+// Leaves the free-space map starts out with. It doubles whenever a page beyond them shows up.
+#define HEAP_FSM_INITIAL_CAPACITY 64
+
+static bool ReserveSuperblock(HeapTable_t *table);
+static void WriteSuperblock(HeapTable_t *table);
+static inline uint32_t SuperblockPages(HeapTable_t *table);
+static inline HeapPage_t *GetPage(HeapTable_t *table, uint64_t page_id);
+static inline void ReleasePage(HeapTable_t *table, HeapPage_t *page, bool dirty);
+static inline Latch_t *PageLatch(HeapTable_t *table, HeapPage_t *page, uint64_t page_id);
+static void *AllocPage(HeapTable_t *table, uint64_t *page_id);
+static uint64_t NumPages(HeapTable_t *table);
+static HeapPage_t *LatchRecordPage(HeapTable_t *table, const RecordID_t *rid, bool exclusive);
+static void UnlatchRecordPage(HeapTable_t *table, HeapPage_t *page, bool exclusive, bool dirty);
+static inline HeapSlot_t *PageSlots(HeapPage_t *page);
+static inline uint32_t RowSpace(uint32_t size);
+static inline uint32_t PageEnd(HeapTable_t *table);
+static inline uint32_t ContiguousSpace(HeapPage_t *page);
+static void InitDataPage(HeapTable_t *table, HeapPage_t *page, uint64_t page_id);
+static bool PlaceRow(HeapTable_t *table, HeapPage_t *page, const void *data, uint32_t size, uint32_t *slot_num);
+static void RemoveRow(HeapTable_t *table, HeapPage_t *page, uint32_t slot_num);
+static void CompactPage(HeapTable_t *table, HeapPage_t *page);
+static bool InsertRow(HeapTable_t *table, const void *data, uint32_t size, RecordID_t *rid, uint64_t source_page);
+static bool InitFreeSpaceMap(HeapTable_t *table);
+static void SetFreeSpace(HeapTable_t *table, uint64_t page_id, uint32_t free_bytes);
+static void SetCategory(HeapFreeSpaceMap_t *fsm, uint64_t page_id, uint8_t category);
+static uint64_t FindFreeSpace(HeapTable_t *table, uint32_t bytes, uint64_t from);
+static uint64_t SearchFreeSpace(HeapFreeSpaceMap_t *fsm, uint64_t node, uint64_t low, uint64_t width, uint8_t category, uint64_t from);
+static bool WriteFreeSpaceMap(HeapTable_t *table);
+static bool ReadFreeSpaceMap(HeapTable_t *table);
+static inline uint8_t *FreeSpaceData(HeapFreeSpacePage_t *page);
+
+void heap_InitOptions(HeapTableOptions_t *options)
+{
+    memset(options, 0, sizeof(HeapTableOptions_t));
+    options->page_size = 4096;
+}
+
+HeapTable_t *heap_Create(const HeapTableOptions_t *options)
+{
+    HeapTable_t *table = calloc(1, sizeof(HeapTable_t));
+    if (table == NULL)
+    {
+        fprintf(stderr, "Error in heap table: unable to allocate table.\n");
+        return NULL;
+    }
+    table->page_size = options->page_size;
+    // A page has to take the headers and at least one row, and the free-space map a useful number of pages.
+    if (table->page_size < sizeof(HeapPage_t) + sizeof(HeapSlot_t) + 4 * HEAP_ROW_ALIGN ||
+        table->page_size < sizeof(HeapFreeSpacePage_t) + 4 * HEAP_ROW_ALIGN)
+    {
+        fprintf(stderr, "Error in heap table: page size %d is too small.\n", table->page_size);
+        free(table);
+        return NULL;
+    }
+    table->max_row_size = (PageEnd(table) - sizeof(HeapPage_t) - sizeof(HeapSlot_t)) & ~(HEAP_ROW_ALIGN - 1);
+    table->fsm_head = HEAP_NO_PAGE;
+    // The pages come from an arena of their own, possibly mapped from a table file, or from a buffer pool
+    // in front of the file, the same as the pages of an index tree.
+    if (options->path != NULL && options->buffer_frames > 0)
+    {
+        if (options->buffer_frames < HEAP_MIN_BUFFER_FRAMES)
+        {
+            fprintf(stderr, "Error in heap table: a buffer pool needs at least %d frames.\n", HEAP_MIN_BUFFER_FRAMES);
+            free(table);
+            return NULL;
+        }
+        table->buffer = bp_Create(options->path, pool_FrameSize(table->page_size), options->buffer_frames, options->buffer_policy);
+    }
+    else if (options->path != NULL)
+        table->pool = pool_CreateFile(options->path, table->page_size);
+    else
+        table->pool = pool_Create(table->page_size, options->huge_pages);
+    if (table->pool == NULL && table->buffer == NULL)
+    {
+        free(table);
+        return NULL;
+    }
+    if (!InitFreeSpaceMap(table) || !ReserveSuperblock(table))
+    {
+        pool_Destroy(table->pool);
+        bp_Destroy(table->buffer);
+        free(table->fsm.nodes);
+        free(table);
+        return NULL;
+    }
+    table->superblock_pages = SuperblockPages(table);
+    WriteSuperblock(table);
+    return table;
+}
+
+HeapTable_t *heap_Open(const HeapTableOptions_t *options)
+{
+    const char *path = options->path;
+    // The superblock is read on its own first, since we need the page size before we can map the pages.
+    HeapSuperblock_t superblock;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error in heap table: unable to open %s.\n", path);
+        return NULL;
+    }
+    size_t read = fread(&superblock, sizeof(HeapSuperblock_t), 1, file);
+    fclose(file);
+    if (read != 1 || superblock.magic != HEAP_FILE_MAGIC || superblock.version != HEAP_FILE_VERSION)
+    {
+        fprintf(stderr, "Error in heap table: %s is not a table file.\n", path);
+        return NULL;
+    }
+
+    HeapTable_t *table = calloc(1, sizeof(HeapTable_t));
+    if (table == NULL)
+    {
+        fprintf(stderr, "Error in heap table: unable to allocate table.\n");
+        return NULL;
+    }
+    table->page_size = superblock.page_size;
+    table->max_row_size = (PageEnd(table) - sizeof(HeapPage_t) - sizeof(HeapSlot_t)) & ~(HEAP_ROW_ALIGN - 1);
+    table->num_rows = superblock.num_rows;
+    table->fsm_head = superblock.fsm_head;
+    if (options->buffer_frames > 0)
+    {
+        if (options->buffer_frames < HEAP_MIN_BUFFER_FRAMES)
+        {
+            fprintf(stderr, "Error in heap table: a buffer pool needs at least %d frames.\n", HEAP_MIN_BUFFER_FRAMES);
+            free(table);
+            return NULL;
+        }
+        table->buffer = bp_Open(path, pool_FrameSize(table->page_size), options->buffer_frames, options->buffer_policy, superblock.num_frames, superblock.free_head, superblock.num_free);
+    }
+    else
+        table->pool = pool_OpenFile(path, table->page_size, superblock.num_frames, superblock.free_head, superblock.num_free);
+    if (table->pool == NULL && table->buffer == NULL)
+    {
+        free(table);
+        return NULL;
+    }
+    table->superblock_pages = SuperblockPages(table);
+    if (!InitFreeSpaceMap(table) || !ReadFreeSpaceMap(table))
+    {
+        pool_Destroy(table->pool);
+        bp_Destroy(table->buffer);
+        free(table->fsm.nodes);
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+bool heap_Sync(HeapTable_t *table)
+{
+    // The map is written first, since it may add pages to the file, which the superblock has to know of.
+    if (!WriteFreeSpaceMap(table))
+        return false;
+    WriteSuperblock(table);
+    if (table->buffer != NULL)
+        return bp_Flush(table->buffer);
+    return pool_Sync(table->pool);
+}
+
+bool heap_Destroy(HeapTable_t *table)
+{
+    if (table == NULL)
+        return false;
+    // Like an index tree, the pages are given back with the arena as a whole. Only a table file is synced,
+    // a table in memory has nowhere to go.
+    bool synced = table->buffer != NULL || table->pool->fd >= 0 ? heap_Sync(table) : true;
+    pool_Destroy(table->pool);
+    bp_Destroy(table->buffer);
+    pthread_mutex_destroy(&table->fsm.lock);
+    free(table->fsm.nodes);
+    free(table);
+    return synced;
+}
+
+bool heap_Insert(HeapTable_t *table, const void *data, uint32_t size, RecordID_t *rid)
+{
+    if (size > table->max_row_size)
+    {
+        fprintf(stderr, "Error in heap table: row of %d bytes is larger than a page takes.\n", size);
+        return false;
+    }
+    if (!InsertRow(table, data, size, rid, HEAP_NO_PAGE))
+        return false;
+    __atomic_fetch_add(&table->num_rows, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+bool heap_Fetch(HeapTable_t *table, const RecordID_t *rid, HeapRow_t *row)
+{
+    // The row is handed out right where it is in the page. The shared latch keeps it from being changed or
+    // moved by a compaction until it's released, so no copy is needed.
+    HeapPage_t *page = LatchRecordPage(table, rid, false);
+    if (page == NULL)
+        return false;
+    HeapSlot_t *slot = &PageSlots(page)[rid->slot_num];
+    row->data = (uint8_t *)page + slot->offset;
+    row->size = slot->size;
+    row->rid = *rid;
+    row->table = table;
+    row->page = page;
+    return true;
+}
+
+void heap_Release(HeapRow_t *row)
+{
+    UnlatchRecordPage(row->table, row->page, false, false);
+    row->page = NULL;
+}
+
+bool heap_Update(HeapTable_t *table, RecordID_t *rid, const void *data, uint32_t size)
+{
+    if (size > table->max_row_size)
+    {
+        fprintf(stderr, "Error in heap table: row of %d bytes is larger than a page takes.\n", size);
+        return false;
+    }
+    HeapPage_t *page = LatchRecordPage(table, rid, true);
+    if (page == NULL)
+        return false;
+    HeapSlot_t *slot = &PageSlots(page)[rid->slot_num];
+    uint32_t old_space = RowSpace(slot->size);
+    uint32_t new_space = RowSpace(size);
+    if (new_space <= old_space)
+    {
+        // The new row fits where the old one was. Any bytes left over are a hole until the next compaction.
+        memmove((uint8_t *)page + slot->offset, data, size);
+        slot->size = size;
+        page->free_bytes += old_space - new_space;
+    }
+    else if (page->free_bytes + old_space >= new_space)
+    {
+        // The row grows, but still fits in the page once the old row is out of the way. The slot is
+        // emptied first, so a compaction leaves the old row behind.
+        slot->offset = 0;
+        page->free_bytes += old_space;
+        if (ContiguousSpace(page) < new_space)
+            CompactPage(table, page);
+        page->free_end -= new_space;
+        memcpy((uint8_t *)page + page->free_end, data, size);
+        slot->offset = page->free_end;
+        slot->size = size;
+        page->free_bytes -= new_space;
+    }
+    else
+    {
+        // The row has to go to another page. It's added there before it's removed here, while we still
+        // hold this page, so no reader can find the row in neither place.
+        RecordID_t new_rid;
+        if (!InsertRow(table, data, size, &new_rid, page->page_id))
+        {
+            UnlatchRecordPage(table, page, true, false);
+            return false;
+        }
+        RemoveRow(table, page, rid->slot_num);
+        *rid = new_rid;
+    }
+    SetFreeSpace(table, page->page_id, page->free_bytes);
+    UnlatchRecordPage(table, page, true, true);
+    return true;
+}
+
+bool heap_Delete(HeapTable_t *table, const RecordID_t *rid)
+{
+    HeapPage_t *page = LatchRecordPage(table, rid, true);
+    if (page == NULL)
+        return false;
+    RemoveRow(table, page, rid->slot_num);
+    SetFreeSpace(table, page->page_id, page->free_bytes);
+    UnlatchRecordPage(table, page, true, true);
+    __atomic_fetch_sub(&table->num_rows, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+HeapScan_t *heap_OpenScan(HeapTable_t *table)
+{
+    HeapScan_t *scan = malloc(sizeof(HeapScan_t));
+    if (scan == NULL)
+    {
+        fprintf(stderr, "Error in heap table: unable to allocate scan.\n");
+        exit(EXIT_FAILURE);
+    }
+    scan->table = table;
+    scan->page = NULL;
+    scan->page_id = table->superblock_pages;
+    scan->slot = 0;
+    return scan;
+}
+
+bool heap_Next(HeapScan_t *scan, HeapRow_t *row)
+{
+    HeapTable_t *table = scan->table;
+    for (;;)
+    {
+        // Pages are visited in the order of their ids, skipping the ones that don't hold rows. Pages added
+        // while the scan is under way are visited too, if it hasn't passed them yet.
+        if (scan->page == NULL)
+        {
+            if (scan->page_id >= NumPages(table))
+                return false;
+            HeapPage_t *page = GetPage(table, scan->page_id);
+            latch_AcquireShared(PageLatch(table, page, scan->page_id));
+            if (page->kind != HEAP_PAGE_DATA)
+            {
+                latch_ReleaseShared(PageLatch(table, page, scan->page_id));
+                ReleasePage(table, page, false);
+                scan->page_id++;
+                continue;
+            }
+            scan->page = page;
+            scan->slot = 0;
+        }
+        HeapSlot_t *slots = PageSlots(scan->page);
+        for (; scan->slot < scan->page->num_slots; scan->slot++)
+        {
+            if (slots[scan->slot].offset == 0)
+                continue;
+            row->data = (uint8_t *)scan->page + slots[scan->slot].offset;
+            row->size = slots[scan->slot].size;
+            row->rid.page_num = scan->page_id;
+            row->rid.slot_num = scan->slot;
+            row->table = table;
+            row->page = scan->page;
+            scan->slot++;
+            return true;
+        }
+        latch_ReleaseShared(PageLatch(table, scan->page, scan->page_id));
+        ReleasePage(table, scan->page, false);
+        scan->page = NULL;
+        scan->page_id++;
+    }
+}
+
+void heap_CloseScan(HeapScan_t *scan)
+{
+    if (scan->page != NULL)
+    {
+        latch_ReleaseShared(PageLatch(scan->table, scan->page, scan->page_id));
+        ReleasePage(scan->table, scan->page, false);
+    }
+    free(scan);
+}
+
+bool ReserveSuperblock(HeapTable_t *table)
+{
+    // The superblock takes the first pages of the file, as in an index file.
+    uint32_t frame_size = pool_FrameSize(table->page_size);
+    for (uint32_t offset = 0; offset < sizeof(HeapSuperblock_t); offset += frame_size)
+    {
+        uint64_t page_id;
+        HeapPage_t *page = AllocPage(table, &page_id);
+        if (page == NULL)
+        {
+            fprintf(stderr, "Error in heap table: unable to allocate superblock.\n");
+            return false;
+        }
+        ReleasePage(table, page, true);
+    }
+    return true;
+}
+
+void WriteSuperblock(HeapTable_t *table)
+{
+    HeapSuperblock_t superblock;
+    memset(&superblock, 0, sizeof(HeapSuperblock_t));
+    superblock.magic = HEAP_FILE_MAGIC;
+    superblock.version = HEAP_FILE_VERSION;
+    superblock.page_size = table->page_size;
+    superblock.num_rows = __atomic_load_n(&table->num_rows, __ATOMIC_RELAXED);
+    superblock.fsm_head = table->fsm_head;
+    // Rows may be added while the table is synced, so the state of the arena is read under its lock.
+    if (table->buffer != NULL)
+    {
+        pthread_mutex_lock(&table->buffer->lock);
+        superblock.num_frames = table->buffer->num_pages;
+        superblock.free_head = table->buffer->free_head;
+        superblock.num_free = table->buffer->num_free;
+        pthread_mutex_unlock(&table->buffer->lock);
+    }
+    else
+    {
+        pthread_mutex_lock(&table->pool->lock);
+        superblock.num_frames = table->pool->num_frames;
+        superblock.free_head = table->pool->free_head;
+        superblock.num_free = table->pool->num_free;
+        pthread_mutex_unlock(&table->pool->lock);
+    }
+
+    uint32_t frame_size = pool_FrameSize(table->page_size);
+    for (uint32_t offset = 0; offset < sizeof(HeapSuperblock_t); offset += frame_size)
+    {
+        HeapPage_t *page = GetPage(table, offset / frame_size);
+        uint32_t size = sizeof(HeapSuperblock_t) - offset < frame_size ? sizeof(HeapSuperblock_t) - offset : frame_size;
+        memcpy(page, (uint8_t *)&superblock + offset, size);
+        ReleasePage(table, page, true);
+    }
+}
+
+static inline uint32_t SuperblockPages(HeapTable_t *table)
+{
+    uint32_t frame_size = pool_FrameSize(table->page_size);
+    return (sizeof(HeapSuperblock_t) + frame_size - 1) / frame_size;
+}
+
+static inline HeapPage_t *GetPage(HeapTable_t *table, uint64_t page_id)
+{
+    // The same as in an index tree: a page of an arena stays where it is, a page of a buffer pool is
+    // pinned in its frame until it's released.
+    if (table->buffer == NULL)
+        return pool_Frame(table->pool, page_id);
+    HeapPage_t *page = bp_Pin(table->buffer, page_id);
+    if (page == NULL)
+    {
+        fprintf(stderr, "Error in heap table: unable to read page %ld.\n", page_id);
+        exit(EXIT_FAILURE);
+    }
+    return page;
+}
+
+static inline void ReleasePage(HeapTable_t *table, HeapPage_t *page, bool dirty)
+{
+    if (table->buffer != NULL)
+        bp_Unpin(table->buffer, page, dirty);
+}
+
+static inline Latch_t *PageLatch(HeapTable_t *table, HeapPage_t *page, uint64_t page_id)
+{
+    // The page id is passed along, since a page that isn't set up yet doesn't hold its own.
+    return table->buffer != NULL ? bp_Latch(table->buffer, page) : pool_Latch(table->pool, page_id);
+}
+
+void *AllocPage(HeapTable_t *table, uint64_t *page_id)
+{
+    if (table->buffer != NULL)
+        return bp_New(table->buffer, page_id);
+    return pool_Alloc(table->pool, page_id);
+}
+
+uint64_t NumPages(HeapTable_t *table)
+{
+    // Pages handed out so far. The counter is read under the lock it's changed under, which also makes sure
+    // a new page is seen zeroed.
+    uint64_t num_pages;
+    if (table->buffer != NULL)
+    {
+        pthread_mutex_lock(&table->buffer->lock);
+        num_pages = table->buffer->num_pages;
+        pthread_mutex_unlock(&table->buffer->lock);
+    }
+    else
+    {
+        pthread_mutex_lock(&table->pool->lock);
+        num_pages = table->pool->num_frames;
+        pthread_mutex_unlock(&table->pool->lock);
+    }
+    return num_pages;
+}
+
+HeapPage_t *LatchRecordPage(HeapTable_t *table, const RecordID_t *rid, bool exclusive)
+{
+    // Returns the page of the row at rid, pinned and latched, or NULL if there is no row there. A RecordID
+    // comes from outside the table, so it's checked before anything is read: the page has to be a data page,
+    // and the slot one of its rows.
+    if (rid->page_num < table->superblock_pages || rid->page_num >= NumPages(table))
+        return NULL;
+    HeapPage_t *page = GetPage(table, rid->page_num);
+    latch_Acquire(PageLatch(table, page, rid->page_num), exclusive);
+    if (page->kind != HEAP_PAGE_DATA || rid->slot_num >= page->num_slots || PageSlots(page)[rid->slot_num].offset == 0)
+    {
+        latch_Release(PageLatch(table, page, rid->page_num), exclusive);
+        ReleasePage(table, page, false);
+        return NULL;
+    }
+    return page;
+}
+
+void UnlatchRecordPage(HeapTable_t *table, HeapPage_t *page, bool exclusive, bool dirty)
+{
+    latch_Release(PageLatch(table, page, page->page_id), exclusive);
+    ReleasePage(table, page, dirty);
+}
+
+static inline HeapSlot_t *PageSlots(HeapPage_t *page)
+{
+    return (HeapSlot_t *)(page + 1);
+}
+
+static inline uint32_t RowSpace(uint32_t size)
+{
+    return (size + HEAP_ROW_ALIGN - 1) & ~(HEAP_ROW_ALIGN - 1);
+}
+
+static inline uint32_t PageEnd(HeapTable_t *table)
+{
+    // Rows are stored down from here, the end of the page rounded down to the row alignment.
+    return table->page_size & ~(HEAP_ROW_ALIGN - 1);
+}
+
+static inline uint32_t ContiguousSpace(HeapPage_t *page)
+{
+    // The free space between the slot directory and the lowest row.
+    return page->free_end - sizeof(HeapPage_t) - page->num_slots * sizeof(HeapSlot_t);
+}
+
+void InitDataPage(HeapTable_t *table, HeapPage_t *page, uint64_t page_id)
+{
+    page->page_id = page_id;
+    page->kind = HEAP_PAGE_DATA;
+    page->num_slots = 0;
+    page->free_end = PageEnd(table);
+    page->free_bytes = PageEnd(table) - sizeof(HeapPage_t);
+}
+
+bool PlaceRow(HeapTable_t *table, HeapPage_t *page, const void *data, uint32_t size, uint32_t *slot_num)
+{
+    // Stores a row in a page latched exclusively, if it has room for it, and returns its slot.
+    // An empty slot is reused before the directory grows, so RecordIDs stay dense.
+    HeapSlot_t *slots = PageSlots(page);
+    uint32_t slot = 0;
+    while (slot < page->num_slots && slots[slot].offset != 0)
+        slot++;
+    uint32_t space = RowSpace(size);
+    uint32_t needed = space + (slot == page->num_slots ? sizeof(HeapSlot_t) : 0);
+    if (page->free_bytes < needed)
+        return false;
+    // The free bytes may be spread over holes between the rows, in which case they are brought together first.
+    if (ContiguousSpace(page) < needed)
+        CompactPage(table, page);
+    if (slot == page->num_slots)
+        page->num_slots++;
+    page->free_end -= space;
+    memcpy((uint8_t *)page + page->free_end, data, size);
+    slots[slot].offset = page->free_end;
+    slots[slot].size = size;
+    page->free_bytes -= needed;
+    *slot_num = slot;
+    return true;
+}
+
+void RemoveRow(HeapTable_t *table, HeapPage_t *page, uint32_t slot_num)
+{
+    // The row's bytes become a hole. Empty slots at the end of the directory are given back as well, but the
+    // others have to stay, since the RecordIDs of the rows after them are their positions.
+    HeapSlot_t *slots = PageSlots(page);
+    page->free_bytes += RowSpace(slots[slot_num].size);
+    slots[slot_num].offset = 0;
+    slots[slot_num].size = 0;
+    while (page->num_slots > 0 && slots[page->num_slots - 1].offset == 0)
+    {
+        page->num_slots--;
+        page->free_bytes += sizeof(HeapSlot_t);
+    }
+    // An empty page has no holes left to close.
+    if (page->num_slots == 0)
+        page->free_end = PageEnd(table);
+}
+
+void CompactPage(HeapTable_t *table, HeapPage_t *page)
+{
+    // Moves the rows up against the end of the page, closing the holes between them, so all the free space
+    // is in one piece. The slots keep their numbers, so no RecordID changes.
+    uint8_t *copy = malloc(table->page_size);
+    if (copy == NULL)
+    {
+        fprintf(stderr, "Error in heap table: unable to allocate page copy.\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, page, table->page_size);
+    HeapSlot_t *slots = PageSlots(page);
+    uint32_t end = PageEnd(table);
+    for (uint32_t slot = 0; slot < page->num_slots; slot++)
+    {
+        if (slots[slot].offset == 0)
+            continue;
+        end -= RowSpace(slots[slot].size);
+        memcpy((uint8_t *)page + end, copy + slots[slot].offset, slots[slot].size);
+        slots[slot].offset = end;
+    }
+    page->free_end = end;
+    free(copy);
+}
+
+bool InsertRow(HeapTable_t *table, const void *data, uint32_t size, RecordID_t *rid, uint64_t source_page)
+{
+    // Stores a row in the first page the free-space map has with room for it, or in a new page.
+    // A row that heap_Update moves is stored while the thread holds its old page, source_page. Another page
+    // is then only latched if it's free right away: two updates that each wait for the other's page would
+    // never finish. A new page is safe to wait for, since no one else knows of it yet.
+    uint32_t needed = RowSpace(size) + sizeof(HeapSlot_t);
+    uint64_t from = table->superblock_pages;
+    for (;;)
+    {
+        uint64_t page_id = FindFreeSpace(table, needed, from);
+        if (page_id == HEAP_NO_PAGE)
+            break;
+        if (page_id == source_page)
+        {
+            from = page_id + 1;
+            continue;
+        }
+        HeapPage_t *page = GetPage(table, page_id);
+        Latch_t *latch = PageLatch(table, page, page_id);
+        if (source_page == HEAP_NO_PAGE)
+            latch_AcquireExclusive(latch);
+        else if (!latch_TryAcquireExclusive(latch))
+        {
+            ReleasePage(table, page, false);
+            from = page_id + 1;
+            continue;
+        }
+        uint32_t slot_num;
+        bool placed = PlaceRow(table, page, data, size, &slot_num);
+        // The map may have been behind the page, in which case it's put right and we look again.
+        SetFreeSpace(table, page_id, page->free_bytes);
+        latch_ReleaseExclusive(latch);
+        ReleasePage(table, page, placed);
+        if (placed)
+        {
+            rid->page_num = page_id;
+            rid->slot_num = slot_num;
+            return true;
+        }
+    }
+
+    uint64_t page_id;
+    HeapPage_t *page = AllocPage(table, &page_id);
+    if (page == NULL)
+    {
+        fprintf(stderr, "Error in heap table: unable to allocate page.\n");
+        return false;
+    }
+    // A RecordID only has room for 32-bit page numbers. The page is left behind unused.
+    if (page_id > UINT32_MAX)
+    {
+        fprintf(stderr, "Error in heap table: table is full.\n");
+        ReleasePage(table, page, true);
+        return false;
+    }
+    // A scan, or a fetch with a stale RecordID, may already look at the page, so it's set up under its latch.
+    Latch_t *latch = PageLatch(table, page, page_id);
+    latch_AcquireExclusive(latch);
+    InitDataPage(table, page, page_id);
+    uint32_t slot_num;
+    PlaceRow(table, page, data, size, &slot_num);
+    SetFreeSpace(table, page_id, page->free_bytes);
+    latch_ReleaseExclusive(latch);
+    ReleasePage(table, page, true);
+    rid->page_num = page_id;
+    rid->slot_num = slot_num;
+    return true;
+}
+
+bool InitFreeSpaceMap(HeapTable_t *table)
+{
+    HeapFreeSpaceMap_t *fsm = &table->fsm;
+    pthread_mutex_init(&fsm->lock, NULL);
+    // A category is a step of the page, so every free byte count of a page maps into the 256 categories.
+    fsm->step = (table->page_size + HEAP_FSM_CATEGORIES - 1) / HEAP_FSM_CATEGORIES;
+    fsm->capacity = HEAP_FSM_INITIAL_CAPACITY;
+    fsm->nodes = calloc(2 * fsm->capacity, sizeof(uint8_t));
+    if (fsm->nodes == NULL)
+    {
+        fprintf(stderr, "Error in heap table: unable to allocate free-space map.\n");
+        return false;
+    }
+    return true;
+}
+
+void SetFreeSpace(HeapTable_t *table, uint64_t page_id, uint32_t free_bytes)
+{
+    // Called with the page latched, so the map never gets ahead of the page. The map lock is always taken
+    // after a page latch, never before one.
+    uint32_t category = free_bytes / table->fsm.step;
+    pthread_mutex_lock(&table->fsm.lock);
+    SetCategory(&table->fsm, page_id, category < HEAP_FSM_CATEGORIES ? category : HEAP_FSM_CATEGORIES - 1);
+    pthread_mutex_unlock(&table->fsm.lock);
+}
+
+void SetCategory(HeapFreeSpaceMap_t *fsm, uint64_t page_id, uint8_t category)
+{
+    // The tree doubles until it has a leaf for the page. The leaves are copied over, and the nodes above
+    // them worked out again from the bottom up.
+    if (page_id >= fsm->capacity)
+    {
+        uint64_t capacity = fsm->capacity;
+        while (capacity <= page_id)
+            capacity *= 2;
+        uint8_t *nodes = calloc(2 * capacity, sizeof(uint8_t));
+        if (nodes == NULL)
+        {
+            fprintf(stderr, "Error in heap table: unable to allocate free-space map.\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(nodes + capacity, fsm->nodes + fsm->capacity, fsm->capacity);
+        for (uint64_t node = capacity - 1; node > 0; node--)
+            nodes[node] = nodes[2 * node] > nodes[2 * node + 1] ? nodes[2 * node] : nodes[2 * node + 1];
+        free(fsm->nodes);
+        fsm->nodes = nodes;
+        fsm->capacity = capacity;
+    }
+    // Walk up from the leaf, and stop as soon as a node doesn't change.
+    uint64_t node = fsm->capacity + page_id;
+    fsm->nodes[node] = category;
+    for (node /= 2; node > 0; node /= 2)
+    {
+        uint8_t highest = fsm->nodes[2 * node] > fsm->nodes[2 * node + 1] ? fsm->nodes[2 * node] : fsm->nodes[2 * node + 1];
+        if (fsm->nodes[node] == highest)
+            break;
+        fsm->nodes[node] = highest;
+    }
+}
+
+uint64_t FindFreeSpace(HeapTable_t *table, uint32_t bytes, uint64_t from)
+{
+    // Returns the first page, from the page from on, with at least bytes free, or HEAP_NO_PAGE if none has.
+    // Going for the first page rather than the best fit fills the table from the front, and keeps the
+    // pages at the end free for large rows.
+    uint32_t category = (bytes + table->fsm.step - 1) / table->fsm.step;
+    if (category >= HEAP_FSM_CATEGORIES)
+        return HEAP_NO_PAGE;
+    pthread_mutex_lock(&table->fsm.lock);
+    uint64_t page_id = SearchFreeSpace(&table->fsm, 1, 0, table->fsm.capacity, category, from);
+    pthread_mutex_unlock(&table->fsm.lock);
+    return page_id;
+}
+
+uint64_t SearchFreeSpace(HeapFreeSpaceMap_t *fsm, uint64_t node, uint64_t low, uint64_t width, uint8_t category, uint64_t from)
+{
+    // Looks for the page below node, which covers the pages from low on, that comes first. A subtree without
+    // a large enough category, or entirely before from, is passed over without going into it.
+    if (fsm->nodes[node] < category || low + width <= from)
+        return HEAP_NO_PAGE;
+    if (width == 1)
+        return low;
+    uint64_t page_id = SearchFreeSpace(fsm, 2 * node, low, width / 2, category, from);
+    if (page_id != HEAP_NO_PAGE)
+        return page_id;
+    return SearchFreeSpace(fsm, 2 * node + 1, low + width / 2, width / 2, category, from);
+}
+
+bool WriteFreeSpaceMap(HeapTable_t *table)
+{
+    // Copies the categories of every page into the chain of map pages, which grows as the table does.
+    // The map lock keeps out other syncs, and any change to the map while its pages are written. The pages of
+    // the map are only latched briefly, and alone, by a scan, so latching them under the map lock can't close
+    // a cycle with the page-then-map order of the writers.
+    HeapFreeSpaceMap_t *fsm = &table->fsm;
+    uint32_t per_page = table->page_size - sizeof(HeapFreeSpacePage_t);
+    pthread_mutex_lock(&fsm->lock);
+    HeapFreeSpacePage_t *previous = NULL;
+    uint64_t page_id = table->fsm_head;
+    // Pages added for the map show up in the page count, and are covered by the map themselves, with
+    // category 0.
+    for (uint64_t first = 0; first < NumPages(table); first += per_page)
+    {
+        HeapFreeSpacePage_t *page;
+        bool created = page_id == HEAP_NO_PAGE;
+        if (created)
+        {
+            page = AllocPage(table, &page_id);
+            if (page == NULL)
+            {
+                fprintf(stderr, "Error in heap table: unable to allocate free-space map page.\n");
+                if (previous != NULL)
+                    ReleasePage(table, (HeapPage_t *)previous, true);
+                pthread_mutex_unlock(&fsm->lock);
+                return false;
+            }
+            if (previous != NULL)
+                previous->next = page_id;
+            else
+                table->fsm_head = page_id;
+        }
+        else
+            page = (HeapFreeSpacePage_t *)GetPage(table, page_id);
+        Latch_t *latch = PageLatch(table, (HeapPage_t *)page, page_id);
+        latch_AcquireExclusive(latch);
+        if (created)
+        {
+            page->page_id = page_id;
+            page->kind = HEAP_PAGE_FREE_SPACE;
+            page->next = HEAP_NO_PAGE;
+        }
+        uint64_t num_pages = NumPages(table);
+        page->first = first;
+        page->count = num_pages - first < per_page ? num_pages - first : per_page;
+        uint8_t *categories = FreeSpaceData(page);
+        for (uint32_t i = 0; i < page->count; i++)
+            categories[i] = first + i < fsm->capacity ? fsm->nodes[fsm->capacity + first + i] : 0;
+        latch_ReleaseExclusive(latch);
+        if (previous != NULL)
+            ReleasePage(table, (HeapPage_t *)previous, true);
+        previous = page;
+        page_id = page->next;
+    }
+    if (previous != NULL)
+        ReleasePage(table, (HeapPage_t *)previous, true);
+    pthread_mutex_unlock(&fsm->lock);
+    return true;
+}
+
+bool ReadFreeSpaceMap(HeapTable_t *table)
+{
+    // Fills the map from its pages in the file. Pages the file got after the map was last written, which
+    // only happens if the table wasn't closed, aren't covered, and stay in category 0. They are never picked
+    // for an insert, but keep their rows.
+    uint64_t num_pages = NumPages(table);
+    for (uint64_t page_id = table->fsm_head; page_id != HEAP_NO_PAGE;)
+    {
+        if (page_id < table->superblock_pages || page_id >= num_pages)
+        {
+            fprintf(stderr, "Error in heap table: free-space map page %ld is out of range.\n", page_id);
+            return false;
+        }
+        HeapFreeSpacePage_t *page = (HeapFreeSpacePage_t *)GetPage(table, page_id);
+        if (page->kind != HEAP_PAGE_FREE_SPACE || page->count > table->page_size - sizeof(HeapFreeSpacePage_t))
+        {
+            fprintf(stderr, "Error in heap table: page %ld is not a free-space map page.\n", page_id);
+            ReleasePage(table, (HeapPage_t *)page, false);
+            return false;
+        }
+        uint8_t *categories = FreeSpaceData(page);
+        for (uint32_t i = 0; i < page->count && page->first + i < num_pages; i++)
+        {
+            if (categories[i] > 0)
+                SetCategory(&table->fsm, page->first + i, categories[i]);
+        }
+        uint64_t next = page->next;
+        ReleasePage(table, (HeapPage_t *)page, false);
+        page_id = next;
+    }
+    return true;
+}
+
+static inline uint8_t *FreeSpaceData(HeapFreeSpacePage_t *page)
+{
+    return (uint8_t *)(page + 1);
+}
@@ -0,0 +1,768 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "index_key.h"
+
+// On x86 we have vector compares for the integer key types. SSE2 is always there on x86-64,
+// the wider kernels are only used if the CPU reports support for them when the tree is created.
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define IDXK_HAVE_X86_SIMD 1
+#endif
+
+// Integer searches halve the range until at most this many keys are left, and then count the keys below
+// the search key in what remains. That's two cache lines of keys, which a few vector compares
+// get through faster than the mispredicted branches of the last rounds of a binary search.
+#define INT32_SCAN_WINDOW 32
+#define INT64_SCAN_WINDOW 16
+
+// Multipliers of the key hash, odd constants with their bits well spread, from the golden ratio and from
+// the finalizer of SplitMix64.
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+#define HASH_MIX_1 0xBF58476D1CE4E5B9ULL
+#define HASH_MIX_2 0x94D049BB133111EBULL
+
+// Strict orderings of two loaded column values, used to specialize the routines below.
+#define ASCENDING_LESS(a, b) ((a) < (b))
+#define DESCENDING_LESS(a, b) ((a) > (b))
+#define DOUBLE_ASCENDING_LESS(a, b) ((a) < (b) || (isnan(b) && !isnan(a)))
+#define DOUBLE_DESCENDING_LESS(a, b) DOUBLE_ASCENDING_LESS(b, a)
+
+// Generates the compare and search routines for a single fixed-size scalar column.
+// The ordering is expanded straight into the search loop, so every probe is a load and a compare or two,
+// not a call through the tree's compare pointer.
+// The search is a branch-light binary search: the range shrinks by half every round whichever way the
+// compare goes, so the only data-dependent choice is where the range starts, which becomes a cmov.
+#define DEFINE_SCALAR_KEY_ROUTINES(NAME, TYPE, LESS)                                                        \
+    static inline TYPE Load##NAME(const uint8_t *p)                                                         \
+    {                                                                                                       \
+        TYPE value;                                                                                         \
+        memcpy(&value, p, sizeof(TYPE));                                                                    \
+        return value;                                                                                       \
+    }                                                                                                       \
+                                                                                                            \
+    static int Compare##NAME(const IndexKeyOps_t *ops, const void *a, const void *b)                       \
+    {                                                                                                       \
+        TYPE x = Load##NAME(a);                                                                             \
+        TYPE y = Load##NAME(b);                                                                             \
+        return LESS(y, x) - LESS(x, y);                                                                     \
+    }                                                                                                       \
+                                                                                                            \
+    static inline uint32_t Search##NAME(const uint8_t *keys, uint32_t count, TYPE key, bool upper)          \
+    {                                                                                                       \
+        if (count == 0)                                                                                     \
+            return 0;                                                                                       \
+        uint32_t base = 0;                                                                                  \
+        while (count > 1)                                                                                   \
+        {                                                                                                   \
+            uint32_t half = count / 2;                                                                      \
+            TYPE probe = Load##NAME(keys + (size_t)(base + half - 1) * sizeof(TYPE));                       \
+            base = (upper ? !LESS(key, probe) : LESS(probe, key)) ? base + half : base;                     \
+            count -= half;                                                                                  \
+        }                                                                                                   \
+        TYPE probe = Load##NAME(keys + (size_t)base * sizeof(TYPE));                                        \
+        return base + (upper ? !LESS(key, probe) : LESS(probe, key));                                       \
+    }                                                                                                       \
+                                                                                                            \
+    static uint32_t LowerBound##NAME(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key) \
+    {                                                                                                       \
+        return Search##NAME(keys, count, Load##NAME(key), false);                                           \
+    }                                                                                                       \
+                                                                                                            \
+    static uint32_t UpperBound##NAME(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key) \
+    {                                                                                                       \
+        return Search##NAME(keys, count, Load##NAME(key), true);                                            \
+    }
+
+DEFINE_SCALAR_KEY_ROUTINES(Int32, int32_t, ASCENDING_LESS)
+DEFINE_SCALAR_KEY_ROUTINES(Int32Desc, int32_t, DESCENDING_LESS)
+DEFINE_SCALAR_KEY_ROUTINES(Int64, int64_t, ASCENDING_LESS)
+DEFINE_SCALAR_KEY_ROUTINES(Int64Desc, int64_t, DESCENDING_LESS)
+DEFINE_SCALAR_KEY_ROUTINES(Double, double, DOUBLE_ASCENDING_LESS)
+DEFINE_SCALAR_KEY_ROUTINES(DoubleDesc, double, DOUBLE_DESCENDING_LESS)
+
+typedef uint32_t (*CountInt32_t)(const uint8_t *keys, uint32_t count, int32_t key, bool upper);
+typedef uint32_t (*CountInt64_t)(const uint8_t *keys, uint32_t count, int64_t key, bool upper);
+
+static uint32_t TypeSize(IndexKeyType_t type);
+static inline uint64_t HashBytes(const uint8_t *bytes, uint32_t size);
+static bool IsByteOrdered(const IndexKeyDesc_t *desc);
+static int CompareBytes(const IndexKeyOps_t *ops, const void *a, const void *b);
+static int CompareBytesDesc(const IndexKeyOps_t *ops, const void *a, const void *b);
+static uint32_t LowerBoundBytes(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key);
+static uint32_t UpperBoundBytes(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key);
+static int CompareColumn(const IndexKeyColumn_t *column, const uint8_t *a, const uint8_t *b);
+static int CompareComposite(const IndexKeyOps_t *ops, const void *a, const void *b);
+static uint32_t LowerBoundGeneric(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key);
+static uint32_t UpperBoundGeneric(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key);
+#ifdef IDXK_HAVE_X86_SIMD
+static inline uint32_t SearchInt32Window(const uint8_t *keys, uint32_t count, int32_t key, bool upper, CountInt32_t count_keys);
+static inline uint32_t SearchInt64Window(const uint8_t *keys, uint32_t count, int64_t key, bool upper, CountInt64_t count_keys);
+static uint32_t CountInt32Scalar(const uint8_t *keys, uint32_t count, int32_t key, bool upper);
+static uint32_t CountInt64Scalar(const uint8_t *keys, uint32_t count, int64_t key, bool upper);
+static uint32_t CountInt32Sse2(const uint8_t *keys, uint32_t count, int32_t key, bool upper);
+static uint32_t CountInt32Avx2(const uint8_t *keys, uint32_t count, int32_t key, bool upper);
+static uint32_t CountInt64Sse42(const uint8_t *keys, uint32_t count, int64_t key, bool upper);
+static uint32_t CountInt64Avx2(const uint8_t *keys, uint32_t count, int64_t key, bool upper);
+static uint32_t LowerBoundInt32Sse2(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key);
+static uint32_t UpperBoundInt32Sse2(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key);
+static uint32_t LowerBoundInt32Avx2(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key);
+static uint32_t UpperBoundInt32Avx2(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key);
+static uint32_t LowerBoundInt64Sse42(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key);
+static uint32_t UpperBoundInt64Sse42(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key);
+static uint32_t LowerBoundInt64Avx2(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key);
+static uint32_t UpperBoundInt64Avx2(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key);
+#endif
+
+void idxk_InitDesc(IndexKeyDesc_t *desc)
+{
+    memset(desc, 0, sizeof(IndexKeyDesc_t));
+}
+
+bool idxk_AddColumn(IndexKeyDesc_t *desc, IndexKeyType_t type, uint32_t size, bool descending)
+{
+    if (desc->num_columns == IDXK_MAX_COLUMNS)
+    {
+        fprintf(stderr, "Error in index key: a key can't have more than %d columns.\n", IDXK_MAX_COLUMNS);
+        return false;
+    }
+    // The numeric types have a fixed size, the byte types take theirs from the caller.
+    uint32_t type_size = TypeSize(type);
+    if (type_size == 0 && size == 0)
+    {
+        fprintf(stderr, "Error in index key: column %d needs a size.\n", desc->num_columns);
+        return false;
+    }
+    if (type_size != 0 && size != 0 && size != type_size)
+    {
+        fprintf(stderr, "Error in index key: column %d has size %d, but its type has size %d.\n", desc->num_columns, size, type_size);
+        return false;
+    }
+
+    IndexKeyColumn_t *column = &desc->columns[desc->num_columns++];
+    column->type = type;
+    column->size = type_size != 0 ? type_size : size;
+    column->descending = descending;
+    return true;
+}
+
+uint32_t idxk_KeySize(const IndexKeyDesc_t *desc)
+{
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < desc->num_columns; i++)
+    {
+        size += desc->columns[i].size;
+    }
+    return size;
+}
+
+bool idxk_InitOps(IndexKeyOps_t *ops, const IndexKeyDesc_t *desc)
+{
+    if (desc->num_columns == 0)
+    {
+        fprintf(stderr, "Error in index key: a key needs at least one column.\n");
+        return false;
+    }
+    ops->desc = *desc;
+    ops->key_size = idxk_KeySize(desc);
+
+    // Keys made up only of ascending byte columns, composite or not, are ordered exactly like memcmp
+    // orders the whole key, so they can skip the column walk.
+    if (IsByteOrdered(desc))
+    {
+        ops->compare = CompareBytes;
+        ops->lower_bound = LowerBoundBytes;
+        ops->upper_bound = UpperBoundBytes;
+        return true;
+    }
+
+    // Any other composite key compares column by column.
+    if (desc->num_columns > 1)
+    {
+        ops->compare = CompareComposite;
+        ops->lower_bound = LowerBoundGeneric;
+        ops->upper_bound = UpperBoundGeneric;
+        return true;
+    }
+
+    // A single column gets the routines specialized for its type and direction.
+    const IndexKeyColumn_t *column = &desc->columns[0];
+    switch (column->type)
+    {
+    case IDXK_TYPE_INT32:
+        if (column->descending)
+        {
+            ops->compare = CompareInt32Desc;
+            ops->lower_bound = LowerBoundInt32Desc;
+            ops->upper_bound = UpperBoundInt32Desc;
+            break;
+        }
+        ops->compare = CompareInt32;
+        ops->lower_bound = LowerBoundInt32;
+        ops->upper_bound = UpperBoundInt32;
+#ifdef IDXK_HAVE_X86_SIMD
+        ops->lower_bound = LowerBoundInt32Sse2;
+        ops->upper_bound = UpperBoundInt32Sse2;
+        if (__builtin_cpu_supports("avx2"))
+        {
+            ops->lower_bound = LowerBoundInt32Avx2;
+            ops->upper_bound = UpperBoundInt32Avx2;
+        }
+#endif
+        break;
+    case IDXK_TYPE_INT64:
+        if (column->descending)
+        {
+            ops->compare = CompareInt64Desc;
+            ops->lower_bound = LowerBoundInt64Desc;
+            ops->upper_bound = UpperBoundInt64Desc;
+            break;
+        }
+        ops->compare = CompareInt64;
+        ops->lower_bound = LowerBoundInt64;
+        ops->upper_bound = UpperBoundInt64;
+#ifdef IDXK_HAVE_X86_SIMD
+        if (__builtin_cpu_supports("avx2"))
+        {
+            ops->lower_bound = LowerBoundInt64Avx2;
+            ops->upper_bound = UpperBoundInt64Avx2;
+        }
+        else if (__builtin_cpu_supports("sse4.2"))
+        {
+            ops->lower_bound = LowerBoundInt64Sse42;
+            ops->upper_bound = UpperBoundInt64Sse42;
+        }
+#endif
+        break;
+    case IDXK_TYPE_DOUBLE:
+        ops->compare = column->descending ? CompareDoubleDesc : CompareDouble;
+        ops->lower_bound = column->descending ? LowerBoundDoubleDesc : LowerBoundDouble;
+        ops->upper_bound = column->descending ? UpperBoundDoubleDesc : UpperBoundDouble;
+        break;
+    case IDXK_TYPE_BINARY:
+    case IDXK_TYPE_CHAR:
+        // Ascending byte columns were handled above.
+        ops->compare = CompareBytesDesc;
+        ops->lower_bound = LowerBoundGeneric;
+        ops->upper_bound = UpperBoundGeneric;
+        break;
+    }
+    return true;
+}
+
+void idxk_FormatKey(const IndexKeyOps_t *ops, const void *key, char *buffer, size_t size)
+{
+    const uint8_t *column_key = key;
+    size_t used = 0;
+    buffer[0] = '\0';
+    if (ops->desc.num_columns > 1)
+        used += snprintf(buffer + used, used < size ? size - used : 0, "(");
+
+    for (uint32_t i = 0; i < ops->desc.num_columns; i++)
+    {
+        const IndexKeyColumn_t *column = &ops->desc.columns[i];
+        if (i > 0)
+            used += snprintf(buffer + used, used < size ? size - used : 0, ", ");
+        switch (column->type)
+        {
+        case IDXK_TYPE_INT32:
+            used += snprintf(buffer + used, used < size ? size - used : 0, "%d", LoadInt32(column_key));
+            break;
+        case IDXK_TYPE_INT64:
+            used += snprintf(buffer + used, used < size ? size - used : 0, "%ld", LoadInt64(column_key));
+            break;
+        case IDXK_TYPE_DOUBLE:
+            used += snprintf(buffer + used, used < size ? size - used : 0, "%g", LoadDouble(column_key));
+            break;
+        case IDXK_TYPE_CHAR:
+        {
+            // The blank padding isn't part of the value.
+            uint32_t length = column->size;
+            while (length > 0 && column_key[length - 1] == ' ')
+                length--;
+            used += snprintf(buffer + used, used < size ? size - used : 0, "'%.*s'", (int)length, column_key);
+            break;
+        }
+        case IDXK_TYPE_BINARY:
+            used += snprintf(buffer + used, used < size ? size - used : 0, "0x");
+            for (uint32_t j = 0; j < column->size; j++)
+            {
+                used += snprintf(buffer + used, used < size ? size - used : 0, "%02x", column_key[j]);
+            }
+            break;
+        }
+        column_key += column->size;
+    }
+
+    if (ops->desc.num_columns > 1)
+        snprintf(buffer + used, used < size ? size - used : 0, ")");
+}
+
+uint32_t idxk_CutBefore(const IndexKeyOps_t *ops, uint32_t offset)
+{
+    uint32_t column_start = 0;
+    for (uint32_t i = 0; i < ops->desc.num_columns; i++)
+    {
+        const IndexKeyColumn_t *column = &ops->desc.columns[i];
+        if (offset < column_start + column->size)
+            return column->type == IDXK_TYPE_BINARY || column->type == IDXK_TYPE_CHAR ? offset : column_start;
+        column_start += column->size;
+    }
+    return column_start;
+}
+
+uint32_t idxk_CutAfter(const IndexKeyOps_t *ops, uint32_t offset)
+{
+    uint32_t column_start = 0;
+    for (uint32_t i = 0; i < ops->desc.num_columns; i++)
+    {
+        const IndexKeyColumn_t *column = &ops->desc.columns[i];
+        if (offset <= column_start)
+            return column_start;
+        if (offset < column_start + column->size && (column->type == IDXK_TYPE_BINARY || column->type == IDXK_TYPE_CHAR))
+            return offset;
+        column_start += column->size;
+    }
+    return column_start;
+}
+
+int idxk_CompareRange(const IndexKeyOps_t *ops, const void *a, const void *b, uint32_t start, uint32_t end)
+{
+    // Keys ordered like memcmp stay that way in pieces.
+    if (ops->compare == CompareBytes)
+        return memcmp(a, b, end - start);
+
+    // Otherwise we walk the columns that overlap the range. Whole columns compare as usual, a column that is
+    // cut is a byte column, whose part compares like memcmp.
+    const uint8_t *column_a = a;
+    const uint8_t *column_b = b;
+    uint32_t column_start = 0;
+    for (uint32_t i = 0; i < ops->desc.num_columns && column_start < end; i++)
+    {
+        const IndexKeyColumn_t *column = &ops->desc.columns[i];
+        uint32_t column_end = column_start + column->size;
+        if (column_end > start)
+        {
+            uint32_t from = column_start > start ? column_start : start;
+            uint32_t to = column_end < end ? column_end : end;
+            int keycmp;
+            if (from == column_start && to == column_end)
+                keycmp = CompareColumn(column, column_a, column_b);
+            else
+            {
+                keycmp = memcmp(column_a, column_b, to - from);
+                keycmp = column->descending ? -keycmp : keycmp;
+            }
+            if (keycmp != 0)
+                return keycmp;
+            column_a += to - from;
+            column_b += to - from;
+        }
+        column_start = column_end;
+    }
+    return 0;
+}
+
+uint32_t idxk_SearchRange(const IndexKeyOps_t *ops, const void *pieces, uint32_t count, const void *key, uint32_t start, uint32_t end, bool upper)
+{
+    // The branch-light binary search, through the range compare. Empty pieces are all equal to the key.
+    uint32_t size = end - start;
+    if (count == 0 || size == 0)
+        return upper ? count : 0;
+    const uint8_t *base = pieces;
+    while (count > 1)
+    {
+        uint32_t half = count / 2;
+        int keycmp = idxk_CompareRange(ops, base + (size_t)(half - 1) * size, key, start, end);
+        base = (upper ? keycmp <= 0 : keycmp < 0) ? base + (size_t)half * size : base;
+        count -= half;
+    }
+    int keycmp = idxk_CompareRange(ops, base, key, start, end);
+    return (base - (const uint8_t *)pieces) / size + (upper ? keycmp <= 0 : keycmp < 0);
+}
+
+void idxk_FillHighest(const IndexKeyOps_t *ops, void *key, uint32_t start)
+{
+    uint8_t *column_key = key;
+    uint32_t column_start = 0;
+    for (uint32_t i = 0; i < ops->desc.num_columns; i++)
+    {
+        const IndexKeyColumn_t *column = &ops->desc.columns[i];
+        uint32_t column_end = column_start + column->size;
+        if (column_end > start)
+        {
+            switch (column->type)
+            {
+            case IDXK_TYPE_INT32:
+            {
+                int32_t value = column->descending ? INT32_MIN : INT32_MAX;
+                memcpy(column_key + column_start, &value, sizeof(int32_t));
+                break;
+            }
+            case IDXK_TYPE_INT64:
+            {
+                int64_t value = column->descending ? INT64_MIN : INT64_MAX;
+                memcpy(column_key + column_start, &value, sizeof(int64_t));
+                break;
+            }
+            case IDXK_TYPE_DOUBLE:
+            {
+                // NaN orders after every number, and so first when descending.
+                double value = column->descending ? -INFINITY : NAN;
+                memcpy(column_key + column_start, &value, sizeof(double));
+                break;
+            }
+            case IDXK_TYPE_BINARY:
+            case IDXK_TYPE_CHAR:
+            {
+                // Only a byte column may be cut, so only here may the fill start partway.
+                uint32_t from = column_start > start ? column_start : start;
+                memset(column_key + from, column->descending ? 0x00 : 0xFF, column_end - from);
+                break;
+            }
+            }
+        }
+        column_start = column_end;
+    }
+}
+
+uint64_t idxk_Hash(const IndexKeyOps_t *ops, const void *key)
+{
+    // Every other type compares equal only if its bytes are equal. Doubles don't: 0 equals -0, and every NaN
+    // equals every other NaN. So keys with DOUBLE columns are hashed from a copy with one value for each.
+    uint8_t canonical[ops->key_size];
+    const uint8_t *bytes = key;
+    uint32_t column_start = 0;
+    for (uint32_t i = 0; i < ops->desc.num_columns; i++)
+    {
+        const IndexKeyColumn_t *column = &ops->desc.columns[i];
+        if (column->type == IDXK_TYPE_DOUBLE)
+        {
+            if (bytes == key)
+                bytes = memcpy(canonical, key, ops->key_size);
+            double value = LoadDouble(canonical + column_start);
+            value = isnan(value) ? NAN : value == 0 ? 0.0 : value;
+            memcpy(canonical + column_start, &value, sizeof(double));
+        }
+        column_start += column->size;
+    }
+    return HashBytes(bytes, ops->key_size);
+}
+
+static inline uint64_t HashBytes(const uint8_t *bytes, uint32_t size)
+{
+    // Takes the key 8 bytes at a time, and mixes the result with the finalizer of SplitMix64, so every bit of
+    // the key reaches every bit of the hash. The low bits pick buckets, and the high bits tell keys apart.
+    uint64_t hash = size * HASH_MULTIPLIER;
+    uint32_t pos = 0;
+    for (; pos + sizeof(uint64_t) <= size; pos += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, bytes + pos, sizeof(uint64_t));
+        hash = (hash ^ word) * HASH_MULTIPLIER;
+        hash ^= hash >> 29;
+    }
+    if (pos < size)
+    {
+        uint64_t word = 0;
+        memcpy(&word, bytes + pos, size - pos);
+        hash = (hash ^ word) * HASH_MULTIPLIER;
+        hash ^= hash >> 29;
+    }
+    hash = (hash ^ (hash >> 30)) * HASH_MIX_1;
+    hash = (hash ^ (hash >> 27)) * HASH_MIX_2;
+    return hash ^ (hash >> 31);
+}
+
+uint32_t TypeSize(IndexKeyType_t type)
+{
+    switch (type)
+    {
+    case IDXK_TYPE_INT32:
+        return sizeof(int32_t);
+    case IDXK_TYPE_INT64:
+        return sizeof(int64_t);
+    case IDXK_TYPE_DOUBLE:
+        return sizeof(double);
+    default:
+        return 0;
+    }
+}
+
+bool IsByteOrdered(const IndexKeyDesc_t *desc)
+{
+    for (uint32_t i = 0; i < desc->num_columns; i++)
+    {
+        const IndexKeyColumn_t *column = &desc->columns[i];
+        if ((column->type != IDXK_TYPE_BINARY && column->type != IDXK_TYPE_CHAR) || column->descending)
+            return false;
+    }
+    return true;
+}
+
+int CompareBytes(const IndexKeyOps_t *ops, const void *a, const void *b)
+{
+    return memcmp(a, b, ops->key_size);
+}
+
+int CompareBytesDesc(const IndexKeyOps_t *ops, const void *a, const void *b)
+{
+    return memcmp(b, a, ops->key_size);
+}
+
+uint32_t LowerBoundBytes(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key)
+{
+    // The branch-light binary search, with memcmp called directly.
+    if (count == 0)
+        return 0;
+    const uint8_t *base = keys;
+    while (count > 1)
+    {
+        uint32_t half = count / 2;
+        base = memcmp(base + (size_t)(half - 1) * ops->key_size, key, ops->key_size) < 0 ? base + (size_t)half * ops->key_size : base;
+        count -= half;
+    }
+    return (base - (const uint8_t *)keys) / ops->key_size + (memcmp(base, key, ops->key_size) < 0);
+}
+
+uint32_t UpperBoundBytes(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key)
+{
+    if (count == 0)
+        return 0;
+    const uint8_t *base = keys;
+    while (count > 1)
+    {
+        uint32_t half = count / 2;
+        base = memcmp(base + (size_t)(half - 1) * ops->key_size, key, ops->key_size) <= 0 ? base + (size_t)half * ops->key_size : base;
+        count -= half;
+    }
+    return (base - (const uint8_t *)keys) / ops->key_size + (memcmp(base, key, ops->key_size) <= 0);
+}
+
+int CompareColumn(const IndexKeyColumn_t *column, const uint8_t *a, const uint8_t *b)
+{
+    int keycmp;
+    switch (column->type)
+    {
+    case IDXK_TYPE_INT32:
+        keycmp = CompareInt32(NULL, a, b);
+        break;
+    case IDXK_TYPE_INT64:
+        keycmp = CompareInt64(NULL, a, b);
+        break;
+    case IDXK_TYPE_DOUBLE:
+        keycmp = CompareDouble(NULL, a, b);
+        break;
+    default:
+        keycmp = memcmp(a, b, column->size);
+        break;
+    }
+    return column->descending ? -keycmp : keycmp;
+}
+
+int CompareComposite(const IndexKeyOps_t *ops, const void *a, const void *b)
+{
+    // The first column that differs decides the order.
+    const uint8_t *column_a = a;
+    const uint8_t *column_b = b;
+    for (uint32_t i = 0; i < ops->desc.num_columns; i++)
+    {
+        int keycmp = CompareColumn(&ops->desc.columns[i], column_a, column_b);
+        if (keycmp != 0)
+            return keycmp;
+        column_a += ops->desc.columns[i].size;
+        column_b += ops->desc.columns[i].size;
+    }
+    return 0;
+}
+
+uint32_t LowerBoundGeneric(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key)
+{
+    // The branch-light binary search, going through the compare routine for every probe.
+    if (count == 0)
+        return 0;
+    const uint8_t *base = keys;
+    while (count > 1)
+    {
+        uint32_t half = count / 2;
+        base = ops->compare(ops, base + (size_t)(half - 1) * ops->key_size, key) < 0 ? base + (size_t)half * ops->key_size : base;
+        count -= half;
+    }
+    return (base - (const uint8_t *)keys) / ops->key_size + (ops->compare(ops, base, key) < 0);
+}
+
+uint32_t UpperBoundGeneric(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key)
+{
+    // Same as the lower bound, except that equal keys are skipped as well.
+    if (count == 0)
+        return 0;
+    const uint8_t *base = keys;
+    while (count > 1)
+    {
+        uint32_t half = count / 2;
+        base = ops->compare(ops, base + (size_t)(half - 1) * ops->key_size, key) <= 0 ? base + (size_t)half * ops->key_size : base;
+        count -= half;
+    }
+    return (base - (const uint8_t *)keys) / ops->key_size + (ops->compare(ops, base, key) <= 0);
+}
+
+#ifdef IDXK_HAVE_X86_SIMD
+static inline uint32_t SearchInt32Window(const uint8_t *keys, uint32_t count, int32_t key, bool upper, CountInt32_t count_keys)
+{
+    // We narrow the range with the branch-light binary search until the window is reached. Everything before
+    // base is below the key(or equal, for the upper bound) and everything after the range is not, so
+    // the answer is base plus the number of keys in the range that are.
+    uint32_t base = 0;
+    while (count > INT32_SCAN_WINDOW)
+    {
+        uint32_t half = count / 2;
+        int32_t probe = LoadInt32(keys + (size_t)(base + half - 1) * sizeof(int32_t));
+        base = (upper ? probe <= key : probe < key) ? base + half : base;
+        count -= half;
+    }
+    return base + count_keys(keys + (size_t)base * sizeof(int32_t), count, key, upper);
+}
+
+static inline uint32_t SearchInt64Window(const uint8_t *keys, uint32_t count, int64_t key, bool upper, CountInt64_t count_keys)
+{
+    uint32_t base = 0;
+    while (count > INT64_SCAN_WINDOW)
+    {
+        uint32_t half = count / 2;
+        int64_t probe = LoadInt64(keys + (size_t)(base + half - 1) * sizeof(int64_t));
+        base = (upper ? probe <= key : probe < key) ? base + half : base;
+        count -= half;
+    }
+    return base + count_keys(keys + (size_t)base * sizeof(int64_t), count, key, upper);
+}
+
+uint32_t CountInt32Scalar(const uint8_t *keys, uint32_t count, int32_t key, bool upper)
+{
+    uint32_t below = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int32_t value = LoadInt32(keys + (size_t)i * sizeof(int32_t));
+        below += upper ? value <= key : value < key;
+    }
+    return below;
+}
+
+uint32_t CountInt64Scalar(const uint8_t *keys, uint32_t count, int64_t key, bool upper)
+{
+    uint32_t below = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int64_t value = LoadInt64(keys + (size_t)i * sizeof(int64_t));
+        below += upper ? value <= key : value < key;
+    }
+    return below;
+}
+
+// The vector kernels count the keys below the search key a full register at a time. A lane compare
+// gives all ones for the keys that are higher(upper bound) or lower(lower bound), the lanes are packed
+// into a bit mask and counted. The keys that don't fill a register are counted one by one.
+
+uint32_t CountInt32Sse2(const uint8_t *keys, uint32_t count, int32_t key, bool upper)
+{
+    __m128i needle = _mm_set1_epi32(key);
+    uint32_t below = 0;
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i values = _mm_loadu_si128((const __m128i *)(keys + (size_t)i * sizeof(int32_t)));
+        if (upper)
+            below += 4 - __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(values, needle))));
+        else
+            below += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(needle, values))));
+    }
+    return below + CountInt32Scalar(keys + (size_t)i * sizeof(int32_t), count - i, key, upper);
+}
+
+__attribute__((target("avx2"))) uint32_t CountInt32Avx2(const uint8_t *keys, uint32_t count, int32_t key, bool upper)
+{
+    __m256i needle = _mm256_set1_epi32(key);
+    uint32_t below = 0;
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i values = _mm256_loadu_si256((const __m256i *)(keys + (size_t)i * sizeof(int32_t)));
+        if (upper)
+            below += 8 - __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(values, needle))));
+        else
+            below += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(needle, values))));
+    }
+    return below + CountInt32Scalar(keys + (size_t)i * sizeof(int32_t), count - i, key, upper);
+}
+
+__attribute__((target("sse4.2"))) uint32_t CountInt64Sse42(const uint8_t *keys, uint32_t count, int64_t key, bool upper)
+{
+    __m128i needle = _mm_set1_epi64x(key);
+    uint32_t below = 0;
+    uint32_t i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128i values = _mm_loadu_si128((const __m128i *)(keys + (size_t)i * sizeof(int64_t)));
+        if (upper)
+            below += 2 - __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(values, needle))));
+        else
+            below += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(needle, values))));
+    }
+    return below + CountInt64Scalar(keys + (size_t)i * sizeof(int64_t), count - i, key, upper);
+}
+
+__attribute__((target("avx2"))) uint32_t CountInt64Avx2(const uint8_t *keys, uint32_t count, int64_t key, bool upper)
+{
+    __m256i needle = _mm256_set1_epi64x(key);
+    uint32_t below = 0;
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i values = _mm256_loadu_si256((const __m256i *)(keys + (size_t)i * sizeof(int64_t)));
+        if (upper)
+            below += 4 - __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(values, needle))));
+        else
+            below += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(needle, values))));
+    }
+    return below + CountInt64Scalar(keys + (size_t)i * sizeof(int64_t), count - i, key, upper);
+}
+
+uint32_t LowerBoundInt32Sse2(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key)
+{
+    return SearchInt32Window(keys, count, LoadInt32(key), false, CountInt32Sse2);
+}
+
+uint32_t UpperBoundInt32Sse2(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key)
+{
+    return SearchInt32Window(keys, count, LoadInt32(key), true, CountInt32Sse2);
+}
+
+uint32_t LowerBoundInt32Avx2(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key)
+{
+    return SearchInt32Window(keys, count, LoadInt32(key), false, CountInt32Avx2);
+}
+
+uint32_t UpperBoundInt32Avx2(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key)
+{
+    return SearchInt32Window(keys, count, LoadInt32(key), true, CountInt32Avx2);
+}
+
+uint32_t LowerBoundInt64Sse42(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key)
+{
+    return SearchInt64Window(keys, count, LoadInt64(key), false, CountInt64Sse42);
+}
+
+uint32_t UpperBoundInt64Sse42(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key)
+{
+    return SearchInt64Window(keys, count, LoadInt64(key), true, CountInt64Sse42);
+}
+
+uint32_t LowerBoundInt64Avx2(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key)
+{
+    return SearchInt64Window(keys, count, LoadInt64(key), false, CountInt64Avx2);
+}
+
+uint32_t UpperBoundInt64Avx2(const IndexKeyOps_t *ops, const void *keys, uint32_t count, const void *key)
+{
+    return SearchInt64Window(keys, count, LoadInt64(key), true, CountInt64Avx2);
+}
+#endif
@@ -1,452 +1,4680 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "index_tree.h"
+#include "external_sort.h"
 
-static IndexTree_t tree;
-static int level;
+// Position of an entry that isn't there.
+#define INDEX_NO_ENTRY UINT32_MAX
+// Most keys idxt_FindRecords takes down the tree together.
+#define INDEX_BATCH_WIDTH 16
+// Unchanged bytes a changed page may have between two changed stretches, which are still logged as one.
+#define INDEX_LOG_GAP 16
+// A thread times one in this many of its operations on a tree. Reading the clock around every step would
+// add a few percent to a lookup, which is as long as a cache miss or two.
+#define INDEX_STATS_SAMPLE 16
+// Trees a thread keeps its counters for at hand, so it doesn't have to look them up in the tree.
+#define INDEX_STATS_CACHE 4
+// Records a thread of a parallel build takes from the source at a time.
+#define INDEX_BUILD_BATCH 4096
+// Records each thread of a parallel build contributes to the sample the key ranges are cut from.
+#define INDEX_BUILD_SAMPLES 64
+// Fewest records in a key range of a parallel build. Fewer records are built by fewer threads, so no run is
+// just a page or two.
+#define INDEX_BUILD_MIN_RANGE 4096
+// Frames of a buffer pool for each thread of a parallel build. A thread keeps two leaf pages pinned, and
+// a posting page or two while it adds to a posting list.
+#define INDEX_BUILD_FRAMES 8
 
-static IndexPage_t *CreateEmptyPage(bool is_leaf, IndexPage_t *parent);
-static IndexPage_t *ProcessNonleafPage(IndexPage_t *page, void *key);
-static RecordID_t *ProcessLeafPage(IndexPage_t *page, void *key);
-static IndexPageEntry_t *InsertLeafPageEntry(IndexPage_t *page, void *key, uint32_t page_num, uint32_t slot_num);
-static IndexPageEntry_t *BalanceAndInsertLeafPageEntry(IndexPage_t *page, void *key, uint32_t page_num, uint32_t slot_num);
-static IndexPageEntry_t *InsertNonleafPageEntry(IndexPage_t *target, IndexPage_t *source);
-static IndexPageEntry_t *GetNonleafPageEntry(IndexPage_t *source, IndexPage_t *target);
-static void DisplayPage(IndexPage_t *page);
+// Counting and timing in the operations, or nothing at all when built with IDXT_NO_STATS.
+#ifndef IDXT_NO_STATS
+#define INDEX_COUNT(tree, counter) CountEvent(&ThreadStats(tree)->counters.counter)
+#define INDEX_COUNT_OPERATION(tree, counter) CountOperation(ThreadStats(tree), &ThreadStats(tree)->counters.counter)
+#define INDEX_TIMER_START(tree) StartTimer(tree)
+#define INDEX_TIMER_STOP(tree, timer, start) StopTimer(&ThreadStats(tree)->counters.timer, start)
+#else
+#define INDEX_COUNT(tree, counter) ((void)0)
+#define INDEX_COUNT_OPERATION(tree, counter) ((void)0)
+#define INDEX_TIMER_START(tree) ((void)(tree), (uint64_t)0)
+#define INDEX_TIMER_STOP(tree, timer, start) ((void)(start))
+#endif
 
-void idxt_Create(uint32_t page_size, uint32_t key_size)
+typedef struct IndexPath IndexPath_t;
+typedef struct IndexBatch IndexBatch_t;
+typedef struct IndexEntries IndexEntries_t;
+typedef struct IndexBulkLevel IndexBulkLevel_t;
+typedef struct IndexBulkLoader IndexBulkLoader_t;
+typedef struct IndexBulkRun IndexBulkRun_t;
+typedef struct IndexBuildWorker IndexBuildWorker_t;
+typedef struct IndexParallelBuild IndexParallelBuild_t;
+typedef struct IndexActionPage IndexActionPage_t;
+typedef struct IndexAction IndexAction_t;
+typedef struct IndexLogAction IndexLogAction_t;
+typedef struct IndexLogPage IndexLogPage_t;
+typedef struct IndexLogRange IndexLogRange_t;
+typedef struct IndexRecovery IndexRecovery_t;
+typedef struct IndexStatsCache IndexStatsCache_t;
+
+// How FindLeafPage latches the pages on its way down.
+typedef enum IndexLatchMode
+{
+    // Shared latches all the way, for readers.
+    INDEX_LATCH_SHARED,
+    // Shared latches, except for an exclusive latch on the leaf page. For writers that expect the leaf
+    // page to have room, so nothing above it changes.
+    INDEX_LATCH_LEAF_EXCLUSIVE,
+    // Exclusive latches all the way, for writers that may split pages. The latches on the pages above
+    // a page that has room are let go of as soon as we reach it, since a split can't go past it.
+    INDEX_LATCH_SPLIT,
+    // Same, for writers that may merge pages. Here a page is safe if it can lose an entry and still be
+    // at least half full.
+    INDEX_LATCH_MERGE,
+    // Exclusive latches all the way, and every page above the leaf page is kept. For writers that may have
+    // to move right from the leaf page into pages under other parents, and merge pages there.
+    INDEX_LATCH_EXCLUSIVE,
+} IndexLatchMode_t;
+
+// The non-leaf pages above a leaf page that a writer holds on to, pinned and latched exclusively,
+// from the top down. A split or a merge works its way back up along the path, so pages don't need to
+// know their parent.
+struct IndexPath
+{
+    uint32_t depth;
+    IndexPage_t *pages[IDXT_MAX_HEIGHT];
+};
+
+// The keys of idxt_FindRecords, for sorting their positions.
+struct IndexBatch
+{
+    IndexTree_t *tree;
+    void *keys;
+};
+
+// Entries of one or two pages, with their keys in full, while they are divided over pages anew.
+// Splits and merges take pages apart into entries and lay them out again, since with key compression the
+// pages may not keep their keys the same way afterwards.
+struct IndexEntries
+{
+    uint32_t count;
+    uint32_t data_size;
+    uint8_t *keys;
+    uint8_t *data;
+};
+
+// The right edge of one level of a tree under construction.
+// The open page is the one being filled. The pending page is the full page before it, which is held back
+// from the parent level until we know whether the open page ends up underfull and needs entries from it.
+struct IndexBulkLevel
+{
+    IndexPage_t *pending;
+    IndexPage_t *open;
+};
+
+struct IndexBulkLoader
+{
+    IndexTree_t *tree;
+    double fill_factor;
+    uint32_t num_levels;
+    IndexBulkLevel_t levels[IDXT_MAX_HEIGHT];
+    // In a parallel build, the leaf pages that are done go into a run, instead of to the level above.
+    IndexBulkRun_t *run;
+};
+
+// The leaf pages one thread of a parallel build made, left to right, with the separator between each page and
+// the next. They are linked to each other, but not yet to the pages of the other runs, and have no parent.
+struct IndexBulkRun
+{
+    uint64_t *page_ids;
+    uint8_t *separators;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+// A thread of a parallel build. It takes a share of the records from the source and sorts them, and later
+// builds the run of leaf pages for one range of keys, out of the records of every thread.
+struct IndexBuildWorker
+{
+    IndexParallelBuild_t *build;
+    pthread_t thread;
+    uint32_t id;
+    uint8_t *records;
+    uint64_t count;
+    uint64_t capacity;
+    IndexBulkRun_t run;
+    bool failed;
+};
+
+struct IndexParallelBuild
+{
+    IndexTree_t *tree;
+    double fill_factor;
+    // The source is called by one thread at a time, under the lock.
+    IndexRecordSource_t source;
+    void *context;
+    pthread_mutex_t lock;
+    bool exhausted;
+    // A record is the key followed by its RecordID, as in an unsorted bulk load.
+    uint32_t record_size;
+    uint32_t num_workers;
+    IndexBuildWorker_t *workers;
+    // Key ranges, one for each of the first num_ranges workers. Range r starts at record
+    // bounds[r * num_workers + w] of worker w, and ends where range r + 1 starts.
+    uint32_t num_ranges;
+    uint64_t *bounds;
+};
+
+// A page an action of a logged tree has latched exclusively, created, or read from a posting list, in case
+// the action changes it.
+struct IndexActionPage
+{
+    IndexPage_t *page;
+    uint64_t page_id;
+    // The page as it was before the action. Zeros for a page the action created.
+    uint8_t *before;
+    // The action holds the latch of the page.
+    bool latched;
+    bool is_new;
+    // A page the action has changed stays pinned, and latched if it was, until the action ends, so no one
+    // sees the change before it's in the log. An unchanged page is let go of as usual.
+    bool changed;
+    // The action gave the page back. It's only freed once the action has ended.
+    bool freed;
+};
+
+// An insert, delete or update of a logged tree, with every split and merge it brings along.
+// The pages it changes are held until it ends, and then go to the log together, in one record. So the log
+// only ever has whole actions, a page only reaches the index file after the log has its actions, and after
+// a crash, the actions in the log are all there is to redo. Nothing is ever undone.
+// Each thread has its own, since a thread makes one change at a time.
+struct IndexAction
+{
+    // The tree the action is under way in, or NULL.
+    IndexTree_t *tree;
+    IndexActionPage_t *pages;
+    uint32_t num_pages;
+    uint32_t capacity;
+    // The root the action left the tree with, if it changed it.
+    bool root_changed;
+    uint64_t root;
+    // The record, while it's put together.
+    uint8_t *record;
+    size_t record_size;
+    size_t record_capacity;
+};
+
+// A record in the log of a tree: one action. It's followed by the pages the action changed, each an
+// IndexLogPage followed by the stretches of its bytes that changed, each an IndexLogRange followed by the
+// bytes. Pages are logged by their bytes, rather than by the entries that changed, so the same records
+// cover leaf, non-leaf and posting pages, and every way they change.
+struct IndexLogAction
+{
+    // The new root, or IDXT_NO_PAGE if the action didn't change it.
+    uint64_t root;
+    uint32_t num_pages;
+};
+
+struct IndexLogPage
+{
+    uint64_t page_id;
+    // The action created the page, which starts out zeroed.
+    uint32_t is_new;
+    uint32_t num_ranges;
+};
+
+struct IndexLogRange
+{
+    uint32_t offset;
+    uint32_t size;
+};
+
+// Recovery of a tree from its log.
+struct IndexRecovery
+{
+    IndexTree_t *tree;
+    // Actions found in the log.
+    uint64_t actions;
+};
+
+// The counters of one thread for one tree. Only the thread writes to them, each with a single store, so they
+// can be read at any time. Aligned to a cache line, so threads never write to the same one.
+struct IndexThreadStats
+{
+    // The thread, by the address of its cache below, which no other thread has while it's alive. A thread that
+    // gets the address of one that has exited takes over its counters.
+    const void *owner;
+    IndexThreadStats_t *next;
+    IndexTreeCounters_t counters;
+    // Operations of the thread so far, and whether the one under way is timed.
+    uint64_t ops;
+    bool timed;
+} __attribute__((aligned(64)));
+
+// A tree the thread has counters for, and the counters.
+struct IndexStatsCache
+{
+    uint64_t stats_id;
+    IndexThreadStats_t *stats;
+};
+
+// The trees of the thread, the last one used first.
+static __thread IndexStatsCache_t stats_cache[INDEX_STATS_CACHE];
+// Ids handed out to trees, for their counters. 0 is never handed out, and stands for no tree.
+static uint64_t next_stats_id;
+
+// The action of the thread, if it has one under way.
+static __thread IndexAction_t thread_action;
+// The tree the thread is changing while it has snapshots open, so the pages it changes are kept as they were.
+static __thread IndexTree_t *thread_versions;
+
+
+static bool CheckBufferFrames(uint32_t buffer_frames);
+static bool ReserveSuperblock(IndexTree_t *tree);
+static void WriteSuperblock(IndexTree_t *tree, bool clean);
+static IndexPage_t *CreateEmptyPage(IndexTree_t *tree, bool is_leaf);
+static uint32_t CalculateMaxEntries(IndexTree_t *tree, uint32_t data_size);
+static uint32_t PrefixLimit(const IndexKeyOps_t *ops);
+static inline uint32_t DataOffset(IndexTree_t *tree);
+static uint32_t LayoutCapacity(IndexTree_t *tree, IndexPage_t *page, uint32_t prefix_size, uint32_t key_end);
+static inline uint8_t *PageKey(IndexTree_t *tree, IndexPage_t *page, uint32_t pos);
+static inline uint8_t *PageSharedKey(IndexPage_t *page);
+static inline uint32_t KeyWidth(IndexPage_t *page);
+static inline int CompareKeys(IndexTree_t *tree, const void *a, const void *b);
+static void CopyPageKey(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, void *key);
+static inline const uint8_t *ReadPageKey(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, uint8_t *buffer);
+static int ComparePageKey(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, const void *key);
+static uint32_t SearchPage(IndexTree_t *tree, IndexPage_t *page, uint32_t count, const void *key, bool upper);
+static inline uint32_t CommonPrefix(const uint8_t *a, const uint8_t *b, uint32_t limit);
+static inline uint32_t CommonSuffixStart(const uint8_t *a, const uint8_t *b, uint32_t from, uint32_t size);
+static void FitLayout(IndexTree_t *tree, IndexPage_t *page, const void *key, uint32_t *prefix_size, uint32_t *key_end);
+static bool KeyFitsLayout(IndexTree_t *tree, IndexPage_t *page, const void *key);
+static bool PageHasRoom(IndexTree_t *tree, IndexPage_t *page, const void *key);
+static bool AbsorbsSplit(IndexTree_t *tree, IndexPage_t *page, void *key);
+static void SetPageLayout(IndexTree_t *tree, IndexPage_t *page, uint32_t prefix_size, uint32_t key_end);
+static void InsertPageEntry(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, const void *key, const void *data);
+static void ReplacePageKey(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, const void *key);
+static void ShortestSeparator(IndexTree_t *tree, const uint8_t *low, const uint8_t *high, uint8_t *separator);
+static void PageSeparator(IndexTree_t *tree, IndexPage_t *left, IndexPage_t *right, uint8_t *separator);
+static inline RecordID_t *PageRecordID(IndexPage_t *page, uint32_t pos);
+static inline uint64_t *PageChild(IndexPage_t *page, uint32_t pos);
+static inline uint32_t LeafDataSize(IndexTree_t *tree);
+static inline IndexPage_t *GetPage(IndexTree_t *tree, uint64_t page_id);
+static inline void ReleasePage(IndexTree_t *tree, IndexPage_t *page, bool dirty);
+static inline void LatchPage(IndexTree_t *tree, IndexPage_t *page, bool exclusive);
+static inline void UnlatchPage(IndexTree_t *tree, IndexPage_t *page, bool exclusive);
+static inline bool TryLatchPage(IndexTree_t *tree, IndexPage_t *page);
+static void ReleasePath(IndexTree_t *tree, IndexPath_t *path, uint32_t held);
+static void *AllocPage(IndexTree_t *tree, uint64_t *page_id);
+static IndexPage_t *FindLeafPage(IndexTree_t *tree, void *key, IndexLatchMode_t mode, IndexPath_t *path);
+static IndexPage_t *LatchRoot(IndexTree_t *tree, IndexLatchMode_t mode);
+static IndexPage_t *LatchRightmostLeaf(IndexTree_t *tree, void *key);
+static void NoteInsert(IndexTree_t *tree, IndexPage_t *page, void *key);
+static uint64_t ProcessNonleafPage(IndexTree_t *tree, IndexPage_t *page, void *key);
+static bool ProcessLeafPage(IndexTree_t *tree, IndexPage_t *page, void *key, RecordID_t *rid);
+static void HeatLeafPage(IndexTree_t *tree, IndexPage_t *page);
+static void HashLeafPage(IndexTree_t *tree, IndexPage_t *page);
+static inline void ForgetKey(IndexTree_t *tree, const void *key);
+static int CompareBatchKeys(const void *a, const void *b, void *context);
+static inline void PrefetchPage(IndexTree_t *tree, IndexPage_t *page, uint64_t page_id);
+static uint32_t FindRecordGroup(IndexTree_t *tree, void *keys, uint32_t *order, uint32_t count, RecordID_t *rids, bool *found);
+static uint32_t FindLowerBound(IndexTree_t *tree, IndexPage_t *page, void *key);
+static uint32_t FindInsertPosition(IndexTree_t *tree, IndexPage_t *page, void *key);
+static uint32_t InsertLeafPageEntry(IndexTree_t *tree, IndexPage_t *page, void *key, uint32_t page_num, uint32_t slot_num);
+static void BalanceAndInsertLeafPageEntry(IndexTree_t *tree, IndexPath_t *path, IndexPage_t *page, void *key, uint32_t page_num, uint32_t slot_num);
+static void InsertNonleafPageEntry(IndexTree_t *tree, IndexPage_t *target, uint32_t pos, void *key, uint64_t child);
+static void InitEntries(IndexTree_t *tree, IndexEntries_t *entries, uint32_t data_size, uint32_t capacity);
+static void AddPageEntries(IndexTree_t *tree, IndexEntries_t *entries, IndexPage_t *page);
+static void InsertEntry(IndexTree_t *tree, IndexEntries_t *entries, uint32_t pos, const void *key, const void *data);
+static inline uint8_t *EntryKey(IndexTree_t *tree, IndexEntries_t *entries, uint32_t pos);
+static void FreeEntries(IndexEntries_t *entries);
+static void EntriesLayout(IndexTree_t *tree, IndexPage_t *page, IndexEntries_t *entries, uint32_t first, uint32_t count, uint32_t *prefix_size, uint32_t *key_end);
+static bool EntriesFit(IndexTree_t *tree, IndexPage_t *page, IndexEntries_t *entries, uint32_t first, uint32_t count);
+static void StoreEntries(IndexTree_t *tree, IndexPage_t *page, IndexEntries_t *entries, uint32_t first, uint32_t count);
+static uint32_t ChooseSplit(IndexTree_t *tree, IndexPage_t *page, IndexEntries_t *entries, uint32_t preferred);
+static uint32_t PreferredSplit(IndexTree_t *tree, IndexPage_t *page, uint32_t count, uint32_t pos);
+static IndexPage_t *SplitPage(IndexTree_t *tree, IndexPage_t *page, IndexEntries_t *entries, uint32_t pos);
+static void InsertSplitIntoParent(IndexTree_t *tree, IndexPath_t *path, IndexPage_t *low_page, IndexPage_t *high_page);
+static inline uint32_t MinEntries(IndexPage_t *page);
+static inline bool IsRoot(IndexTree_t *tree, IndexPage_t *page);
+static uint32_t FindLeafPageEntry(IndexTree_t *tree, IndexPage_t *page, void *key, RecordID_t *rid);
+static IndexPage_t *FindLeafPageEntryToRight(IndexTree_t *tree, IndexPage_t *page, void *key, RecordID_t *rid, uint32_t *pos);
+static IndexPage_t *FindLeafPageEntryOnPath(IndexTree_t *tree, IndexPath_t *path, IndexPage_t *page, void *key, RecordID_t *rid, uint32_t *pos);
+static IndexPage_t *NextLeafPageOnPath(IndexTree_t *tree, IndexPath_t *path, IndexPage_t *page);
+static void RemovePageEntry(IndexTree_t *tree, IndexPage_t *page, uint32_t pos);
+static void RebalancePage(IndexTree_t *tree, IndexPath_t *path, IndexPage_t *page);
+static void MergePages(IndexTree_t *tree, IndexPage_t *parent, uint32_t pos, IndexPage_t *left, IndexPage_t *right, IndexEntries_t *entries);
+static uint32_t GetNonleafPageEntry(IndexPage_t *source, IndexPage_t *target);
+static uint32_t BulkLoadTarget(IndexBulkLoader_t *loader, IndexPage_t *page, void *key);
+static bool BulkLoadAppend(IndexBulkLoader_t *loader, uint32_t level, void *key, void *data);
+static bool BulkLoadFinish(IndexBulkLoader_t *loader);
+static void BulkLoadAbort(IndexBulkLoader_t *loader);
+static bool CheckBulkLoad(IndexTree_t *tree, double fill_factor);
+static bool BulkLoadRecord(IndexBulkLoader_t *loader, void *key, RecordID_t *rid, bool same_key);
+static void BulkLoadEvenOut(IndexBulkLoader_t *loader, IndexPage_t *low, IndexPage_t *high);
+static void BulkLoadFinishRun(IndexBulkLoader_t *loader);
+static void AddRunPage(IndexTree_t *tree, IndexBulkRun_t *run, uint64_t page_id, const void *separator);
+static void DestroyRun(IndexTree_t *tree, IndexBulkRun_t *run);
+static bool ParallelBulkLoad(IndexTree_t *tree, IndexRecordSource_t source, void *context, double fill_factor, uint32_t num_threads);
+static void *CollectRecords(void *arg);
+static void PartitionRecords(IndexParallelBuild_t *build);
+static void *BuildRun(void *arg);
+static void SiftRecords(IndexParallelBuild_t *build, uint32_t *heap, uint32_t size, uint32_t node, const uint64_t *positions);
+static bool StitchRuns(IndexParallelBuild_t *build);
+static int CompareBulkRecords(const void *a, const void *b, void *context);
+static bool SortedRecordSource(void *context, void *key, RecordID_t *rid);
+static inline IndexPosting_t *PagePosting(IndexPage_t *page, uint32_t pos);
+static inline IndexPostingPage_t *GetPostingPage(IndexTree_t *tree, uint64_t page_id);
+static inline void ReleasePostingPage(IndexTree_t *tree, IndexPostingPage_t *page, bool dirty);
+static inline uint64_t PackRecordID(const RecordID_t *rid);
+static inline void UnpackRecordID(uint64_t value, RecordID_t *rid);
+static inline uint8_t *PostingData(IndexPostingPage_t *page);
+static inline uint32_t VarintSize(uint64_t value);
+static inline uint32_t EncodeVarint(uint8_t *out, uint64_t value);
+static inline uint32_t DecodeVarint(const uint8_t *in, uint64_t *value);
+static void FillLeafData(IndexTree_t *tree, void *data, const RecordID_t *rid);
+static void GetLeafRecordID(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, RecordID_t *rid);
+static uint32_t FindPostingEntry(IndexTree_t *tree, IndexPage_t *page, void *key);
+static bool RemoveLeafPageRecord(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, RecordID_t *rid);
+static IndexPostingPage_t *CreatePostingPage(IndexTree_t *tree, uint64_t value);
+static uint32_t DecodePostingPage(IndexPostingPage_t *page, uint64_t *values);
+static uint32_t EncodedPostingSize(uint64_t *values, uint32_t count);
+static void EncodePostingPage(IndexPostingPage_t *page, uint64_t *values, uint32_t count);
+static bool PostingContains(IndexTree_t *tree, IndexPosting_t *posting, RecordID_t *rid);
+static bool PostingAdd(IndexTree_t *tree, IndexPosting_t *posting, RecordID_t *rid);
+static bool PostingRemove(IndexTree_t *tree, IndexPosting_t *posting, RecordID_t *rid);
+static void FreePosting(IndexTree_t *tree, IndexPosting_t *posting);
+static uint32_t CursorReadPosting(IndexCursor_t *cursor, RecordID_t *rids, void *keys, uint32_t max_rids);
+static void DestroyPage(IndexTree_t *tree, IndexPage_t *page);
+static void FreePage(IndexTree_t *tree, IndexPage_t *page);
+static void CursorEnterPage(IndexCursor_t *cursor, IndexPage_t *page, uint32_t pos);
+static void DisplayPage(IndexTree_t *tree, IndexPage_t *page, int level);
+static bool AddRecord(IndexTree_t *tree, void *key, uint32_t page_num, uint32_t slot_num);
+static bool DeleteRecord(IndexTree_t *tree, void *key, uint32_t page_num, uint32_t slot_num);
+static bool UpdateRecordID(IndexTree_t *tree, void *key, uint32_t page_num, uint32_t slot_num, uint32_t new_page_num, uint32_t new_slot_num);
+static bool BulkLoad(IndexTree_t *tree, IndexRecordSource_t source, void *context, double fill_factor);
+static bool OpenLog(IndexTree_t *tree, const char *path, uint32_t group_delay, bool create);
+static bool WriteHook(void *context, uint64_t page_id, const void *page);
+static bool Checkpoint(IndexTree_t *tree, bool clean);
+static bool InitSnapshots(IndexTree_t *tree);
+static bool InitAdaptiveHash(IndexTree_t *tree, uint64_t entries);
+static inline void SaveVersion(IndexTree_t *tree, void *page, uint64_t page_id);
+static void *ReadSnapshotPage(IndexSnapshot_t *snapshot, uint64_t page_id, void *buffer);
+static void FindSnapshotLeaf(IndexCursor_t *cursor, void *key);
+static IndexCursor_t *AllocCursor(IndexTree_t *tree, void *hi);
+static inline IndexPostingPage_t *CursorGetPostingPage(IndexCursor_t *cursor, uint64_t page_id);
+static inline void CursorReleasePostingPage(IndexCursor_t *cursor);
+static inline uint32_t SuperblockPages(IndexTree_t *tree);
+static void BeginAction(IndexTree_t *tree);
+static void EndAction(IndexTree_t *tree);
+static inline void BeginSnapshotChange(IndexTree_t *tree);
+static inline void EndSnapshotChange(IndexTree_t *tree);
+static IndexActionPage_t *FindActionPage(IndexTree_t *tree, void *page);
+static IndexActionPage_t *TrackPage(IndexTree_t *tree, void *page, uint64_t page_id, bool latched);
+static void TrackNewPage(IndexTree_t *tree, void *page, uint64_t page_id, bool latched);
+static bool KeepPage(IndexTree_t *tree, void *page);
+static void SetRoot(IndexTree_t *tree, uint64_t root);
+static void AppendRecord(IndexAction_t *action, const void *data, size_t size);
+static uint32_t LogPageRanges(IndexTree_t *tree, IndexActionPage_t *held);
+static bool RecoverTree(IndexTree_t *tree, bool clean);
+static bool ReplayAction(void *context, uint64_t lsn, const void *record, uint32_t size);
+static bool MarkPage(IndexTree_t *tree, uint64_t page_id, uint8_t *reachable, uint64_t *count);
+static bool MarkPages(IndexTree_t *tree, uint64_t page_id, uint8_t *reachable, uint64_t *count);
+static inline IndexThreadStats_t *ThreadStats(IndexTree_t *tree);
+static IndexThreadStats_t *FindThreadStats(IndexTree_t *tree);
+static inline void CountEvent(uint64_t *counter);
+static inline void CountOperation(IndexThreadStats_t *stats, uint64_t *counter);
+static inline uint64_t StartTimer(IndexTree_t *tree);
+static inline void StopTimer(IndexTreeTimer_t *timer, uint64_t start);
+static inline uint64_t ReadCycles(void);
+static IndexPage_t *LatchLeftmostPage(IndexTree_t *tree, uint32_t level);
+
+void idxt_InitOptions(IndexTreeOptions_t *options)
+{
+    memset(options, 0, sizeof(IndexTreeOptions_t));
+    options->page_size = 4096;
+    options->split_policy = IDXT_SPLIT_ADAPTIVE;
+    idxk_InitDesc(&options->key);
+}
+
+IndexTree_t *idxt_Create(const IndexTreeOptions_t *options)
+{
+    // Every tree is its own handle, owning its page arena and its page counter,
+    // so any number of trees can live side by side.
+    IndexTree_t *tree = calloc(1, sizeof(IndexTree_t));
+    if (tree == NULL)
+    {
+        fprintf(stderr, "Error in index tree: unable to allocate tree.\n");
+        return NULL;
+    }
+    tree->stats_id = __atomic_add_fetch(&next_stats_id, 1, __ATOMIC_RELAXED);
+    // Set meta-data and create root.
+    tree->page_counter = 0;
+    tree->page_size = options->page_size;
+    // The compare and search routines for the key layout are picked once, here.
+    if (!idxk_InitOps(&tree->key_ops, &options->key))
+    {
+        free(tree);
+        return NULL;
+    }
+    tree->key_size = tree->key_ops.key_size;
+    tree->non_unique = options->non_unique;
+    tree->compress_keys = options->compress_keys;
+    tree->prefix_limit = PrefixLimit(&tree->key_ops);
+    tree->split_policy = options->split_policy;
+    // A page has to hold at least two entries of either kind, otherwise a split can't divide it.
+    if (CalculateMaxEntries(tree, LeafDataSize(tree)) < 2 || CalculateMaxEntries(tree, sizeof(uint64_t)) < 2)
+    {
+        fprintf(stderr, "Error in index tree: page size %d is too small for key size %d.\n", tree->page_size, tree->key_size);
+        free(tree);
+        return NULL;
+    }
+    // A posting page has to take a few records of the largest size, otherwise a split may not divide it.
+    if (tree->non_unique && tree->page_size < sizeof(IndexPostingPage_t) + 4 * VarintSize(UINT64_MAX))
+    {
+        fprintf(stderr, "Error in index tree: page size %d is too small for posting lists.\n", tree->page_size);
+        free(tree);
+        return NULL;
+    }
+    // Only a buffer pool decides when a page is written, so only it can hold a page back until the log
+    // has the changes to it.
+    if (options->wal && (options->path == NULL || options->buffer_frames == 0))
+    {
+        fprintf(stderr, "Error in index tree: a logged tree needs an index file with a buffer pool.\n");
+        free(tree);
+        return NULL;
+    }
+    // All the pages of the tree are carved out of its own arena, which may be mapped from an index file.
+    // Or, with a buffer pool, the index file is read into a fixed number of frames as pages are needed.
+    if (options->path != NULL && options->buffer_frames > 0)
+    {
+        if (!CheckBufferFrames(options->buffer_frames))
+        {
+            free(tree);
+            return NULL;
+        }
+        tree->buffer = bp_Create(options->path, pool_FrameSize(tree->page_size), options->buffer_frames, options->buffer_policy);
+    }
+    else if (options->path != NULL)
+        tree->pool = pool_CreateFile(options->path, tree->page_size);
+    else
+        tree->pool = pool_Create(tree->page_size, options->huge_pages);
+    if (tree->pool == NULL && tree->buffer == NULL)
+    {
+        free(tree);
+        return NULL;
+    }
+    if (!ReserveSuperblock(tree))
+    {
+        pool_Destroy(tree->pool);
+        bp_Destroy(tree->buffer);
+        free(tree);
+        return NULL;
+    }
+    IndexPage_t *root = CreateEmptyPage(tree, /* is_leaf */ true);
+    tree->root = root->page_id;
+    ReleasePage(tree, root, true);
+    WriteSuperblock(tree, true);
+    // A logged tree starts out with a checkpoint, so the file is complete before the first action is logged.
+    if (options->wal && (!OpenLog(tree, options->path, options->wal_group_delay, true) || !Checkpoint(tree, false)))
+    {
+        wal_Destroy(tree->log);
+        bp_Destroy(tree->buffer);
+        free(tree);
+        return NULL;
+    }
+    if (options->snapshots && !InitSnapshots(tree))
+    {
+        idxt_Destroy(tree);
+        return NULL;
+    }
+    if (options->adaptive_hash_entries > 0 && !InitAdaptiveHash(tree, options->adaptive_hash_entries))
+    {
+        idxt_Destroy(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+IndexTree_t *idxt_Open(const IndexTreeOptions_t *options)
+{
+    const char *path = options->path;
+    // The superblock is read on its own first, since we need the page size before we can map the pages.
+    IndexSuperblock_t superblock;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error in index tree: unable to open %s.\n", path);
+        return NULL;
+    }
+    size_t read = fread(&superblock, sizeof(IndexSuperblock_t), 1, file);
+    fclose(file);
+    if (read != 1 || superblock.magic != IDXT_FILE_MAGIC || superblock.version != IDXT_FILE_VERSION)
+    {
+        fprintf(stderr, "Error in index tree: %s is not an index file.\n", path);
+        return NULL;
+    }
+    if (superblock.wal && options->buffer_frames == 0)
+    {
+        fprintf(stderr, "Error in index tree: %s is logged, and needs a buffer pool.\n", path);
+        return NULL;
+    }
+    // After a crash, the file may have pages the superblock doesn't know of yet, handed out since the last
+    // checkpoint.
+    uint64_t num_pages = superblock.num_frames;
+    struct stat status;
+    if (superblock.wal && stat(path, &status) == 0 && (uint64_t)status.st_size / pool_FrameSize(superblock.page_size) > num_pages)
+        num_pages = status.st_size / pool_FrameSize(superblock.page_size);
+
+    IndexTree_t *tree = calloc(1, sizeof(IndexTree_t));
+    if (tree == NULL)
+    {
+        fprintf(stderr, "Error in index tree: unable to allocate tree.\n");
+        return NULL;
+    }
+    tree->stats_id = __atomic_add_fetch(&next_stats_id, 1, __ATOMIC_RELAXED);
+    tree->page_size = superblock.page_size;
+    // Only the key layout is stored, the routines for it are picked again, for this process.
+    if (!idxk_InitOps(&tree->key_ops, &superblock.key) || tree->key_ops.key_size != superblock.key_size)
+    {
+        fprintf(stderr, "Error in index tree: %s has an invalid key layout.\n", path);
+        free(tree);
+        return NULL;
+    }
+    tree->key_size = tree->key_ops.key_size;
+    tree->non_unique = superblock.non_unique;
+    tree->compress_keys = superblock.compress_keys;
+    tree->prefix_limit = PrefixLimit(&tree->key_ops);
+    tree->split_policy = options->split_policy;
+    if (options->buffer_frames > 0)
+    {
+        if (!CheckBufferFrames(options->buffer_frames))
+        {
+            free(tree);
+            return NULL;
+        }
+        tree->buffer = bp_Open(path, pool_FrameSize(tree->page_size), options->buffer_frames, options->buffer_policy, num_pages, superblock.free_head, superblock.num_free);
+    }
+    else
+        tree->pool = pool_OpenFile(path, tree->page_size, superblock.num_frames, superblock.free_head, superblock.num_free);
+    if (tree->pool == NULL && tree->buffer == NULL)
+    {
+        free(tree);
+        return NULL;
+    }
+    tree->root = superblock.root;
+    tree->page_counter = superblock.page_counter;
+    // A logged tree is recovered from its log, which is empty unless the tree was left behind by a crash.
+    if (superblock.wal && (!OpenLog(tree, path, options->wal_group_delay, false) || !RecoverTree(tree, superblock.clean)))
+    {
+        wal_Destroy(tree->log);
+        bp_Destroy(tree->buffer);
+        free(tree);
+        return NULL;
+    }
+    if (options->snapshots && !InitSnapshots(tree))
+    {
+        idxt_Destroy(tree);
+        return NULL;
+    }
+    if (options->adaptive_hash_entries > 0 && !InitAdaptiveHash(tree, options->adaptive_hash_entries))
+    {
+        idxt_Destroy(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+bool idxt_Sync(IndexTree_t *tree)
+{
+    // A logged tree has a checkpoint instead. It waits for the actions under way, and keeps new ones out
+    // until the pages are written.
+    if (tree->log != NULL)
+    {
+        pthread_rwlock_wrlock(&tree->checkpoint_lock);
+        bool synced = Checkpoint(tree, false);
+        pthread_rwlock_unlock(&tree->checkpoint_lock);
+        return synced;
+    }
+    WriteSuperblock(tree, true);
+    if (tree->buffer != NULL)
+        return bp_Flush(tree->buffer);
+    return pool_Sync(tree->pool);
+}
+
+bool idxt_Destroy(IndexTree_t *tree)
+{
+    if (tree == NULL)
+        return false;
+    // Every page lives in the arena, so we give back the arena as a whole instead of visiting the pages,
+    // and then the handle itself. An index file is brought up to date before it's unmapped. A logged tree
+    // is marked as closed as well, so the next open can trust its free pages.
+    bool synced = tree->log != NULL ? Checkpoint(tree, true) : idxt_Sync(tree);
+    pool_Destroy(tree->pool);
+    bp_Destroy(tree->buffer);
+    if (tree->log != NULL)
+    {
+        wal_Destroy(tree->log);
+        pthread_rwlock_destroy(&tree->checkpoint_lock);
+    }
+    if (tree->versions != NULL)
+    {
+        pv_Destroy(tree->versions);
+        pthread_rwlock_destroy(&tree->snapshot_lock);
+    }
+    hidx_Destroy(tree->adaptive_hash);
+    free(tree->leaf_heat);
+    while (tree->thread_stats != NULL)
+    {
+        IndexThreadStats_t *stats = tree->thread_stats;
+        tree->thread_stats = stats->next;
+        free(stats);
+    }
+    free(tree);
+    return synced;
+}
+
+bool idxt_AddRecord(IndexTree_t *tree, void *key, uint32_t page_num, uint32_t slot_num)
+{
+    INDEX_COUNT_OPERATION(tree, inserts);
+    // In a logged tree, the insert is an action, which goes to the log as a whole once it's done.
+    BeginAction(tree);
+    bool added = AddRecord(tree, key, page_num, slot_num);
+    EndAction(tree);
+    return added;
+}
+
+bool AddRecord(IndexTree_t *tree, void *key, uint32_t page_num, uint32_t slot_num)
+{
+    // Inserting an index for a record into the index tree is complicated.
+    // It requires balancing the tree by keeping track of the number of entries in each page,
+    // while at the same time ensuring that the keys are stored in sequential order.
+    // We have to traverse down the tree to the leaf page where we would like to insert the entry.
+    // Most of the time the leaf page has room, and only the leaf page changes, so we first go down
+    // the way a reader does and only latch the leaf page exclusively.
+    // While the inserts are appends, they all go to the right-most leaf page, and we go there straight away.
+    IndexPage_t *current = NULL;
+    if (__atomic_load_n(&tree->append_streak, __ATOMIC_RELAXED) >= IDXT_APPEND_STREAK)
+        current = LatchRightmostLeaf(tree, key);
+    if (current != NULL)
+        INDEX_COUNT(tree, rightmost_inserts);
+    else
+        current = FindLeafPage(tree, key, INDEX_LATCH_LEAF_EXCLUSIVE, NULL);
+    NoteInsert(tree, current, key);
+    // In a non-unique tree, a key that is already there only gets the record added to its list,
+    // and the leaf page itself doesn't change shape.
+    RecordID_t rid;
+    rid.page_num = page_num;
+    rid.slot_num = slot_num;
+    uint32_t pos = FindPostingEntry(tree, current, key);
+    if (pos != INDEX_NO_ENTRY)
+    {
+        bool added = PostingAdd(tree, PagePosting(current, pos), &rid);
+        UnlatchPage(tree, current, true);
+        ReleasePage(tree, current, added);
+        return added;
+    }
+    // We need to check if there is any room.
+    // If not, we have to insert a new page with ensuing balancing acts to bite our ass.
+    if (PageHasRoom(tree, current, key))
+    {
+        // Yey, there is room! Now we just need to re-organize the entries so we maintain
+        // ascending sequential order...
+        InsertLeafPageEntry(tree, current, key, page_num, slot_num);
+        UnlatchPage(tree, current, true);
+        ReleasePage(tree, current, true);
+        return true;
+    }
+
+    // Fuck...
+    // The split may go all the way up, so we start over and latch every page that may be split
+    // on the way down. The leaf page may have changed in the meantime, so we check again.
+    INDEX_COUNT(tree, restarts);
+    UnlatchPage(tree, current, true);
+    ReleasePage(tree, current, false);
+    IndexPath_t path;
+    current = FindLeafPage(tree, key, INDEX_LATCH_SPLIT, &path);
+    uint32_t held = path.depth;
+    pos = FindPostingEntry(tree, current, key);
+    if (pos != INDEX_NO_ENTRY)
+    {
+        bool added = PostingAdd(tree, PagePosting(current, pos), &rid);
+        UnlatchPage(tree, current, true);
+        ReleasePage(tree, current, added);
+        ReleasePath(tree, &path, held);
+        return added;
+    }
+    if (PageHasRoom(tree, current, key))
+        InsertLeafPageEntry(tree, current, key, page_num, slot_num);
+    else
+    {
+        uint64_t start = INDEX_TIMER_START(tree);
+        BalanceAndInsertLeafPageEntry(tree, &path, current, key, page_num, slot_num);
+        INDEX_TIMER_STOP(tree, split, start);
+    }
+    UnlatchPage(tree, current, true);
+    ReleasePage(tree, current, true);
+    ReleasePath(tree, &path, held);
+    return true;
+}
+
+bool idxt_FindRecord(IndexTree_t *tree, void *key, RecordID_t *rid)
+{
+    // Starting at the root:
+    // 1.  Check if leaf page.
+    // 2a. If leaf page, search entries for key. If found, copy the RecordID, if not, return false.
+    // 2b. If non-leaf page, walk through the entries and compare the key.
+    // 3a. If key is less than the highest key in an entry, go to the child page. Repeat step 1.
+    // 3b. Else, go to the next entry. Repeat step 3a.
+
+    // Note: If we reach level 0(no more children), and the page is not a leaf page,
+    // there is an error in the tree structure. It should not happen.
+
+    INDEX_COUNT_OPERATION(tree, lookups);
+    // A key of a hot leaf page is in the adaptive hash, and we don't go down the tree at all.
+    if (tree->adaptive_hash != NULL && hidx_Find(tree->adaptive_hash, key, rid))
+    {
+        INDEX_COUNT(tree, hash_hits);
+        return true;
+    }
+    // Traverse the three to level 0(the leaf pages).
+    IndexPage_t *current = FindLeafPage(tree, key, INDEX_LATCH_SHARED, NULL);
+    if (tree->adaptive_hash != NULL)
+        HeatLeafPage(tree, current);
+
+    // After traversing to the correct leaf page, we have to find and return the correct entry.
+    // The entry is copied out, since the page may change, or be paged out, once we let go of it.
+    bool found = ProcessLeafPage(tree, current, key, rid);
+    // A key shared by several entries may run on into the next page. Once the ones in this page are deleted,
+    // this page only has lower keys, and the rest are in the next page, so we follow the chain that far.
+    while (!found && current->next != IDXT_NO_PAGE && (current->num_entries == 0 || ComparePageKey(tree, current, current->num_entries - 1, key) < 0))
+    {
+        IndexPage_t *next = GetPage(tree, current->next);
+        LatchPage(tree, next, false);
+        UnlatchPage(tree, current, false);
+        ReleasePage(tree, current, false);
+        current = next;
+        found = ProcessLeafPage(tree, current, key, rid);
+    }
+    UnlatchPage(tree, current, false);
+    ReleasePage(tree, current, false);
+    return found;
+}
+
+uint32_t idxt_FindRecords(IndexTree_t *tree, void *keys, uint32_t num_keys, RecordID_t *rids, bool *found)
+{
+    INDEX_COUNT_OPERATION(tree, batch_lookups);
+    // The keys are looked up in sorted order, through a table of their positions, so the results can
+    // still go where the caller expects them.
+    uint32_t *order = malloc(sizeof(uint32_t) * num_keys);
+    if (order == NULL && num_keys > 0)
+    {
+        // Without room to sort, we can still look them up one at a time.
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < num_keys; i++)
+        {
+            found[i] = idxt_FindRecord(tree, (uint8_t *)keys + (size_t)i * tree->key_size, &rids[i]);
+            count += found[i];
+        }
+        return count;
+    }
+    for (uint32_t i = 0; i < num_keys; i++)
+        order[i] = i;
+    IndexBatch_t batch;
+    batch.tree = tree;
+    batch.keys = keys;
+    qsort_r(order, num_keys, sizeof(uint32_t), CompareBatchKeys, &batch);
+
+    // Each group of neighbouring keys goes down together. Every page on the way stays latched until the
+    // level below it is, so a group is kept small. With a buffer pool, where they also stay pinned, it's
+    // kept to a share of the frames.
+    uint32_t width = INDEX_BATCH_WIDTH;
+    if (tree->buffer != NULL && tree->buffer->num_frames / 8 < width)
+        width = tree->buffer->num_frames / 8;
+    uint32_t count = 0;
+    for (uint32_t first = 0; first < num_keys; first += width)
+        count += FindRecordGroup(tree, keys, order + first, num_keys - first < width ? num_keys - first : width, rids, found);
+    free(order);
+    return count;
+}
+
+bool idxt_DeleteRecord(IndexTree_t *tree, void *key, uint32_t page_num, uint32_t slot_num)
+{
+    INDEX_COUNT_OPERATION(tree, deletes);
+    BeginAction(tree);
+    bool deleted = DeleteRecord(tree, key, page_num, slot_num);
+    EndAction(tree);
+    return deleted;
+}
+
+bool DeleteRecord(IndexTree_t *tree, void *key, uint32_t page_num, uint32_t slot_num)
+{
+    RecordID_t rid;
+    rid.page_num = page_num;
+    rid.slot_num = slot_num;
+
+    // Like an insert, most deletes only change the leaf page, so we first go down the way a reader does.
+    // A key may be shared by more entries than fit in one page, so ours may be in a page further right.
+    IndexPage_t *current = FindLeafPage(tree, key, INDEX_LATCH_LEAF_EXCLUSIVE, NULL);
+    uint32_t pos;
+    current = FindLeafPageEntryToRight(tree, current, key, &rid, &pos);
+    if (current == NULL)
+        return false;
+    // A record of a posting list with others in it only shortens the list, so the leaf page keeps its entry.
+    bool keeps_entry = tree->non_unique && PagePosting(current, pos)->count > 1;
+    if (keeps_entry || current->num_entries > MinEntries(current) || IsRoot(tree, current))
+    {
+        RemoveLeafPageRecord(tree, current, pos, &rid);
+        UnlatchPage(tree, current, true);
+        ReleasePage(tree, current, true);
+        return true;
+    }
+
+    // The leaf page would end up less than half full, and may have to be merged with a sibling, which
+    // in turn may leave its parent underfull and so on up. We start over and latch every page that may
+    // change on the way down. The entry may have moved or gone in the meantime, so we look again.
+    INDEX_COUNT(tree, restarts);
+    UnlatchPage(tree, current, true);
+    ReleasePage(tree, current, false);
+    IndexPath_t path;
+    current = FindLeafPage(tree, key, INDEX_LATCH_MERGE, &path);
+    pos = FindLeafPageEntry(tree, current, key, &rid);
+    if (pos == INDEX_NO_ENTRY)
+    {
+        // The entry is further right. The pages there may be under other parents than the ones on the path,
+        // so we go down once more, keeping every page above the leaf, and move right along the path.
+        UnlatchPage(tree, current, true);
+        ReleasePage(tree, current, false);
+        ReleasePath(tree, &path, path.depth);
+        current = FindLeafPage(tree, key, INDEX_LATCH_EXCLUSIVE, &path);
+        current = FindLeafPageEntryOnPath(tree, &path, current, key, &rid, &pos);
+        if (current == NULL)
+        {
+            ReleasePath(tree, &path, path.depth);
+            return false;
+        }
+    }
+    if (!RemoveLeafPageRecord(tree, current, pos, &rid))
+    {
+        UnlatchPage(tree, current, true);
+        ReleasePage(tree, current, true);
+        ReleasePath(tree, &path, path.depth);
+        return true;
+    }
+    // The pages the rebalancing reaches are let go of as it leaves them, the rest of the path is untouched.
+    RebalancePage(tree, &path, current);
+    ReleasePath(tree, &path, path.depth);
+    return true;
+}
+
+bool idxt_UpdateRecord(IndexTree_t *tree, void *key, uint32_t page_num, uint32_t slot_num, void *new_key, uint32_t new_page_num, uint32_t new_slot_num)
+{
+    INDEX_COUNT_OPERATION(tree, updates);
+    // A new key means a new place in the tree, so the entry is moved there.
+    if (CompareKeys(tree, key, new_key) != 0)
+    {
+        if (!idxt_DeleteRecord(tree, key, page_num, slot_num))
+            return false;
+        return idxt_AddRecord(tree, new_key, new_page_num, new_slot_num);
+    }
+    BeginAction(tree);
+    bool updated = UpdateRecordID(tree, key, page_num, slot_num, new_page_num, new_slot_num);
+    EndAction(tree);
+    return updated;
+}
+
+bool UpdateRecordID(IndexTree_t *tree, void *key, uint32_t page_num, uint32_t slot_num, uint32_t new_page_num, uint32_t new_slot_num)
+{
+    // With the same key, only the RecordID changes, and the entry stays where it is.
+    RecordID_t rid;
+    rid.page_num = page_num;
+    rid.slot_num = slot_num;
+    IndexPage_t *current = FindLeafPage(tree, key, INDEX_LATCH_LEAF_EXCLUSIVE, NULL);
+    uint32_t pos;
+    current = FindLeafPageEntryToRight(tree, current, key, &rid, &pos);
+    if (current == NULL)
+        return false;
+    RecordID_t new_rid;
+    new_rid.page_num = new_page_num;
+    new_rid.slot_num = new_slot_num;
+    bool updated = true;
+    if (!tree->non_unique)
+    {
+        ForgetKey(tree, key);
+        *PageRecordID(current, pos) = new_rid;
+    }
+    else if (PagePosting(current, pos)->count == 1)
+        PagePosting(current, pos)->rid = new_rid;
+    else if (PackRecordID(&rid) != PackRecordID(&new_rid))
+    {
+        // A posting list is sorted, so the record is taken out and added back in its new place,
+        // unless the key already has the new record.
+        updated = !PostingContains(tree, PagePosting(current, pos), &new_rid);
+        if (updated)
+        {
+            PostingRemove(tree, PagePosting(current, pos), &rid);
+            PostingAdd(tree, PagePosting(current, pos), &new_rid);
+        }
+    }
+    UnlatchPage(tree, current, true);
+    ReleasePage(tree, current, updated);
+    return updated;
+}
+
+IndexCursor_t *idxt_OpenCursor(IndexTree_t *tree, void *lo, void *hi)
+{
+    INDEX_COUNT_OPERATION(tree, scans);
+    IndexCursor_t *cursor = AllocCursor(tree, hi);
+    if (cursor == NULL)
+        return NULL;
+
+    // We only descend once, to the leaf page where lo belongs. From there on the cursor only
+    // moves right along the chain of leaf pages.
+    IndexPage_t *leaf = FindLeafPage(tree, lo, INDEX_LATCH_SHARED, NULL);
+    CursorEnterPage(cursor, leaf, lo != NULL ? FindLowerBound(tree, leaf, lo) : 0);
+    return cursor;
+}
+
+IndexCursor_t *idxt_OpenKeyCursor(IndexTree_t *tree, void *key)
+{
+    // The records of a key are the range from the key to itself.
+    return idxt_OpenCursor(tree, key, key);
+}
+
+uint32_t idxt_Next(IndexCursor_t *cursor, RecordID_t *rids, void *keys, uint32_t max_rids)
+{
+    IndexTree_t *tree = cursor->tree;
+    uint32_t count = 0;
+    while (count < max_rids && cursor->page != NULL)
+    {
+        // Move on to the next leaf page once we are through the range of this one.
+        if (cursor->pos == cursor->end)
+        {
+            // If the range ended inside this page, there is nothing more to find.
+            // The cursor keeps its page pinned and latched, and lets go of it once it's on the next one.
+            // A snapshot cursor only has a copy, which the next page is copied over.
+            uint64_t next = cursor->end < cursor->page->num_entries ? IDXT_NO_PAGE : cursor->page->next;
+            if (cursor->snapshot != NULL)
+            {
+                CursorEnterPage(cursor, next != IDXT_NO_PAGE ? ReadSnapshotPage(cursor->snapshot, next, cursor->page_copy) : NULL, 0);
+                continue;
+            }
+            IndexPage_t *next_page = NULL;
+            if (next != IDXT_NO_PAGE)
+            {
+                next_page = GetPage(tree, next);
+                LatchPage(tree, next_page, false);
+            }
+            UnlatchPage(tree, cursor->page, false);
+            ReleasePage(tree, cursor->page, false);
+            CursorEnterPage(cursor, next_page, 0);
+            continue;
+        }
+
+        // In a non-unique tree, every entry stands for the records in its posting list.
+        if (tree->non_unique)
+        {
+            count += CursorReadPosting(cursor, rids + count, keys != NULL ? (uint8_t *)keys + (size_t)count * tree->key_size : NULL, max_rids - count);
+            continue;
+        }
+
+        // The entries in range are contiguous in both arrays, so we copy as many as we can in one go.
+        uint32_t batch = cursor->end - cursor->pos;
+        if (batch > max_rids - count)
+            batch = max_rids - count;
+        memcpy(rids + count, PageRecordID(cursor->page, cursor->pos), sizeof(RecordID_t) * batch);
+        if (keys != NULL && !tree->compress_keys)
+            memcpy((uint8_t *)keys + (size_t)count * tree->key_size, PageKey(tree, cursor->page, cursor->pos), (size_t)batch * tree->key_size);
+        else if (keys != NULL)
+        {
+            for (uint32_t i = 0; i < batch; i++)
+                CopyPageKey(tree, cursor->page, cursor->pos + i, (uint8_t *)keys + (size_t)(count + i) * tree->key_size);
+        }
+        cursor->pos += batch;
+        count += batch;
+    }
+    return count;
+}
+
+void idxt_Close(IndexCursor_t *cursor)
+{
+    if (cursor->posting_page != NULL)
+        CursorReleasePostingPage(cursor);
+    if (cursor->page != NULL && cursor->snapshot == NULL)
+    {
+        UnlatchPage(cursor->tree, cursor->page, false);
+        ReleasePage(cursor->tree, cursor->page, false);
+    }
+    free(cursor->page_copy);
+    free(cursor->posting_copy);
+    free(cursor);
+}
+
+IndexSnapshot_t *idxt_OpenSnapshot(IndexTree_t *tree)
+{
+    if (tree->versions == NULL)
+    {
+        fprintf(stderr, "Error in index tree: the tree doesn't allow snapshots.\n");
+        return NULL;
+    }
+    IndexSnapshot_t *snapshot = malloc(sizeof(IndexSnapshot_t));
+    if (snapshot == NULL)
+    {
+        fprintf(stderr, "Error in index tree: unable to allocate snapshot.\n");
+        return NULL;
+    }
+    snapshot->tree = tree;
+    // With no change under way, the root and every page are as they were after the last one. The changes
+    // after it are of a later epoch, and keep the pages they change for the snapshot.
+    pthread_rwlock_wrlock(&tree->snapshot_lock);
+    snapshot->epoch = pv_OpenSnapshot(tree->versions);
+    snapshot->root = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+    pthread_rwlock_unlock(&tree->snapshot_lock);
+    return snapshot;
+}
+
+IndexCursor_t *idxt_OpenSnapshotCursor(IndexSnapshot_t *snapshot, void *lo, void *hi)
+{
+    IndexTree_t *tree = snapshot->tree;
+    INDEX_COUNT_OPERATION(tree, scans);
+    IndexCursor_t *cursor = AllocCursor(tree, hi);
+    if (cursor == NULL)
+        return NULL;
+    cursor->snapshot = snapshot;
+    cursor->page_copy = malloc(tree->page_size);
+    cursor->posting_copy = malloc(tree->page_size);
+    if (cursor->page_copy == NULL || cursor->posting_copy == NULL)
+    {
+        fprintf(stderr, "Error in index tree: unable to allocate cursor.\n");
+        idxt_Close(cursor);
+        return NULL;
+    }
+    // Like any cursor, it goes down once, and then moves right along the leaf pages, as the snapshot has them.
+    FindSnapshotLeaf(cursor, lo);
+    IndexPage_t *leaf = (IndexPage_t *)cursor->page_copy;
+    CursorEnterPage(cursor, leaf, lo != NULL ? FindLowerBound(tree, leaf, lo) : 0);
+    return cursor;
+}
+
+void idxt_CloseSnapshot(IndexSnapshot_t *snapshot)
+{
+    pv_CloseSnapshot(snapshot->tree->versions, snapshot->epoch);
+    free(snapshot);
+}
+
+bool idxt_BulkLoad(IndexTree_t *tree, IndexRecordSource_t source, void *context, double fill_factor)
+{
+    INDEX_COUNT_OPERATION(tree, bulk_loads);
+    // A bulk load isn't logged. Its pages are only reachable once it's done, and a checkpoint right after
+    // gets them to the disk in one go. Other changes wait until then, since a checkpoint can't have any
+    // under way.
+    if (tree->log != NULL)
+        pthread_rwlock_wrlock(&tree->checkpoint_lock);
+    uint64_t empty_root = tree->root;
+    bool loaded = BulkLoad(tree, source, context, fill_factor);
+    if (loaded && tree->log != NULL)
+        loaded = Checkpoint(tree, false);
+    // The empty root is only given back after that, so a crash during the load leaves the empty tree
+    // in the file. It may have been the right-most leaf page, which the loaded tree has a new one of.
+    if (loaded)
+    {
+        __atomic_store_n(&tree->rightmost_leaf, IDXT_NO_PAGE, __ATOMIC_RELEASE);
+        FreePage(tree, GetPage(tree, empty_root));
+    }
+    if (tree->log != NULL)
+        pthread_rwlock_unlock(&tree->checkpoint_lock);
+    return loaded;
+}
+
+bool BulkLoad(IndexTree_t *tree, IndexRecordSource_t source, void *context, double fill_factor)
+{
+    if (!CheckBulkLoad(tree, fill_factor))
+        return false;
+
+    // The first leaf is a new page. The empty root stays the root until the new tree takes its place,
+    // so a load that fails leaves the tree the way it was. The loader keeps the pages at the right edge
+    // pinned until they are done.
+    IndexBulkLoader_t loader;
+    memset(&loader, 0, sizeof(IndexBulkLoader_t));
+    loader.tree = tree;
+    loader.fill_factor = fill_factor;
+    loader.num_levels = 1;
+    loader.levels[0].open = CreateEmptyPage(tree, true);
+
+    // Every record is appended to the right-most leaf, which is only possible if they arrive in order.
+    uint8_t key[tree->key_size];
+    uint8_t last_key[tree->key_size];
+    bool has_last_key = false;
+    RecordID_t rid;
+    while (source(context, key, &rid))
+    {
+        if (has_last_key && CompareKeys(tree, key, last_key) < 0)
+        {
+            fprintf(stderr, "Error in index tree: bulk load input is not sorted.\n");
+            BulkLoadAbort(&loader);
+            return false;
+        }
+        if (!BulkLoadRecord(&loader, key, &rid, has_last_key && CompareKeys(tree, key, last_key) == 0))
+        {
+            BulkLoadAbort(&loader);
+            return false;
+        }
+        memcpy(last_key, key, tree->key_size);
+        has_last_key = true;
+    }
+
+    if (!BulkLoadFinish(&loader))
+    {
+        BulkLoadAbort(&loader);
+        return false;
+    }
+    return true;
+}
+
+bool idxt_BulkLoadUnsorted(IndexTree_t *tree, IndexRecordSource_t source, void *context, double fill_factor, size_t memory_budget)
+{
+    // A sort record is the key followed by its RecordID.
+    ExternalSort_t *sort = xsort_Create(tree->key_size + sizeof(RecordID_t), memory_budget, CompareBulkRecords, tree);
+    if (sort == NULL)
+        return false;
+
+    uint8_t record[tree->key_size + sizeof(RecordID_t)];
+    RecordID_t rid;
+    while (source(context, record, &rid))
+    {
+        memcpy(record + tree->key_size, &rid, sizeof(RecordID_t));
+        if (!xsort_Add(sort, record))
+        {
+            xsort_Destroy(sort);
+            return false;
+        }
+    }
+    if (!xsort_Finish(sort))
+    {
+        xsort_Destroy(sort);
+        return false;
+    }
+
+    // The sorted output is then streamed straight into the sorted bulk load.
+    bool loaded = idxt_BulkLoad(tree, SortedRecordSource, sort, fill_factor);
+    xsort_Destroy(sort);
+    return loaded;
+}
+
+bool idxt_BulkLoadParallel(IndexTree_t *tree, IndexRecordSource_t source, void *context, double fill_factor, uint32_t num_threads)
+{
+    INDEX_COUNT_OPERATION(tree, bulk_loads);
+    // Like idxt_BulkLoad, the load isn't logged, but followed by a checkpoint, and the empty root is only
+    // given back after that.
+    if (tree->log != NULL)
+        pthread_rwlock_wrlock(&tree->checkpoint_lock);
+    uint64_t empty_root = tree->root;
+    bool loaded = ParallelBulkLoad(tree, source, context, fill_factor, num_threads);
+    if (loaded && tree->log != NULL)
+        loaded = Checkpoint(tree, false);
+    if (loaded)
+    {
+        __atomic_store_n(&tree->rightmost_leaf, IDXT_NO_PAGE, __ATOMIC_RELEASE);
+        FreePage(tree, GetPage(tree, empty_root));
+    }
+    if (tree->log != NULL)
+        pthread_rwlock_unlock(&tree->checkpoint_lock);
+    return loaded;
+}
+
+void idxt_GetStats(IndexTree_t *tree, IndexTreeStats_t *stats)
+{
+    memset(stats, 0, sizeof(IndexTreeStats_t));
+
+    // The counters of every thread are added up, one by one, since they are all uint64_t. A thread may add a
+    // block while we go through them, which we either see or don't, like the operations it counts.
+    for (IndexThreadStats_t *thread = __atomic_load_n(&tree->thread_stats, __ATOMIC_ACQUIRE); thread != NULL; thread = thread->next)
+    {
+        const uint64_t *from = (const uint64_t *)&thread->counters;
+        uint64_t *to = (uint64_t *)&stats->counters;
+        for (size_t i = 0; i < sizeof(IndexTreeCounters_t) / sizeof(uint64_t); i++)
+            to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+
+    // Each level is walked from its left-most page to the right along the chain of pages, the way a cursor
+    // walks the leaf pages, with the next page latched before the latch on the last one is let go of.
+    // Going down to the next level starts from the root again, so we never wait for a page of one level while
+    // holding one of another, which writers do from the top down.
+    uint64_t total_entries = 0;
+    uint64_t total_capacity = 0;
+    for (uint32_t level = 0; level < IDXT_MAX_HEIGHT; level++)
+    {
+        IndexPage_t *page = LatchLeftmostPage(tree, level);
+        if (page == NULL)
+            break;
+        bool is_leaf = page->is_leaf;
+        uint64_t capacity = 0;
+        for (;;)
+        {
+            stats->level_pages[level]++;
+            stats->level_entries[level] += page->num_entries;
+            capacity += page->max_entries;
+            if (is_leaf && tree->non_unique)
+            {
+                for (uint32_t i = 0; i < page->num_entries; i++)
+                    stats->records += PagePosting(page, i)->count;
+            }
+            IndexPage_t *next = page->next != IDXT_NO_PAGE ? GetPage(tree, page->next) : NULL;
+            if (next != NULL)
+                LatchPage(tree, next, false);
+            UnlatchPage(tree, page, false);
+            ReleasePage(tree, page, false);
+            if (next == NULL)
+                break;
+            page = next;
+        }
+        stats->height = level + 1;
+        stats->level_fill[level] = capacity > 0 ? (double)stats->level_entries[level] / capacity : 0;
+        total_entries += stats->level_entries[level];
+        total_capacity += capacity;
+        if (is_leaf)
+        {
+            stats->leaf_pages = stats->level_pages[level];
+            if (!tree->non_unique)
+                stats->records = stats->level_entries[level];
+            break;
+        }
+        stats->nonleaf_pages += stats->level_pages[level];
+    }
+    stats->fill_factor = total_capacity > 0 ? (double)total_entries / total_capacity : 0;
+    // Every other page in use is part of a posting list. Under concurrent writers, the page counter may
+    // have moved on from the pages we counted.
+    uint64_t page_counter = __atomic_load_n(&tree->page_counter, __ATOMIC_RELAXED);
+    if (tree->non_unique && page_counter > stats->leaf_pages + stats->nonleaf_pages)
+        stats->posting_pages = page_counter - stats->leaf_pages - stats->nonleaf_pages;
+    if (tree->versions != NULL)
+    {
+        stats->page_versions = __atomic_load_n(&tree->versions->num_versions, __ATOMIC_RELAXED);
+        stats->reclaimed_versions = __atomic_load_n(&tree->versions->reclaimed, __ATOMIC_RELAXED);
+    }
+    if (tree->adaptive_hash != NULL)
+        stats->hash_entries = hidx_Count(tree->adaptive_hash);
+}
+
+void idxt_DisplayTree(IndexTree_t *tree)
+{
+    printf("Index tree:\n");
+    printf("\t Page size: %d\n", tree->page_size);
+    printf("\t Page count: %ld\n", tree->page_counter);
+    printf("\t Key size: %d\n", tree->key_size);
+    IndexPage_t *root = GetPage(tree, tree->root);
+    DisplayPage(tree, root, 0);
+    ReleasePage(tree, root, false);
+}
+
+bool CheckBufferFrames(uint32_t buffer_frames)
+{
+    // A split keeps a couple of pages pinned on every level it goes through, so a pool that can't hold
+    // that many pages at once would fail halfway through.
+    if (buffer_frames < IDXT_MIN_BUFFER_FRAMES)
+    {
+        fprintf(stderr, "Error in index tree: a buffer pool needs at least %d frames.\n", IDXT_MIN_BUFFER_FRAMES);
+        return false;
+    }
+    return true;
+}
+
+bool ReserveSuperblock(IndexTree_t *tree)
+{
+    // The superblock takes the first pages of the file, as many as it needs with small pages.
+    // The pages are back to back in the file, so the superblock can be read from its start in one go.
+    uint32_t frame_size = pool_FrameSize(tree->page_size);
+    for (uint32_t offset = 0; offset < sizeof(IndexSuperblock_t); offset += frame_size)
+    {
+        uint64_t page_id;
+        IndexPage_t *page = AllocPage(tree, &page_id);
+        if (page == NULL)
+        {
+            fprintf(stderr, "Error in index tree: unable to allocate superblock.\n");
+            return false;
+        }
+        ReleasePage(tree, page, true);
+    }
+    return true;
+}
+
+void WriteSuperblock(IndexTree_t *tree, bool clean)
+{
+    IndexSuperblock_t superblock;
+    memset(&superblock, 0, sizeof(IndexSuperblock_t));
+    superblock.magic = IDXT_FILE_MAGIC;
+    superblock.version = IDXT_FILE_VERSION;
+    superblock.page_size = tree->page_size;
+    superblock.key_size = tree->key_size;
+    superblock.key = tree->key_ops.desc;
+    superblock.non_unique = tree->non_unique;
+    superblock.compress_keys = tree->compress_keys;
+    superblock.wal = tree->log != NULL;
+    superblock.clean = clean;
+    superblock.root = tree->root;
+    superblock.page_counter = tree->page_counter;
+    if (tree->buffer != NULL)
+    {
+        superblock.num_frames = tree->buffer->num_pages;
+        superblock.free_head = tree->buffer->free_head;
+        superblock.num_free = tree->buffer->num_free;
+    }
+    else
+    {
+        superblock.num_frames = tree->pool->num_frames;
+        superblock.free_head = tree->pool->free_head;
+        superblock.num_free = tree->pool->num_free;
+    }
+
+    // The superblock is copied into its pages one page at a time, since in a buffer pool they are
+    // only back to back in the file.
+    uint32_t frame_size = pool_FrameSize(tree->page_size);
+    for (uint32_t offset = 0; offset < sizeof(IndexSuperblock_t); offset += frame_size)
+    {
+        IndexPage_t *page = GetPage(tree, offset / frame_size);
+        uint32_t size = sizeof(IndexSuperblock_t) - offset < frame_size ? sizeof(IndexSuperblock_t) - offset : frame_size;
+        memcpy(page, (uint8_t *)&superblock + offset, size);
+        ReleasePage(tree, page, true);
+    }
+}
+
+IndexPage_t *CreateEmptyPage(IndexTree_t *tree, bool is_leaf)
+{
+    // The header and both entry arrays live in one page_size frame from the arena, so a page is a single
+    // allocation and inserting into it never allocates. The frame number doubles as the page id.
+    // The new page is pinned, like a page from GetPage.
+    uint64_t frame;
+    IndexPage_t *page = AllocPage(tree, &frame);
+    if (page == NULL)
+    {
+        fprintf(stderr, "Error in index tree: unable to allocate page.\n");
+        exit(EXIT_FAILURE);
+    }
+    // A page an action creates is held by the action until it ends, like the pages it changes.
+    if (thread_action.tree == tree)
+        TrackNewPage(tree, page, frame, true);
+    page->is_leaf = is_leaf;
+    page->page_id = frame;
+    __atomic_fetch_add(&tree->page_counter, 1, __ATOMIC_RELAXED);
+    // If leaf page, data size is the size of RID(or of a posting, in a non-unique tree), else it's the size
+    // of the page id of another page.
+    if (page->is_leaf)
+    {
+        page->data_size = LeafDataSize(tree);
+    }
+    else
+    {
+        page->data_size = sizeof(uint64_t);
+    }
+    // The data array comes first so RIDs and child page ids stay naturally aligned,
+    // the key array follows right after it.
+    page->data_offset = DataOffset(tree);
+    // We need to calculate the number of entries in the page based on
+    // the size of the key, the size of the data, and the page size.
+    // Until it has keys to compress, a page keeps them in full.
+    page->prefix_size = 0;
+    page->key_end = tree->key_size;
+    page->max_entries = LayoutCapacity(tree, page, page->prefix_size, page->key_end);
+    page->keys_offset = page->data_offset + page->max_entries * page->data_size;
+    page->num_entries = 0;
+
+    return page;
+}
+
+uint32_t CalculateMaxEntries(IndexTree_t *tree, uint32_t data_size)
+{
+    // Number of entries a page takes with its keys in full.
+    uint32_t header_size = DataOffset(tree);
+    if (tree->page_size <= header_size)
+        return 0;
+    return (tree->page_size - header_size) / (tree->key_size + data_size);
+}
+
+uint32_t PrefixLimit(const IndexKeyOps_t *ops)
+{
+    // A key in the middle of a page shares the bytes the keys around it share, as long as equal columns have
+    // equal bytes, so a page only has to give up its prefix for a key that goes before or after all of its
+    // keys. Doubles don't keep to that, -0 and 0 are equal, so a prefix stops at the first one.
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < ops->desc.num_columns && ops->desc.columns[i].type != IDXK_TYPE_DOUBLE; i++)
+        offset += ops->desc.columns[i].size;
+    return offset;
+}
+
+static inline uint32_t DataOffset(IndexTree_t *tree)
+{
+    // The data array follows the header, and with key compression the key holding the shared bytes.
+    uint32_t offset = (sizeof(IndexPage_t) + 7) & ~7;
+    if (tree->compress_keys)
+        offset += (tree->key_size + 7) & ~7;
+    return offset;
+}
+
+uint32_t LayoutCapacity(IndexTree_t *tree, IndexPage_t *page, uint32_t prefix_size, uint32_t key_end)
+{
+    // Number of entries the page takes with bytes prefix_size to key_end of every key in the key array.
+    uint32_t capacity = (tree->page_size - page->data_offset) / (page->data_size + key_end - prefix_size);
+    // A key that comes up into a full non-leaf page from a split below may not share the bytes its keys
+    // share, and the half of the page it ends up in may then have to keep every key in full. So a non-leaf page
+    // takes at most twice, less two, the entries that fit in full, and either half fits, however many bytes
+    // it has to keep. A leaf page doesn't need that, a key that doesn't share its prefix goes before or after
+    // all of its keys, and can be split off on its own.
+    if (tree->compress_keys && !page->is_leaf)
+    {
+        uint32_t limit = 2 * (CalculateMaxEntries(tree, page->data_size) - 1);
+        if (capacity > limit)
+            capacity = limit;
+    }
+    return capacity;
+}
+
+static inline uint8_t *PageKey(IndexTree_t *tree, IndexPage_t *page, uint32_t pos)
+{
+    // The bytes kept in the key array for the key at pos, which are the whole key without key compression.
+    return (uint8_t *)page + page->keys_offset + (size_t)pos * KeyWidth(page);
+}
+
+static inline uint8_t *PageSharedKey(IndexPage_t *page)
+{
+    // With key compression, a whole key with the bytes every key of the page shares.
+    return (uint8_t *)page + ((sizeof(IndexPage_t) + 7) & ~7);
+}
+
+static inline uint32_t KeyWidth(IndexPage_t *page)
+{
+    return page->key_end - page->prefix_size;
+}
+
+static inline int CompareKeys(IndexTree_t *tree, const void *a, const void *b)
+{
+    return tree->key_ops.compare(&tree->key_ops, a, b);
+}
+
+void CopyPageKey(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, void *key)
+{
+    // Copies out the key at pos in full. With key compression it's put back together from the shared bytes
+    // and the bytes kept for it.
+    uint8_t *out = key;
+    if (!tree->compress_keys)
+    {
+        memcpy(out, PageKey(tree, page, pos), tree->key_size);
+        return;
+    }
+    const uint8_t *shared = PageSharedKey(page);
+    memcpy(out, shared, page->prefix_size);
+    memcpy(out + page->prefix_size, PageKey(tree, page, pos), KeyWidth(page));
+    memcpy(out + page->key_end, shared + page->key_end, tree->key_size - page->key_end);
+}
+
+static inline const uint8_t *ReadPageKey(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, uint8_t *buffer)
+{
+    // The key at pos in full: right in the page without key compression, or put back together in buffer.
+    if (!tree->compress_keys)
+        return PageKey(tree, page, pos);
+    CopyPageKey(tree, page, pos, buffer);
+    return buffer;
+}
+
+int ComparePageKey(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, const void *key)
+{
+    uint8_t buffer[tree->key_size];
+    return CompareKeys(tree, ReadPageKey(tree, page, pos, buffer), key);
+}
+
+uint32_t SearchPage(IndexTree_t *tree, IndexPage_t *page, uint32_t count, const void *key, bool upper)
+{
+    // Position of the first of the first count keys of the page that is equal to or higher than key,
+    // or with upper, of the first one higher than key.
+    IndexKeyOps_t *ops = &tree->key_ops;
+    if (!tree->compress_keys)
+        return upper ? ops->upper_bound(ops, PageKey(tree, page, 0), count, key) : ops->lower_bound(ops, PageKey(tree, page, 0), count, key);
+
+    // With key compression, a key that differs from the prefix every key of the page shares goes before
+    // or after all of them.
+    const uint8_t *search_key = key;
+    const uint8_t *shared = PageSharedKey(page);
+    int keycmp = idxk_CompareRange(ops, search_key, shared, 0, page->prefix_size);
+    if (keycmp != 0)
+        return keycmp < 0 ? 0 : count;
+    // Otherwise we search the bytes kept for every key. The keys that have the same bytes there as key
+    // only differ from it in the shared bytes after them, which decide whether they go before or after it.
+    keycmp = idxk_CompareRange(ops, search_key + page->key_end, shared + page->key_end, page->key_end, tree->key_size);
+    return idxk_SearchRange(ops, PageKey(tree, page, 0), count, search_key + page->prefix_size, page->prefix_size, page->key_end, upper ? keycmp >= 0 : keycmp > 0);
+}
+
+static inline uint32_t CommonPrefix(const uint8_t *a, const uint8_t *b, uint32_t limit)
+{
+    // Number of leading bytes a and b share, at most limit.
+    uint32_t same = 0;
+    while (same < limit && a[same] == b[same])
+        same++;
+    return same;
+}
+
+static inline uint32_t CommonSuffixStart(const uint8_t *a, const uint8_t *b, uint32_t from, uint32_t size)
+{
+    // Offset from which on a and b, size bytes each, share every byte, at least from.
+    uint32_t start = size;
+    while (start > from && a[start - 1] == b[start - 1])
+        start--;
+    return start;
+}
+
+void FitLayout(IndexTree_t *tree, IndexPage_t *page, const void *key, uint32_t *prefix_size, uint32_t *key_end)
+{
+    // The bytes of every key the page has to keep to take key as well: the shared bytes are cut back to the
+    // ones key shares with them. An empty page shares everything it can with key, up to the prefix limit,
+    // and in a non-leaf page, from there on.
+    *prefix_size = page->prefix_size;
+    *key_end = page->key_end;
+    if (!tree->compress_keys)
+        return;
+    if (page->num_entries == 0)
+    {
+        *prefix_size = tree->prefix_limit;
+        *key_end = page->is_leaf ? tree->key_size : tree->prefix_limit;
+        return;
+    }
+    const uint8_t *shared = PageSharedKey(page);
+    uint32_t same = CommonPrefix(shared, key, page->prefix_size);
+    if (same < page->prefix_size)
+        *prefix_size = idxk_CutBefore(&tree->key_ops, same);
+    if (!page->is_leaf)
+    {
+        uint32_t start = CommonSuffixStart(shared, key, page->key_end, tree->key_size);
+        if (start > page->key_end)
+            *key_end = idxk_CutAfter(&tree->key_ops, start);
+    }
+}
+
+bool KeyFitsLayout(IndexTree_t *tree, IndexPage_t *page, const void *key)
+{
+    // Whether key shares the bytes the keys of the page share, so it can go into the page as it is.
+    uint32_t prefix_size;
+    uint32_t key_end;
+    FitLayout(tree, page, key, &prefix_size, &key_end);
+    return prefix_size == page->prefix_size && key_end == page->key_end;
+}
+
+bool PageHasRoom(IndexTree_t *tree, IndexPage_t *page, const void *key)
+{
+    // Whether the page can take another entry with key without being split. With key compression, it may
+    // have to keep more bytes of every key to take key, and so take fewer entries.
+    uint32_t prefix_size;
+    uint32_t key_end;
+    FitLayout(tree, page, key, &prefix_size, &key_end);
+    return page->num_entries < LayoutCapacity(tree, page, prefix_size, key_end);
+}
+
+bool AbsorbsSplit(IndexTree_t *tree, IndexPage_t *page, void *key)
+{
+    // Whether a page on the way down to insert key can't be split by it, so nothing above it changes.
+    // A leaf page has to have room for key, a non-leaf page for one more entry from a split below it.
+    // With key compression we can't tell which key that is, so it has to have room for it in full.
+    if (page->is_leaf)
+        return PageHasRoom(tree, page, key);
+    if (tree->compress_keys)
+        return page->num_entries < CalculateMaxEntries(tree, page->data_size);
+    return page->num_entries < page->max_entries;
+}
+
+void SetPageLayout(IndexTree_t *tree, IndexPage_t *page, uint32_t prefix_size, uint32_t key_end)
+{
+    // Keeps more bytes of every key in the key array, from prefix_size, at most the current one, to key_end,
+    // at least the current one. The bytes added are shared ones, so they come from the shared key.
+    // The page has to have room for its entries in the new layout, which moves the key array.
+    uint32_t width = key_end - prefix_size;
+    uint32_t num_entries = page->num_entries;
+    uint8_t keys[(size_t)num_entries * width + 1];
+    const uint8_t *shared = PageSharedKey(page);
+    for (uint32_t i = 0; i < num_entries; i++)
+    {
+        uint8_t *key = keys + (size_t)i * width;
+        memcpy(key, shared + prefix_size, page->prefix_size - prefix_size);
+        memcpy(key + page->prefix_size - prefix_size, PageKey(tree, page, i), KeyWidth(page));
+        memcpy(key + page->key_end - prefix_size, shared + page->key_end, key_end - page->key_end);
+    }
+    page->prefix_size = prefix_size;
+    page->key_end = key_end;
+    page->max_entries = LayoutCapacity(tree, page, prefix_size, key_end);
+    page->keys_offset = page->data_offset + page->max_entries * page->data_size;
+    memcpy(PageKey(tree, page, 0), keys, (size_t)num_entries * width);
+}
+
+void InsertPageEntry(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, const void *key, const void *data)
+{
+    // Puts an entry into the page at pos, which has to have room for it.
+    // With key compression, the page first takes on a layout that fits key, if it doesn't yet.
+    // The first key of an empty page is the one whose bytes the page shares.
+    uint32_t prefix_size;
+    uint32_t key_end;
+    FitLayout(tree, page, key, &prefix_size, &key_end);
+    if (tree->compress_keys && page->num_entries == 0)
+        memcpy(PageSharedKey(page), key, tree->key_size);
+    if (prefix_size != page->prefix_size || key_end != page->key_end)
+        SetPageLayout(tree, page, prefix_size, key_end);
+
+    // We have to shift the other entries to the right using memmove and insert.
+    // Keys and data live in separate arrays, so both have to be shifted.
+    uint32_t width = KeyWidth(page);
+    uint32_t shift = page->num_entries - pos;
+    uint8_t *page_data = (uint8_t *)page + page->data_offset;
+    memmove(PageKey(tree, page, pos + 1), PageKey(tree, page, pos), (size_t)shift * width);
+    memmove(page_data + (size_t)(pos + 1) * page->data_size, page_data + (size_t)pos * page->data_size, (size_t)shift * page->data_size);
+    // Then we insert our entry at pos.
+    memcpy(PageKey(tree, page, pos), (const uint8_t *)key + page->prefix_size, width);
+    memcpy(page_data + (size_t)pos * page->data_size, data, page->data_size);
+    page->num_entries++;
+}
+
+void ReplacePageKey(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, const void *key)
+{
+    // Replaces the key at pos. The page has to have room for its entries in a layout that fits key.
+    uint32_t prefix_size;
+    uint32_t key_end;
+    FitLayout(tree, page, key, &prefix_size, &key_end);
+    if (prefix_size != page->prefix_size || key_end != page->key_end)
+        SetPageLayout(tree, page, prefix_size, key_end);
+    memcpy(PageKey(tree, page, pos), (const uint8_t *)key + page->prefix_size, KeyWidth(page));
+}
+
+void ShortestSeparator(IndexTree_t *tree, const uint8_t *low, const uint8_t *high, uint8_t *separator)
+{
+    // The key with the fewest leading bytes of its own that is at least low and below high, low being below
+    // high: the bytes of low up to the first cut point where the two differ, and the highest value after it.
+    // Every key that goes into a non-leaf page this way ends in the same bytes, which the page then shares.
+    memcpy(separator, low, tree->key_size);
+    uint32_t same = CommonPrefix(low, high, tree->key_size);
+    if (same == tree->key_size)
+        return;
+    uint32_t cut = idxk_CutAfter(&tree->key_ops, same + 1);
+    if (cut < tree->key_size && idxk_CompareRange(&tree->key_ops, low, high, 0, cut) < 0)
+        idxk_FillHighest(&tree->key_ops, separator, cut);
+}
+
+void PageSeparator(IndexTree_t *tree, IndexPage_t *left, IndexPage_t *right, uint8_t *separator)
+{
+    // The key for the left of two neighbouring pages in their parent: an upper bound for everything below the
+    // left page, and nothing below the right page, if any, is lower. That's the last key of the left page,
+    // or with key compression and leaf pages, the shortest key between the two pages.
+    CopyPageKey(tree, left, left->num_entries - 1, separator);
+    if (!tree->compress_keys || !left->is_leaf || right == NULL || right->num_entries == 0)
+        return;
+    uint8_t low[tree->key_size];
+    uint8_t high[tree->key_size];
+    memcpy(low, separator, tree->key_size);
+    CopyPageKey(tree, right, 0, high);
+    if (CompareKeys(tree, low, high) < 0)
+        ShortestSeparator(tree, low, high, separator);
+}
+
+static inline RecordID_t *PageRecordID(IndexPage_t *page, uint32_t pos)
+{
+    return (RecordID_t *)((uint8_t *)page + page->data_offset) + pos;
+}
+
+static inline uint64_t *PageChild(IndexPage_t *page, uint32_t pos)
+{
+    return (uint64_t *)((uint8_t *)page + page->data_offset) + pos;
+}
+
+static inline uint32_t LeafDataSize(IndexTree_t *tree)
+{
+    return tree->non_unique ? sizeof(IndexPosting_t) : sizeof(RecordID_t);
+}
+
+static inline IndexPage_t *GetPage(IndexTree_t *tree, uint64_t page_id)
+{
+    // In an arena, mapped or not, every page stays where it is for as long as the tree is open.
+    // In a buffer pool, the page is pinned in its frame until it's released.
+    if (tree->buffer == NULL)
+        return pool_Frame(tree->pool, page_id);
+    IndexPage_t *page = bp_Pin(tree->buffer, page_id);
+    if (page == NULL)
+    {
+        fprintf(stderr, "Error in index tree: unable to read page %ld.\n", page_id);
+        exit(EXIT_FAILURE);
+    }
+    return page;
+}
+
+static inline void ReleasePage(IndexTree_t *tree, IndexPage_t *page, bool dirty)
+{
+    // Every page from GetPage or CreateEmptyPage is released once we are done with it.
+    // If dirty, the page has been changed.
+    if (tree->buffer != NULL)
+        bp_Unpin(tree->buffer, page, dirty);
+}
+
+static inline void LatchPage(IndexTree_t *tree, IndexPage_t *page, bool exclusive)
+{
+    // An action already holds the pages it has changed. The pages it latches exclusively, it may change,
+    // so it takes them along.
+    bool in_action = thread_action.tree == tree;
+    if (in_action && FindActionPage(tree, page) != NULL)
+        return;
+    // The latch of a page is kept with its frame rather than in the page, so it never reaches the file.
+    latch_Acquire(tree->buffer != NULL ? bp_Latch(tree->buffer, page) : pool_Latch(tree->pool, page->page_id), exclusive);
+    if (exclusive)
+        SaveVersion(tree, page, page->page_id);
+    if (in_action && exclusive)
+        TrackPage(tree, page, page->page_id, true);
+}
+
+static inline void UnlatchPage(IndexTree_t *tree, IndexPage_t *page, bool exclusive)
+{
+    // A page an action has changed stays latched until the action ends.
+    if (thread_action.tree == tree && KeepPage(tree, page))
+        return;
+    latch_Release(tree->buffer != NULL ? bp_Latch(tree->buffer, page) : pool_Latch(tree->pool, page->page_id), exclusive);
+}
+
+static inline bool TryLatchPage(IndexTree_t *tree, IndexPage_t *page)
+{
+    // Latches a page exclusively, unless someone else holds its latch.
+    bool in_action = thread_action.tree == tree;
+    if (in_action && FindActionPage(tree, page) != NULL)
+        return true;
+    if (!latch_TryAcquireExclusive(tree->buffer != NULL ? bp_Latch(tree->buffer, page) : pool_Latch(tree->pool, page->page_id)))
+        return false;
+    SaveVersion(tree, page, page->page_id);
+    if (in_action)
+        TrackPage(tree, page, page->page_id, true);
+    return true;
+}
+
+void ReleasePath(IndexTree_t *tree, IndexPath_t *path, uint32_t held)
+{
+    // Lets go of the pages a writer held on to. The ones a split has gone through, from path->depth
+    // and up to held, have changed.
+    for (uint32_t i = 0; i < held; i++)
+    {
+        UnlatchPage(tree, path->pages[i], true);
+        ReleasePage(tree, path->pages[i], i >= path->depth);
+    }
+    path->depth = 0;
+}
+
+void *AllocPage(IndexTree_t *tree, uint64_t *page_id)
+{
+    if (tree->buffer != NULL)
+        return bp_New(tree->buffer, page_id);
+    return pool_Alloc(tree->pool, page_id);
+}
+
+IndexPage_t *FindLeafPage(IndexTree_t *tree, void *key, IndexLatchMode_t mode, IndexPath_t *path)
+{
+    // Walks from the root down to the leaf page where key belongs, and returns it pinned and latched,
+    // exclusively unless mode is INDEX_LATCH_SHARED.
+    // Without a key, we keep to the left-most child and end up in the first leaf page.
+    // With INDEX_LATCH_SPLIT or INDEX_LATCH_MERGE, the non-leaf pages a split or merge may reach are kept in path,
+    // and with INDEX_LATCH_EXCLUSIVE all of them.
+    //
+    // We use latch crabbing: the child is latched before the latch on its parent is let go of, so no
+    // page can change between the moment we pick the child and the moment we are on it.
+    uint64_t start = INDEX_TIMER_START(tree);
+    IndexPage_t *current = LatchRoot(tree, mode);
+    if (path != NULL)
+        path->depth = 0;
+    while (!current->is_leaf)
+    {
+        // Get the next page.
+        uint64_t next_id = key != NULL ? ProcessNonleafPage(tree, current, key) : (current->num_entries > 0 ? *PageChild(current, 0) : IDXT_NO_PAGE);
+        // We need to check for a missing page here in case there is an error in the tree structure.
+        if (next_id == IDXT_NO_PAGE)
+        {
+            // If there is no next page, it means that the last page was a non-leaf page, and there are no more
+            // child pages. In other words, we have a non-leaf page at level 0 and there is a severe error.
+            fprintf(stderr, "Error in index tree: non-leaf page at level 0.\n");
+            exit(EXIT_FAILURE);
+        }
+        // Whether a page is a leaf never changes while it's in the tree, and the latch on the parent keeps
+        // it in the tree, so we can look before we latch it.
+        IndexPage_t *next = GetPage(tree, next_id);
+        bool keep_path = mode == INDEX_LATCH_SPLIT || mode == INDEX_LATCH_MERGE || mode == INDEX_LATCH_EXCLUSIVE;
+        LatchPage(tree, next, keep_path || (mode == INDEX_LATCH_LEAF_EXCLUSIVE && next->is_leaf));
+
+        if (keep_path)
+        {
+            if (path->depth == IDXT_MAX_HEIGHT)
+            {
+                fprintf(stderr, "Error in index tree: tree exceeded %d levels.\n", IDXT_MAX_HEIGHT);
+                exit(EXIT_FAILURE);
+            }
+            path->pages[path->depth++] = current;
+            // A page with room for one more entry absorbs a split of its child, and a page with an entry to
+            // spare absorbs a merge of two of its children, so nothing above it can change.
+            if (mode == INDEX_LATCH_SPLIT ? AbsorbsSplit(tree, next, key) : mode == INDEX_LATCH_MERGE && next->num_entries > MinEntries(next))
+                ReleasePath(tree, path, path->depth);
+        }
+        else
+        {
+            UnlatchPage(tree, current, false);
+            ReleasePage(tree, current, false);
+        }
+        current = next;
+    }
+    INDEX_TIMER_STOP(tree, descent, start);
+    return current;
+}
+
+IndexPage_t *LatchRoot(IndexTree_t *tree, IndexLatchMode_t mode)
+{
+    // The root only changes while its page is latched exclusively, so once we have latched the page,
+    // we check that it's still the root. If not, the root was split, or handed down to its only child,
+    // while we got to it, and we try again.
+    for (;;)
+    {
+        uint64_t root_id = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+        IndexPage_t *root = GetPage(tree, root_id);
+        bool exclusive = mode != INDEX_LATCH_SHARED && (mode != INDEX_LATCH_LEAF_EXCLUSIVE || root->is_leaf);
+        // A root that was handed down may have been freed since, and the page id in its header overwritten,
+        // so we go by the id we read instead.
+        Latch_t *latch = tree->buffer != NULL ? bp_Latch(tree->buffer, root) : pool_Latch(tree->pool, root_id);
+        latch_Acquire(latch, exclusive);
+        // If the page is the root, but no longer the kind we latched it for, it has been split and become
+        // the root again since we looked, which is just as good a reason to try again.
+        if (__atomic_load_n(&tree->root, __ATOMIC_ACQUIRE) == root_id && (mode != INDEX_LATCH_LEAF_EXCLUSIVE || exclusive == root->is_leaf))
+        {
+            if (exclusive)
+                SaveVersion(tree, root, root_id);
+            if (exclusive && thread_action.tree == tree)
+                TrackPage(tree, root, root_id, true);
+            return root;
+        }
+        latch_Release(latch, exclusive);
+        ReleasePage(tree, root, false);
+    }
+}
+
+IndexPage_t *LatchRightmostLeaf(IndexTree_t *tree, void *key)
+{
+    // Returns the right-most leaf page, pinned and latched exclusively, if key goes at or past its end, or NULL
+    // if it doesn't, or the page isn't known. Like the root, the page only stops being the right-most leaf
+    // page while it's latched exclusively, so once we have latched it, we check that it still is.
+    uint64_t page_id = __atomic_load_n(&tree->rightmost_leaf, __ATOMIC_ACQUIRE);
+    if (page_id == IDXT_NO_PAGE)
+        return NULL;
+    IndexPage_t *page = GetPage(tree, page_id);
+    // The page may have been merged away and freed since, and handed out again, so we go by the id we read,
+    // and don't look at the page until we know it's still the one.
+    Latch_t *latch = tree->buffer != NULL ? bp_Latch(tree->buffer, page) : pool_Latch(tree->pool, page_id);
+    latch_Acquire(latch, true);
+    // Every key of the pages to the left is lower than the keys of the page, so going down from the root
+    // would end up here as well. An empty page is left to the descent.
+    if (__atomic_load_n(&tree->rightmost_leaf, __ATOMIC_ACQUIRE) == page_id && page->num_entries > 0 && ComparePageKey(tree, page, page->num_entries - 1, key) <= 0)
+    {
+        SaveVersion(tree, page, page_id);
+        if (thread_action.tree == tree)
+            TrackPage(tree, page, page_id, true);
+        return page;
+    }
+    latch_Release(latch, true);
+    ReleasePage(tree, page, false);
+    return NULL;
+}
+
+void NoteInsert(IndexTree_t *tree, IndexPage_t *page, void *key)
+{
+    // Counts the inserts in a row that go at or past the end of the right-most leaf page, the leaf page
+    // being the one key goes to, latched exclusively. Once there are enough, further ones aren't counted, so
+    // appends from many threads don't all write to the counter.
+    bool rightmost = page->next == IDXT_NO_PAGE;
+    bool append = rightmost && (page->num_entries == 0 || ComparePageKey(tree, page, page->num_entries - 1, key) <= 0);
+    uint32_t streak = __atomic_load_n(&tree->append_streak, __ATOMIC_RELAXED);
+    if (append && streak < IDXT_APPEND_STREAK)
+        __atomic_store_n(&tree->append_streak, streak + 1, __ATOMIC_RELAXED);
+    else if (!append && streak > 0)
+        __atomic_store_n(&tree->append_streak, 0, __ATOMIC_RELAXED);
+    // The page can't stop being the right-most leaf page while we hold its latch, so we may say it is.
+    if (rightmost && __atomic_load_n(&tree->rightmost_leaf, __ATOMIC_RELAXED) != page->page_id)
+        __atomic_store_n(&tree->rightmost_leaf, page->page_id, __ATOMIC_RELEASE);
+}
+
+uint64_t ProcessNonleafPage(IndexTree_t *tree, IndexPage_t *current, void *key)
+{
+    // A non-leaf page represents a sparse index, meaning that we simply have markers for different
+    // intervals of the key. Each entry holds the highest key value of its child page. If the key is less than
+    // or equal to the highest key value, it means that the record exists in one of the underlying child pages
+    // because keys are stored in sequence from left to right. If all the entries in the non-leaf page have a lower key, the key belongs to the last
+    // child, which covers everything above the second to last marker.
+    if (current->num_entries == 0)
+    {
+        // If we get here, the page has no children at all.
+        return IDXT_NO_PAGE;
+    }
+
+    // The markers are sorted, so we search for the first marker equal to or higher than the key.
+    // The last child is left out of the search, it's where we end up if no marker qualifies.
+    uint32_t pos = SearchPage(tree, current, current->num_entries - 1, key, false);
+    return *PageChild(current, pos);
+}
+
+bool ProcessLeafPage(IndexTree_t *tree, IndexPage_t *current, void *key, RecordID_t *rid)
+{
+    // The entries are sorted in ascending order,
+    // so we use binary search to find the first entry that isn't lower than the key.
+    // If that entry has the key, we found our record.
+    uint32_t pos = FindLowerBound(tree, current, key);
+    if (pos < current->num_entries && ComparePageKey(tree, current, pos, key) == 0)
+    {
+        GetLeafRecordID(tree, current, pos, rid);
+        return true;
+    }
+
+    // If we reach this, no record was found and we return false(not found).
+    return false;
+}
+
+void HeatLeafPage(IndexTree_t *tree, IndexPage_t *page)
+{
+    // Counts a lookup of a leaf page, latched, and hashes its keys once it's had IDXT_HASH_HEAT of them.
+    // Another lookup of the page may do the same at the same time, which only adds the keys twice.
+    uint32_t *heat = &tree->leaf_heat[page->page_id & (IDXT_HEAT_SLOTS - 1)];
+    uint32_t count = __atomic_load_n(heat, __ATOMIC_RELAXED) + 1;
+    if (count < IDXT_HASH_HEAT)
+    {
+        __atomic_store_n(heat, count, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_store_n(heat, 0, __ATOMIC_RELAXED);
+    HashLeafPage(tree, page);
+}
+
+void HashLeafPage(IndexTree_t *tree, IndexPage_t *page)
+{
+    // Adds the keys of a leaf page, latched, to the adaptive hash, with the record a lookup of each finds.
+    // A change takes its key out while it holds the page exclusively, so with our latch, no change to a key we
+    // add is under way, and every later one takes it out again.
+    // Keys shared by several entries are left out: a lookup finds the first of them, which may be in another
+    // page. So is the first key of every page but the left-most, which may be one of those.
+    // An insert of a key that is already there goes after the entries that have it, into the same page, so
+    // the record a lookup finds only changes with a delete or an update, and inserts take nothing out.
+    // A full hash isn't emptied for every page that gets hot, or with more hot pages than it takes, it would
+    // never hold more than the last few. It's emptied once the lookups that missed it are a few times what it
+    // holds, so a hot set that moved on gets in, at the cost of hashing every few lookups at most.
+    if (hidx_Count(tree->adaptive_hash) + page->num_entries > tree->adaptive_hash_limit)
+    {
+        uint64_t skipped = __atomic_add_fetch(&tree->hash_skipped, 1, __ATOMIC_RELAXED);
+        if (skipped * IDXT_HASH_HEAT < tree->adaptive_hash_limit * IDXT_HASH_RENEW)
+            return;
+        __atomic_store_n(&tree->hash_skipped, 0, __ATOMIC_RELAXED);
+        hidx_Clear(tree->adaptive_hash);
+    }
+    uint8_t buffer[tree->key_size];
+    uint32_t first = page->prev != IDXT_NO_PAGE ? 1 : 0;
+    for (uint32_t pos = first; pos < page->num_entries; pos++)
+    {
+        const uint8_t *key = ReadPageKey(tree, page, pos, buffer);
+        if ((pos > 0 && ComparePageKey(tree, page, pos - 1, key) == 0) || (pos + 1 < page->num_entries && ComparePageKey(tree, page, pos + 1, key) == 0))
+            continue;
+        RecordID_t rid;
+        GetLeafRecordID(tree, page, pos, &rid);
+        if (!hidx_Put(tree->adaptive_hash, key, &rid))
+            return;
+    }
+    INDEX_COUNT(tree, hashed_pages);
+}
+
+static inline void ForgetKey(IndexTree_t *tree, const void *key)
+{
+    // Called by every change to the record a lookup of key finds, with its leaf page latched exclusively,
+    // before the change.
+    if (tree->adaptive_hash != NULL)
+        hidx_Delete(tree->adaptive_hash, key);
+}
+
+int CompareBatchKeys(const void *a, const void *b, void *context)
+{
+    IndexBatch_t *batch = context;
+    uint32_t key_size = batch->tree->key_size;
+    return CompareKeys(batch->tree, (uint8_t *)batch->keys + (size_t)*(const uint32_t *)a * key_size, (uint8_t *)batch->keys + (size_t)*(const uint32_t *)b * key_size);
+}
+
+static inline void PrefetchPage(IndexTree_t *tree, IndexPage_t *page, uint64_t page_id)
+{
+    // Starts loading a page we are about to search, without waiting for it: the header, and the middle of
+    // the page, which is about where a binary search through the keys starts. We can't read the header to
+    // find the middle of the keys exactly, since that is the miss we are trying not to wait for.
+    // The latch is kept apart from the page in an arena, so it's fetched as well, to be written.
+    __builtin_prefetch(page, 0, 3);
+    __builtin_prefetch((uint8_t *)page + tree->page_size / 2, 0, 3);
+    if (tree->buffer == NULL)
+        __builtin_prefetch(pool_Latch(tree->pool, page_id), 1, 3);
+}
+
+uint32_t FindRecordGroup(IndexTree_t *tree, void *keys, uint32_t *order, uint32_t count, RecordID_t *rids, bool *found)
+{
+    // Looks up count keys, in sorted order through order, and at most INDEX_BATCH_WIDTH of them.
+    // We go down level by level. On each level we keep the distinct pages the keys went through, with the
+    // first key for each, so neighbouring keys that share a page only latch and search it once.
+    // Sorted keys reach the pages of a level from left to right, so taking the latches of a level in
+    // that order keeps to the order every other thread takes them in.
+    IndexPage_t *pages[INDEX_BATCH_WIDTH];
+    uint32_t first[INDEX_BATCH_WIDTH + 1];
+    uint32_t num_pages = 1;
+    pages[0] = LatchRoot(tree, INDEX_LATCH_SHARED);
+    first[0] = 0;
+    first[1] = count;
+    while (!pages[0]->is_leaf)
+    {
+        // Route every key to its child. Keys going to the same child are next to each other.
+        uint64_t child_ids[INDEX_BATCH_WIDTH];
+        uint32_t child_first[INDEX_BATCH_WIDTH + 1];
+        uint32_t num_children = 0;
+        for (uint32_t p = 0; p < num_pages; p++)
+        {
+            for (uint32_t k = first[p]; k < first[p + 1]; k++)
+            {
+                uint64_t child_id = ProcessNonleafPage(tree, pages[p], (uint8_t *)keys + (size_t)order[k] * tree->key_size);
+                if (child_id == IDXT_NO_PAGE)
+                {
+                    fprintf(stderr, "Error in index tree: non-leaf page at level 0.\n");
+                    exit(EXIT_FAILURE);
+                }
+                if (num_children == 0 || child_ids[num_children - 1] != child_id)
+                {
+                    child_ids[num_children] = child_id;
+                    child_first[num_children++] = k;
+                }
+            }
+        }
+        child_first[num_children] = count;
+
+        // Every child is prefetched before any of them is touched, so their misses overlap.
+        // Only then are they latched, which reads their latches, and their parents let go of.
+        IndexPage_t *children[INDEX_BATCH_WIDTH];
+        for (uint32_t c = 0; c < num_children; c++)
+        {
+            children[c] = GetPage(tree, child_ids[c]);
+            PrefetchPage(tree, children[c], child_ids[c]);
+        }
+        for (uint32_t c = 0; c < num_children; c++)
+            LatchPage(tree, children[c], false);
+        for (uint32_t p = 0; p < num_pages; p++)
+        {
+            UnlatchPage(tree, pages[p], false);
+            ReleasePage(tree, pages[p], false);
+        }
+        memcpy(pages, children, sizeof(IndexPage_t *) * num_children);
+        memcpy(first, child_first, sizeof(uint32_t) * (num_children + 1));
+        num_pages = num_children;
+    }
+
+    // A key past the end of its leaf page may still be in the next one, if it's shared by several entries
+    // and the ones in this page were deleted. That's rare, so those keys are looked up again on their own.
+    uint32_t num_found = 0;
+    uint32_t retry[INDEX_BATCH_WIDTH];
+    uint32_t num_retries = 0;
+    for (uint32_t p = 0; p < num_pages; p++)
+    {
+        IndexPage_t *page = pages[p];
+        for (uint32_t k = first[p]; k < first[p + 1]; k++)
+        {
+            uint32_t i = order[k];
+            void *key = (uint8_t *)keys + (size_t)i * tree->key_size;
+            found[i] = ProcessLeafPage(tree, page, key, &rids[i]);
+            num_found += found[i];
+            if (!found[i] && page->next != IDXT_NO_PAGE && (page->num_entries == 0 || ComparePageKey(tree, page, page->num_entries - 1, key) < 0))
+                retry[num_retries++] = i;
+        }
+        UnlatchPage(tree, page, false);
+        ReleasePage(tree, page, false);
+    }
+    for (uint32_t r = 0; r < num_retries; r++)
+    {
+        uint32_t i = retry[r];
+        found[i] = idxt_FindRecord(tree, (uint8_t *)keys + (size_t)i * tree->key_size, &rids[i]);
+        num_found += found[i];
+    }
+    return num_found;
+}
+
+uint32_t FindLowerBound(IndexTree_t *tree, IndexPage_t *page, void *key)
+{
+    // Position of the first entry with a key equal to or higher than key.
+    // Only leaf pages are searched this way, non-leaf pages are searched on the way down.
+    uint64_t start = INDEX_TIMER_START(tree);
+    uint32_t pos = SearchPage(tree, page, page->num_entries, key, false);
+    INDEX_TIMER_STOP(tree, leaf_search, start);
+    return pos;
+}
+
+uint32_t FindInsertPosition(IndexTree_t *tree, IndexPage_t *page, void *key)
+{
+    // We need to maintain order, so the new entry goes right before the first entry with a higher key.
+    // If there are none, it goes right after the entries in use.
+    uint64_t start = INDEX_TIMER_START(tree);
+    uint32_t pos = SearchPage(tree, page, page->num_entries, key, true);
+    INDEX_TIMER_STOP(tree, leaf_search, start);
+    return pos;
+}
+
+uint32_t InsertLeafPageEntry(IndexTree_t *tree, IndexPage_t *page, void *key, uint32_t page_num, uint32_t slot_num)
+{
+    // We need to maintain order, so first we need to position ourselves.
+    uint32_t isrt_pos = FindInsertPosition(tree, page, key);
+
+    // Then we insert our entry at isrt_pos.
+    RecordID_t rid;
+    rid.page_num = page_num;
+    rid.slot_num = slot_num;
+    uint8_t data[page->data_size];
+    FillLeafData(tree, data, &rid);
+    InsertPageEntry(tree, page, isrt_pos, key, data);
+    return isrt_pos;
+}
+
+void BalanceAndInsertLeafPageEntry(IndexTree_t *tree, IndexPath_t *path, IndexPage_t *page, void *key, uint32_t page_num, uint32_t slot_num)
+{
+    // We create the RecordID.
+    RecordID_t rid;
+    rid.page_num = page_num;
+    rid.slot_num = slot_num;
+
+    // To balance, we need to know the candidates and order them.
+    // We also need a split ratio: how should we divide the entries between the two pages?
+    //
+    // The algorithm for balancing is the following:
+    // 1. Order the entries in ascending sequence.
+    // 2. Based on the cut ratio, calculate the position of the split.
+    //    If, for example, 10 candidates, and a 50/50 split, then we should split the range 0..4 into the
+    //    first page, and range 5..9 into the second page. The ratio follows from the split policy of the tree,
+    //    and where the new entry goes.
+    // 3. In the parent, the previous entry pointing to the pre-split table need to be split into two entries:
+    //    - The lower-key table with key[4] as highest key(because they are ordered ascending).
+    //    - The higher-key table with key[9] as highest key.
+    // 4. If the parent table is full also, repeat from step 1.
+    uint8_t data[page->data_size];
+    FillLeafData(tree, data, &rid);
+    IndexEntries_t entries;
+    InitEntries(tree, &entries, page->data_size, page->num_entries + 1);
+    AddPageEntries(tree, &entries, page);
+    uint32_t pos = FindInsertPosition(tree, page, key);
+    InsertEntry(tree, &entries, pos, key, data);
+    IndexPage_t *new_page = SplitPage(tree, page, &entries, pos);
+    FreeEntries(&entries);
+    InsertSplitIntoParent(tree, path, page, new_page);
+    // If we split the right-most leaf page, the new page takes its place. The split is in the parent by now,
+    // and we still hold the latch of the page, so no one who goes straight to the new page gets there early.
+    if (new_page->next == IDXT_NO_PAGE)
+        __atomic_store_n(&tree->rightmost_leaf, new_page->page_id, __ATOMIC_RELEASE);
+    ReleasePage(tree, new_page, true);
+}
+
+void InsertNonleafPageEntry(IndexTree_t *tree, IndexPage_t *target, uint32_t pos, void *key, uint64_t child)
+{
+    InsertPageEntry(tree, target, pos, key, &child);
+}
+
+void InitEntries(IndexTree_t *tree, IndexEntries_t *entries, uint32_t data_size, uint32_t capacity)
+{
+    // Entries are laid out like a page without key compression: one key array and one data array.
+    entries->count = 0;
+    entries->data_size = data_size;
+    entries->keys = malloc((size_t)capacity * tree->key_size);
+    entries->data = malloc((size_t)capacity * data_size);
+    if (entries->keys == NULL || entries->data == NULL)
+    {
+        fprintf(stderr, "Error in index tree: out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void AddPageEntries(IndexTree_t *tree, IndexEntries_t *entries, IndexPage_t *page)
+{
+    // Adds every entry of the page, with its key in full, after the ones there.
+    for (uint32_t i = 0; i < page->num_entries; i++)
+        CopyPageKey(tree, page, i, EntryKey(tree, entries, entries->count + i));
+    memcpy(entries->data + (size_t)entries->count * entries->data_size, (uint8_t *)page + page->data_offset, (size_t)page->num_entries * entries->data_size);
+    entries->count += page->num_entries;
+}
+
+void InsertEntry(IndexTree_t *tree, IndexEntries_t *entries, uint32_t pos, const void *key, const void *data)
+{
+    // All the entries up to pos are kept where they are, the new one is placed at pos,
+    // and all the entries after pos are shifted one to the right.
+    uint32_t shift = entries->count - pos;
+    memmove(EntryKey(tree, entries, pos + 1), EntryKey(tree, entries, pos), (size_t)shift * tree->key_size);
+    memmove(entries->data + (size_t)(pos + 1) * entries->data_size, entries->data + (size_t)pos * entries->data_size, (size_t)shift * entries->data_size);
+    memcpy(EntryKey(tree, entries, pos), key, tree->key_size);
+    memcpy(entries->data + (size_t)pos * entries->data_size, data, entries->data_size);
+    entries->count++;
+}
+
+static inline uint8_t *EntryKey(IndexTree_t *tree, IndexEntries_t *entries, uint32_t pos)
+{
+    return entries->keys + (size_t)pos * tree->key_size;
+}
+
+void FreeEntries(IndexEntries_t *entries)
+{
+    free(entries->keys);
+    free(entries->data);
+}
+
+void EntriesLayout(IndexTree_t *tree, IndexPage_t *page, IndexEntries_t *entries, uint32_t first, uint32_t count, uint32_t *prefix_size, uint32_t *key_end)
+{
+    // The bytes of every key a page has to keep for count entries from first on: the ones the first and the
+    // last of them don't share, since the ones in between are in order, and for a non-leaf page the ones
+    // any of them doesn't share at the end.
+    *prefix_size = 0;
+    *key_end = tree->key_size;
+    if (!tree->compress_keys || count == 0)
+        return;
+    const uint8_t *low = EntryKey(tree, entries, first);
+    uint32_t same = CommonPrefix(low, EntryKey(tree, entries, first + count - 1), tree->prefix_limit);
+    *prefix_size = idxk_CutBefore(&tree->key_ops, same);
+    if (page->is_leaf)
+        return;
+    uint32_t start = *prefix_size;
+    for (uint32_t i = 1; i < count && start < tree->key_size; i++)
+        start = CommonSuffixStart(low, EntryKey(tree, entries, first + i), start, tree->key_size);
+    *key_end = idxk_CutAfter(&tree->key_ops, start);
+}
+
+bool EntriesFit(IndexTree_t *tree, IndexPage_t *page, IndexEntries_t *entries, uint32_t first, uint32_t count)
+{
+    // Whether count entries from first on fit into the page.
+    uint32_t prefix_size;
+    uint32_t key_end;
+    EntriesLayout(tree, page, entries, first, count, &prefix_size, &key_end);
+    return count <= LayoutCapacity(tree, page, prefix_size, key_end);
+}
+
+void StoreEntries(IndexTree_t *tree, IndexPage_t *page, IndexEntries_t *entries, uint32_t first, uint32_t count)
+{
+    // Replaces the entries of the page with count entries from first on, which have to fit into it.
+    uint32_t prefix_size;
+    uint32_t key_end;
+    EntriesLayout(tree, page, entries, first, count, &prefix_size, &key_end);
+    if (tree->compress_keys && count > 0)
+        memcpy(PageSharedKey(page), EntryKey(tree, entries, first), tree->key_size);
+    page->prefix_size = prefix_size;
+    page->key_end = key_end;
+    page->max_entries = LayoutCapacity(tree, page, prefix_size, key_end);
+    page->keys_offset = page->data_offset + page->max_entries * page->data_size;
+    page->num_entries = count;
+    uint32_t width = KeyWidth(page);
+    for (uint32_t i = 0; i < count; i++)
+        memcpy(PageKey(tree, page, i), EntryKey(tree, entries, first + i) + prefix_size, width);
+    memcpy((uint8_t *)page + page->data_offset, entries->data + (size_t)first * entries->data_size, (size_t)count * entries->data_size);
+}
+
+uint32_t ChooseSplit(IndexTree_t *tree, IndexPage_t *page, IndexEntries_t *entries, uint32_t preferred)
+{
+    // Number of entries to keep in the low page when dividing the entries between two pages like page,
+    // as close to preferred as both halves fit, or 0 if they don't fit anywhere.
+    // Without key compression, every entry takes the same room, so preferred is where we divide.
+    if (!tree->compress_keys)
+        return preferred;
+
+    // With key compression, the halves take as many bytes of every key as their first and last keys
+    // (and for non-leaf pages, the ones in between) don't share. We work out how many entries a low page
+    // takes for every point to divide at, and a high page, and go outwards from preferred to find one
+    // where both fit.
+    uint32_t count = entries->count;
+    uint32_t *low_capacity = malloc((size_t)(count + 1) * sizeof(uint32_t));
+    uint32_t *high_capacity = malloc((size_t)(count + 1) * sizeof(uint32_t));
+    if (low_capacity == NULL || high_capacity == NULL)
+    {
+        fprintf(stderr, "Error in index tree: out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    const uint8_t *first = EntryKey(tree, entries, 0);
+    const uint8_t *last = EntryKey(tree, entries, count - 1);
+    uint32_t start = 0;
+    for (uint32_t split = 1; split < count; split++)
+    {
+        // The low page holds entries 0 to split - 1.
+        const uint8_t *key = EntryKey(tree, entries, split - 1);
+        uint32_t prefix_size = idxk_CutBefore(&tree->key_ops, CommonPrefix(first, key, tree->prefix_limit));
+        uint32_t key_end = tree->key_size;
+        if (!page->is_leaf)
+        {
+            start = split == 1 ? prefix_size : CommonSuffixStart(first, key, start > prefix_size ? start : prefix_size, tree->key_size);
+            key_end = idxk_CutAfter(&tree->key_ops, start);
+        }
+        low_capacity[split] = LayoutCapacity(tree, page, prefix_size, key_end);
+    }
+    start = tree->key_size;
+    for (uint32_t split = count - 1; split > 0; split--)
+    {
+        // The high page holds entries split to count - 1.
+        const uint8_t *key = EntryKey(tree, entries, split);
+        uint32_t prefix_size = idxk_CutBefore(&tree->key_ops, CommonPrefix(key, last, tree->prefix_limit));
+        uint32_t key_end = tree->key_size;
+        if (!page->is_leaf)
+        {
+            start = split == count - 1 ? prefix_size : CommonSuffixStart(last, key, start > prefix_size ? start : prefix_size, tree->key_size);
+            key_end = idxk_CutAfter(&tree->key_ops, start);
+        }
+        high_capacity[split] = LayoutCapacity(tree, page, prefix_size, key_end);
+    }
+
+    uint32_t chosen = 0;
+    for (uint32_t distance = 0; chosen == 0 && distance < count; distance++)
+    {
+        if (preferred >= distance + 1 && preferred - distance < count && preferred - distance <= low_capacity[preferred - distance] && count - (preferred - distance) <= high_capacity[preferred - distance])
+            chosen = preferred - distance;
+        else if (distance > 0 && preferred + distance < count && preferred + distance <= low_capacity[preferred + distance] && count - (preferred + distance) <= high_capacity[preferred + distance])
+            chosen = preferred + distance;
+    }
+    free(low_capacity);
+    free(high_capacity);
+    return chosen;
+}
+
+uint32_t PreferredSplit(IndexTree_t *tree, IndexPage_t *page, uint32_t count, uint32_t pos)
+{
+    // Number of entries a split of page should leave in it, out of count entries with the new one at pos.
+    // We will use a 50/50 left-biased split by default. This means that if we have 9 candidates,
+    // 5 will be to the left and 4 will be to the right. Mathematically, we say that we floor
+    // the result of the divide, and we add the remainder to the left side.
+    uint32_t balanced = count / 2 + count % 2;
+    // Only a split of the right-most page of a level, with the new entry at its end, goes by the policy.
+    // That's where keys that only ever grow go, and the page left behind doesn't get any more of them.
+    if (page->next != IDXT_NO_PAGE || pos != count - 1)
+        return balanced;
+    if (tree->split_policy == IDXT_SPLIT_APPEND)
+        return count - 1;
+    if (tree->split_policy == IDXT_SPLIT_ADAPTIVE && __atomic_load_n(&tree->append_streak, __ATOMIC_RELAXED) >= IDXT_APPEND_STREAK)
+    {
+        uint32_t high_count = count / 10 > 1 ? count / 10 : 1;
+        return count - high_count > balanced ? count - high_count : balanced;
+    }
+    return balanced;
+}
+
+IndexPage_t *SplitPage(IndexTree_t *tree, IndexPage_t *page, IndexEntries_t *entries, uint32_t pos)
+{
+    // The entries are the ones of the page plus the new one, at pos, ordered in ascending sequence.
+    // With key compression, the halves may not fit where we'd like to divide them, and we move the split
+    // to where they do.
+    uint32_t preferred = PreferredSplit(tree, page, entries->count, pos);
+    uint32_t low_count = ChooseSplit(tree, page, entries, preferred);
+    if (low_count == 0)
+    {
+        fprintf(stderr, "Error in index tree: page %ld can't be split.\n", page->page_id);
+        exit(EXIT_FAILURE);
+    }
+
+    if (page->is_leaf)
+        INDEX_COUNT(tree, leaf_splits);
+    else
+        INDEX_COUNT(tree, nonleaf_splits);
+    if (preferred > entries->count / 2 + entries->count % 2)
+        INDEX_COUNT(tree, append_splits);
+
+    // We use the existing page as the low page, so we keep the lower key-partition of the candidates
+    // in the existing page.
+    StoreEntries(tree, page, entries, 0, low_count);
+
+    // We need to create a new page for the higher key-partition of the candidates.
+    IndexPage_t *new_page = CreateEmptyPage(tree, page->is_leaf);
+    // The new page goes right after the existing page in the chain of pages on this level.
+    new_page->prev = page->page_id;
+    new_page->next = page->next;
+    // Our page is latched, and latches are only taken from left to right along a level, so we can latch
+    // the page to the right of it to update its link.
+    if (page->next != IDXT_NO_PAGE)
+    {
+        IndexPage_t *next = GetPage(tree, page->next);
+        LatchPage(tree, next, true);
+        next->prev = new_page->page_id;
+        UnlatchPage(tree, next, true);
+        ReleasePage(tree, next, true);
+    }
+    page->next = new_page->page_id;
+    StoreEntries(tree, new_page, entries, low_count, entries->count - low_count);
+
+    return new_page;
+}
+
+void InsertSplitIntoParent(IndexTree_t *tree, IndexPath_t *path, IndexPage_t *low_page, IndexPage_t *high_page)
+{
+    uint8_t low_key[tree->key_size];
+    uint8_t high_key[tree->key_size];
+    PageSeparator(tree, low_page, high_page, low_key);
+    CopyPageKey(tree, high_page, high_page->num_entries - 1, high_key);
+
+    // If we split the root, there is no parent(non-leaf) page left on the path, so we need to create one.
+    // The new root gets one entry for each half, and the tree grows by one level.
+    // The new root is only published once it's complete. Until then, the old root stays latched, so
+    // anyone who gets to it waits and then finds that it's no longer the root.
+    if (path->depth == 0)
+    {
+        INDEX_COUNT(tree, root_splits);
+        IndexPage_t *root = CreateEmptyPage(tree, false);
+        InsertNonleafPageEntry(tree, root, 0, low_key, low_page->page_id);
+        InsertNonleafPageEntry(tree, root, 1, high_key, high_page->page_id);
+        SetRoot(tree, root->page_id);
+        ReleasePage(tree, root, true);
+        return;
+    }
+
+    // In the parent, the entry pointing to the pre-split page is split into two entries.
+    // The low page keeps the existing entry, but its highest key is now the highest key left in the low page.
+    // The high page inherits the previous key, which is still an upper bound for everything it holds.
+    // The parent is already pinned and latched on the path.
+    IndexPage_t *parent = path->pages[--path->depth];
+    uint32_t pos = GetNonleafPageEntry(parent, low_page);
+    uint8_t bound[tree->key_size];
+    CopyPageKey(tree, parent, pos, bound);
+    // The last entry of a page is never compared against, so its key may lag behind the keys below it.
+    // We take the highest of the two to keep the displayed keys truthful.
+    if (CompareKeys(tree, high_key, bound) > 0)
+        memcpy(bound, high_key, tree->key_size);
+
+    // Usually the parent has room for the new entry as it is.
+    if (KeyFitsLayout(tree, parent, low_key) && PageHasRoom(tree, parent, bound))
+    {
+        ReplacePageKey(tree, parent, pos, low_key);
+        InsertNonleafPageEntry(tree, parent, pos + 1, bound, high_page->page_id);
+        return;
+    }
+
+    // Otherwise we lay out its entries anew. If the parent is full also, it has to be split as well,
+    // and so on upwards. The children don't know their parent, so nothing below the split pages has to change.
+    IndexEntries_t entries;
+    InitEntries(tree, &entries, parent->data_size, parent->num_entries + 1);
+    AddPageEntries(tree, &entries, parent);
+    memcpy(EntryKey(tree, &entries, pos), low_key, tree->key_size);
+    InsertEntry(tree, &entries, pos + 1, bound, &high_page->page_id);
+    if (EntriesFit(tree, parent, &entries, 0, entries.count))
+    {
+        StoreEntries(tree, parent, &entries, 0, entries.count);
+        FreeEntries(&entries);
+        return;
+    }
+    IndexPage_t *new_page = SplitPage(tree, parent, &entries, pos + 1);
+    FreeEntries(&entries);
+    InsertSplitIntoParent(tree, path, parent, new_page);
+    ReleasePage(tree, new_page, true);
+}
+
+uint32_t GetNonleafPageEntry(IndexPage_t *source, IndexPage_t *target)
+{
+    // Walk through entries.
+    // If the entry points to target, return its position.
+    // A child always has an entry in its parent, so not finding it means the tree is corrupt.
+    for (uint32_t i = 0; i < source->num_entries; i++)
+    {
+        if (*PageChild(source, i) == target->page_id)
+        {
+            return i;
+        }
+    }
+
+    fprintf(stderr, "Error in index tree: page %ld is missing from its parent.\n", target->page_id);
+    exit(EXIT_FAILURE);
+}
+
+static inline uint32_t MinEntries(IndexPage_t *page)
+{
+    // A page with fewer entries than this, other than the root, is underfull.
+    return page->max_entries / 2;
+}
+
+static inline bool IsRoot(IndexTree_t *tree, IndexPage_t *page)
+{
+    // Only valid while the page is latched, since the root only changes under the latch of its page.
+    return __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE) == page->page_id;
+}
+
+uint32_t FindLeafPageEntry(IndexTree_t *tree, IndexPage_t *page, void *key, RecordID_t *rid)
+{
+    // Position of the entry with both key and rid, or INDEX_NO_ENTRY if it isn't in the page.
+    // In a non-unique tree, that's the entry of the key, if rid is in its list.
+    if (tree->non_unique)
+    {
+        uint32_t pos = FindPostingEntry(tree, page, key);
+        return pos != INDEX_NO_ENTRY && PostingContains(tree, PagePosting(page, pos), rid) ? pos : INDEX_NO_ENTRY;
+    }
+    // Entries with the same key are kept in the order they were added, not by RecordID,
+    // so we look through all of them.
+    for (uint32_t pos = FindLowerBound(tree, page, key); pos < page->num_entries && ComparePageKey(tree, page, pos, key) == 0; pos++)
+    {
+        RecordID_t *candidate = PageRecordID(page, pos);
+        if (candidate->page_num == rid->page_num && candidate->slot_num == rid->slot_num)
+            return pos;
+    }
+    return INDEX_NO_ENTRY;
+}
+
+uint32_t FindPostingEntry(IndexTree_t *tree, IndexPage_t *page, void *key)
+{
+    // In a non-unique tree, the position of the entry of key, or INDEX_NO_ENTRY if it isn't in the page.
+    // Always INDEX_NO_ENTRY in other trees, where every record has an entry of its own.
+    if (!tree->non_unique)
+        return INDEX_NO_ENTRY;
+    uint32_t pos = FindLowerBound(tree, page, key);
+    if (pos < page->num_entries && ComparePageKey(tree, page, pos, key) == 0)
+        return pos;
+    return INDEX_NO_ENTRY;
+}
+
+bool RemoveLeafPageRecord(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, RecordID_t *rid)
+{
+    // Removes a record from the leaf entry at pos, which has it. Returns true if the entry went with it,
+    // and false if it stays, with the other records of its posting list.
+    if (tree->non_unique && PagePosting(page, pos)->count > 1)
+    {
+        PostingRemove(tree, PagePosting(page, pos), rid);
+        return false;
+    }
+    if (tree->adaptive_hash != NULL)
+    {
+        uint8_t buffer[tree->key_size];
+        ForgetKey(tree, ReadPageKey(tree, page, pos, buffer));
+    }
+    RemovePageEntry(tree, page, pos);
+    return true;
+}
+
+IndexPage_t *FindLeafPageEntryToRight(IndexTree_t *tree, IndexPage_t *page, void *key, RecordID_t *rid, uint32_t *pos)
+{
+    // Looks for the entry in a leaf page, latched exclusively, and then along the chain of leaf pages for
+    // as long as they may hold the key. Returns the page with the entry, still latched, and its position
+    // through pos. Returns NULL if there is no such entry, having let go of every page.
+    for (;;)
+    {
+        *pos = FindLeafPageEntry(tree, page, key, rid);
+        if (*pos != INDEX_NO_ENTRY)
+            return page;
+        // Only if the key runs up to the end of the page can there be more of it in the next one.
+        // A page emptied by earlier deletes doesn't tell, so we look past it.
+        uint64_t next = page->num_entries == 0 || ComparePageKey(tree, page, page->num_entries - 1, key) <= 0 ? page->next : IDXT_NO_PAGE;
+        IndexPage_t *next_page = NULL;
+        if (next != IDXT_NO_PAGE)
+        {
+            next_page = GetPage(tree, next);
+            LatchPage(tree, next_page, true);
+        }
+        UnlatchPage(tree, page, true);
+        ReleasePage(tree, page, false);
+        if (next_page == NULL)
+            return NULL;
+        page = next_page;
+    }
+}
+
+IndexPage_t *FindLeafPageEntryOnPath(IndexTree_t *tree, IndexPath_t *path, IndexPage_t *page, void *key, RecordID_t *rid, uint32_t *pos)
+{
+    // Same as FindLeafPageEntryToRight, but with every page above the leaf page on the path, and the path
+    // kept up to date as we move right, so the page we end up on can be rebalanced.
+    for (;;)
+    {
+        *pos = FindLeafPageEntry(tree, page, key, rid);
+        if (*pos != INDEX_NO_ENTRY)
+            return page;
+        if (page->num_entries > 0 && ComparePageKey(tree, page, page->num_entries - 1, key) > 0)
+        {
+            UnlatchPage(tree, page, true);
+            ReleasePage(tree, page, false);
+            return NULL;
+        }
+        page = NextLeafPageOnPath(tree, path, page);
+        if (page == NULL)
+            return NULL;
+    }
+}
+
+IndexPage_t *NextLeafPageOnPath(IndexTree_t *tree, IndexPath_t *path, IndexPage_t *page)
+{
+    // Moves from a leaf page to the next one, with every page above it on the path. We go up to the
+    // first page that has a child right of the one we came from, and down its left-most children from there.
+    // The pages we leave haven't changed, and are let go of. The ones we enter are latched top-down,
+    // under their parent, the same way as on the way down from the root.
+    // Returns NULL if the page is the last one, having let go of it.
+    uint32_t level = path->depth;
+    IndexPage_t *child = page;
+    uint32_t pos = 0;
+    while (level > 0)
+    {
+        pos = GetNonleafPageEntry(path->pages[level - 1], child) + 1;
+        if (pos < path->pages[level - 1]->num_entries)
+            break;
+        child = path->pages[--level];
+    }
+    UnlatchPage(tree, page, true);
+    ReleasePage(tree, page, false);
+    for (uint32_t i = level; i < path->depth; i++)
+    {
+        UnlatchPage(tree, path->pages[i], true);
+        ReleasePage(tree, path->pages[i], false);
+    }
+    path->depth = level;
+    if (level == 0)
+        return NULL;
+
+    IndexPage_t *next = GetPage(tree, *PageChild(path->pages[level - 1], pos));
+    LatchPage(tree, next, true);
+    while (!next->is_leaf)
+    {
+        path->pages[path->depth++] = next;
+        next = GetPage(tree, *PageChild(next, 0));
+        LatchPage(tree, next, true);
+    }
+    return next;
+}
+
+void RemovePageEntry(IndexTree_t *tree, IndexPage_t *page, uint32_t pos)
+{
+    // The entries after pos are shifted one to the left in both arrays.
+    uint8_t *data = (uint8_t *)page + page->data_offset;
+    uint32_t shift = page->num_entries - pos - 1;
+    memmove(PageKey(tree, page, pos), PageKey(tree, page, pos + 1), (size_t)shift * KeyWidth(page));
+    memmove(data + (size_t)pos * page->data_size, data + (size_t)(pos + 1) * page->data_size, (size_t)shift * page->data_size);
+    page->num_entries--;
+}
+
+void RebalancePage(IndexTree_t *tree, IndexPath_t *path, IndexPage_t *page)
+{
+    // The page has just lost an entry. It's pinned and latched exclusively, and let go of here.
+    // Its parent, if it has to change, is the last page on the path.
+    if (IsRoot(tree, page))
+    {
+        // The root doesn't have to be half full. But a non-leaf root with a single child is of no use,
+        // so the child becomes the root, and the tree shrinks by one level. Anyone who got to the old
+        // root waits on its latch, and then finds that it's no longer the root.
+        if (!page->is_leaf && page->num_entries == 1)
+        {
+            INDEX_COUNT(tree, root_collapses);
+            SetRoot(tree, *PageChild(page, 0));
+            UnlatchPage(tree, page, true);
+            FreePage(tree, page);
+            return;
+        }
+        UnlatchPage(tree, page, true);
+        ReleasePage(tree, page, true);
+        return;
+    }
+    // A page that was still safe to take an entry from when we went down is never underfull,
+    // and it's the top of the path, so whenever we get here the parent is on the path.
+    if (page->num_entries >= MinEntries(page) || path->depth == 0)
+    {
+        UnlatchPage(tree, page, true);
+        ReleasePage(tree, page, true);
+        return;
+    }
+
+    // The page is underfull, so we pair it with a sibling under the same parent. The parent is latched,
+    // so nobody else can go down to either of them and change the parent under us.
+    IndexPage_t *parent = path->pages[path->depth - 1];
+    uint32_t pos = GetNonleafPageEntry(parent, page);
+    IndexPage_t *left;
+    IndexPage_t *right;
+    if (pos + 1 < parent->num_entries)
+    {
+        // Latches are taken from left to right along a level, so we can wait for the right sibling.
+        left = page;
+        right = GetPage(tree, *PageChild(parent, pos + 1));
+        LatchPage(tree, right, true);
+    }
+    else if (pos > 0)
+    {
+        // Waiting for the left sibling, though, while we hold the page, could deadlock with anyone going the
+        // usual way, like a cursor on the left sibling waiting for our page. So we only take it if it's free.
+        // Otherwise the page is left underfull, which only costs space, and a later delete evens it out.
+        left = GetPage(tree, *PageChild(parent, pos - 1));
+        if (!TryLatchPage(tree, left))
+        {
+            ReleasePage(tree, left, false);
+            UnlatchPage(tree, page, true);
+            ReleasePage(tree, page, true);
+            return;
+        }
+        right = page;
+        pos--;
+    }
+    else
+    {
+        // An only child, which can only happen with very small pages. Nothing to pair it with.
+        UnlatchPage(tree, page, true);
+        ReleasePage(tree, page, true);
+        return;
+    }
+
+    // The entries of both pages, in one list. The last entry of a non-leaf page is never compared against,
+    // so its key may lag behind the keys below it. Once entries follow it, it is compared against, so it gets
+    // the key of the left page in the parent, which does bound everything below it.
+    uint32_t total = left->num_entries + right->num_entries;
+    IndexEntries_t entries;
+    InitEntries(tree, &entries, left->data_size, total);
+    AddPageEntries(tree, &entries, left);
+    if (!left->is_leaf)
+        CopyPageKey(tree, parent, pos, EntryKey(tree, &entries, left->num_entries - 1));
+    AddPageEntries(tree, &entries, right);
+
+    if (EntriesFit(tree, left, &entries, 0, total))
+    {
+        // The two fit in one page, so they are merged, and the parent loses an entry,
+        // which may leave it underfull in turn.
+        MergePages(tree, parent, pos, left, right, &entries);
+        FreeEntries(&entries);
+        path->depth--;
+        RebalancePage(tree, path, parent);
+        return;
+    }
+
+    // Otherwise the sibling has entries to spare, and the entries are divided evenly between the two,
+    // left-biased like a split. Only the boundary between the pages moves, so only the key of the left page
+    // changes in the parent, and the parent keeps its number of entries.
+    // With key compression, the halves or the new key in the parent may not fit, and then the pages are
+    // left as they are, which only costs space.
+    uint32_t low_count = ChooseSplit(tree, left, &entries, total / 2 + total % 2);
+    if (low_count != 0)
+    {
+        uint8_t separator[tree->key_size];
+        uint8_t *low_key = EntryKey(tree, &entries, low_count - 1);
+        uint8_t *high_key = EntryKey(tree, &entries, low_count);
+        memcpy(separator, low_key, tree->key_size);
+        if (tree->compress_keys && left->is_leaf && CompareKeys(tree, low_key, high_key) < 0)
+            ShortestSeparator(tree, low_key, high_key, separator);
+        uint32_t prefix_size;
+        uint32_t key_end;
+        FitLayout(tree, parent, separator, &prefix_size, &key_end);
+        if (parent->num_entries <= LayoutCapacity(tree, parent, prefix_size, key_end))
+        {
+            StoreEntries(tree, left, &entries, 0, low_count);
+            StoreEntries(tree, right, &entries, low_count, total - low_count);
+            ReplacePageKey(tree, parent, pos, separator);
+            INDEX_COUNT(tree, redistributions);
+        }
+    }
+    FreeEntries(&entries);
+    UnlatchPage(tree, left, true);
+    ReleasePage(tree, left, true);
+    UnlatchPage(tree, right, true);
+    ReleasePage(tree, right, true);
+    path->depth--;
+    UnlatchPage(tree, parent, true);
+    ReleasePage(tree, parent, true);
+}
+
+void MergePages(IndexTree_t *tree, IndexPage_t *parent, uint32_t pos, IndexPage_t *left, IndexPage_t *right, IndexEntries_t *entries)
+{
+    // Moves every entry of the right page into the left page, at pos and pos + 1 in the parent, and frees
+    // the right page. Both are latched exclusively, and let go of here. The entries are the ones of both,
+    // which fit into the left page.
+    INDEX_COUNT(tree, merges);
+    StoreEntries(tree, left, entries, 0, entries->count);
+    // The right page drops out of the chain of pages on this level. The page after it is further right,
+    // so we can latch it to update its link. If there is none, the left page becomes the right-most one,
+    // which we say while we still hold the latch of the right page.
+    left->next = right->next;
+    if (left->is_leaf && left->next == IDXT_NO_PAGE)
+        __atomic_store_n(&tree->rightmost_leaf, left->page_id, __ATOMIC_RELEASE);
+    if (right->next != IDXT_NO_PAGE)
+    {
+        IndexPage_t *next = GetPage(tree, right->next);
+        LatchPage(tree, next, true);
+        next->prev = left->page_id;
+        UnlatchPage(tree, next, true);
+        ReleasePage(tree, next, true);
+    }
+    // The left page now covers the range of both, so it takes over the key of the right page,
+    // and the entry of the right page goes.
+    uint8_t key[tree->key_size];
+    CopyPageKey(tree, parent, pos + 1, key);
+    ReplacePageKey(tree, parent, pos, key);
+    RemovePageEntry(tree, parent, pos + 1);
+    UnlatchPage(tree, right, true);
+    FreePage(tree, right);
+    UnlatchPage(tree, left, true);
+    ReleasePage(tree, left, true);
+}
+
+uint32_t BulkLoadTarget(IndexBulkLoader_t *loader, IndexPage_t *page, void *key)
+{
+    // Number of entries we put into a page before moving on to the next one.
+    // A page needs at least two entries, or the non-leaf levels would never narrow down to a root.
+    // With key compression, that depends on the bytes its keys share, with key as well, if there is one.
+    uint32_t prefix_size = page->prefix_size;
+    uint32_t key_end = page->key_end;
+    if (key != NULL)
+        FitLayout(loader->tree, page, key, &prefix_size, &key_end);
+    uint32_t target = (uint32_t)(LayoutCapacity(loader->tree, page, prefix_size, key_end) * loader->fill_factor);
+    if (target < 2)
+        target = 2;
+    return target;
+}
+
+bool BulkLoadAppend(IndexBulkLoader_t *loader, uint32_t level, void *key, void *data)
+{
+    IndexTree_t *tree = loader->tree;
+    if (level >= IDXT_MAX_HEIGHT)
+    {
+        fprintf(stderr, "Error in index tree: bulk load exceeded %d levels.\n", IDXT_MAX_HEIGHT);
+        return false;
+    }
+    // The first entry for a level above the ones we have means the tree grows by one level.
+    if (level == loader->num_levels)
+    {
+        loader->levels[level].open = CreateEmptyPage(tree, false);
+        loader->num_levels++;
+    }
+
+    IndexBulkLevel_t *current = &loader->levels[level];
+    if (current->open->num_entries >= BulkLoadTarget(loader, current->open, key))
+    {
+        // The open page is full. The pending page before it won't change anymore, so it is handed
+        // to the parent level, and the open page takes its place as pending.
+        if (current->pending != NULL)
+        {
+            IndexPage_t *done = current->pending;
+            uint8_t separator[tree->key_size];
+            PageSeparator(tree, done, current->open, separator);
+            // In a parallel build, the leaf page goes into the run of the thread, and gets its parent later.
+            if (loader->run != NULL && level == 0)
+                AddRunPage(tree, loader->run, done->page_id, separator);
+            else if (!BulkLoadAppend(loader, level + 1, separator, &done->page_id))
+                return false;
+            ReleasePage(tree, done, true);
+        }
+        current->pending = current->open;
+        current->open = CreateEmptyPage(tree, current->pending->is_leaf);
+        current->open->prev = current->pending->page_id;
+        current->pending->next = current->open->page_id;
+    }
+
+    // Appending never shifts anything, the entry simply goes into the first unused slot.
+    InsertPageEntry(tree, current->open, current->open->num_entries, key, data);
+    return true;
+}
+
+bool BulkLoadFinish(IndexBulkLoader_t *loader)
+{
+    IndexTree_t *tree = loader->tree;
+    // We close the levels from the leaves and up. Closing a level may add entries to, or even create,
+    // the level above it, so num_levels is re-read on every iteration.
+    for (uint32_t level = 0; level < loader->num_levels; level++)
+    {
+        IndexBulkLevel_t *current = &loader->levels[level];
+        // The leaf level of a parallel build was closed by the threads that built it.
+        if (current->open == NULL)
+            continue;
+        // A level consisting of a single page, with no level above it, is the root.
+        if (current->pending == NULL && level == loader->num_levels - 1)
+        {
+            tree->root = current->open->page_id;
+            ReleasePage(tree, current->open, true);
+            current->open = NULL;
+            return true;
+        }
+
+        if (current->pending != NULL)
+        {
+            BulkLoadEvenOut(loader, current->pending, current->open);
+
+            // A page is only let go of once its parent has it, so on failure the loader still holds it.
+            IndexPage_t *done = current->pending;
+            uint8_t separator[tree->key_size];
+            PageSeparator(tree, done, current->open, separator);
+            if (!BulkLoadAppend(loader, level + 1, separator, &done->page_id))
+                return false;
+            current->pending = NULL;
+            ReleasePage(tree, done, true);
+        }
+        IndexPage_t *done = current->open;
+        uint8_t separator[tree->key_size];
+        PageSeparator(tree, done, NULL, separator);
+        if (!BulkLoadAppend(loader, level + 1, separator, &done->page_id))
+            return false;
+        current->open = NULL;
+        ReleasePage(tree, done, true);
+    }
+    return true;
+}
+
+void BulkLoadAbort(IndexBulkLoader_t *loader)
+{
+    IndexTree_t *tree = loader->tree;
+    // Every page is either held by a level of the loader or has already been handed to a page
+    // in the level above it, so freeing the held pages, with their children, frees everything.
+    for (uint32_t level = 0; level < loader->num_levels; level++)
+    {
+        if (loader->levels[level].pending != NULL)
+            DestroyPage(tree, loader->levels[level].pending);
+        if (loader->levels[level].open != NULL)
+            DestroyPage(tree, loader->levels[level].open);
+    }
+    // The empty root was left alone, so the tree is as empty as we found it.
+}
+
+bool CheckBulkLoad(IndexTree_t *tree, double fill_factor)
+{
+    // The tree is built from the leaves and up, so there can't be anything in it already.
+    IndexPage_t *root = GetPage(tree, tree->root);
+    bool empty = root->is_leaf && root->num_entries == 0;
+    ReleasePage(tree, root, false);
+    if (!empty)
+    {
+        fprintf(stderr, "Error in index tree: bulk load requires an empty tree.\n");
+        return false;
+    }
+    if (!(fill_factor > 0 && fill_factor <= 1))
+    {
+        fprintf(stderr, "Error in index tree: fill factor %f is out of range.\n", fill_factor);
+        return false;
+    }
+    return true;
+}
+
+bool BulkLoadRecord(IndexBulkLoader_t *loader, void *key, RecordID_t *rid, bool same_key)
+{
+    // Every record is appended to the right-most leaf. In a non-unique tree, the records of a key after the
+    // first go into the posting list of its entry, which is the last one appended, in the open leaf page.
+    IndexTree_t *tree = loader->tree;
+    if (tree->non_unique && same_key)
+    {
+        IndexPage_t *open = loader->levels[0].open;
+        if (!PostingAdd(tree, PagePosting(open, open->num_entries - 1), rid))
+        {
+            fprintf(stderr, "Error in index tree: bulk load input has a record twice.\n");
+            return false;
+        }
+        return true;
+    }
+    uint8_t data[LeafDataSize(tree)];
+    FillLeafData(tree, data, rid);
+    return BulkLoadAppend(loader, 0, key, data);
+}
+
+void BulkLoadEvenOut(IndexBulkLoader_t *loader, IndexPage_t *low, IndexPage_t *high)
+{
+    // The last page of a level, or of a run, gets whatever is left over, which may be very little.
+    // If one of two neighbouring pages is less than half full, we even it out with the other.
+    if (low->num_entries >= BulkLoadTarget(loader, low, NULL) / 2 && high->num_entries >= BulkLoadTarget(loader, high, NULL) / 2)
+        return;
+    IndexTree_t *tree = loader->tree;
+    uint32_t total = low->num_entries + high->num_entries;
+    IndexEntries_t entries;
+    InitEntries(tree, &entries, high->data_size, total);
+    AddPageEntries(tree, &entries, low);
+    AddPageEntries(tree, &entries, high);
+    uint32_t low_count = ChooseSplit(tree, low, &entries, total / 2 + total % 2);
+    if (low_count != 0)
+    {
+        StoreEntries(tree, low, &entries, 0, low_count);
+        StoreEntries(tree, high, &entries, low_count, total - low_count);
+    }
+    FreeEntries(&entries);
+}
+
+void BulkLoadFinishRun(IndexBulkLoader_t *loader)
+{
+    // Closes the leaf level of a parallel build like BulkLoadFinish does, but the last two pages go into
+    // the run as well. The separator after the last page depends on the first page of the next run, so it's
+    // left to the stitching.
+    IndexTree_t *tree = loader->tree;
+    IndexBulkLevel_t *leaves = &loader->levels[0];
+    if (leaves->pending != NULL)
+    {
+        BulkLoadEvenOut(loader, leaves->pending, leaves->open);
+        uint8_t separator[tree->key_size];
+        PageSeparator(tree, leaves->pending, leaves->open, separator);
+        AddRunPage(tree, loader->run, leaves->pending->page_id, separator);
+        ReleasePage(tree, leaves->pending, true);
+        leaves->pending = NULL;
+    }
+    AddRunPage(tree, loader->run, leaves->open->page_id, NULL);
+    ReleasePage(tree, leaves->open, true);
+    leaves->open = NULL;
+}
+
+void AddRunPage(IndexTree_t *tree, IndexBulkRun_t *run, uint64_t page_id, const void *separator)
+{
+    if (run->count == run->capacity)
+    {
+        run->capacity = run->capacity > 0 ? 2 * run->capacity : 64;
+        run->page_ids = realloc(run->page_ids, sizeof(uint64_t) * run->capacity);
+        run->separators = realloc(run->separators, (size_t)tree->key_size * run->capacity);
+        if (run->page_ids == NULL || run->separators == NULL)
+        {
+            fprintf(stderr, "Error in index tree: unable to allocate leaf run.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    run->page_ids[run->count] = page_id;
+    if (separator != NULL)
+        memcpy(run->separators + (size_t)run->count * tree->key_size, separator, tree->key_size);
+    run->count++;
+}
+
+void DestroyRun(IndexTree_t *tree, IndexBulkRun_t *run)
+{
+    // Frees the leaf pages of a run, with their posting lists, and the run itself.
+    for (uint32_t i = 0; i < run->count; i++)
+        DestroyPage(tree, GetPage(tree, run->page_ids[i]));
+    free(run->page_ids);
+    free(run->separators);
+    memset(run, 0, sizeof(IndexBulkRun_t));
+}
+
+bool ParallelBulkLoad(IndexTree_t *tree, IndexRecordSource_t source, void *context, double fill_factor, uint32_t num_threads)
+{
+    if (!CheckBulkLoad(tree, fill_factor))
+        return false;
+    if (num_threads == 0)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cores > 0 ? (uint32_t)cores : 1;
+    }
+    // In a buffer pool, every thread keeps a few pages pinned at once, and they all have to fit.
+    if (tree->buffer != NULL && num_threads > tree->buffer->num_frames / INDEX_BUILD_FRAMES)
+        num_threads = tree->buffer->num_frames / INDEX_BUILD_FRAMES;
+
+    IndexParallelBuild_t build;
+    memset(&build, 0, sizeof(IndexParallelBuild_t));
+    build.tree = tree;
+    build.fill_factor = fill_factor;
+    build.source = source;
+    build.context = context;
+    build.record_size = tree->key_size + sizeof(RecordID_t);
+    build.num_workers = num_threads;
+    build.workers = calloc(num_threads, sizeof(IndexBuildWorker_t));
+    if (build.workers == NULL)
+    {
+        fprintf(stderr, "Error in index tree: unable to allocate build threads.\n");
+        return false;
+    }
+    pthread_mutex_init(&build.lock, NULL);
+
+    // First, the threads take the records from the source between them, and each sorts its own in memory.
+    for (uint32_t w = 0; w < num_threads; w++)
+    {
+        build.workers[w].build = &build;
+        build.workers[w].id = w;
+        pthread_create(&build.workers[w].thread, NULL, CollectRecords, &build.workers[w]);
+    }
+    uint64_t total = 0;
+    bool failed = false;
+    for (uint32_t w = 0; w < num_threads; w++)
+    {
+        pthread_join(build.workers[w].thread, NULL);
+        total += build.workers[w].count;
+        failed |= build.workers[w].failed;
+    }
+
+    // Then the records are cut into ranges of keys, and each range is built into a run of leaf pages by a
+    // thread of its own. An empty input makes an empty leaf page, like it does for idxt_BulkLoad.
+    if (!failed && total == 0)
+    {
+        IndexPage_t *leaf = CreateEmptyPage(tree, true);
+        tree->root = leaf->page_id;
+        ReleasePage(tree, leaf, true);
+    }
+    else if (!failed)
+    {
+        build.num_ranges = total / INDEX_BUILD_MIN_RANGE < num_threads ? (uint32_t)(total / INDEX_BUILD_MIN_RANGE) : num_threads;
+        if (build.num_ranges == 0)
+            build.num_ranges = 1;
+        build.bounds = malloc(sizeof(uint64_t) * (build.num_ranges + 1) * num_threads);
+        if (build.bounds == NULL)
+        {
+            fprintf(stderr, "Error in index tree: unable to allocate key ranges.\n");
+            failed = true;
+        }
+        else
+        {
+            PartitionRecords(&build);
+            for (uint32_t r = 0; r < build.num_ranges; r++)
+                pthread_create(&build.workers[r].thread, NULL, BuildRun, &build.workers[r]);
+            for (uint32_t r = 0; r < build.num_ranges; r++)
+            {
+                pthread_join(build.workers[r].thread, NULL);
+                failed |= build.workers[r].failed;
+            }
+        }
+        // Last, the runs are joined into one level of leaf pages, and the levels above built over it.
+        if (!failed)
+            failed = !StitchRuns(&build);
+        for (uint32_t r = 0; r < build.num_ranges; r++)
+        {
+            if (failed)
+                DestroyRun(tree, &build.workers[r].run);
+            free(build.workers[r].run.page_ids);
+            free(build.workers[r].run.separators);
+        }
+    }
+
+    for (uint32_t w = 0; w < num_threads; w++)
+        free(build.workers[w].records);
+    free(build.workers);
+    free(build.bounds);
+    pthread_mutex_destroy(&build.lock);
+    return !failed;
+}
+
+void *CollectRecords(void *arg)
+{
+    // Takes records from the source a batch at a time, until it runs dry, and sorts them. The source is
+    // only ever called by one thread at a time, but the sorting is spread over all of them.
+    IndexBuildWorker_t *worker = arg;
+    IndexParallelBuild_t *build = worker->build;
+    IndexTree_t *tree = build->tree;
+    for (bool exhausted = false; !exhausted;)
+    {
+        if (worker->count + INDEX_BUILD_BATCH > worker->capacity)
+        {
+            uint64_t capacity = worker->capacity > 0 ? 2 * worker->capacity : INDEX_BUILD_BATCH;
+            uint8_t *records = realloc(worker->records, capacity * build->record_size);
+            if (records == NULL)
+            {
+                fprintf(stderr, "Error in index tree: unable to allocate build records.\n");
+                worker->failed = true;
+                pthread_mutex_lock(&build->lock);
+                build->exhausted = true;
+                pthread_mutex_unlock(&build->lock);
+                return NULL;
+            }
+            worker->records = records;
+            worker->capacity = capacity;
+        }
+        pthread_mutex_lock(&build->lock);
+        uint32_t taken = 0;
+        while (!build->exhausted && taken < INDEX_BUILD_BATCH)
+        {
+            uint8_t *record = worker->records + (worker->count + taken) * build->record_size;
+            RecordID_t rid;
+            if (!build->source(build->context, record, &rid))
+            {
+                build->exhausted = true;
+                break;
+            }
+            memcpy(record + tree->key_size, &rid, sizeof(RecordID_t));
+            taken++;
+        }
+        exhausted = build->exhausted;
+        pthread_mutex_unlock(&build->lock);
+        worker->count += taken;
+    }
+    qsort_r(worker->records, worker->count, build->record_size, CompareBulkRecords, tree);
+    return NULL;
+}
+
+void PartitionRecords(IndexParallelBuild_t *build)
+{
+    // Cuts the keys into ranges of about as many records each. Every thread gives a sample of evenly spaced
+    // records, the sample is sorted, and the keys at even steps through it are where the ranges start.
+    // Each thread's records are sorted, so where a range starts in them is found with a binary search.
+    // The ranges are cut by key alone, so all the records of a key are in the same range, and in a
+    // non-unique tree, in the same posting list.
+    IndexTree_t *tree = build->tree;
+    uint32_t num_workers = build->num_workers;
+    uint32_t record_size = build->record_size;
+    uint8_t *samples = malloc((size_t)num_workers * INDEX_BUILD_SAMPLES * record_size);
+    if (samples == NULL)
+    {
+        fprintf(stderr, "Error in index tree: unable to allocate key sample.\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t num_samples = 0;
+    for (uint32_t w = 0; w < num_workers; w++)
+    {
+        IndexBuildWorker_t *worker = &build->workers[w];
+        for (uint32_t i = 0; i < INDEX_BUILD_SAMPLES && worker->count > 0; i++)
+        {
+            uint64_t pos = worker->count * i / INDEX_BUILD_SAMPLES;
+            memcpy(samples + (size_t)num_samples * record_size, worker->records + pos * record_size, record_size);
+            num_samples++;
+        }
+    }
+    qsort_r(samples, num_samples, record_size, CompareBulkRecords, tree);
+
+    for (uint32_t w = 0; w < num_workers; w++)
+    {
+        build->bounds[w] = 0;
+        build->bounds[build->num_ranges * num_workers + w] = build->workers[w].count;
+    }
+    for (uint32_t r = 1; r < build->num_ranges; r++)
+    {
+        const uint8_t *start = samples + (size_t)num_samples * r / build->num_ranges * record_size;
+        for (uint32_t w = 0; w < num_workers; w++)
+        {
+            IndexBuildWorker_t *worker = &build->workers[w];
+            uint64_t low = 0;
+            uint64_t high = worker->count;
+            while (low < high)
+            {
+                uint64_t middle = low + (high - low) / 2;
+                if (CompareKeys(tree, worker->records + middle * record_size, start) < 0)
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+            build->bounds[r * num_workers + w] = low;
+        }
+    }
+    free(samples);
+}
+
+void *BuildRun(void *arg)
+{
+    // Builds the leaf pages of one key range. The range is spread over the sorted records of every thread,
+    // which are merged through a heap of the threads, ordered by the next record each has in the range.
+    IndexBuildWorker_t *worker = arg;
+    IndexParallelBuild_t *build = worker->build;
+    IndexTree_t *tree = build->tree;
+    uint32_t num_workers = build->num_workers;
+    uint64_t positions[num_workers];
+    uint64_t ends[num_workers];
+    uint32_t heap[num_workers];
+    uint32_t size = 0;
+    for (uint32_t w = 0; w < num_workers; w++)
+    {
+        positions[w] = build->bounds[worker->id * num_workers + w];
+        ends[w] = build->bounds[(worker->id + 1) * num_workers + w];
+        if (positions[w] < ends[w])
+            heap[size++] = w;
+    }
+    for (uint32_t i = size / 2; i-- > 0;)
+        SiftRecords(build, heap, size, i, positions);
+
+    IndexBulkLoader_t loader;
+    memset(&loader, 0, sizeof(IndexBulkLoader_t));
+    loader.tree = tree;
+    loader.fill_factor = build->fill_factor;
+    loader.num_levels = 1;
+    loader.levels[0].open = CreateEmptyPage(tree, true);
+    loader.run = &worker->run;
+
+    const uint8_t *last_key = NULL;
+    while (size > 0)
+    {
+        uint32_t w = heap[0];
+        uint8_t *record = build->workers[w].records + positions[w] * build->record_size;
+        RecordID_t rid;
+        memcpy(&rid, record + tree->key_size, sizeof(RecordID_t));
+        if (!BulkLoadRecord(&loader, record, &rid, last_key != NULL && CompareKeys(tree, record, last_key) == 0))
+        {
+            BulkLoadAbort(&loader);
+            DestroyRun(tree, &worker->run);
+            worker->failed = true;
+            return NULL;
+        }
+        last_key = record;
+        if (++positions[w] == ends[w])
+            heap[0] = heap[--size];
+        SiftRecords(build, heap, size, 0, positions);
+    }
+
+    // A range can be empty when a few keys have most of the records.
+    if (loader.levels[0].open->num_entries == 0)
+        DestroyPage(tree, loader.levels[0].open);
+    else
+        BulkLoadFinishRun(&loader);
+    return NULL;
+}
+
+void SiftRecords(IndexParallelBuild_t *build, uint32_t *heap, uint32_t size, uint32_t node, const uint64_t *positions)
+{
+    // Moves the thread at node down the heap, until the next records of its children are both higher.
+    if (node >= size)
+        return;
+    for (;;)
+    {
+        uint32_t lowest = node;
+        const uint8_t *lowest_record = build->workers[heap[node]].records + positions[heap[node]] * build->record_size;
+        for (uint32_t child = 2 * node + 1; child <= 2 * node + 2 && child < size; child++)
+        {
+            const uint8_t *record = build->workers[heap[child]].records + positions[heap[child]] * build->record_size;
+            if (CompareBulkRecords(record, lowest_record, build->tree) < 0)
+            {
+                lowest = child;
+                lowest_record = record;
+            }
+        }
+        if (lowest == node)
+            return;
+        uint32_t swap = heap[node];
+        heap[node] = heap[lowest];
+        heap[lowest] = swap;
+        node = lowest;
+    }
+}
+
+bool StitchRuns(IndexParallelBuild_t *build)
+{
+    // The runs are in key order, so putting them side by side makes the leaf level. Where two runs meet,
+    // the pages are linked, and evened out if one of them has few entries. Then every leaf page is handed
+    // to the level above, with the separators the runs kept, and the rest of the tree is built over them
+    // the same way idxt_BulkLoad builds it.
+    IndexTree_t *tree = build->tree;
+    IndexBulkLoader_t loader;
+    memset(&loader, 0, sizeof(IndexBulkLoader_t));
+    loader.tree = tree;
+    loader.fill_factor = build->fill_factor;
+    loader.num_levels = 1;
+
+    IndexBulkRun_t *prev = NULL;
+    uint64_t num_leaves = 0;
+    for (uint32_t r = 0; r < build->num_ranges; r++)
+    {
+        IndexBulkRun_t *run = &build->workers[r].run;
+        num_leaves += run->count;
+        if (run->count == 0)
+            continue;
+        if (prev != NULL)
+        {
+            IndexPage_t *low = GetPage(tree, prev->page_ids[prev->count - 1]);
+            IndexPage_t *high = GetPage(tree, run->page_ids[0]);
+            low->next = high->page_id;
+            high->prev = low->page_id;
+            BulkLoadEvenOut(&loader, low, high);
+            uint8_t separator[tree->key_size];
+            PageSeparator(tree, low, high, separator);
+            memcpy(prev->separators + (size_t)(prev->count - 1) * tree->key_size, separator, tree->key_size);
+            ReleasePage(tree, low, true);
+            ReleasePage(tree, high, true);
+        }
+        prev = run;
+    }
+
+    // A single leaf page is the whole tree.
+    if (num_leaves == 1)
+    {
+        tree->root = prev->page_ids[0];
+        return true;
+    }
+
+    bool failed = false;
+    for (uint32_t r = 0; r < build->num_ranges; r++)
+    {
+        IndexBulkRun_t *run = &build->workers[r].run;
+        for (uint32_t i = 0; i < run->count; i++)
+        {
+            // A page the level above didn't take is freed here, along with the rest of the runs, since
+            // BulkLoadAbort only frees the pages that were handed to it.
+            if (failed)
+            {
+                DestroyPage(tree, GetPage(tree, run->page_ids[i]));
+                continue;
+            }
+            uint8_t separator[tree->key_size];
+            if (run == prev && i == run->count - 1)
+            {
+                IndexPage_t *last = GetPage(tree, run->page_ids[i]);
+                PageSeparator(tree, last, NULL, separator);
+                ReleasePage(tree, last, false);
+            }
+            else
+                memcpy(separator, run->separators + (size_t)i * tree->key_size, tree->key_size);
+            if (!BulkLoadAppend(&loader, 1, separator, &run->page_ids[i]))
+            {
+                BulkLoadAbort(&loader);
+                DestroyPage(tree, GetPage(tree, run->page_ids[i]));
+                failed = true;
+            }
+        }
+        run->count = 0;
+    }
+    if (failed)
+        return false;
+    if (!BulkLoadFinish(&loader))
+    {
+        BulkLoadAbort(&loader);
+        return false;
+    }
+    return true;
+}
+
+int CompareBulkRecords(const void *a, const void *b, void *context)
+{
+    // In a non-unique tree, the records of a key are sorted as well, so they are appended to its posting
+    // list in order.
+    IndexTree_t *tree = context;
+    int result = CompareKeys(tree, a, b);
+    if (result != 0 || !tree->non_unique)
+        return result;
+    RecordID_t rid_a;
+    RecordID_t rid_b;
+    memcpy(&rid_a, (const uint8_t *)a + tree->key_size, sizeof(RecordID_t));
+    memcpy(&rid_b, (const uint8_t *)b + tree->key_size, sizeof(RecordID_t));
+    uint64_t value_a = PackRecordID(&rid_a);
+    uint64_t value_b = PackRecordID(&rid_b);
+    return value_a < value_b ? -1 : value_a > value_b;
+}
+
+bool SortedRecordSource(void *context, void *key, RecordID_t *rid)
+{
+    // Splits a sort record back into the key and its RecordID.
+    ExternalSort_t *sort = context;
+    uint32_t key_size = sort->record_size - sizeof(RecordID_t);
+    const uint8_t *record = xsort_Next(sort);
+    if (record == NULL)
+        return false;
+    memcpy(key, record, key_size);
+    memcpy(rid, record + key_size, sizeof(RecordID_t));
+    return true;
+}
+
+static inline IndexPosting_t *PagePosting(IndexPage_t *page, uint32_t pos)
+{
+    return (IndexPosting_t *)((uint8_t *)page + page->data_offset) + pos;
+}
+
+static inline IndexPostingPage_t *GetPostingPage(IndexTree_t *tree, uint64_t page_id)
+{
+    // Posting pages have no latches of their own, they change under the latch of their leaf page.
+    // An action takes them along as it reads them, in case it changes them, and so are they kept for the
+    // snapshots.
+    IndexPostingPage_t *page = (IndexPostingPage_t *)GetPage(tree, page_id);
+    SaveVersion(tree, page, page_id);
+    if (thread_action.tree == tree && FindActionPage(tree, page) == NULL)
+        TrackPage(tree, page, page_id, false);
+    return page;
+}
+
+static inline void ReleasePostingPage(IndexTree_t *tree, IndexPostingPage_t *page, bool dirty)
+{
+    if (thread_action.tree == tree)
+        KeepPage(tree, page);
+    ReleasePage(tree, (IndexPage_t *)page, dirty);
+}
+
+static inline uint64_t PackRecordID(const RecordID_t *rid)
+{
+    // Orders records by page_num, then slot_num.
+    return (uint64_t)rid->page_num << 32 | rid->slot_num;
+}
+
+static inline void UnpackRecordID(uint64_t value, RecordID_t *rid)
+{
+    rid->page_num = value >> 32;
+    rid->slot_num = (uint32_t)value;
+}
+
+static inline uint8_t *PostingData(IndexPostingPage_t *page)
+{
+    return (uint8_t *)page + sizeof(IndexPostingPage_t);
+}
+
+static inline uint32_t VarintSize(uint64_t value)
+{
+    uint32_t size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static inline uint32_t EncodeVarint(uint8_t *out, uint64_t value)
+{
+    // 7 bits per byte, lowest first. The high bit of a byte tells that another one follows.
+    uint32_t size = 0;
+    while (value >= 0x80)
+    {
+        out[size++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    out[size++] = (uint8_t)value;
+    return size;
+}
+
+static inline uint32_t DecodeVarint(const uint8_t *in, uint64_t *value)
+{
+    uint32_t size = 0;
+    uint32_t shift = 0;
+    *value = 0;
+    do
+    {
+        *value |= (uint64_t)(in[size] & 0x7f) << shift;
+        shift += 7;
+    } while (in[size++] & 0x80);
+    return size;
+}
+
+void FillLeafData(IndexTree_t *tree, void *data, const RecordID_t *rid)
+{
+    // The data of a new leaf entry for a single record.
+    if (tree->non_unique)
+    {
+        IndexPosting_t posting;
+        memset(&posting, 0, sizeof(IndexPosting_t));
+        posting.count = 1;
+        posting.rid = *rid;
+        memcpy(data, &posting, sizeof(IndexPosting_t));
+    }
+    else
+        memcpy(data, rid, sizeof(RecordID_t));
+}
+
+void GetLeafRecordID(IndexTree_t *tree, IndexPage_t *page, uint32_t pos, RecordID_t *rid)
+{
+    // The record of a leaf entry, or the first one of its posting list.
+    if (!tree->non_unique)
+    {
+        *rid = *PageRecordID(page, pos);
+        return;
+    }
+    IndexPosting_t *posting = PagePosting(page, pos);
+    if (posting->count == 1)
+    {
+        *rid = posting->rid;
+        return;
+    }
+    IndexPostingPage_t *head = GetPostingPage(tree, posting->head);
+    UnpackRecordID(head->first, rid);
+    ReleasePostingPage(tree, head, false);
+}
+
+IndexPostingPage_t *CreatePostingPage(IndexTree_t *tree, uint64_t value)
+{
+    // A new posting page with a single record. Like CreateEmptyPage, it's returned pinned.
+    uint64_t page_id;
+    IndexPostingPage_t *page = AllocPage(tree, &page_id);
+    if (page == NULL)
+    {
+        fprintf(stderr, "Error in index tree: unable to allocate page.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (thread_action.tree == tree)
+        TrackNewPage(tree, page, page_id, false);
+    __atomic_fetch_add(&tree->page_counter, 1, __ATOMIC_RELAXED);
+    page->page_id = page_id;
+    page->next = IDXT_NO_PAGE;
+    page->tail = page_id;
+    page->first = value;
+    page->last = value;
+    page->count = 1;
+    page->used = 0;
+    return page;
+}
+
+uint32_t DecodePostingPage(IndexPostingPage_t *page, uint64_t *values)
+{
+    uint8_t *data = PostingData(page);
+    uint32_t offset = 0;
+    values[0] = page->first;
+    for (uint32_t i = 1; i < page->count; i++)
+    {
+        uint64_t delta;
+        offset += DecodeVarint(data + offset, &delta);
+        values[i] = values[i - 1] + delta;
+    }
+    return page->count;
+}
+
+uint32_t EncodedPostingSize(uint64_t *values, uint32_t count)
+{
+    uint32_t size = 0;
+    for (uint32_t i = 1; i < count; i++)
+        size += VarintSize(values[i] - values[i - 1]);
+    return size;
+}
+
+void EncodePostingPage(IndexPostingPage_t *page, uint64_t *values, uint32_t count)
+{
+    // The caller has made sure they fit.
+    uint8_t *data = PostingData(page);
+    page->first = values[0];
+    page->last = values[count - 1];
+    page->count = count;
+    page->used = 0;
+    for (uint32_t i = 1; i < count; i++)
+        page->used += EncodeVarint(data + page->used, values[i] - values[i - 1]);
+}
+
+bool PostingContains(IndexTree_t *tree, IndexPosting_t *posting, RecordID_t *rid)
+{
+    uint64_t value = PackRecordID(rid);
+    if (posting->count == 1)
+        return PackRecordID(&posting->rid) == value;
+    // The pages are in order, so only the first page that goes up to the record can have it.
+    uint64_t page_id = posting->head;
+    while (page_id != IDXT_NO_PAGE)
+    {
+        IndexPostingPage_t *page = GetPostingPage(tree, page_id);
+        if (page->last >= value)
+        {
+            bool found = false;
+            if (page->first <= value)
+            {
+                uint64_t values[page->count];
+                DecodePostingPage(page, values);
+                for (uint32_t i = 0; i < page->count && !found; i++)
+                    found = values[i] == value;
+            }
+            ReleasePostingPage(tree, page, false);
+            return found;
+        }
+        page_id = page->next;
+        ReleasePostingPage(tree, page, false);
+    }
+    return false;
+}
+
+bool PostingAdd(IndexTree_t *tree, IndexPosting_t *posting, RecordID_t *rid)
+{
+    // Adds a record to the posting list of a leaf entry, which is latched exclusively along with its page.
+    // Returns false if the record is already in it.
+    uint64_t value = PackRecordID(rid);
+    uint32_t capacity = tree->page_size - sizeof(IndexPostingPage_t);
+    if (posting->count == 1)
+    {
+        // The second record of a key starts the list.
+        uint64_t existing = PackRecordID(&posting->rid);
+        if (existing == value)
+            return false;
+        uint64_t values[2] = {existing < value ? existing : value, existing < value ? value : existing};
+        IndexPostingPage_t *head = CreatePostingPage(tree, values[0]);
+        EncodePostingPage(head, values, 2);
+        posting->head = head->page_id;
+        posting->count = 2;
+        ReleasePostingPage(tree, head, true);
+        return true;
+    }
+
+    // Records mostly arrive in order, as rows are appended to a table, so they go to the end of the last page.
+    IndexPostingPage_t *head = GetPostingPage(tree, posting->head);
+    IndexPostingPage_t *tail = head->tail == head->page_id ? head : GetPostingPage(tree, head->tail);
+    if (value > tail->last)
+    {
+        uint32_t size = VarintSize(value - tail->last);
+        if (tail->used + size <= capacity)
+        {
+            EncodeVarint(PostingData(tail) + tail->used, value - tail->last);
+            tail->used += size;
+            tail->last = value;
+            tail->count++;
+        }
+        else
+        {
+            IndexPostingPage_t *page = CreatePostingPage(tree, value);
+            tail->next = page->page_id;
+            head->tail = page->page_id;
+            ReleasePostingPage(tree, page, true);
+        }
+        if (tail != head)
+            ReleasePostingPage(tree, tail, true);
+        ReleasePostingPage(tree, head, true);
+        posting->count++;
+        return true;
+    }
+    if (tail != head)
+        ReleasePostingPage(tree, tail, false);
+
+    // Otherwise the record goes into the first page that goes up to it, which is decoded and written again.
+    IndexPostingPage_t *page = head;
+    while (page->last < value)
+    {
+        IndexPostingPage_t *next = GetPostingPage(tree, page->next);
+        if (page != head)
+            ReleasePostingPage(tree, page, false);
+        page = next;
+    }
+    uint64_t values[page->count + 1];
+    DecodePostingPage(page, values);
+    uint32_t pos = 0;
+    while (values[pos] < value)
+        pos++;
+    if (values[pos] == value)
+    {
+        if (page != head)
+            ReleasePostingPage(tree, page, false);
+        ReleasePostingPage(tree, head, false);
+        return false;
+    }
+    memmove(values + pos + 1, values + pos, sizeof(uint64_t) * (page->count - pos));
+    values[pos] = value;
+    uint32_t count = page->count + 1;
+    if (EncodedPostingSize(values, count) <= capacity)
+        EncodePostingPage(page, values, count);
+    else
+    {
+        // The page is full, so it's split in two halves, and the upper half goes into a new page after it.
+        // The halves are even by size rather than by count, since the distances vary in size.
+        uint32_t total = EncodedPostingSize(values, count);
+        uint32_t low_count = 1;
+        uint32_t low_size = 0;
+        while (low_count < count - 1 && low_size + VarintSize(values[low_count] - values[low_count - 1]) <= total / 2)
+        {
+            low_size += VarintSize(values[low_count] - values[low_count - 1]);
+            low_count++;
+        }
+        IndexPostingPage_t *high = CreatePostingPage(tree, values[low_count]);
+        EncodePostingPage(high, values + low_count, count - low_count);
+        EncodePostingPage(page, values, low_count);
+        high->next = page->next;
+        page->next = high->page_id;
+        if (head->tail == page->page_id)
+            head->tail = high->page_id;
+        ReleasePostingPage(tree, high, true);
+    }
+    if (page != head)
+        ReleasePostingPage(tree, page, true);
+    ReleasePostingPage(tree, head, true);
+    posting->count++;
+    return true;
+}
+
+bool PostingRemove(IndexTree_t *tree, IndexPosting_t *posting, RecordID_t *rid)
+{
+    // Removes a record from a posting list of at least two records, latched like for PostingAdd.
+    // A list left with a single record gives up its page, and keeps the record in the entry again.
+    // Returns false if the record isn't in it.
+    uint64_t value = PackRecordID(rid);
+    IndexPostingPage_t *head = GetPostingPage(tree, posting->head);
+    IndexPostingPage_t *prev = NULL;
+    IndexPostingPage_t *page = head;
+    while (page->last < value && page->next != IDXT_NO_PAGE)
+    {
+        if (prev != NULL && prev != head)
+            ReleasePostingPage(tree, prev, false);
+        prev = page;
+        page = GetPostingPage(tree, page->next);
+    }
+
+    bool found = false;
+    if (page->first <= value && value <= page->last)
+    {
+        uint64_t values[page->count];
+        DecodePostingPage(page, values);
+        uint32_t pos = 0;
+        while (pos < page->count && values[pos] != value)
+            pos++;
+        if (pos < page->count)
+        {
+            found = true;
+            memmove(values + pos, values + pos + 1, sizeof(uint64_t) * (page->count - pos - 1));
+            // Taking out a record never makes the rest larger, its distance is merged into the next one.
+            if (page->count > 1)
+                EncodePostingPage(page, values, page->count - 1);
+            else
+                page->count = 0;
+        }
+    }
+
+    if (found && page->count == 0)
+    {
+        // An emptied page drops out of the chain. If it's the first page, the next one takes over the tail.
+        if (page == head)
+        {
+            IndexPostingPage_t *next = GetPostingPage(tree, page->next);
+            next->tail = head->tail;
+            posting->head = next->page_id;
+            ReleasePostingPage(tree, next, true);
+            head = NULL;
+        }
+        else
+        {
+            prev->next = page->next;
+            if (head->tail == page->page_id)
+                head->tail = prev->page_id;
+        }
+        FreePage(tree, (IndexPage_t *)page);
+        page = NULL;
+    }
+    if (prev != NULL && prev != head)
+        ReleasePostingPage(tree, prev, found);
+    if (page != NULL && page != head)
+        ReleasePostingPage(tree, page, found);
+    if (head != NULL)
+        ReleasePostingPage(tree, head, found);
+    if (!found)
+        return false;
+
+    posting->count--;
+    if (posting->count == 1)
+    {
+        // The one record left is the first one of the first, and only, page.
+        head = GetPostingPage(tree, posting->head);
+        UnpackRecordID(head->first, &posting->rid);
+        FreePage(tree, (IndexPage_t *)head);
+    }
+    return true;
+}
+
+void FreePosting(IndexTree_t *tree, IndexPosting_t *posting)
+{
+    // Gives back the pages of a posting list.
+    if (posting->count == 1)
+        return;
+    uint64_t page_id = posting->head;
+    while (page_id != IDXT_NO_PAGE)
+    {
+        IndexPostingPage_t *page = GetPostingPage(tree, page_id);
+        page_id = page->next;
+        FreePage(tree, (IndexPage_t *)page);
+    }
+}
+
+void CursorEnterPage(IndexCursor_t *cursor, IndexPage_t *page, uint32_t pos)
+{
+    // Positions the cursor at pos in page, and works out where the range ends within the page.
+    // Unless the upper bound falls inside the page, the range covers the rest of it.
+    IndexTree_t *tree = cursor->tree;
+    cursor->page = page;
+    cursor->pos = pos;
+    if (page == NULL)
+        return;
+    cursor->end = page->num_entries;
+    if (cursor->has_hi && page->num_entries > 0 && ComparePageKey(tree, page, page->num_entries - 1, cursor->hi) > 0)
+        cursor->end = FindInsertPosition(tree, page, cursor->hi);
+    if (cursor->pos > cursor->end)
+        cursor->pos = cursor->end;
+}
+
+IndexCursor_t *AllocCursor(IndexTree_t *tree, void *hi)
 {
-    // Set meta-data and create root.
-    tree.page_counter = 0;
-    tree.page_size = page_size;
-    tree.key_size = key_size;
-    tree.root = CreateEmptyPage(/* is_leaf */ true, /* no parent */ NULL);
+    // The upper bound is copied, so the caller doesn't have to keep it around.
+    IndexCursor_t *cursor = calloc(1, sizeof(IndexCursor_t) + tree->key_size);
+    if (cursor == NULL)
+        return NULL;
+    cursor->tree = tree;
+    cursor->has_hi = hi != NULL;
+    if (cursor->has_hi)
+        memcpy(cursor->hi, hi, tree->key_size);
+    return cursor;
 }
 
-bool idxt_Destroy()
+static inline IndexPostingPage_t *CursorGetPostingPage(IndexCursor_t *cursor, uint64_t page_id)
 {
-    return false;
+    if (cursor->snapshot != NULL)
+        return ReadSnapshotPage(cursor->snapshot, page_id, cursor->posting_copy);
+    return GetPostingPage(cursor->tree, page_id);
 }
 
-bool idxt_AddRecord(void *key, uint32_t page_num, uint32_t slot_num)
+static inline void CursorReleasePostingPage(IndexCursor_t *cursor)
 {
-    // Inserting an index for a record into the index tree is complicated.
-    // It requires balancing the tree by keeping track of the number of entries in each page,
-    // while at the same time ensuring that the keys are stored in sequential order.
-    // We have to traverse down the tree to the leaf page where we would like to insert the entry.
-    IndexPage_t *current = tree.root;
+    if (cursor->snapshot == NULL)
+        ReleasePostingPage(cursor->tree, cursor->posting_page, false);
+    cursor->posting_page = NULL;
+}
+
+void FindSnapshotLeaf(IndexCursor_t *cursor, void *key)
+{
+    // Goes down from the root of the snapshot to the leaf page where key belongs, like FindLeafPage, but
+    // through copies of the pages as the snapshot has them, one over the other in the cursor. The copy of the
+    // leaf page is left there.
+    IndexSnapshot_t *snapshot = cursor->snapshot;
+    IndexTree_t *tree = cursor->tree;
+    uint64_t start = INDEX_TIMER_START(tree);
+    IndexPage_t *current = ReadSnapshotPage(snapshot, snapshot->root, cursor->page_copy);
     while (!current->is_leaf)
     {
-        // Get the next page.
-        current = ProcessNonleafPage(current, key);
-        // We need to check for NULL here in case there is an error in the tree structure.
-        if (current == NULL)
+        uint64_t next_id = key != NULL ? ProcessNonleafPage(tree, current, key) : (current->num_entries > 0 ? *PageChild(current, 0) : IDXT_NO_PAGE);
+        if (next_id == IDXT_NO_PAGE)
         {
-            // If current is NULL, it means that the last page was a non-leaf page, and there are no more
-            // child pages. In other words, we have a non-leaf page at level 0 and there is a severe error.
             fprintf(stderr, "Error in index tree: non-leaf page at level 0.\n");
             exit(EXIT_FAILURE);
         }
+        current = ReadSnapshotPage(snapshot, next_id, cursor->page_copy);
     }
-    // We need to check if there is any room.
-    // If not, we have to insert a new page with ensuing balancing acts to bite our ass.
-    if (current->num_entries < current->max_entries)
-    {
-        // Yey, there is room! Now we just need to re-organize the entries so we maintain
-        // ascending sequential order...
-        InsertLeafPageEntry(current, key, page_num, slot_num);
-        return true;
-    }
-    else
+    INDEX_TIMER_STOP(tree, descent, start);
+}
+
+void *ReadSnapshotPage(IndexSnapshot_t *snapshot, uint64_t page_id, void *buffer)
+{
+    // Copies a page into buffer as the snapshot has it, and returns buffer. If the page has changed since the
+    // snapshot, the version from before is in the store. Otherwise we copy the page as it is, without a latch,
+    // and look again. A change to the page only starts once its version is in the store, so if there is
+    // still none, no change got to the page while we copied it.
+    IndexTree_t *tree = snapshot->tree;
+    const void *version = pv_Find(tree->versions, page_id, snapshot->epoch);
+    if (version == NULL)
     {
-        // Fuck...
-        BalanceAndInsertLeafPageEntry(current, key, page_num, slot_num);
-        return true;
+        IndexPage_t *page = GetPage(tree, page_id);
+        memcpy(buffer, page, tree->page_size);
+        ReleasePage(tree, page, false);
+        version = pv_Find(tree->versions, page_id, snapshot->epoch);
+        if (version == NULL)
+            return buffer;
     }
+    memcpy(buffer, version, tree->page_size);
+    return buffer;
 }
 
-RecordID_t *idxt_FindRecord(void *key)
+uint32_t CursorReadPosting(IndexCursor_t *cursor, RecordID_t *rids, void *keys, uint32_t max_rids)
 {
-    // Starting at the root:
-    // 1.  Check if leaf page.
-    // 2a. If leaf page, search entries for key. If found, return RecordID, if not, return NULL.
-    // 2b. If non-leaf page, walk through the entries and compare the key.
-    // 3a. If key is less than the highest key in an entry, go to the child page. Repeat step 1.
-    // 3b. Else, go to the next entry. Repeat step 3a.
-
-    // Note: If we reach level 0(no more children), and the page is not a leaf page,
-    // there is an error in the tree structure. It should not happen.
+    // Copies the records of the entry at pos, from where the cursor left off, and moves on to the next
+    // entry once they are all done. Returns the number of records copied, at most max_rids.
+    // Posting pages only change under the latch of their leaf page, so the latch the cursor holds on it
+    // keeps them as they are, and the cursor can stop halfway through a list. A snapshot cursor reads the
+    // list as the snapshot has it, a copy of a page at a time.
+    IndexTree_t *tree = cursor->tree;
+    IndexPosting_t *posting = PagePosting(cursor->page, cursor->pos);
+    uint8_t buffer[tree->key_size];
+    const uint8_t *key = ReadPageKey(tree, cursor->page, cursor->pos, buffer);
+    if (posting->count == 1)
+    {
+        rids[0] = posting->rid;
+        if (keys != NULL)
+            memcpy(keys, key, tree->key_size);
+        cursor->pos++;
+        return 1;
+    }
 
-    IndexPage_t *current = tree.root;
-    // Traverse the three to level 0(the leaf pages).
-    while (!current->is_leaf)
+    if (cursor->posting_page == NULL)
     {
-        // Get the next page.
-        current = ProcessNonleafPage(current, key);
-        // We need to check for NULL here in case there is an error in the tree structure.
-        if (current == NULL)
+        cursor->posting_page = CursorGetPostingPage(cursor, posting->head);
+        cursor->posting_pos = 0;
+        cursor->posting_offset = 0;
+    }
+    uint32_t count = 0;
+    while (count < max_rids)
+    {
+        IndexPostingPage_t *page = cursor->posting_page;
+        if (cursor->posting_pos == page->count)
         {
-            // If current is NULL, it means that the last page was a non-leaf page, and there are no more
-            // child pages. In other words, we have a non-leaf page at level 0 and there is a severe error.
-            fprintf(stderr, "Error in index tree: non-leaf page at level 0.\n");
-            exit(EXIT_FAILURE);
+            uint64_t next = page->next;
+            CursorReleasePostingPage(cursor);
+            if (next == IDXT_NO_PAGE)
+            {
+                cursor->pos++;
+                break;
+            }
+            cursor->posting_page = CursorGetPostingPage(cursor, next);
+            cursor->posting_pos = 0;
+            cursor->posting_offset = 0;
+            continue;
+        }
+        // The first record of a page is whole, the others are the distance to the one before.
+        if (cursor->posting_pos == 0)
+            cursor->posting_value = page->first;
+        else
+        {
+            uint64_t delta;
+            cursor->posting_offset += DecodeVarint(PostingData(page) + cursor->posting_offset, &delta);
+            cursor->posting_value += delta;
         }
+        cursor->posting_pos++;
+        UnpackRecordID(cursor->posting_value, &rids[count]);
+        if (keys != NULL)
+            memcpy((uint8_t *)keys + (size_t)count * tree->key_size, key, tree->key_size);
+        count++;
     }
-
-    // After traversing to the correct leaf page, we have to find and return the correct entry.
-    return ProcessLeafPage(current, key);
+    return count;
 }
 
-void idxt_DisplayTree()
+void DestroyPage(IndexTree_t *tree, IndexPage_t *page)
 {
-    printf("Index tree:\n");
-    printf("\t Page size: %d\n", tree.page_size);
-    printf("\t Page count: %ld\n", tree.page_counter);
-    printf("\t Key size: %d\n", tree.key_size);
-    level = 0;
-    DisplayPage(tree.root);
+    // Releases a pinned page and everything below it back to the arena.
+    if (page->is_leaf && tree->non_unique)
+    {
+        for (uint32_t i = 0; i < page->num_entries; i++)
+            FreePosting(tree, PagePosting(page, i));
+    }
+    if (!page->is_leaf)
+    {
+        for (uint32_t i = 0; i < page->num_entries; i++)
+        {
+            DestroyPage(tree, GetPage(tree, *PageChild(page, i)));
+        }
+    }
+    FreePage(tree, page);
 }
 
-IndexPage_t *CreateEmptyPage(bool is_leaf, IndexPage_t *parent)
+void FreePage(IndexTree_t *tree, IndexPage_t *page)
 {
-    IndexPage_t *page = calloc(1, sizeof(IndexPage_t));
-    page->is_leaf = is_leaf;
-    page->parent = parent;
-    page->page_id = tree.page_counter++;
-    // If leaf page, data size is the size of RID, else it's the size of a pointer to
-    // another page.
-    if (page->is_leaf)
+    // The page is released first, a buffer pool only takes back pages that aren't pinned.
+    // The arena overwrites a free page, and hands it out again, so the snapshots keep it as it was.
+    uint64_t page_id = page->page_id;
+    SaveVersion(tree, page, page_id);
+    // In an action, the page is only freed once the action has ended, so it can't be handed out again
+    // before the log has the action that let go of it.
+    if (thread_action.tree == tree)
     {
-        page->data_size = sizeof(RecordID_t);
+        IndexActionPage_t *held = FindActionPage(tree, page);
+        if (held == NULL)
+            held = TrackPage(tree, page, page_id, false);
+        held->freed = true;
+        ReleasePage(tree, page, false);
+        __atomic_fetch_sub(&tree->page_counter, 1, __ATOMIC_RELAXED);
+        return;
     }
+    ReleasePage(tree, page, false);
+    if (tree->buffer != NULL)
+        bp_Free(tree->buffer, page_id);
     else
-    {
-        page->data_size = sizeof(IndexPage_t *);
-    }
-    // We need to calculate the number of entries in the page based on
-    // the size of the key, the size of the data, and the page size.
-    page->max_entries = tree.page_size / (tree.key_size + page->data_size);
-    // Finally, allocate the entries and set utilized entries to 0.
-    page->entries = calloc(page->max_entries, sizeof(IndexPageEntry_t));
-    page->num_entries = 0;
-
-    return page;
+        pool_Free(tree->pool, page_id);
+    __atomic_fetch_sub(&tree->page_counter, 1, __ATOMIC_RELAXED);
 }
 
-IndexPage_t *ProcessNonleafPage(IndexPage_t *current, void *key)
+void DisplayPage(IndexTree_t *tree, IndexPage_t *page, int level)
 {
-    // A non-leaf page represents a sparse index, meaning that we simply have markers for different
-    // intervals of the key. We have to process each entry sequentially, comparing the key with the highest
-    // key value of the child page of that entry. If the key is less than the highest key value, it means
-    // that the record exists in one of the underlying child pages because keys are stored in sequence from
-    // left to right. If all the entries in the non-leaf page have a lower key, it means that the record
-    // doesn't exist in the tree.
+    char formatted_key[256];
+    uint8_t key[tree->key_size];
+    printf("\nLevel %d - Page %ld\n", level, page->page_id);
+    printf("\tLeaf: %d\n", page->is_leaf);
+    printf("\tNum entries: %d\n", page->num_entries);
+    printf("\tMax entries: %d\n", page->max_entries);
+    printf("\tData size: %d\n", page->data_size);
+    if (tree->compress_keys)
+        printf("\tKey bytes: %d-%d\n", page->prefix_size, page->key_end);
 
-    for (int i = 0; i < current->num_entries; i++)
+    if (page->is_leaf)
     {
-        if (memcmp(current->entries[i].key, key, tree.key_size) >= 0)
+        for (int i = 0; i < page->num_entries; i++)
         {
-            return (IndexPage_t *)current->entries[i].data;
+            printf("\tEntry %d:\n", i);
+            // Print key
+            idxk_FormatKey(&tree->key_ops, ReadPageKey(tree, page, i, key), formatted_key, sizeof(formatted_key));
+            printf("\t\t-Key: %s\n", formatted_key);
+            RecordID_t rid;
+            GetLeafRecordID(tree, page, i, &rid);
+            if (tree->non_unique)
+                printf("\t\t-Records: %ld\n", PagePosting(page, i)->count);
+            printf("\t\t-Page num: %d\n", rid.page_num);
+            printf("\t\t-Slot num: %d\n", rid.slot_num);
         }
+        return;
     }
 
-    // If we get here, it means that the record doesn't exist. We return NULL(not found).
-    return NULL;
+    for (int i = 0; i < page->num_entries; i++)
+    {
+        printf("\tEntry %d\n", i);
+        // Print key
+        idxk_FormatKey(&tree->key_ops, ReadPageKey(tree, page, i, key), formatted_key, sizeof(formatted_key));
+        printf("\t-Key: %s\n", formatted_key);
+        printf("\t-Child page-id: %ld\n", *PageChild(page, i));
+    }
+
+    for (int i = 0; i < page->num_entries; i++)
+    {
+        IndexPage_t *child = GetPage(tree, *PageChild(page, i));
+        DisplayPage(tree, child, level + 1);
+        ReleasePage(tree, child, false);
+    }
 }
 
-RecordID_t *ProcessLeafPage(IndexPage_t *current, void *key)
+bool OpenLog(IndexTree_t *tree, const char *path, uint32_t group_delay, bool create)
 {
-    // The entries are sorted in ascending order,
-    // so we use binary search.
+    // The log sits next to the index file.
+    char log_path[strlen(path) + sizeof(".wal")];
+    sprintf(log_path, "%s.wal", path);
+    tree->log = create ? wal_Create(log_path, group_delay) : wal_Open(log_path, group_delay);
+    if (tree->log == NULL)
+        return false;
+    // Actions are short and checkpoints are rare, so a checkpoint goes ahead of the actions that come in
+    // after it, rather than wait for a moment without any.
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&tree->checkpoint_lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+    bp_SetWriteHook(tree->buffer, WriteHook, tree);
+    return true;
+}
 
-    // First we set the boundaries.
-    uint32_t max = current->num_entries;
-    uint32_t min = 0;
+bool InitSnapshots(IndexTree_t *tree)
+{
+    tree->versions = pv_Create(tree->page_size);
+    if (tree->versions == NULL)
+        return false;
+    // Like a checkpoint, a snapshot goes ahead of the changes that come in after it, rather than wait for a
+    // moment without any.
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&tree->snapshot_lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+    return true;
+}
 
-    while (max >= min)
+bool InitAdaptiveHash(IndexTree_t *tree, uint64_t entries)
+{
+    // The records of a key shared by many are in its posting list, which a hash entry can't stand in for, so a
+    // non-unique tree goes without.
+    if (tree->non_unique)
+        return true;
+    // The hash starts out empty, and grows as pages get hot.
+    tree->adaptive_hash = hidx_Create(&tree->key_ops.desc, 0);
+    tree->leaf_heat = calloc(IDXT_HEAT_SLOTS, sizeof(uint32_t));
+    if (tree->adaptive_hash == NULL || tree->leaf_heat == NULL)
     {
-        int mid = min + (max - min) / 2;
+        fprintf(stderr, "Error in index tree: unable to allocate adaptive hash.\n");
+        return false;
+    }
+    tree->adaptive_hash_limit = entries;
+    return true;
+}
 
-        int keycmp = memcmp(current->entries[mid].key, key, tree.key_size);
-        if (keycmp == 0)
-            return (RecordID_t *)current->entries[mid].data;
+bool WriteHook(void *context, uint64_t page_id, const void *page)
+{
+    // A page only reaches the index file once the log has every action that changed it, the rule the log
+    // is named for. The superblock has no LSN, but it's only written in a checkpoint, when the log has
+    // every action anyway.
+    IndexTree_t *tree = context;
+    if (page_id < SuperblockPages(tree))
+        return true;
+    return wal_Commit(tree->log, ((const IndexPage_t *)page)->lsn);
+}
 
-        if (keycmp < 0)
-            min = mid + 1;
-        else
-            max = mid - 1;
-    }
+bool Checkpoint(IndexTree_t *tree, bool clean)
+{
+    // Once the pages are on the disk, the log has nothing they don't, and starts over. The superblock is
+    // written along with them. The caller keeps every action out meanwhile.
+    WriteSuperblock(tree, clean);
+    return bp_Flush(tree->buffer) && wal_Reset(tree->log);
+}
 
-    // If we reach this, no record was found and we return NULL(not found).
-    return NULL;
+static inline uint32_t SuperblockPages(IndexTree_t *tree)
+{
+    uint32_t frame_size = pool_FrameSize(tree->page_size);
+    return (sizeof(IndexSuperblock_t) + frame_size - 1) / frame_size;
 }
 
-IndexPageEntry_t *InsertLeafPageEntry(IndexPage_t *page, void *key, uint32_t page_num, uint32_t slot_num)
+void BeginAction(IndexTree_t *tree)
 {
-    // We create the RecordID.
-    RecordID_t *rid = calloc(1, sizeof(RecordID_t));
-    rid->page_num = page_num;
-    rid->slot_num = slot_num;
+    BeginSnapshotChange(tree);
+    // Only a logged tree has actions.
+    if (tree->log == NULL)
+        return;
+    pthread_rwlock_rdlock(&tree->checkpoint_lock);
+    memset(&thread_action, 0, sizeof(IndexAction_t));
+    thread_action.tree = tree;
+}
 
-    // We need to maintain order, so first we need to position ourselves.
-    // We either have to reorder the list, or we find an available position.
-    int isrt_pos = -1;
-    for (int i = 0; i < page->max_entries; i++)
+void EndAction(IndexTree_t *tree)
+{
+    IndexAction_t *action = &thread_action;
+    if (action->tree != tree)
     {
-        if (!page->entries[i].in_use || memcmp(key, page->entries[i].key, tree.key_size) < 0)
+        EndSnapshotChange(tree);
+        return;
+    }
+
+    // The pages the action changed go into one record, along with the root if it changed. A page that was
+    // freed is left out, nothing can reach it any more.
+    IndexLogAction_t header;
+    memset(&header, 0, sizeof(IndexLogAction_t));
+    header.root = action->root_changed ? action->root : IDXT_NO_PAGE;
+    action->record_size = 0;
+    AppendRecord(action, &header, sizeof(IndexLogAction_t));
+    for (uint32_t i = 0; i < action->num_pages; i++)
+    {
+        IndexActionPage_t *held = &action->pages[i];
+        if (!held->changed && memcmp(held->before, held->page, tree->page_size) != 0)
+            held->changed = true;
+        if (held->changed && !held->freed && LogPageRanges(tree, held) > 0)
+            header.num_pages++;
+    }
+    uint64_t lsn = 0;
+    if (header.num_pages > 0 || action->root_changed)
+    {
+        memcpy(action->record, &header, sizeof(IndexLogAction_t));
+        lsn = wal_Append(tree->log, action->record, action->record_size);
+        // The pages get the LSN while they are still held, so none of them can be written before the log
+        // has the record.
+        for (uint32_t i = 0; i < action->num_pages; i++)
         {
-            isrt_pos = i;
-            break;
+            if (action->pages[i].changed && !action->pages[i].freed)
+                action->pages[i].page->lsn = lsn;
         }
     }
 
-    // If we find an available position, we simply take it and insert.
-    if (!page->entries[isrt_pos].in_use)
+    // Now the pages can be let go of, and the freed ones freed.
+    for (uint32_t i = 0; i < action->num_pages; i++)
     {
-        page->entries[isrt_pos].in_use = true;
-        // We check if the key and data is initialized first.
-        page->entries[isrt_pos].key = calloc(1, tree.key_size);
-        page->entries[isrt_pos].data = calloc(1, page->data_size);
+        IndexActionPage_t *held = &action->pages[i];
+        if (held->latched)
+            latch_Release(bp_Latch(tree->buffer, held->page), true);
+        bp_Unpin(tree->buffer, held->page, held->changed);
+        if (held->freed)
+            bp_Free(tree->buffer, held->page_id);
+        free(held->before);
+    }
+    free(action->pages);
+    free(action->record);
+    memset(action, 0, sizeof(IndexAction_t));
+    pthread_rwlock_unlock(&tree->checkpoint_lock);
+    EndSnapshotChange(tree);
 
-        memcpy(page->entries[isrt_pos].key, key, tree.key_size);
-        memcpy(page->entries[isrt_pos].data, (void *)rid, page->data_size);
-        page->num_entries++;
-        return &page->entries[isrt_pos];
+    // The call returns once the record is on the disk. Others may already have seen the changes, but any
+    // action of theirs that depends on them comes later in the log, so it can't be on the disk without ours.
+    // Actions that end at the same time are made durable by the same sync.
+    if (lsn != 0 && !wal_Commit(tree->log, lsn))
+    {
+        fprintf(stderr, "Error in index tree: unable to write log.\n");
+        exit(EXIT_FAILURE);
     }
+}
 
-    // We have to shift the other entries to the right using memmove and insert.
-    memmove(&page->entries[isrt_pos + 1], &page->entries[isrt_pos], sizeof(IndexPageEntry_t) * (page->num_entries - isrt_pos));
-    // Then we insert our entry at isrt_pos.
-    page->entries[isrt_pos].in_use = true;
-    // We need to allocate new key and data fields for this entry.
-    page->entries[isrt_pos].key = calloc(1, tree.key_size);
-    page->entries[isrt_pos].data = calloc(1, page->data_size);
-    memcpy(page->entries[isrt_pos].key, key, tree.key_size);
-    memcpy(page->entries[isrt_pos].data, (void *)rid, page->data_size);
-    page->num_entries++;
-    return &page->entries[isrt_pos];
+static inline void BeginSnapshotChange(IndexTree_t *tree)
+{
+    // A tree with snapshots holds off new ones until the change is done. While there are snapshots open,
+    // the pages it changes are kept as they were for them.
+    if (tree->versions == NULL)
+        return;
+    pthread_rwlock_rdlock(&tree->snapshot_lock);
+    thread_versions = pv_HasSnapshots(tree->versions) ? tree : NULL;
 }
 
-IndexPageEntry_t *BalanceAndInsertLeafPageEntry(IndexPage_t *page, void *key, uint32_t page_num, uint32_t slot_num)
+static inline void EndSnapshotChange(IndexTree_t *tree)
 {
-    // We create the RecordID.
-    RecordID_t *rid = calloc(1, sizeof(RecordID_t));
-    rid->page_num = page_num;
-    rid->slot_num = slot_num;
+    if (tree->versions == NULL)
+        return;
+    thread_versions = NULL;
+    pthread_rwlock_unlock(&tree->snapshot_lock);
+}
 
-    // To balance, we need to know the candidates and order them.
-    // We also need a split ratio: how should we divide the entries between the two pages?
-    //
-    // The algorithm for balancing is the following:
-    // 1. Order the entries in ascending sequence.
-    // 2. Based on the cut ratio, calculate the position of the split.
-    //    If, for example, 10 candidates, and a 50/50 split, then we should split the range 0..4 into the
-    //    first page, and range 5..9 into the second page.
-    // 3. In the parent, the previous entry pointing to the pre-split table need to be split into two entries:
-    //    - The lower-key table with key[4] as highest key(because they are ordered ascending).
-    //    - The higher-key table with key[9] as highest key.
-    // 4. If the parent table is full also, repeat from step 1.
+static inline void SaveVersion(IndexTree_t *tree, void *page, uint64_t page_id)
+{
+    // Called as a change gets hold of a page it may change, before it does.
+    if (thread_versions == tree)
+        pv_Save(tree->versions, page_id, page);
+}
 
-    // We need room for the existing entries plus the new one.
-    IndexPageEntry_t candidates[page->num_entries + 1];
-    // We find the isrt_pos of our new entry with respect to sequence.
-    int isrt_pos = -1;
-    for (int i = 0; i < page->num_entries; i++)
+IndexActionPage_t *FindActionPage(IndexTree_t *tree, void *page)
+{
+    // An action holds a few pages per level at most, so a look through all of them is quick.
+    IndexAction_t *action = &thread_action;
+    for (uint32_t i = 0; i < action->num_pages; i++)
     {
-        if (memcmp(key, page->entries[i].key, tree.key_size) < 0)
-        {
-            isrt_pos = i;
-            break;
-        }
+        if (action->pages[i].page == page)
+            return &action->pages[i];
     }
-    // We know, before getting here, that our key is lower than atleast the highest key of this page,
-    // so we should almost never see isrt_pos = -1 here. The exception is if this is a single root page.
-    if (isrt_pos == -1)
+    return NULL;
+}
+
+IndexActionPage_t *TrackPage(IndexTree_t *tree, void *page, uint64_t page_id, bool latched)
+{
+    // Takes a pinned page along in the action of the thread, with a copy of how it is now.
+    IndexAction_t *action = &thread_action;
+    if (action->num_pages == action->capacity)
     {
-        // If the key is not less than any of the keys present, we insert it right after them.
-        isrt_pos = page->num_entries;
-        // First we copy all the existing entries.
-        memcpy(candidates, page->entries, sizeof(IndexPageEntry_t) * (page->num_entries));
-        // Then, we insert our new entry.
-        candidates[isrt_pos].in_use = true;
-        candidates[isrt_pos].key = calloc(1, tree.key_size);
-        candidates[isrt_pos].data = calloc(1, page->data_size);
-        memcpy(candidates[isrt_pos].key, key, tree.key_size);
-        memcpy(candidates[isrt_pos].data, (void *)rid, page->data_size);
+        uint32_t capacity = action->capacity > 0 ? action->capacity * 2 : 16;
+        IndexActionPage_t *pages = realloc(action->pages, sizeof(IndexActionPage_t) * capacity);
+        if (pages == NULL)
+        {
+            fprintf(stderr, "Error in index tree: unable to allocate action.\n");
+            exit(EXIT_FAILURE);
+        }
+        action->pages = pages;
+        action->capacity = capacity;
     }
-    else
+    IndexActionPage_t *held = &action->pages[action->num_pages++];
+    memset(held, 0, sizeof(IndexActionPage_t));
+    held->page = page;
+    held->page_id = page_id;
+    held->latched = latched;
+    held->before = malloc(tree->page_size);
+    if (held->before == NULL)
     {
-        // We now create our candidates list. All the existing entries up to the isrt_pos is kept where they are,
-        // all the entries after the isrt_pos is shifted to the right.
-        memcpy(candidates, page->entries, sizeof(IndexPageEntry_t) * isrt_pos);
-        // Insert our new entry.
-        candidates[isrt_pos].in_use = true;
-        page->entries[isrt_pos].key = calloc(1, tree.key_size);
-        page->entries[isrt_pos].data = calloc(1, page->data_size);
-        memcpy(candidates[isrt_pos].key, key, tree.key_size);
-        memcpy(candidates[isrt_pos].data, (void *)rid, page->data_size);
-        // Copy the rest.
-        memcpy(candidates + isrt_pos + 1, page->entries + isrt_pos, sizeof(IndexPageEntry_t) * (page->num_entries - isrt_pos));
+        fprintf(stderr, "Error in index tree: unable to allocate action.\n");
+        exit(EXIT_FAILURE);
     }
+    memcpy(held->before, page, tree->page_size);
+    // The action pins the page once more for itself, so the page stays in its frame until the action
+    // ends, whenever the caller releases it.
+    bp_Pin(tree->buffer, page_id);
+    return held;
+}
 
-    // We now have our candidates ordered in ascending sequence.
-    // We will use a 50/50 left-biased split by default. This means that if we have 9 candidates,
-    // 5 will be to the left and 4 will be to the right. Mathematically, we say that we floor
-    // the result of the divide, and we add the remainder to the left side.
-    int lowpage_range_end = (page->num_entries + 1) / 2 + (page->num_entries + 1) % 2 - 1;
-    int highpage_range_end = lowpage_range_end + (page->num_entries + 1) / 2;
+void TrackNewPage(IndexTree_t *tree, void *page, uint64_t page_id, bool latched)
+{
+    // A new page is still zeroed, which is what recovery starts it from.
+    if (latched)
+        latch_Acquire(bp_Latch(tree->buffer, page), true);
+    IndexActionPage_t *held = TrackPage(tree, page, page_id, latched);
+    held->is_new = true;
+    held->changed = true;
+}
 
-    // If we need to create a new leaf page, and there are no parent(non-leaf) page, we need to create one.
-    // This occurs if we only have a single root page.
-    IndexPageEntry_t *lower_page_entry;
-    if (page->parent == NULL)
+bool KeepPage(IndexTree_t *tree, void *page)
+{
+    // Called as a page is let go of in an action. A page the action has changed is kept until it ends,
+    // and true returned. Otherwise the action lets go of the page as well.
+    IndexAction_t *action = &thread_action;
+    IndexActionPage_t *held = FindActionPage(tree, page);
+    if (held == NULL)
+        return false;
+    if (held->changed || held->freed || memcmp(held->before, page, tree->page_size) != 0)
     {
-        tree.root = CreateEmptyPage(false, NULL);
-        lower_page_entry = InsertNonleafPageEntry(tree.root, page);
+        held->changed = true;
+        return true;
     }
-    // We use the existing page as the low page, so we keep the lower key-partition of the candidates
-    // in the existing page and update it's entry in the parent.
-    // We clear the current entries and copy the lower-part from candidates.
-    memset(page->entries, 0, sizeof(IndexPageEntry_t) * (page->num_entries));
-    page->num_entries = lowpage_range_end + 1;
-    memcpy(page->entries, candidates, sizeof(IndexPageEntry_t) * page->num_entries);
-    // Then we get a reference to it's entry in the parent and update it with the new highest key.
-    if(!lower_page_entry)
-        lower_page_entry = GetNonleafPageEntry(page->parent, page);
-    memcpy(lower_page_entry->key, page->entries[page->num_entries - 1].key, tree.key_size);
-
-    // We need to create a new page for the higher key-partition of the candidates.
-    IndexPage_t *new_page = CreateEmptyPage(true, page->parent);
-    // We first insert the higher-key candidates into it's entries.
-    new_page->num_entries = highpage_range_end - lowpage_range_end;
-    memcpy(new_page->entries, candidates + lowpage_range_end + 1, sizeof(IndexPageEntry_t) * page->num_entries);
-    // Then, we insert it into the parent.
-    InsertNonleafPageEntry(page->parent, new_page);
+    free(held->before);
+    bp_Unpin(tree->buffer, page, false);
+    *held = action->pages[--action->num_pages];
+    return false;
+}
 
-    // TEMP!
-    for(int i = 0; i < page->num_entries; i++)
+void SetRoot(IndexTree_t *tree, uint64_t root)
+{
+    // The root changes under concurrent readers, so it's written atomically. In an action, the change is
+    // logged along with the pages.
+    __atomic_store_n(&tree->root, root, __ATOMIC_RELEASE);
+    if (thread_action.tree == tree)
     {
-        if(memcmp(key, page->entries[i].key, tree.key_size) == 0)
-            return &page->entries[i];
+        thread_action.root_changed = true;
+        thread_action.root = root;
     }
+}
 
-    for(int i = 0; i < new_page->num_entries; i++)
+void AppendRecord(IndexAction_t *action, const void *data, size_t size)
+{
+    if (action->record_size + size > action->record_capacity)
     {
-        if(memcmp(key, new_page->entries[i].key, tree.key_size) == 0)
-            return &new_page->entries[i];
+        size_t capacity = action->record_capacity > 0 ? action->record_capacity : 4096;
+        while (capacity < action->record_size + size)
+            capacity *= 2;
+        uint8_t *record = realloc(action->record, capacity);
+        if (record == NULL)
+        {
+            fprintf(stderr, "Error in index tree: unable to allocate action.\n");
+            exit(EXIT_FAILURE);
+        }
+        action->record = record;
+        action->record_capacity = capacity;
     }
-
-    return NULL;
+    memcpy(action->record + action->record_size, data, size);
+    action->record_size += size;
 }
 
-IndexPageEntry_t *InsertNonleafPageEntry(IndexPage_t *target, IndexPage_t *source)
+uint32_t LogPageRanges(IndexTree_t *tree, IndexActionPage_t *held)
 {
-    // First, we get the highest key from the source, which is the highest entry in use.
-    void *key = source->entries[source->num_entries - 1].key;
+    // Adds a page to the record of the action, with the stretches of bytes that changed, found by comparing
+    // the page with its copy from before. Stretches with only a few unchanged bytes between them go in as
+    // one, which takes less than another range would. Returns the number of stretches.
+    IndexAction_t *action = &thread_action;
+    size_t start = action->record_size;
+    IndexLogPage_t log_page;
+    memset(&log_page, 0, sizeof(IndexLogPage_t));
+    log_page.page_id = held->page_id;
+    log_page.is_new = held->is_new;
+    AppendRecord(action, &log_page, sizeof(IndexLogPage_t));
 
-    // We need to maintain order, so first we need to position ourselves.
-    // We either have to reorder the list, or we find an available position.
-    int isrt_pos = -1;
-    for (int i = 0; i < target->max_entries; i++)
+    const uint8_t *before = held->before;
+    const uint8_t *after = (const uint8_t *)held->page;
+    uint32_t offset = 0;
+    while (offset < tree->page_size)
     {
-        if (!target->entries[i].in_use || memcmp(key, target->entries[i].key, tree.key_size) < 0)
+        // Unchanged bytes are skipped a word at a time where possible.
+        if (offset + sizeof(uint64_t) <= tree->page_size && memcmp(before + offset, after + offset, sizeof(uint64_t)) == 0)
         {
-            isrt_pos = i;
-            break;
+            offset += sizeof(uint64_t);
+            continue;
+        }
+        if (before[offset] == after[offset])
+        {
+            offset++;
+            continue;
+        }
+        uint32_t end = offset + 1;
+        for (uint32_t next = end; next < tree->page_size && next - end < INDEX_LOG_GAP; next++)
+        {
+            if (before[next] != after[next])
+                end = next + 1;
         }
+        IndexLogRange_t range;
+        range.offset = offset;
+        range.size = end - offset;
+        AppendRecord(action, &range, sizeof(IndexLogRange_t));
+        AppendRecord(action, after + offset, range.size);
+        log_page.num_ranges++;
+        offset = end;
     }
-
-    // If we find an available position, we simply take it and insert.
-    if (!target->entries[isrt_pos].in_use)
+    if (log_page.num_ranges == 0)
     {
-        target->entries[isrt_pos].in_use = true;
-        // Allocate a key and data.
-        target->entries[isrt_pos].key = calloc(1, tree.key_size);
-        target->entries[isrt_pos].data = calloc(1, target->data_size);
-        memcpy(target->entries[isrt_pos].key, key, tree.key_size);
-        target->entries[isrt_pos].data = (void *)source;
-        target->num_entries++;
-        // Insertion was succesfull, so we also update parent pointer in child.
-        source->parent = target;
-        return &target->entries[isrt_pos];
+        action->record_size = start;
+        return 0;
     }
-
-    // We have to shift the other entries to the right using memmove and insert.
-    memmove(&target->entries[isrt_pos + 1], &target->entries[isrt_pos], sizeof(IndexPageEntry_t) * (target->num_entries - isrt_pos));
-    // Then we insert our entry at isrt_pos.
-    target->entries[isrt_pos].in_use = true;
-    // We need to allocate new key and data fields for this entry.
-    target->entries[isrt_pos].key = calloc(1, tree.key_size);
-    target->entries[isrt_pos].data = calloc(1, target->data_size);
-    memcpy(target->entries[isrt_pos].key, key, tree.key_size);
-    target->entries[isrt_pos].data = (void *)source;
-    target->num_entries++;
-    // Insertion was succesfull, so we also update parent pointer in child.
-    source->parent = target;
-    return &target->entries[isrt_pos];
+    memcpy(action->record + start, &log_page, sizeof(IndexLogPage_t));
+    return log_page.num_ranges;
 }
 
-IndexPageEntry_t *GetNonleafPageEntry(IndexPage_t *source, IndexPage_t *target)
+bool RecoverTree(IndexTree_t *tree, bool clean)
 {
-    // Walk through entries. 
-    // If highest key of target matches key of entry, return entry.
-    // Else, return NULL(not found).
+    // Redo: every action in the log is applied to the pages that don't have it yet. Actions only reach the
+    // log whole, and pages only reach the file after their actions, so there is nothing to undo.
+    IndexRecovery_t recovery;
+    recovery.tree = tree;
+    recovery.actions = 0;
+    if (!wal_Replay(tree->log, ReplayAction, &recovery))
+        return false;
 
-    void *highest_key_target = target->entries[target->num_entries - 1].key;
-    for(int i = 0; i < source->num_entries; i++)
+    // The free pages are linked through the pages themselves, which isn't logged. After a crash, the links
+    // may be anything, so the free pages are found again: every page that can't be reached from the root.
+    if (!clean || recovery.actions > 0)
     {
-        if(memcmp(highest_key_target, source->entries[i].key, tree.key_size) == 0)
+        uint64_t num_pages = tree->buffer->num_pages;
+        uint8_t *reachable = calloc(num_pages, 1);
+        if (reachable == NULL)
+        {
+            fprintf(stderr, "Error in index tree: unable to allocate recovery.\n");
+            return false;
+        }
+        uint64_t count = 0;
+        if (!MarkPages(tree, tree->root, reachable, &count))
+        {
+            free(reachable);
+            return false;
+        }
+        tree->page_counter = count;
+        tree->buffer->free_head = POOL_NO_FRAME;
+        tree->buffer->num_free = 0;
+        // From the end, so the pages at the start of the file are handed out first.
+        for (uint64_t page_id = num_pages; page_id-- > SuperblockPages(tree);)
         {
-            return &source->entries[i];
+            if (!reachable[page_id])
+                bp_Free(tree->buffer, page_id);
         }
+        free(reachable);
     }
+    // A checkpoint gets the recovered tree to the disk and empties the log. It also marks the tree as open,
+    // so a crash from here on is recognized.
+    return Checkpoint(tree, false);
+}
 
-    return NULL;
+bool ReplayAction(void *context, uint64_t lsn, const void *record, uint32_t size)
+{
+    IndexRecovery_t *recovery = context;
+    IndexTree_t *tree = recovery->tree;
+    const uint8_t *data = record;
+    const uint8_t *end = data + size;
+    IndexLogAction_t action;
+    if (size < sizeof(IndexLogAction_t))
+    {
+        fprintf(stderr, "Error in index tree: log record %ld is corrupt.\n", lsn);
+        return false;
+    }
+    memcpy(&action, data, sizeof(IndexLogAction_t));
+    data += sizeof(IndexLogAction_t);
+    for (uint32_t i = 0; i < action.num_pages; i++)
+    {
+        IndexLogPage_t log_page;
+        if ((size_t)(end - data) < sizeof(IndexLogPage_t))
+        {
+            fprintf(stderr, "Error in index tree: log record %ld is corrupt.\n", lsn);
+            return false;
+        }
+        memcpy(&log_page, data, sizeof(IndexLogPage_t));
+        data += sizeof(IndexLogPage_t);
+        if (log_page.page_id < SuperblockPages(tree))
+        {
+            fprintf(stderr, "Error in index tree: log record %ld is corrupt.\n", lsn);
+            return false;
+        }
+        // A page past the end of the file was handed out after the last checkpoint, and never written.
+        if (log_page.page_id >= tree->buffer->num_pages)
+            tree->buffer->num_pages = log_page.page_id + 1;
+        IndexPage_t *page = GetPage(tree, log_page.page_id);
+        bool redo = page->lsn < lsn;
+        if (redo && log_page.is_new)
+            memset(page, 0, tree->page_size);
+        bool valid = true;
+        for (uint32_t j = 0; j < log_page.num_ranges && valid; j++)
+        {
+            IndexLogRange_t range;
+            valid = (size_t)(end - data) >= sizeof(IndexLogRange_t);
+            if (!valid)
+                break;
+            memcpy(&range, data, sizeof(IndexLogRange_t));
+            data += sizeof(IndexLogRange_t);
+            valid = range.offset <= tree->page_size && range.size <= tree->page_size - range.offset && (size_t)(end - data) >= range.size;
+            if (valid && redo)
+                memcpy((uint8_t *)page + range.offset, data, range.size);
+            data += valid ? range.size : 0;
+        }
+        if (redo)
+            page->lsn = lsn;
+        ReleasePage(tree, page, redo);
+        if (!valid)
+        {
+            fprintf(stderr, "Error in index tree: log record %ld is corrupt.\n", lsn);
+            return false;
+        }
+    }
+    if (action.root != IDXT_NO_PAGE)
+        tree->root = action.root;
+    recovery->actions++;
+    return true;
 }
 
-void DisplayPage(IndexPage_t *page)
+bool MarkPage(IndexTree_t *tree, uint64_t page_id, uint8_t *reachable, uint64_t *count)
 {
-    printf("\nLevel %d - Page %ld\n", level, page->page_id);
-    printf("\tLeaf: %d\n", page->is_leaf);
-    printf("\tNum entries: %d\n", page->num_entries);
-    printf("\tMax entries: %d\n", page->max_entries);
-    printf("\tData size: %d\n", page->data_size);
+    // Every page of the tree is reached once, through a single link.
+    if (page_id < SuperblockPages(tree) || page_id >= tree->buffer->num_pages || reachable[page_id])
+    {
+        fprintf(stderr, "Error in index tree: page %ld is linked wrongly.\n", page_id);
+        return false;
+    }
+    reachable[page_id] = 1;
+    (*count)++;
+    return true;
+}
 
-    if (page->is_leaf)
+bool MarkPages(IndexTree_t *tree, uint64_t page_id, uint8_t *reachable, uint64_t *count)
+{
+    // Marks a page and every page below it, posting pages included, and counts them.
+    if (!MarkPage(tree, page_id, reachable, count))
+        return false;
+    IndexPage_t *page = GetPage(tree, page_id);
+    bool marked = true;
+    for (uint32_t i = 0; i < page->num_entries && marked; i++)
     {
-        for (int i = 0; i < page->num_entries; i++)
+        if (!page->is_leaf)
         {
-            printf("\tEntry %d:\n", i);
-            printf("\t\t-Key: 0x");
-            // Print key
-            for (int j = tree.key_size - 1; j >= 0; j--)
-            {
-                printf("%02x", ((uint8_t *)(page->entries[i].key))[j]);
-            }
-            printf("\n");
-            printf("\t\t-Page num: %d\n", ((RecordID_t *)page->entries[i].data)->page_num);
-            printf("\t\t-Slot num: %d\n", ((RecordID_t *)page->entries[i].data)->slot_num);
+            marked = MarkPages(tree, *PageChild(page, i), reachable, count);
+            continue;
+        }
+        if (!tree->non_unique || PagePosting(page, i)->count == 1)
+            continue;
+        uint64_t posting_id = PagePosting(page, i)->head;
+        while (posting_id != IDXT_NO_PAGE && marked)
+        {
+            marked = MarkPage(tree, posting_id, reachable, count);
+            if (!marked)
+                break;
+            IndexPostingPage_t *posting_page = GetPostingPage(tree, posting_id);
+            posting_id = posting_page->next;
+            ReleasePostingPage(tree, posting_page, false);
         }
-        return;
     }
+    ReleasePage(tree, page, false);
+    return marked;
+}
 
-    for (int i = 0; i < page->num_entries; i++)
+static inline IndexThreadStats_t *ThreadStats(IndexTree_t *tree)
+{
+    // The counters of the thread for the tree. Usually the thread keeps using the tree it used last.
+    if (stats_cache[0].stats_id == tree->stats_id)
+        return stats_cache[0].stats;
+    return FindThreadStats(tree);
+}
+
+IndexThreadStats_t *FindThreadStats(IndexTree_t *tree)
+{
+    // The counters of a tree the thread used before may still be in its cache, otherwise they are looked
+    // for in the tree, or added to it if the thread hasn't used the tree before. Either way, they are moved
+    // to the front of the cache, and the tree used the longest ago drops out.
+    uint32_t slot = 0;
+    while (slot < INDEX_STATS_CACHE - 1 && stats_cache[slot].stats_id != tree->stats_id)
+        slot++;
+    IndexStatsCache_t found = stats_cache[slot];
+    if (found.stats_id != tree->stats_id)
     {
-        printf("\tEntry %d\n", i);
-        printf("\t-Key: 0x");
-        // Print key
-        for (int j = tree.key_size; j >= 0; j--)
+        found.stats_id = tree->stats_id;
+        found.stats = NULL;
+        for (IndexThreadStats_t *stats = __atomic_load_n(&tree->thread_stats, __ATOMIC_ACQUIRE); stats != NULL && found.stats == NULL; stats = stats->next)
         {
-            printf("%02x", ((uint8_t *)(page->entries[i].key))[j]);
+            if (stats->owner == stats_cache)
+                found.stats = stats;
+        }
+        if (found.stats == NULL)
+        {
+            found.stats = aligned_alloc(__alignof__(IndexThreadStats_t), sizeof(IndexThreadStats_t));
+            if (found.stats == NULL)
+            {
+                fprintf(stderr, "Error in index tree: unable to allocate counters.\n");
+                exit(EXIT_FAILURE);
+            }
+            memset(found.stats, 0, sizeof(IndexThreadStats_t));
+            found.stats->owner = stats_cache;
+            found.stats->next = __atomic_load_n(&tree->thread_stats, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&tree->thread_stats, &found.stats->next, found.stats, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
         }
-        printf("\n");
-        printf("\t-Child page-id: %ld\n", ((IndexPage_t *)page->entries[i].data)->page_id);
     }
+    memmove(&stats_cache[1], &stats_cache[0], sizeof(IndexStatsCache_t) * slot);
+    stats_cache[0] = found;
+    return found.stats;
+}
 
-    for (int i = 0; i < page->num_entries; i++)
+static inline void CountEvent(uint64_t *counter)
+{
+    // Only the thread itself writes its counters, so it doesn't need an atomic add, just a store that
+    // idxt_GetStats can't see half done.
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static inline void CountOperation(IndexThreadStats_t *stats, uint64_t *counter)
+{
+    // Counts an operation, and decides whether its steps are timed.
+    CountEvent(counter);
+    stats->timed = stats->ops++ % INDEX_STATS_SAMPLE == 0;
+}
+
+static inline uint64_t StartTimer(IndexTree_t *tree)
+{
+    // The start of a step, or 0 if the operation isn't timed.
+    return ThreadStats(tree)->timed ? ReadCycles() : 0;
+}
+
+static inline void StopTimer(IndexTreeTimer_t *timer, uint64_t start)
+{
+    if (start == 0)
+        return;
+    uint64_t cycles = ReadCycles() - start;
+    __atomic_store_n(&timer->count, timer->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&timer->cycles, timer->cycles + cycles, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t ReadCycles(void)
+{
+    // The time stamp counter ticks at a fixed rate on every CPU of the last decade or so, whatever the clock
+    // speed, and takes a couple of dozen cycles to read, without a call into the kernel or the vDSO.
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+IndexPage_t *LatchLeftmostPage(IndexTree_t *tree, uint32_t level)
+{
+    // Goes down the left-most children from the root to the first page of a level, 0 being the root, and
+    // returns it pinned and latched shared. Returns NULL if the tree isn't that high.
+    IndexPage_t *page = LatchRoot(tree, INDEX_LATCH_SHARED);
+    for (uint32_t depth = 0; depth < level; depth++)
     {
-        level++;
-        DisplayPage((IndexPage_t *)page->entries[i].data);
-        level--;
+        IndexPage_t *child = !page->is_leaf && page->num_entries > 0 ? GetPage(tree, *PageChild(page, 0)) : NULL;
+        if (child != NULL)
+            LatchPage(tree, child, false);
+        UnlatchPage(tree, page, false);
+        ReleasePage(tree, page, false);
+        if (child == NULL)
+            return NULL;
+        page = child;
     }
+    return page;
 }
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "page_pool.h"
+
+static PagePool_t *InitPool(uint32_t page_size, bool huge_pages, int fd);
+static bool AddChunk(PagePool_t *pool);
+static void *MapChunk(PagePool_t *pool);
+static void *MapFileChunk(PagePool_t *pool);
+
+PagePool_t *pool_Create(uint32_t page_size, bool huge_pages)
+{
+    return InitPool(page_size, huge_pages, -1);
+}
+
+PagePool_t *pool_CreateFile(const char *path, uint32_t page_size)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error in page pool: unable to create %s.\n", path);
+        return NULL;
+    }
+    PagePool_t *pool = InitPool(page_size, false, fd);
+    if (pool == NULL)
+        close(fd);
+    return pool;
+}
+
+PagePool_t *pool_OpenFile(const char *path, uint32_t page_size, uint64_t num_frames, uint64_t free_head, uint64_t num_free)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error in page pool: unable to open %s.\n", path);
+        return NULL;
+    }
+    PagePool_t *pool = InitPool(page_size, false, fd);
+    if (pool == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // We map enough chunks to cover the whole file, and at least every frame handed out. A file written
+    // through a buffer pool may end before its last frames, or partway into a chunk, in which case it's
+    // extended as the chunks are mapped.
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Error in page pool: unable to open %s.\n", path);
+        pool_Destroy(pool);
+        return NULL;
+    }
+    uint64_t num_chunks = ((uint64_t)st.st_size + pool->chunk_bytes - 1) / pool->chunk_bytes;
+    if (num_chunks * pool->frames_per_chunk < num_frames)
+        num_chunks = (num_frames + pool->frames_per_chunk - 1) / pool->frames_per_chunk;
+    for (uint64_t i = 0; i < num_chunks; i++)
+    {
+        if (!AddChunk(pool))
+        {
+            pool_Destroy(pool);
+            return NULL;
+        }
+    }
+    pool->num_frames = num_frames;
+    pool->free_head = free_head;
+    pool->num_free = num_free;
+    return pool;
+}
+
+void *pool_Alloc(PagePool_t *pool, uint64_t *frame)
+{
+    pthread_mutex_lock(&pool->lock);
+    // Released frames are reused first. They still hold their old contents, so they are cleared.
+    if (pool->free_head != POOL_NO_FRAME)
+    {
+        *frame = pool->free_head;
+        uint8_t *address = pool_Frame(pool, *frame);
+        memcpy(&pool->free_head, address, sizeof(uint64_t));
+        pool->num_free--;
+        pthread_mutex_unlock(&pool->lock);
+        memset(address, 0, pool->frame_size);
+        return address;
+    }
+
+    // Otherwise we carve the next frame out of the last chunk, adding a chunk if it's used up.
+    // Fresh chunk memory is already zeroed by the system.
+    if (pool->num_frames == (uint64_t)pool->num_chunks * pool->frames_per_chunk && !AddChunk(pool))
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    *frame = pool->num_frames++;
+    pthread_mutex_unlock(&pool->lock);
+    return pool_Frame(pool, *frame);
+}
+
+void pool_Free(PagePool_t *pool, uint64_t frame)
+{
+    pthread_mutex_lock(&pool->lock);
+    memcpy(pool_Frame(pool, frame), &pool->free_head, sizeof(uint64_t));
+    pool->free_head = frame;
+    pool->num_free++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+bool pool_Sync(PagePool_t *pool)
+{
+    if (pool->fd < 0)
+        return true;
+    for (uint32_t i = 0; i < pool->num_chunks; i++)
+    {
+        if (msync(pool->chunks[i], pool->chunk_bytes, MS_SYNC) != 0)
+        {
+            fprintf(stderr, "Error in page pool: unable to sync chunk %d.\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+void pool_Destroy(PagePool_t *pool)
+{
+    if (pool == NULL)
+        return;
+    for (uint32_t i = 0; i < pool->num_chunks; i++)
+    {
+        munmap(pool->chunks[i], pool->chunk_bytes);
+        free(pool->latches[i]);
+    }
+    if (pool->fd >= 0)
+        close(pool->fd);
+    if (pool->chunks != NULL)
+        munmap(pool->chunks, sizeof(uint8_t *) * POOL_MAX_CHUNKS);
+    if (pool->latches != NULL)
+        munmap(pool->latches, sizeof(Latch_t *) * POOL_MAX_CHUNKS);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+PagePool_t *InitPool(uint32_t page_size, bool huge_pages, int fd)
+{
+    PagePool_t *pool = calloc(1, sizeof(PagePool_t));
+    if (pool == NULL)
+        return NULL;
+    pool->frame_size = pool_FrameSize(page_size);
+    pool->chunk_bytes = POOL_CHUNK_BYTES;
+    if (fd >= 0)
+    {
+        // A chunk of a file is mapped on its own, so it has to be a whole number of system pages, and we
+        // want it to be a whole number of frames too, so the frames are back to back in the file.
+        // The smallest size that is both is repeated for as long as the chunk stays within POOL_CHUNK_BYTES.
+        size_t unit = sysconf(_SC_PAGESIZE);
+        while (unit % pool->frame_size != 0)
+            unit += sysconf(_SC_PAGESIZE);
+        pool->chunk_bytes = unit < POOL_CHUNK_BYTES ? POOL_CHUNK_BYTES / unit * unit : unit;
+    }
+    else if (pool->frame_size > pool->chunk_bytes)
+    {
+        pool->chunk_bytes = pool->frame_size;
+    }
+    pool->frames_per_chunk = pool->chunk_bytes / pool->frame_size;
+    pool->huge_pages = huge_pages;
+    pool->fd = fd;
+    pool->free_head = POOL_NO_FRAME;
+    pthread_mutex_init(&pool->lock, NULL);
+    // The directories are only reserved, the system backs them with memory as they fill up.
+    pool->chunks = mmap(NULL, sizeof(uint8_t *) * POOL_MAX_CHUNKS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    pool->latches = mmap(NULL, sizeof(Latch_t *) * POOL_MAX_CHUNKS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool->chunks == MAP_FAILED || pool->latches == MAP_FAILED)
+    {
+        if (pool->chunks == MAP_FAILED)
+            pool->chunks = NULL;
+        if (pool->latches == MAP_FAILED)
+            pool->latches = NULL;
+        pool->fd = -1;
+        pool_Destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+bool AddChunk(PagePool_t *pool)
+{
+    if (pool->num_chunks == POOL_MAX_CHUNKS)
+    {
+        fprintf(stderr, "Error in page pool: arena is limited to %d chunks.\n", POOL_MAX_CHUNKS);
+        return false;
+    }
+
+    uint8_t *chunk = pool->fd >= 0 ? MapFileChunk(pool) : MapChunk(pool);
+    Latch_t *latches = chunk != NULL ? calloc(pool->frames_per_chunk, sizeof(Latch_t)) : NULL;
+    if (latches == NULL)
+    {
+        fprintf(stderr, "Error in page pool: unable to allocate chunk %d.\n", pool->num_chunks);
+        if (chunk != NULL)
+            munmap(chunk, pool->chunk_bytes);
+        return false;
+    }
+    pool->chunks[pool->num_chunks] = chunk;
+    pool->latches[pool->num_chunks] = latches;
+    pool->num_chunks++;
+    return true;
+}
+
+void *MapChunk(PagePool_t *pool)
+{
+    // Chunks are mapped straight from the system rather than through malloc. They are page aligned, so
+    // every frame is cache line aligned, and they never compete with the rest of the process for the heap.
+    void *chunk;
+    if (pool->huge_pages)
+    {
+#ifdef MAP_HUGETLB
+        // Explicit huge pages are only there if the administrator reserved them, so this may fail.
+        if (pool->chunk_bytes % POOL_CHUNK_BYTES == 0)
+        {
+            chunk = mmap(NULL, pool->chunk_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (chunk != MAP_FAILED)
+                return chunk;
+        }
+#endif
+    }
+
+    chunk = mmap(NULL, pool->chunk_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    // Without reserved huge pages, we ask for transparent huge pages instead.
+    if (pool->huge_pages)
+        madvise(chunk, pool->chunk_bytes, MADV_HUGEPAGE);
+#endif
+    return chunk;
+}
+
+void *MapFileChunk(PagePool_t *pool)
+{
+    // The file is extended before the new chunk is mapped, since touching a mapping beyond the end of
+    // the file faults. The new bytes read as zeros, like fresh anonymous memory.
+    off_t offset = (off_t)pool->num_chunks * pool->chunk_bytes;
+    struct stat st;
+    if (fstat(pool->fd, &st) != 0)
+        return NULL;
+    if (st.st_size < offset + (off_t)pool->chunk_bytes && ftruncate(pool->fd, offset + pool->chunk_bytes) != 0)
+        return NULL;
+    void *chunk = mmap(NULL, pool->chunk_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, offset);
+    if (chunk == MAP_FAILED)
+        return NULL;
+    return chunk;
+}
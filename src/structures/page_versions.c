@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include "page_versions.h"
+
+static inline PageVersionChain_t **FindChain(PageVersions_t *versions, uint64_t page_id);
+static void GrowBuckets(PageVersions_t *versions);
+static bool IsRead(PageVersions_t *versions, uint64_t from, uint64_t to);
+static void Reclaim(PageVersions_t *versions);
+
+PageVersions_t *pv_Create(uint32_t page_size)
+{
+    PageVersions_t *versions = calloc(1, sizeof(PageVersions_t));
+    if (versions == NULL)
+    {
+        fprintf(stderr, "Error in page versions: unable to allocate store.\n");
+        return NULL;
+    }
+    versions->page_size = page_size;
+    versions->num_buckets = PV_MIN_BUCKETS;
+    versions->buckets = calloc(versions->num_buckets, sizeof(PageVersionChain_t *));
+    if (versions->buckets == NULL)
+    {
+        fprintf(stderr, "Error in page versions: unable to allocate store.\n");
+        free(versions);
+        return NULL;
+    }
+    // Epoch 0 is never handed out, so a version is always replaced after some snapshot.
+    versions->epoch = 1;
+    pthread_rwlock_init(&versions->lock, NULL);
+    return versions;
+}
+
+uint64_t pv_OpenSnapshot(PageVersions_t *versions)
+{
+    pthread_rwlock_wrlock(&versions->lock);
+    if (versions->num_snapshots == versions->snapshot_capacity)
+    {
+        uint32_t capacity = versions->snapshot_capacity > 0 ? 2 * versions->snapshot_capacity : 16;
+        uint64_t *snapshots = realloc(versions->snapshots, sizeof(uint64_t) * capacity);
+        if (snapshots == NULL)
+        {
+            fprintf(stderr, "Error in page versions: unable to allocate snapshot.\n");
+            exit(EXIT_FAILURE);
+        }
+        versions->snapshots = snapshots;
+        versions->snapshot_capacity = capacity;
+    }
+    // The snapshot ends the epoch, and epochs only grow, so the list stays in order.
+    uint64_t epoch = versions->epoch;
+    versions->snapshots[versions->num_snapshots] = epoch;
+    __atomic_store_n(&versions->num_snapshots, versions->num_snapshots + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&versions->epoch, epoch + 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&versions->lock);
+    return epoch;
+}
+
+void pv_CloseSnapshot(PageVersions_t *versions, uint64_t epoch)
+{
+    pthread_rwlock_wrlock(&versions->lock);
+    for (uint32_t i = 0; i < versions->num_snapshots; i++)
+    {
+        if (versions->snapshots[i] == epoch)
+        {
+            memmove(&versions->snapshots[i], &versions->snapshots[i + 1], sizeof(uint64_t) * (versions->num_snapshots - i - 1));
+            __atomic_store_n(&versions->num_snapshots, versions->num_snapshots - 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    Reclaim(versions);
+    pthread_rwlock_unlock(&versions->lock);
+}
+
+void pv_Save(PageVersions_t *versions, uint64_t page_id, const void *page)
+{
+    if (!pv_HasSnapshots(versions))
+        return;
+    // Only the one changing the page saves it, so if it hasn't been saved in this epoch, it won't be
+    // while we copy it.
+    uint64_t epoch = __atomic_load_n(&versions->epoch, __ATOMIC_ACQUIRE);
+    pthread_rwlock_rdlock(&versions->lock);
+    PageVersionChain_t *chain = *FindChain(versions, page_id);
+    bool saved = chain != NULL && chain->newest->replaced == epoch;
+    pthread_rwlock_unlock(&versions->lock);
+    if (saved)
+        return;
+
+    PageVersion_t *version = malloc(sizeof(PageVersion_t) + versions->page_size);
+    if (version == NULL)
+    {
+        fprintf(stderr, "Error in page versions: unable to allocate version.\n");
+        exit(EXIT_FAILURE);
+    }
+    version->replaced = epoch;
+    memcpy(version->page, page, versions->page_size);
+
+    pthread_rwlock_wrlock(&versions->lock);
+    PageVersionChain_t **slot = FindChain(versions, page_id);
+    if (*slot == NULL)
+    {
+        chain = malloc(sizeof(PageVersionChain_t));
+        if (chain == NULL)
+        {
+            fprintf(stderr, "Error in page versions: unable to allocate version.\n");
+            exit(EXIT_FAILURE);
+        }
+        chain->page_id = page_id;
+        chain->next = NULL;
+        chain->newest = NULL;
+        *slot = chain;
+        __atomic_store_n(&versions->num_chains, versions->num_chains + 1, __ATOMIC_RELAXED);
+    }
+    chain = *slot;
+    version->older = chain->newest;
+    chain->newest = version;
+    versions->num_versions++;
+    if (versions->num_chains > 2 * versions->num_buckets)
+        GrowBuckets(versions);
+    pthread_rwlock_unlock(&versions->lock);
+    // The version is in the store before any of the changes reach the page. A reader that sees a change
+    // while it copies the page finds the version when it looks again.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+const void *pv_Find(PageVersions_t *versions, uint64_t page_id, uint64_t epoch)
+{
+    // Whatever the caller read of the page before, it read before it looks here. A version the snapshot reads
+    // isn't reclaimed while it's open, so with no pages in the store, there is nothing to look for.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&versions->num_chains, __ATOMIC_RELAXED) == 0)
+        return NULL;
+    pthread_rwlock_rdlock(&versions->lock);
+    const PageVersion_t *found = NULL;
+    PageVersionChain_t *chain = *FindChain(versions, page_id);
+    if (chain != NULL)
+    {
+        for (const PageVersion_t *version = chain->newest; version != NULL && version->replaced > epoch; version = version->older)
+            found = version;
+    }
+    pthread_rwlock_unlock(&versions->lock);
+    return found != NULL ? found->page : NULL;
+}
+
+void pv_Destroy(PageVersions_t *versions)
+{
+    if (versions == NULL)
+        return;
+    versions->num_snapshots = 0;
+    Reclaim(versions);
+    pthread_rwlock_destroy(&versions->lock);
+    free(versions->buckets);
+    free(versions->snapshots);
+    free(versions);
+}
+
+static inline PageVersionChain_t **FindChain(PageVersions_t *versions, uint64_t page_id)
+{
+    // Returns the link to the chain of the page, which is NULL if it has none.
+    uint64_t hash = page_id * 0x9E3779B97F4A7C15ULL;
+    PageVersionChain_t **slot = &versions->buckets[(hash >> 32) & (versions->num_buckets - 1)];
+    while (*slot != NULL && (*slot)->page_id != page_id)
+        slot = &(*slot)->next;
+    return slot;
+}
+
+void GrowBuckets(PageVersions_t *versions)
+{
+    // Called with the lock held exclusively. The chains are only moved, their versions stay where they are,
+    // so a snapshot may still read them once it has the lock back.
+    uint64_t old_count = versions->num_buckets;
+    PageVersionChain_t **old_buckets = versions->buckets;
+    PageVersionChain_t **buckets = calloc(2 * old_count, sizeof(PageVersionChain_t *));
+    if (buckets == NULL)
+        return;
+    versions->buckets = buckets;
+    versions->num_buckets = 2 * old_count;
+    for (uint64_t i = 0; i < old_count; i++)
+    {
+        while (old_buckets[i] != NULL)
+        {
+            PageVersionChain_t *chain = old_buckets[i];
+            old_buckets[i] = chain->next;
+            PageVersionChain_t **slot = FindChain(versions, chain->page_id);
+            chain->next = NULL;
+            *slot = chain;
+        }
+    }
+    free(old_buckets);
+}
+
+bool IsRead(PageVersions_t *versions, uint64_t from, uint64_t to)
+{
+    // Whether a snapshot of an epoch from from up to, but not including, to is open.
+    uint32_t low = 0;
+    uint32_t high = versions->num_snapshots;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (versions->snapshots[middle] < from)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < versions->num_snapshots && versions->snapshots[low] < to;
+}
+
+void Reclaim(PageVersions_t *versions)
+{
+    // Called with the lock held exclusively. Each version is read by the snapshots from the epoch the one
+    // before it was replaced in, up to its own. Those ranges don't overlap, so whether a version goes doesn't
+    // depend on the others of its page.
+    for (uint64_t i = 0; i < versions->num_buckets; i++)
+    {
+        PageVersionChain_t **slot = &versions->buckets[i];
+        while (*slot != NULL)
+        {
+            PageVersionChain_t *chain = *slot;
+            PageVersion_t **link = &chain->newest;
+            while (*link != NULL)
+            {
+                PageVersion_t *version = *link;
+                uint64_t from = version->older != NULL ? version->older->replaced : 0;
+                if (IsRead(versions, from, version->replaced))
+                {
+                    link = &version->older;
+                    continue;
+                }
+                *link = version->older;
+                free(version);
+                versions->num_versions--;
+                versions->reclaimed++;
+            }
+            if (chain->newest != NULL)
+            {
+                slot = &chain->next;
+                continue;
+            }
+            *slot = chain->next;
+            free(chain);
+            __atomic_store_n(&versions->num_chains, versions->num_chains - 1, __ATOMIC_RELAXED);
+        }
+    }
+}
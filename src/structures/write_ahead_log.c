@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "write_ahead_log.h"
+
+typedef struct LogFrame LogFrame_t;
+
+// Stored in front of every record.
+struct LogFrame
+{
+    // Bytes of the record, without the frame.
+    uint32_t size;
+    // Of the record and its LSN, so a record only checks out in the place it was written to.
+    uint32_t checksum;
+};
+
+static WriteAheadLog_t *InitLog(int fd, uint64_t base_lsn, uint32_t group_delay);
+static bool WriteHeader(WriteAheadLog_t *log);
+static bool WriteAll(int fd, const void *data, size_t size, off_t offset);
+static inline off_t LogOffset(WriteAheadLog_t *log, uint64_t lsn);
+static uint32_t Checksum(uint64_t lsn, const void *record, uint32_t size);
+static bool ReadRecord(WriteAheadLog_t *log, uint64_t lsn, off_t file_size, uint8_t **record, uint32_t *capacity, uint32_t *size);
+static bool ReserveBuffer(WriteAheadLog_t *log, size_t size);
+
+WriteAheadLog_t *wal_Create(const char *path, uint32_t group_delay)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error in write-ahead log: unable to create %s.\n", path);
+        return NULL;
+    }
+    WriteAheadLog_t *log = InitLog(fd, 0, group_delay);
+    if (log == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    if (!WriteHeader(log))
+    {
+        wal_Destroy(log);
+        return NULL;
+    }
+    return log;
+}
+
+WriteAheadLog_t *wal_Open(const char *path, uint32_t group_delay)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error in write-ahead log: unable to open %s.\n", path);
+        return NULL;
+    }
+    WriteAheadLogHeader_t header;
+    struct stat status;
+    if (pread(fd, &header, sizeof(WriteAheadLogHeader_t), 0) != sizeof(WriteAheadLogHeader_t) ||
+        header.magic != WAL_FILE_MAGIC || header.version != WAL_FILE_VERSION || fstat(fd, &status) != 0)
+    {
+        fprintf(stderr, "Error in write-ahead log: %s is not a log file.\n", path);
+        close(fd);
+        return NULL;
+    }
+    WriteAheadLog_t *log = InitLog(fd, header.base_lsn, group_delay);
+    if (log == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // We go through the records until one doesn't check out. A crash may leave the last records written
+    // only in part, or not at all, so the log ends there. Anything after it is cut off, so new records
+    // don't end up behind it.
+    uint8_t *record = NULL;
+    uint32_t capacity = 0;
+    uint32_t size;
+    while (ReadRecord(log, log->next_lsn, status.st_size, &record, &capacity, &size))
+        log->next_lsn += sizeof(LogFrame_t) + size;
+    free(record);
+    if (LogOffset(log, log->next_lsn) < status.st_size && (ftruncate(fd, LogOffset(log, log->next_lsn)) != 0 || fdatasync(fd) != 0))
+    {
+        fprintf(stderr, "Error in write-ahead log: unable to truncate %s.\n", path);
+        wal_Destroy(log);
+        return NULL;
+    }
+    log->buffer_lsn = log->next_lsn;
+    log->durable_lsn = log->next_lsn;
+    return log;
+}
+
+bool wal_Replay(WriteAheadLog_t *log, WriteAheadLogReplay_t replay, void *context)
+{
+    // The records up to next_lsn have all been checked when the log was opened.
+    uint8_t *record = NULL;
+    uint32_t capacity = 0;
+    uint32_t size;
+    uint64_t lsn = log->base_lsn;
+    off_t file_size = LogOffset(log, log->durable_lsn);
+    bool replayed = true;
+    while (replayed && lsn < log->durable_lsn)
+    {
+        if (!ReadRecord(log, lsn, file_size, &record, &capacity, &size))
+        {
+            fprintf(stderr, "Error in write-ahead log: unable to read record %ld.\n", lsn);
+            replayed = false;
+            break;
+        }
+        lsn += sizeof(LogFrame_t) + size;
+        replayed = replay(context, lsn, record, size);
+    }
+    free(record);
+    return replayed;
+}
+
+uint64_t wal_Append(WriteAheadLog_t *log, const void *record, uint32_t size)
+{
+    pthread_mutex_lock(&log->lock);
+    if (!ReserveBuffer(log, log->buffer_size + sizeof(LogFrame_t) + size))
+    {
+        fprintf(stderr, "Error in write-ahead log: unable to allocate buffer.\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t lsn = log->next_lsn + sizeof(LogFrame_t) + size;
+    LogFrame_t frame;
+    frame.size = size;
+    frame.checksum = Checksum(lsn, record, size);
+    memcpy(log->buffer + log->buffer_size, &frame, sizeof(LogFrame_t));
+    memcpy(log->buffer + log->buffer_size + sizeof(LogFrame_t), record, size);
+    log->buffer_size += sizeof(LogFrame_t) + size;
+    log->next_lsn = lsn;
+    log->stats.records++;
+    log->stats.bytes += sizeof(LogFrame_t) + size;
+    pthread_mutex_unlock(&log->lock);
+    return lsn;
+}
+
+bool wal_Commit(WriteAheadLog_t *log, uint64_t lsn)
+{
+    pthread_mutex_lock(&log->lock);
+    if (log->durable_lsn < lsn)
+        log->stats.commits++;
+    while (log->durable_lsn < lsn && !log->failed)
+    {
+        // Someone else is writing the log, and may well take our records with them. Either way, we
+        // look again once they are done.
+        if (log->syncing)
+        {
+            pthread_cond_wait(&log->synced, &log->lock);
+            continue;
+        }
+
+        // Otherwise we write the log for everyone. Waiting a little first lets more commits join in.
+        log->syncing = true;
+        if (log->group_delay > 0)
+        {
+            pthread_mutex_unlock(&log->lock);
+            usleep(log->group_delay);
+            pthread_mutex_lock(&log->lock);
+        }
+        // The buffer is swapped for the spare, so records can be appended while we write.
+        uint8_t *data = log->buffer;
+        size_t size = log->buffer_size;
+        uint64_t start_lsn = log->buffer_lsn;
+        uint64_t end_lsn = log->next_lsn;
+        log->buffer = log->spare;
+        log->spare = data;
+        size_t capacity = log->buffer_capacity;
+        log->buffer_capacity = log->spare_capacity;
+        log->spare_capacity = capacity;
+        log->buffer_size = 0;
+        log->buffer_lsn = end_lsn;
+        pthread_mutex_unlock(&log->lock);
+
+        bool written = WriteAll(log->fd, data, size, LogOffset(log, start_lsn)) && fdatasync(log->fd) == 0;
+
+        pthread_mutex_lock(&log->lock);
+        if (written)
+            log->durable_lsn = end_lsn;
+        else
+        {
+            fprintf(stderr, "Error in write-ahead log: unable to write log.\n");
+            log->failed = true;
+        }
+        log->stats.syncs++;
+        log->syncing = false;
+        pthread_cond_broadcast(&log->synced);
+    }
+    bool committed = log->durable_lsn >= lsn;
+    pthread_mutex_unlock(&log->lock);
+    return committed;
+}
+
+uint64_t wal_LastLSN(WriteAheadLog_t *log)
+{
+    pthread_mutex_lock(&log->lock);
+    uint64_t lsn = log->next_lsn;
+    pthread_mutex_unlock(&log->lock);
+    return lsn;
+}
+
+bool wal_Reset(WriteAheadLog_t *log)
+{
+    if (!wal_Commit(log, wal_LastLSN(log)))
+        return false;
+    // The header moves on first. Should we crash before the file is cut, the old records are replayed
+    // once more, under LSNs higher than any page has, which leaves the pages the way they are now.
+    // The other way round, new records could be given LSNs that pages already have.
+    pthread_mutex_lock(&log->lock);
+    log->base_lsn = log->next_lsn;
+    log->buffer_lsn = log->next_lsn;
+    log->durable_lsn = log->next_lsn;
+    pthread_mutex_unlock(&log->lock);
+    if (!WriteHeader(log) || ftruncate(log->fd, sizeof(WriteAheadLogHeader_t)) != 0 || fdatasync(log->fd) != 0)
+    {
+        fprintf(stderr, "Error in write-ahead log: unable to reset log.\n");
+        log->failed = true;
+        return false;
+    }
+    return true;
+}
+
+void wal_GetStats(WriteAheadLog_t *log, WriteAheadLogStats_t *stats)
+{
+    pthread_mutex_lock(&log->lock);
+    *stats = log->stats;
+    pthread_mutex_unlock(&log->lock);
+}
+
+void wal_Destroy(WriteAheadLog_t *log)
+{
+    if (log == NULL)
+        return;
+    close(log->fd);
+    free(log->buffer);
+    free(log->spare);
+    pthread_cond_destroy(&log->synced);
+    pthread_mutex_destroy(&log->lock);
+    free(log);
+}
+
+WriteAheadLog_t *InitLog(int fd, uint64_t base_lsn, uint32_t group_delay)
+{
+    WriteAheadLog_t *log = calloc(1, sizeof(WriteAheadLog_t));
+    if (log == NULL)
+        return NULL;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->synced, NULL);
+    log->fd = fd;
+    log->group_delay = group_delay;
+    log->base_lsn = base_lsn;
+    log->buffer_lsn = base_lsn;
+    log->next_lsn = base_lsn;
+    log->durable_lsn = base_lsn;
+    return log;
+}
+
+bool WriteHeader(WriteAheadLog_t *log)
+{
+    WriteAheadLogHeader_t header;
+    memset(&header, 0, sizeof(WriteAheadLogHeader_t));
+    header.magic = WAL_FILE_MAGIC;
+    header.version = WAL_FILE_VERSION;
+    header.base_lsn = log->base_lsn;
+    return WriteAll(log->fd, &header, sizeof(WriteAheadLogHeader_t), 0) && fdatasync(log->fd) == 0;
+}
+
+bool WriteAll(int fd, const void *data, size_t size, off_t offset)
+{
+    // pwrite may write less than asked for, so we keep at it until everything is out.
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written <= 0)
+            return false;
+        data = (const uint8_t *)data + written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+static inline off_t LogOffset(WriteAheadLog_t *log, uint64_t lsn)
+{
+    return sizeof(WriteAheadLogHeader_t) + (off_t)(lsn - log->base_lsn);
+}
+
+uint32_t Checksum(uint64_t lsn, const void *record, uint32_t size)
+{
+    // FNV-1a, which catches a record that is cut short or has stale bytes in it. It doesn't have to
+    // stand up to anything worse than a crash.
+    uint32_t hash = 2166136261u;
+    const uint8_t *bytes = (const uint8_t *)&lsn;
+    for (uint32_t i = 0; i < sizeof(uint64_t); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    bytes = record;
+    for (uint32_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+bool ReadRecord(WriteAheadLog_t *log, uint64_t lsn, off_t file_size, uint8_t **record, uint32_t *capacity, uint32_t *size)
+{
+    // Reads the record that starts at lsn into a buffer that grows as needed. Returns false if there is
+    // none, or it doesn't check out.
+    off_t offset = LogOffset(log, lsn);
+    LogFrame_t frame;
+    if (offset + (off_t)sizeof(LogFrame_t) > file_size || pread(log->fd, &frame, sizeof(LogFrame_t), offset) != sizeof(LogFrame_t))
+        return false;
+    if (frame.size > file_size - offset - sizeof(LogFrame_t))
+        return false;
+    if (frame.size > *capacity)
+    {
+        uint8_t *grown = realloc(*record, frame.size);
+        if (grown == NULL)
+            return false;
+        *record = grown;
+        *capacity = frame.size;
+    }
+    if (pread(log->fd, *record, frame.size, offset + sizeof(LogFrame_t)) != (ssize_t)frame.size)
+        return false;
+    if (Checksum(lsn + sizeof(LogFrame_t) + frame.size, *record, frame.size) != frame.checksum)
+        return false;
+    *size = frame.size;
+    return true;
+}
+
+bool ReserveBuffer(WriteAheadLog_t *log, size_t size)
+{
+    // The buffer doubles as it fills up, and keeps its size for the next round.
+    if (size <= log->buffer_capacity)
+        return true;
+    size_t capacity = log->buffer_capacity > 0 ? log->buffer_capacity : 4096;
+    while (capacity < size)
+        capacity *= 2;
+    uint8_t *grown = realloc(log->buffer, capacity);
+    if (grown == NULL)
+        return false;
+    log->buffer = grown;
+    log->buffer_capacity = capacity;
+    return true;
+}